@@ -66,6 +66,9 @@
 // Over how many queries do we iterate at most when trying to find a match?
 #define MAXITER 1000
 
+// Size of the incrementally maintained top domains / top ads candidate sets
+#define TOPDOMAINS_CANDIDATES 64
+
 // How many hours do we want to store in FTL's memory? [hours]
 #define MAXLOGAGE 24
 
@@ -80,6 +83,12 @@
 // can be 24 hours + 59 minutes
 #define OVERTIME_SLOTS ((MAXLOGAGE+1)*3600/OVERTIME_INTERVAL)
 
+// Tiered overTime history: expiring 10-minute slots cascade into hourly
+// buckets (one week) and those into daily buckets (90 days), so views
+// beyond 24 h stay on the in-memory fast path at constant memory cost
+#define OVERTIME_HOURLY_SLOTS (7*24)
+#define OVERTIME_DAILY_SLOTS 90
+
 // Interval for resolving NEW client and upstream server host names [seconds]
 // Default: 60 (once every minute)
 #define RESOLVE_INTERVAL 60
@@ -90,15 +99,23 @@
 
 // FTLDNS enums
 enum { DATABASE_WRITE_TIMER, EXIT_TIMER, GC_TIMER, LISTS_TIMER, REGEX_TIMER, ARP_TIMER, LAST_TIMER };
-enum { QUERIES, FORWARDED, CLIENTS, DOMAINS, OVERTIME, WILDCARD };
+enum { QUERIES, FORWARDED, CLIENTS, DOMAINS, OVERTIME, WILDCARD, STRINGS };
 enum { DNSSEC_UNSPECIFIED, DNSSEC_SECURE, DNSSEC_INSECURE, DNSSEC_BOGUS, DNSSEC_ABANDONED, DNSSEC_UNKNOWN };
-enum { QUERY_UNKNOWN, QUERY_GRAVITY, QUERY_FORWARDED, QUERY_CACHE, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED_IP, QUERY_EXTERNAL_BLOCKED_NULL, QUERY_EXTERNAL_BLOCKED_NXRA };
+enum { QUERY_UNKNOWN, QUERY_GRAVITY, QUERY_FORWARDED, QUERY_CACHE, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED_IP, QUERY_EXTERNAL_BLOCKED_NULL, QUERY_EXTERNAL_BLOCKED_NXRA, QUERY_REFUSED_RATELIMIT };
 enum { TYPE_A = 1, TYPE_AAAA, TYPE_ANY, TYPE_SRV, TYPE_SOA, TYPE_PTR, TYPE_TXT, TYPE_MAX };
 enum { REPLY_UNKNOWN, REPLY_NODATA, REPLY_NXDOMAIN, REPLY_CNAME, REPLY_IP, REPLY_DOMAIN, REPLY_RRNAME, REPLY_SERVFAIL, REPLY_REFUSED, REPLY_NOTIMP, REPLY_OTHER };
 enum { PRIVACY_SHOW_ALL = 0, PRIVACY_HIDE_DOMAINS, PRIVACY_HIDE_DOMAINS_CLIENTS, PRIVACY_MAXIMUM, PRIVACY_NOSTATS };
 enum { MODE_IP, MODE_NX, MODE_NULL, MODE_IP_NODATA_AAAA, MODE_NODATA };
 enum { REGEX_UNKNOWN, REGEX_BLOCKED, REGEX_NOTBLOCKED };
 enum { BLOCKING_DISABLED, BLOCKING_ENABLED, BLOCKING_UNKNOWN };
+// Instrumented dnsmasq-side hooks (per-hook latency histograms)
+enum { HOOK_NEW_QUERY, HOOK_FORWARDED, HOOK_REPLY, HOOK_CACHE, HOOK_DNSSEC, HOOK_MAX };
+// Number of log-scale nanosecond buckets per hook histogram
+#define HOOK_BUCKETS 32
+// Number of log-scale response-time buckets (0.1 ms units)
+#define RESPONSE_BUCKETS 24
+// Topics a client can subscribe to for pushed updates
+enum { SUBSCRIBE_STATS = (1 << 0), SUBSCRIBE_OVERTIME = (1 << 1) };
 enum {
   DEBUG_DATABASE   = (1 << 0),  /* 00000000 00000001 */
   DEBUG_NETWORKING = (1 << 1),  /* 00000000 00000010 */
@@ -134,6 +151,7 @@ typedef struct {
 	char* db;
 	char* socketfile;
 	char* macvendordb;
+	char* binlog;
 } FTLFileNamesStruct;
 
 typedef struct {
@@ -146,11 +164,32 @@ typedef struct {
 } logFileNamesStruct;
 
 typedef struct {
-	int queries;
+	// The counters incremented by the dnsmasq-side hooks on every query and
+	// reply are grouped into their own cache lines (64-byte aligned block)
+	// so that these hot writes do not false-share cache lines with the
+	// fields below which are mostly read (API workers, capacity checks)
+	int queries __attribute__((aligned(64)));
+	// queries[] is used as a ring: valid entries live at the indices
+	// [queries_start, queries_start + queries). Garbage collection only
+	// advances queries_start, the expired region at the head is reclaimed
+	// by memory_check() before the array would otherwise have to grow
+	int queries_start;
 	int blocked;
 	int cached;
 	int unknown;
-	int forwarded;
+	int ratelimited;
+	// Queries counted in the aggregates but not recorded individually
+	// while sampling mode (SAMPLING > 1) is active
+	int unsampled;
+	int forwardedqueries;
+	int querytype[TYPE_MAX-1];
+	int reply_NODATA;
+	int reply_NXDOMAIN;
+	int reply_CNAME;
+	int reply_IP;
+	int reply_domain;
+	// Mostly-read fields start on a fresh cache line
+	int forwarded __attribute__((aligned(64)));
 	int clients;
 	int domains;
 	int queries_MAX;
@@ -158,15 +197,20 @@ typedef struct {
 	int clients_MAX;
 	int domains_MAX;
 	int strings_MAX;
+	int domainhash_MAX;
+	int clienthash_MAX;
+	int forwardhash_MAX;
+	int stringhash_MAX;
+	int strings_interned;
+	int denserows;
+	int denserows_MAX;
 	int gravity;
 	int gravity_conf;
-	int querytype[TYPE_MAX-1];
-	int forwardedqueries;
-	int reply_NODATA;
-	int reply_NXDOMAIN;
-	int reply_CNAME;
-	int reply_IP;
-	int reply_domain;
+	// Log-scale (power-of-two nanoseconds) latency histograms of the
+	// dnsmasq-side hooks, bucket b counts calls in [2^b, 2^(b+1)) ns
+	unsigned int hook_histogram[HOOK_MAX][HOOK_BUCKETS];
+	// Log-scale histogram of all reply response times (0.1 ms units)
+	unsigned int response_histogram[RESPONSE_BUCKETS];
 } countersStruct;
 
 typedef struct {
@@ -174,6 +218,16 @@ typedef struct {
 	int DBinterval;
 	int port;
 	int maxlogage;
+	int GCbatchsize;
+	int resolveTTL;
+	int floodthreshold;
+	int ratelimit;
+	int sampling;
+	int maincore;
+	int subscribetick;
+	int DBmmapsize;
+	int DBpendingmax;
+	bool DBwal;
 	int16_t debug;
 	unsigned char privacylevel;
 	unsigned char blockingmode;
@@ -185,44 +239,84 @@ typedef struct {
 	bool analyze_only_A_AAAA;
 	bool DBimport;
 	bool parse_arp_cache;
+	bool asyncstats;
+	bool fastestupstream;
+	bool warmrestart;
+	bool shmhugepages;
+	bool nicebackground;
+	bool cacheautogrow;
 } ConfigStruct;
 
 // Dynamic structs
+// The fields every scan touches (GC, database save, API query-log loops)
+// live in queriesDataStruct while the rarely-read companion fields are kept
+// in queriesColdDataStruct. Both arrays are indexed identically, the split
+// only exists so that the hot scans stream through denser memory
 typedef struct {
 	unsigned char magic;
 	unsigned char type;
 	unsigned char status;
-	unsigned char privacylevel;
 	unsigned char reply;
-	unsigned char dnssec;
 	time_t timestamp;
 	int domainID;
 	int clientID;
 	int forwardID;
 	int id; // the ID is a (signed) int in dnsmasq, so no need for a long int here
-	unsigned long response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
-	int64_t db;
-	unsigned int timeidx;
 	bool complete;
 } queriesDataStruct;
 
+typedef struct {
+	unsigned char privacylevel;
+	unsigned char dnssec;
+	unsigned long response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
+	int64_t db;
+} queriesColdDataStruct;
+
 typedef struct {
 	unsigned char magic;
 	size_t ippos;
 	size_t namepos;
+	// The resolved host name is considered valid until this time stamp,
+	// re-resolution passes skip entries whose name has not expired yet
+	time_t nameexpires;
 	int count;
 	int failed;
+	// Exponentially weighted moving averages fed by the reply hooks and
+	// used for latency-aware upstream selection (FASTEST_UPSTREAM mode)
+	float latency_ewma; // [ms]
+	float failure_ewma;
+	// Log-scale histogram of this upstream's response times (0.1 ms units)
+	unsigned int latency_histogram[RESPONSE_BUCKETS];
 	bool new;
 } forwardedDataStruct;
 
+// Number of (slot, count) pairs a client can hold inline before its
+// activity spills into a dense row of the client-overTime segment
+#define CLIENT_SPARSE_SLOTS 16
+
 typedef struct {
 	unsigned char magic;
 	size_t ippos;
 	size_t namepos;
+	// See forwardedDataStruct
+	time_t nameexpires;
 	time_t lastQuery;
 	int count;
 	int blockedcount;
-	int overTime[OVERTIME_SLOTS];
+	// Sparse per-client activity: most clients are active in only a
+	// handful of overTime slots, so their counts live in these inline
+	// (slot, count) pairs. Chatty clients exceeding the pair capacity
+	// spill into a dense row referenced by denserow (dense == true).
+	// Access goes through the accessors in overTime.c
+	unsigned char sparse_used;
+	bool dense;
+	int denserow;
+	unsigned short sparse_idx[CLIENT_SPARSE_SLOTS];
+	int sparse_count[CLIENT_SPARSE_SLOTS];
+	// Rate accounting: number of queries in the current ten-second
+	// window, used to spot flooding clients (see getFlooding())
+	time_t rate_window;
+	unsigned int rate_count;
 	unsigned int numQueriesARP;
 	bool new;
 } clientsDataStruct;
@@ -254,6 +348,20 @@ typedef struct {
 	int version;
 	unsigned int global_shm_counter;
 	unsigned int next_str_pos;
+	// Data epoch for the API response cache: bumped (at most once per
+	// second) whenever a writer releases the exclusive lock
+	unsigned int data_epoch;
+	time_t epoch_stamp;
+	// Sequence lock for external read-only consumers: odd while a writer
+	// holds the exclusive lock, even otherwise. Mapping the segments
+	// read-only and re-checking this value around a read yields a
+	// consistent snapshot without any serialization (see README.md)
+	unsigned int seqlock;
+	// Warm-restart handshake: set on clean shutdown (magic marker plus a
+	// checksum over the counters), cleared again right after a successful
+	// warm attach so a crash can never resume from inconsistent state
+	unsigned int warm_magic;
+	unsigned int warm_checksum;
 } ShmSettings;
 
 // Prepare timers, used mainly for debugging purposes
@@ -272,10 +380,13 @@ extern countersStruct *counters;
 extern ConfigStruct config;
 
 extern queriesDataStruct *queries;
+extern queriesColdDataStruct *queries_cold;
 extern forwardedDataStruct *forwarded;
 extern clientsDataStruct *clients;
 extern domainsDataStruct *domains;
 extern overTimeDataStruct *overTime;
+extern overTimeDataStruct *overTimeHourly;
+extern overTimeDataStruct *overTimeDaily;
 
 // Used in gc.c, memory.c, resolve.c, signals.c, and socket.c
 extern volatile sig_atomic_t killed;
@@ -287,6 +398,8 @@ extern char * username;
 extern bool daemonmode;
 // Used in main.c, database.c, and others
 extern bool database;
+// Set when init_shmem() resumed the previous shared memory state
+extern bool warm_restarted;
 // Used in database.c and gc.c
 extern long int lastdbindex;
 // Used in database.c and gc.c
@@ -310,9 +423,7 @@ extern bool istelnet[MAXCONNS];
 extern int argc_dnsmasq;
 extern const char ** argv_dnsmasq;
 
-extern pthread_t telnet_listenthreadv4;
-extern pthread_t telnet_listenthreadv6;
 extern pthread_t socket_listenthread;
-extern pthread_t DBthread;
-extern pthread_t GCthread;
+extern pthread_t schedulerthread;
 extern pthread_t DNSclientthread;
+extern pthread_t eventqueuethread;
@@ -0,0 +1,211 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Fleet aggregation mode (built via "make aggregate")
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+// Standalone aggregator: periodically pulls the compact machine-readable
+// >metrics response from a fleet of FTL instances, merges the counters and
+// serves the merged view on its own telnet-style port, so external
+// pipelines talk to one endpoint instead of polling every resolver.
+//
+//   pihole-FTL-aggregate <listen-port> <interval-s> <host:port> [host:port ...]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAXPEERS 64
+#define MAXCOUNTERS 128
+
+typedef struct {
+	char name[64];
+	long long value;
+} aggCounter;
+
+static aggCounter merged[MAXCOUNTERS];
+static int nmerged = 0;
+static int peers_alive = 0;
+
+static void merge_counter(const char *name, long long value)
+{
+	for(int i = 0; i < nmerged; i++)
+		if(strcmp(merged[i].name, name) == 0)
+		{
+			merged[i].value += value;
+			return;
+		}
+
+	if(nmerged < MAXCOUNTERS)
+	{
+		snprintf(merged[nmerged].name, sizeof(merged[0].name), "%s", name);
+		merged[nmerged].value = value;
+		nmerged++;
+	}
+}
+
+// Pull >metrics from one peer and merge all plain "name value" lines.
+// Multi-field lines (per-upstream, overtime) are skipped, they are not
+// meaningfully summable across instances
+static bool poll_peer(const char *host, int port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(sock < 0)
+		return false;
+
+	struct timeval timeout = { 3, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, host, &addr.sin_addr);
+
+	if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return false;
+	}
+
+	const char *request = ">metrics\n";
+	if(send(sock, request, strlen(request), 0) < 0)
+	{
+		close(sock);
+		return false;
+	}
+
+	char buffer[65536];
+	size_t used = 0;
+	while(used < sizeof(buffer)-1)
+	{
+		const ssize_t got = recv(sock, buffer+used, sizeof(buffer)-1-used, 0);
+		if(got <= 0)
+			break;
+		used += got;
+		buffer[used] = '\0';
+		if(strstr(buffer, "---EOM---") != NULL)
+			break;
+	}
+	close(sock);
+
+	// Merge the "name value" lines
+	char *saveptr = NULL;
+	for(char *line = strtok_r(buffer, "\n", &saveptr); line != NULL;
+	    line = strtok_r(NULL, "\n", &saveptr))
+	{
+		char name[64];
+		long long value;
+		char extra[8];
+		if(sscanf(line, "%63s %lli %7s", name, &value, extra) == 2 &&
+		   name[0] != '-')
+			merge_counter(name, value);
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <listen-port> <interval-s> <host:port> [host:port ...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const int listenport = atoi(argv[1]);
+	const int interval = atoi(argv[2]) > 0 ? atoi(argv[2]) : 10;
+	const int npeers = argc - 3 > MAXPEERS ? MAXPEERS : argc - 3;
+
+	char hosts[MAXPEERS][64];
+	int ports[MAXPEERS];
+	for(int i = 0; i < npeers; i++)
+	{
+		snprintf(hosts[i], sizeof(hosts[0]), "%s", argv[3+i]);
+		char *colon = strchr(hosts[i], ':');
+		ports[i] = 4711;
+		if(colon != NULL)
+		{
+			*colon = '\0';
+			ports[i] = atoi(colon+1);
+		}
+	}
+
+	// Listening socket for the merged view
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+	struct sockaddr_in bindaddr;
+	memset(&bindaddr, 0, sizeof(bindaddr));
+	bindaddr.sin_family = AF_INET;
+	bindaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	bindaddr.sin_port = htons(listenport);
+	if(bind(listener, (struct sockaddr*)&bindaddr, sizeof(bindaddr)) != 0 ||
+	   listen(listener, 5) != 0)
+	{
+		fprintf(stderr, "Cannot listen on port %i: %s\n", listenport, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	// Serve whatever is cached without blocking the poll loop for long
+	struct timeval accepttimeout = { 0, 200000 };
+	setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &accepttimeout, sizeof(accepttimeout));
+
+	printf("Aggregating %i peers every %i s, serving merged metrics on port %i\n",
+	       npeers, interval, listenport);
+
+	char response[65536] = "";
+	time_t lastpoll = 0;
+	while(true)
+	{
+		if(time(NULL) - lastpoll >= interval)
+		{
+			lastpoll = time(NULL);
+			nmerged = 0;
+			peers_alive = 0;
+			for(int i = 0; i < npeers; i++)
+				if(poll_peer(hosts[i], ports[i]))
+					peers_alive++;
+
+			// Render the merged view once per poll cycle
+			size_t used = (size_t)snprintf(response, sizeof(response),
+			                               "peers %i\npeers_alive %i\n", npeers, peers_alive);
+			for(int i = 0; i < nmerged && used < sizeof(response)-64; i++)
+				used += (size_t)snprintf(response+used, sizeof(response)-used,
+				                         "%s %lli\n", merged[i].name, merged[i].value);
+			snprintf(response+used, sizeof(response)-used, "---EOM---\n\n");
+		}
+
+		// Serve one waiting client (with a short accept timeout so the
+		// poll schedule stays on time)
+		struct sockaddr_in client;
+		socklen_t clientlen = sizeof(client);
+		const int sock = accept(listener, (struct sockaddr*)&client, &clientlen);
+		if(sock >= 0)
+		{
+			// Any command yields the merged view
+			char discard[256];
+			recv(sock, discard, sizeof(discard), MSG_DONTWAIT);
+			if(write(sock, response, strlen(response)) < 0)
+				fprintf(stderr, "write failed: %s\n", strerror(errno));
+			close(sock);
+		}
+		else
+		{
+			usleep(200000);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
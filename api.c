@@ -13,6 +13,10 @@
 #include "version.h"
 // needed for sqlite3_libversion()
 #include "sqlite3.h"
+// lock_shm_read() for the chunked bulk export
+#include "shmem.h"
+// optional gzip framing of bulk exports
+#include <zlib.h>
 
 #define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
 
@@ -50,6 +54,15 @@ void getStats(int *sock)
 	int total = counters->queries;
 	float percentage = 0.0f;
 
+	// In sampling mode the aggregate total is exact while the recorded
+	// (attributed) statistics represent only every N-th query: scale
+	// them back up for reporting
+	if(config.sampling > 1)
+	{
+		total = counters->queries + counters->unsampled;
+		blocked *= config.sampling;
+	}
+
 	// Avoid 1/0 condition
 	if(total > 0)
 		percentage = 1e2f*blocked/total;
@@ -111,9 +124,22 @@ void getStats(int *sock)
 		pack_uint8(*sock, blockingstatus);
 }
 
-void getOverTime(int *sock)
+void getOverTime(const char *client_message, int *sock)
 {
 	int i, from = 0, until = OVERTIME_SLOTS;
+
+	// Coarse tiers: views beyond 24 h are served from the in-memory
+	// hourly/daily rings maintained by the GC cascade
+	if(command(client_message, " hourly"))
+	{
+		getOverTimeTier(sock, false);
+		return;
+	}
+	if(command(client_message, " daily"))
+	{
+		getOverTimeTier(sock, true);
+		return;
+	}
 	bool found = false;
 	time_t mintime = overTime[0].timestamp;
 
@@ -205,22 +231,48 @@ void getTopDomains(const char *client_message, int *sock)
 	if(command(client_message, " asc"))
 		asc = true;
 
-	for(i=0; i < counters->domains; i++)
+	// Number of domains to sort and walk below. The common dashboard
+	// request (top-N descending with N within the candidate set size) is
+	// served from the incrementally maintained candidate sets, so we only
+	// sort TOPDOMAINS_CANDIDATES entries instead of every known domain.
+	// Ascending requests need the full ranking and scan everything
+	int sorted = counters->domains;
+	if(!asc && count <= TOPDOMAINS_CANDIDATES)
 	{
-		validate_access("domains", i, true, __LINE__, __FUNCTION__, __FILE__);
-		temparray[i][0] = i;
-		if(blocked)
-			temparray[i][1] = domains[i].blockedcount;
-		else
-			// Count only permitted queries
-			temparray[i][1] = (domains[i].count - domains[i].blockedcount);
+		int candidates[TOPDOMAINS_CANDIDATES];
+		const int members = getTopDomainsCandidates(blocked, candidates);
+		for(i=0; i < members; i++)
+		{
+			const int j = candidates[i];
+			validate_access("domains", j, true, __LINE__, __FUNCTION__, __FILE__);
+			temparray[i][0] = j;
+			if(blocked)
+				temparray[i][1] = domains[j].blockedcount;
+			else
+				// Count only permitted queries
+				temparray[i][1] = (domains[j].count - domains[j].blockedcount);
+		}
+		sorted = members;
+	}
+	else
+	{
+		for(i=0; i < counters->domains; i++)
+		{
+			validate_access("domains", i, true, __LINE__, __FUNCTION__, __FILE__);
+			temparray[i][0] = i;
+			if(blocked)
+				temparray[i][1] = domains[i].blockedcount;
+			else
+				// Count only permitted queries
+				temparray[i][1] = (domains[i].count - domains[i].blockedcount);
+		}
 	}
 
 	// Sort temporary array
 	if(asc)
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpasc);
+		qsort(temparray, sorted, sizeof(int[2]), cmpasc);
 	else
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpdesc);
+		qsort(temparray, sorted, sizeof(int[2]), cmpdesc);
 
 
 	// Get filter
@@ -261,7 +313,7 @@ void getTopDomains(const char *client_message, int *sock)
 	}
 
 	int n = 0;
-	for(i=0; i < counters->domains; i++)
+	for(i=0; i < sorted; i++)
 	{
 		// Get sorted indices
 		int j = temparray[i][0];
@@ -286,7 +338,7 @@ void getTopDomains(const char *client_message, int *sock)
 				if(istelnet[*sock])
 					ssend(*sock, "%i %i %s wildcard\n", n, domains[j].blockedcount, getstr(domains[j].domainpos));
 				else {
-					char *fancyWildcard = calloc(3 + strlen(getstr(domains[j].domainpos)), sizeof(char));
+					char *fancyWildcard = arena_alloc(3 + strlen(getstr(domains[j].domainpos)));
 					if(fancyWildcard == NULL) return;
 					sprintf(fancyWildcard, "*.%s", getstr(domains[j].domainpos));
 
@@ -294,7 +346,6 @@ void getTopDomains(const char *client_message, int *sock)
 						return;
 
 					pack_int32(*sock, domains[j].blockedcount);
-					free(fancyWildcard);
 				}
 			}
 			else
@@ -583,6 +634,12 @@ void getAllQueries(const char *client_message, int *sock)
 	if(config.privacylevel >= PRIVACY_MAXIMUM)
 		return;
 
+	// Binary clients can opt into string-table framing: each distinct
+	// domain/client string travels in full only once per response,
+	// repetitions are sent as compact integer references (see msgpack.c)
+	if(!istelnet[*sock] && command(client_message, " strtab"))
+		pack_strtab_begin();
+
 	// Do we want a more specific version of this command (domain/client/time interval filtered)?
 	int from = 0, until = 0;
 
@@ -619,8 +676,9 @@ void getAllQueries(const char *client_message, int *sock)
 	// Forward destination filtering?
 	if(command(client_message, ">getallqueries-forward")) {
 		// Get forward destination name we want to see only (limit length to 255 chars)
-		forwarddest = calloc(256, sizeof(char));
+		forwarddest = arena_alloc(256);
 		if(forwarddest == NULL) return;
+		memset(forwarddest, 0, 256);
 		sscanf(client_message, ">getallqueries-forward %255s", forwarddest);
 		filterforwarddest = true;
 
@@ -650,7 +708,6 @@ void getAllQueries(const char *client_message, int *sock)
 			{
 				// Requested forward destination has not been found, we directly
 				// exit here as there is no data to be returned
-				free(forwarddest);
 				return;
 			}
 		}
@@ -659,8 +716,9 @@ void getAllQueries(const char *client_message, int *sock)
 	// Domain filtering?
 	if(command(client_message, ">getallqueries-domain")) {
 		// Get domain name we want to see only (limit length to 255 chars)
-		domainname = calloc(256, sizeof(char));
+		domainname = arena_alloc(256);
 		if(domainname == NULL) return;
+		memset(domainname, 0, 256);
 		sscanf(client_message, ">getallqueries-domain %255s", domainname);
 		filterdomainname = true;
 		// Iterate through all known domains
@@ -679,7 +737,6 @@ void getAllQueries(const char *client_message, int *sock)
 		{
 			// Requested domain has not been found, we directly
 			// exit here as there is no data to be returned
-			free(domainname);
 			return;
 		}
 	}
@@ -687,8 +744,9 @@ void getAllQueries(const char *client_message, int *sock)
 	// Client filtering?
 	if(command(client_message, ">getallqueries-client")) {
 		// Get client name we want to see only (limit length to 255 chars)
-		clientname = calloc(256, sizeof(char));
+		clientname = arena_alloc(256);
 		if(clientname == NULL) return;
+		memset(clientname, 0, 256);
 		sscanf(client_message, ">getallqueries-client %255s", clientname);
 		filterclientname = true;
 		// Iterate through all known clients
@@ -709,7 +767,6 @@ void getAllQueries(const char *client_message, int *sock)
 		{
 			// Requested client has not been found, we directly
 			// exit here as there is no data to be returned
-			free(clientname);
 			return;
 		}
 	}
@@ -719,10 +776,14 @@ void getAllQueries(const char *client_message, int *sock)
 	if(sscanf(client_message, "%*[^(](%i)", &num) > 0)
 	{
 		// User wants a different number of requests
-		// Don't allow a start index that is smaller than zero
-		ibeg = counters->queries-num;
-		if(ibeg < 0)
-			ibeg = 0;
+		// Don't allow a start index before the begin of the query ring
+		ibeg = counters->queries_start + counters->queries-num;
+		if(ibeg < counters->queries_start)
+			ibeg = counters->queries_start;
+	}
+	else
+	{
+		ibeg = counters->queries_start;
 	}
 
 	// Get potentially existing filtering flags
@@ -742,12 +803,79 @@ void getAllQueries(const char *client_message, int *sock)
 	}
 	clearSetupVarsArray();
 
+	// Queries are stored in ascending timestamp order, so a time-filtered
+	// request only has to walk the matching range: binary-search the first
+	// query at or after "from" and the first query after "until" instead
+	// of scanning (and rejecting) the entire history. While the background
+	// import has the ring temporarily unordered we walk the full range;
+	// the per-query timestamp test inside the loop still applies
+	int iend = counters->queries_start + counters->queries;
+	if(from != 0 && !queries_unsorted)
+	{
+		int low = ibeg, high = iend;
+		while(low < high)
+		{
+			const int mid = low + (high - low)/2;
+			if(queries[mid].timestamp < from)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		ibeg = low;
+	}
+	if(until != 0 && !queries_unsorted)
+	{
+		int low = ibeg, high = iend;
+		while(low < high)
+		{
+			const int mid = low + (high - low)/2;
+			if(queries[mid].timestamp <= until)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		iend = low;
+	}
+
+	// When filtering by client or domain, stream the matching records from
+	// the inverted indexes instead of scanning every query and testing the
+	// ID. All other filters still apply inside the loop
+	// While fork()ed TCP workers have recorded queries the main process
+	// has not indexed yet, the lists are incomplete and we scan instead
+	const int *indexlist = NULL;
+	int indexcount = -1;
+	if(queryIndexesComplete())
+	{
+		if(filterclientname && clientid >= 0)
+			indexcount = getQueryIndexList(true, clientid, &indexlist);
+		else if(filterdomainname && domainid >= 0)
+			indexcount = getQueryIndexList(false, domainid, &indexlist);
+	}
+
 	int i;
-	for(i=ibeg; i < counters->queries; i++)
+	for(int k=0; ; k++)
 	{
+		if(indexcount >= 0)
+		{
+			// Iterate over the inverted index list
+			if(k >= indexcount)
+				break;
+			i = indexlist[k];
+			// Respect the requested window ((N) requests, time bounds)
+			if(i < ibeg || i >= iend)
+				continue;
+		}
+		else
+		{
+			// Iterate over the full range
+			i = ibeg + k;
+			if(i >= iend)
+				break;
+		}
+
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 		// Check if this query has been create while in maximum privacy mode
-		if(queries[i].privacylevel >= PRIVACY_MAXIMUM) continue;
+		if(queries_cold[i].privacylevel >= PRIVACY_MAXIMUM) continue;
 
 		validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
 		validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
@@ -805,14 +933,14 @@ void getAllQueries(const char *client_message, int *sock)
 		else
 			client = getClientIPString(i);
 
-		unsigned long delay = queries[i].response;
+		unsigned long delay = queries_cold[i].response;
 		// Check if received (delay should be smaller than 30min)
 		if(delay > 1.8e7)
 			delay = 0;
 
 		if(istelnet[*sock])
 		{
-			ssend(*sock,"%li %s %s %s %i %i %i %lu",queries[i].timestamp,qtype,domain,client,queries[i].status,queries[i].dnssec,queries[i].reply,delay);
+			ssend(*sock,"%li %s %s %s %i %i %i %lu",queries[i].timestamp,qtype,domain,client,queries[i].status,queries_cold[i].dnssec,queries[i].reply,delay);
 			if(config.debug & DEBUG_API)
 				ssend(*sock, " %i", i);
 			ssend(*sock, "\n");
@@ -825,24 +953,119 @@ void getAllQueries(const char *client_message, int *sock)
 			if(!pack_fixstr(*sock, qtype))
 				return;
 
-			// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
-			if(!pack_str32(*sock, domain) || !pack_str32(*sock, client))
+			// Use str32 for domain and client because we have no idea how long they will be
+			// (max is 4294967295 for str32). With string-table framing enabled these
+			// collapse into references after their first occurrence
+			if(!pack_str32_table(*sock, domain) || !pack_str32_table(*sock, client))
 				return;
 
 			pack_uint8(*sock, queries[i].status);
-			pack_uint8(*sock, queries[i].dnssec);
+			pack_uint8(*sock, queries_cold[i].dnssec);
+		}
+	}
+}
+
+// Number of queries serialized per lock slice in getQueryExport()
+#define EXPORT_CHUNKSIZE 10000
+
+// Bulk export of the in-memory query data: the queries are serialized in
+// bounded chunks and the shared-memory lock is re-acquired for every chunk,
+// so pulling millions of records neither freezes the resolver nor holds the
+// lock for the duration of the whole response. ">export gzip" wraps the
+// stream in standard gzip framing for the log-shipping pipelines
+void getQueryExport(const char *client_message, int *sock)
+{
+	// Exit before processing any data if requested via config setting
+	get_privacy_level(NULL);
+	if(config.privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	const bool compress = command(client_message, " gzip");
+
+	z_stream strm;
+	unsigned char zbuffer[16384];
+	if(compress)
+	{
+		memset(&strm, 0, sizeof(strm));
+		// 15+16: maximum window with gzip framing
+		if(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			ssend(*sock, "error: cannot initialize compression\n");
+			return;
 		}
 	}
 
-	// Free allocated memory
-	if(filterclientname)
-		free(clientname);
+	long int pos = -1;
+	bool done = false;
+	while(!done)
+	{
+		// Serialize one chunk while holding the shared lock
+		lock_shm_read();
+
+		// Resume where the last chunk ended. GC may have advanced the
+		// ring head in the meantime, skip whatever expired
+		if(pos < counters->queries_start)
+			pos = counters->queries_start;
+
+		long int end = counters->queries_start + counters->queries;
+		if(end - pos > EXPORT_CHUNKSIZE)
+			end = pos + EXPORT_CHUNKSIZE;
+		else
+			done = true;
+
+		size_t used = 0, size = 65536;
+		char *chunk = calloc(size, sizeof(char));
+		for(; pos < end; pos++)
+		{
+			validate_access("queries", pos, true, __LINE__, __FUNCTION__, __FILE__);
+
+			// Skip queries recorded while in maximum privacy mode
+			if(queries_cold[pos].privacylevel >= PRIVACY_MAXIMUM)
+				continue;
 
-	if(filterdomainname)
-		free(domainname);
+			char line[512];
+			const int len = snprintf(line, sizeof(line), "%li %s %s %s %i %i %i %lu\n",
+			         queries[pos].timestamp,
+			         querytypes[queries[pos].type - TYPE_A],
+			         getDomainString(pos),
+			         getClientIPString(pos),
+			         queries[pos].status,
+			         queries_cold[pos].dnssec,
+			         queries[pos].reply,
+			         queries_cold[pos].response);
+
+			if(used + len + 1 > size)
+			{
+				size *= 2;
+				chunk = realloc(chunk, size);
+			}
+			memcpy(chunk + used, line, len);
+			used += len;
+		}
+		unlock_shm();
+
+		// Write the chunk out without holding the lock
+		if(compress)
+		{
+			strm.next_in = (unsigned char*)chunk;
+			strm.avail_in = used;
+			do
+			{
+				strm.next_out = zbuffer;
+				strm.avail_out = sizeof(zbuffer);
+				deflate(&strm, done ? Z_FINISH : Z_NO_FLUSH);
+				swrite(*sock, zbuffer, sizeof(zbuffer) - strm.avail_out);
+			} while(strm.avail_out == 0 || (done && strm.avail_in > 0));
+		}
+		else if(used > 0)
+		{
+			swrite(*sock, chunk, used);
+		}
+		free(chunk);
+	}
 
-	if(filterforwarddest)
-		free(forwarddest);
+	if(compress)
+		deflateEnd(&strm);
 }
 
 void getRecentBlocked(const char *client_message, int *sock)
@@ -856,10 +1079,20 @@ void getRecentBlocked(const char *client_message, int *sock)
 			num = 0;
 	}
 
-	// Find most recently blocked query
+	// Walk the recent-blocked ring (newest first) instead of scanning
+	// backwards through the query history
 	int found = 0;
-	for(int i = counters->queries - 1; i > 0 ; i--)
+	for(unsigned int n = 0; ; n++)
 	{
+		const int i = getRecentBlockedID(n);
+		if(i < 0)
+			break;
+
+		// Skip entries that have expired from the query ring
+		if(i < counters->queries_start ||
+		   i >= counters->queries_start + counters->queries)
+			continue;
+
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 
 		if(queries[i].status == QUERY_GRAVITY ||
@@ -891,10 +1124,18 @@ void getClientID(int *sock)
 		pack_int32(*sock, *sock);
 }
 
-void getQueryTypesOverTime(int *sock)
+void getQueryTypesOverTime(const char *client_message, int *sock)
 {
 	int i, from = -1, until = OVERTIME_SLOTS;
 	time_t mintime = overTime[0].timestamp;
+
+	// Cursor-based delta request: the client passes the time stamp of the
+	// last slot it already has, we only send the slots after it
+	long int cursor = 0;
+	sscanf(client_message, "%*[^ ] %li", &cursor);
+	if(cursor > 0 && cursor > mintime)
+		mintime = cursor + 1;
+
 	for(i = 0; i < OVERTIME_SLOTS; i++)
 	{
 		if((overTime[i].total > 0 || overTime[i].blocked > 0) && overTime[i].timestamp >= mintime)
@@ -1004,9 +1245,10 @@ void getDBstats(int *sock)
 	format_memory_size(prefix, filesize, &formated);
 
 	if(istelnet[*sock])
-		ssend(*sock,"queries in database: %i\ndatabase filesize: %.2f %sB\nSQLite version: %s\n", get_number_of_queries_in_DB(), formated, prefix, sqlite3_libversion());
+		ssend(*sock,"queries in database: %lli\ndatabase filesize: %.2f %sB\nSQLite version: %s\n", get_number_of_queries_in_DB(), formated, prefix, sqlite3_libversion());
 	else {
-		pack_int32(*sock, get_number_of_queries_in_DB());
+		// The binary API transports this as 32 bit for compatibility
+		pack_int32(*sock, (int32_t) get_number_of_queries_in_DB());
 		pack_int64(*sock, filesize);
 
 		if(!pack_str32(*sock, (char *) sqlite3_libversion()))
@@ -1014,7 +1256,7 @@ void getDBstats(int *sock)
 	}
 }
 
-void getClientsOverTime(int *sock)
+void getClientsOverTime(const char *client_message, int *sock)
 {
 	int i, sendit = -1, until = OVERTIME_SLOTS;
 
@@ -1023,11 +1265,19 @@ void getClientsOverTime(int *sock)
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
 		return;
 
+	// Cursor-based delta request: the client passes the time stamp of the
+	// last slot it already has, we only send the slots after it
+	time_t mintime = overTime[0].timestamp;
+	long int cursor = 0;
+	sscanf(client_message, "%*[^ ] %li", &cursor);
+	if(cursor > 0 && cursor > mintime)
+		mintime = cursor + 1;
+
 	// Find minimum ID to send
 	for(i = 0; i < OVERTIME_SLOTS; i++)
 	{
 		if((overTime[i].total > 0 || overTime[i].blocked > 0) &&
-		   overTime[i].timestamp >= overTime[0].timestamp)
+		   overTime[i].timestamp >= mintime)
 		{
 			sendit = i;
 			break;
@@ -1082,7 +1332,7 @@ void getClientsOverTime(int *sock)
 			if(skipclient[j])
 				continue;
 
-			int thisclient = clients[j].overTime[i];
+			int thisclient = getClientOverTime(j, i);
 
 			if(istelnet[*sock])
 				ssend(*sock, " %i", thisclient);
@@ -1100,6 +1350,205 @@ void getClientsOverTime(int *sock)
 		clearSetupVarsArray();
 }
 
+// List clients whose query rate in the current (or previous) ten-second
+// window exceeds the configured threshold
+void getFlooding(int *sock)
+{
+	const time_t window = time(NULL) / 10;
+	for(int i = 0; i < counters->clients; i++)
+	{
+		validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
+
+		// Ignore stale windows of clients that went quiet
+		if(clients[i].rate_window != window && clients[i].rate_window != window-1)
+			continue;
+
+		const float qps = clients[i].rate_count / 10.0f;
+		if(qps < config.floodthreshold)
+			continue;
+
+		if(istelnet[*sock])
+			ssend(*sock, "%.1f %s %s\n", qps,
+			      getstr(clients[i].ippos), getstr(clients[i].namepos));
+		else
+		{
+			if(!pack_str32(*sock, getstr(clients[i].ippos)))
+				return;
+			pack_float(*sock, qps);
+		}
+	}
+}
+
+// Per-hook latency histograms: one line per hook and non-empty bucket with
+// the bucket's lower bound in nanoseconds and the number of calls
+void getHookTimes(int *sock)
+{
+	const char *hooknames[HOOK_MAX] = { "new_query", "forwarded", "reply", "cache", "dnssec" };
+	for(int hook = 0; hook < HOOK_MAX; hook++)
+		for(unsigned int bucket = 0; bucket < HOOK_BUCKETS; bucket++)
+		{
+			const unsigned int count = counters->hook_histogram[hook][bucket];
+			if(count == 0)
+				continue;
+			ssend(*sock, "%s %llu %u\n", hooknames[hook],
+			      1ULL << bucket, count);
+		}
+}
+
+// Extract a percentile from a log-scale response-time histogram. The
+// returned value is the lower bucket bound in milliseconds
+static float histogram_percentile(const unsigned int *histogram, float fraction)
+{
+	unsigned long total = 0;
+	for(unsigned int bucket = 0; bucket < RESPONSE_BUCKETS; bucket++)
+		total += histogram[bucket];
+	if(total == 0)
+		return 0.0f;
+
+	unsigned long rank = (unsigned long)(total * fraction);
+	unsigned long seen = 0;
+	for(unsigned int bucket = 0; bucket < RESPONSE_BUCKETS; bucket++)
+	{
+		seen += histogram[bucket];
+		if(seen > rank)
+			return (float)(1UL << bucket) / 10.0f;
+	}
+	return (float)(1UL << (RESPONSE_BUCKETS-1)) / 10.0f;
+}
+
+static float histogram_max(const unsigned int *histogram)
+{
+	for(int bucket = RESPONSE_BUCKETS-1; bucket >= 0; bucket--)
+		if(histogram[bucket] > 0)
+			return (float)(1UL << bucket) / 10.0f;
+	return 0.0f;
+}
+
+// Upstream response-time percentiles: one line for the global distribution
+// and one per forward destination (all values in milliseconds)
+void getLatency(int *sock)
+{
+	ssend(*sock, "global %.1f %.1f %.1f %.1f\n",
+	      histogram_percentile(counters->response_histogram, 0.50f),
+	      histogram_percentile(counters->response_histogram, 0.90f),
+	      histogram_percentile(counters->response_histogram, 0.99f),
+	      histogram_max(counters->response_histogram));
+
+	for(int i = 0; i < counters->forwarded; i++)
+	{
+		validate_access("forwarded", i, true, __LINE__, __FUNCTION__, __FILE__);
+		ssend(*sock, "%s %.1f %.1f %.1f %.1f\n", getstr(forwarded[i].ippos),
+		      histogram_percentile(forwarded[i].latency_histogram, 0.50f),
+		      histogram_percentile(forwarded[i].latency_histogram, 0.90f),
+		      histogram_percentile(forwarded[i].latency_histogram, 0.99f),
+		      histogram_max(forwarded[i].latency_histogram));
+	}
+}
+
+// Single machine-readable scrape endpoint: dumps all counters, the
+// per-upstream statistics, the overTime tail and the shared memory usage as
+// "name value" lines. Everything reported here is incrementally maintained
+// elsewhere -- no sorting, no recomputation -- and the output leaves in one
+// buffered write
+void getMetrics(int *sock)
+{
+	ssend(*sock, "queries %i\n", counters->queries);
+	ssend(*sock, "blocked %i\n", counters->blocked);
+	ssend(*sock, "cached %i\n", counters->cached);
+	ssend(*sock, "unknown %i\n", counters->unknown);
+	ssend(*sock, "ratelimited %i\n", counters->ratelimited);
+	ssend(*sock, "unsampled %i\n", counters->unsampled);
+	ssend(*sock, "sampling %i\n", config.sampling);
+	ssend(*sock, "forwarded_queries %i\n", counters->forwardedqueries);
+	ssend(*sock, "clients %i\n", counters->clients);
+	ssend(*sock, "domains %i\n", counters->domains);
+	ssend(*sock, "gravity %i\n", counters->gravity);
+
+	const char *types[TYPE_MAX-1] = { "A", "AAAA", "ANY", "SRV", "SOA", "PTR", "TXT" };
+	for(int i = 0; i < TYPE_MAX-1; i++)
+		ssend(*sock, "querytype_%s %i\n", types[i], counters->querytype[i]);
+
+	ssend(*sock, "reply_NODATA %i\n", counters->reply_NODATA);
+	ssend(*sock, "reply_NXDOMAIN %i\n", counters->reply_NXDOMAIN);
+	ssend(*sock, "reply_CNAME %i\n", counters->reply_CNAME);
+	ssend(*sock, "reply_IP %i\n", counters->reply_IP);
+	ssend(*sock, "reply_domain %i\n", counters->reply_domain);
+
+	// Per-upstream statistics
+	for(int i = 0; i < counters->forwarded; i++)
+	{
+		validate_access("forwarded", i, true, __LINE__, __FUNCTION__, __FILE__);
+		ssend(*sock, "forward %s %i %i %.1f %.3f\n", getstr(forwarded[i].ippos),
+		      forwarded[i].count, forwarded[i].failed,
+		      forwarded[i].latency_ewma, forwarded[i].failure_ewma);
+	}
+
+	// Tail of the overTime data: the six most recent slots that already
+	// started (one hour of history)
+	const time_t now = time(NULL);
+	int last = OVERTIME_SLOTS-1;
+	while(last > 0 && overTime[last].timestamp >= now)
+		last--;
+	for(int i = last > 5 ? last-5 : 0; i <= last; i++)
+		ssend(*sock, "overtime %li %i %i\n", overTime[i].timestamp,
+		      overTime[i].total, overTime[i].blocked);
+
+	// Shared memory usage
+	ssend(*sock, "shm_queries_bytes %zu\n",
+	      (size_t)counters->queries_MAX*(sizeof(queriesDataStruct)+sizeof(queriesColdDataStruct)));
+	ssend(*sock, "shm_strings_bytes %i\n", counters->strings_MAX);
+	ssend(*sock, "shm_clients_bytes %zu\n", (size_t)counters->clients_MAX*sizeof(clientsDataStruct));
+	ssend(*sock, "shm_domains_bytes %zu\n", (size_t)counters->domains_MAX*sizeof(domainsDataStruct));
+}
+
+// Lock contention profile: one line per caller site of the shared-memory
+// lock with acquisition count, contended acquisitions and hold times
+void getLockStats(int *sock)
+{
+	for(unsigned int slot = 0; ; slot++)
+	{
+		const char *caller;
+		unsigned long acquisitions, contended;
+		unsigned long long held_ns, max_ns;
+		if(getLockStatsEntry(slot, &caller, &acquisitions, &contended,
+		                     &held_ns, &max_ns) == NULL)
+			break;
+
+		ssend(*sock, "%s %lu %lu %.3f %.3f\n", caller, acquisitions,
+		      contended, held_ns/1e6, max_ns/1e6);
+	}
+}
+
+// Report one memory line: allocated/used/wasted bytes of one segment
+static void sendMemoryLine(int *sock, const char *name, size_t allocated, size_t used)
+{
+	char prefix_a[2] = "", prefix_u[2] = "", prefix_w[2] = "";
+	double alloc_fmt, used_fmt, wasted_fmt;
+	format_memory_size(prefix_a, allocated, &alloc_fmt);
+	format_memory_size(prefix_u, used, &used_fmt);
+	format_memory_size(prefix_w, allocated - used, &wasted_fmt);
+	ssend(*sock, "%s %.1f %sB allocated, %.1f %sB used, %.1f %sB wasted\n",
+	      name, alloc_fmt, prefix_a, used_fmt, prefix_u, wasted_fmt, prefix_w);
+}
+
+// Per-segment shared memory accounting
+void getMemory(int *sock)
+{
+	sendMemoryLine(sock, "queries",
+	               (size_t)counters->queries_MAX*(sizeof(queriesDataStruct)+sizeof(queriesColdDataStruct)),
+	               (size_t)(counters->queries_start + counters->queries)*(sizeof(queriesDataStruct)+sizeof(queriesColdDataStruct)));
+	sendMemoryLine(sock, "strings", counters->strings_MAX, shm_strings_used());
+	sendMemoryLine(sock, "domains",
+	               (size_t)counters->domains_MAX*sizeof(domainsDataStruct),
+	               (size_t)counters->domains*sizeof(domainsDataStruct));
+	sendMemoryLine(sock, "clients",
+	               (size_t)counters->clients_MAX*sizeof(clientsDataStruct),
+	               (size_t)counters->clients*sizeof(clientsDataStruct));
+	sendMemoryLine(sock, "forwarded",
+	               (size_t)counters->forwarded_MAX*sizeof(forwardedDataStruct),
+	               (size_t)counters->forwarded*sizeof(forwardedDataStruct));
+}
+
 void getClientNames(int *sock)
 {
 	int i;
@@ -1160,11 +1609,33 @@ void getUnknownQueries(int *sock)
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
 		return;
 
+	// Walk only the live set of still-open queries. The index is
+	// self-cleaning: everything answered since the last call is dropped.
+	// While queries recorded by fork()ed TCP workers are not absorbed
+	// yet the index is incomplete and we scan the whole ring instead
+	const int *unknownlist = NULL;
+	int unknowns = -1;
+	if(queryIndexesComplete())
+		unknowns = filterUnknownIndex(&unknownlist);
+
 	int i;
-	for(i=0; i < counters->queries; i++)
+	for(int k = 0; ; k++)
 	{
+		if(unknowns >= 0)
+		{
+			if(k >= unknowns)
+				break;
+			i = unknownlist[k];
+		}
+		else
+		{
+			i = counters->queries_start + k;
+			if(i >= counters->queries_start + counters->queries)
+				break;
+			if(queries[i].status != QUERY_UNKNOWN && queries[i].complete)
+				continue;
+		}
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
-		if(queries[i].status != QUERY_UNKNOWN && queries[i].complete) continue;
 
 		char type[5];
 		if(queries[i].type == TYPE_A)
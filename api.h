@@ -10,16 +10,23 @@
 
 // Statistic methods
 void getStats(int *sock);
-void getOverTime(int *sock);
+void getOverTime(const char *client_message, int *sock);
 void getTopDomains(const char *client_message, int *sock);
 void getTopClients(const char *client_message, int *sock);
 void getForwardDestinations(const char *client_message, int *sock);
 void getQueryTypes(int *sock);
 void getAllQueries(const char *client_message, int *sock);
+void getQueryExport(const char *client_message, int *sock);
 void getRecentBlocked(const char *client_message, int *sock);
-void getQueryTypesOverTime(int *sock);
-void getClientsOverTime(int *sock);
+void getQueryTypesOverTime(const char *client_message, int *sock);
+void getClientsOverTime(const char *client_message, int *sock);
 void getClientNames(int *sock);
+void getFlooding(int *sock);
+void getHookTimes(int *sock);
+void getLatency(int *sock);
+void getMetrics(int *sock);
+void getLockStats(int *sock);
+void getMemory(int *sock);
 void getDomainDetails(const char *client_message, int *sock);
 
 // FTL methods
@@ -33,6 +40,9 @@ void getCacheInformation(int *sock);
 
 // MessagePack serialization helpers
 void pack_eom(int sock);
+void pack_strtab_begin(void);
+void pack_strtab_end(void);
+bool pack_str32_table(int sock, const char *string);
 void pack_bool(int sock, bool value);
 void pack_uint8(int sock, uint8_t value);
 void pack_uint64(int sock, uint64_t value);
@@ -0,0 +1,199 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Microbenchmark harness (built via "make bench", not part of pihole-FTL)
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+// malloc.h must come before FTL.h as the latter redefines the allocator
+// functions as checked macros
+#include <malloc.h>
+#include "FTL.h"
+#include "shmem.h"
+
+// The harness links only the data-structure core, not the dnsmasq and
+// socket interfaces: provide the few symbols the linked objects expect
+char *username = NULL;
+void shift_inflight_hash(int offset) { (void)offset; }
+int main_dnsmasq(int argc, const char **argv) { (void)argc; (void)argv; logg("bench: main_dnsmasq stub called"); return 0; }
+void __attribute__ ((format (gnu_printf, 2, 3))) ssend(int sock, const char *format, ...)
+{
+	(void)sock; (void)format;
+}
+unsigned short __attribute__((pure)) FTL_dnsmasq_port(void) { return (unsigned short)config.port; }
+
+// Number of synthetic entities, overridable on the command line:
+//   ./pihole-FTL-bench [domains] [clients] [lookups]
+static int num_domains = 100000;
+static int num_clients = 3000;
+static int num_lookups = 1000000;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static size_t allocated_bytes(void)
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks;
+}
+
+static void report(const char *name, double ns, long ops, size_t alloc_before)
+{
+	const long alloc_delta = (long)allocated_bytes() - (long)alloc_before;
+	printf("%-28s %10.1f ns/op   (%ld ops in %.1f ms, heap %+ld bytes)\n",
+	       name, ns/ops, ops, ns/1e6, alloc_delta);
+}
+
+static void bench_addstr(void)
+{
+	char buffer[64];
+	const size_t alloc = allocated_bytes();
+	const double start = now_ns();
+	for(int i = 0; i < num_domains; i++)
+	{
+		sprintf(buffer, "bench%i.example.com", i);
+		addstr(buffer);
+	}
+	report("addstr (unique)", now_ns()-start, num_domains, alloc);
+
+	const double start2 = now_ns();
+	for(int i = 0; i < num_domains; i++)
+	{
+		sprintf(buffer, "bench%i.example.com", i);
+		addstr(buffer);
+	}
+	report("addstr (interned hit)", now_ns()-start2, num_domains, alloc);
+}
+
+static void bench_getstr(void)
+{
+	const size_t alloc = allocated_bytes();
+	const double start = now_ns();
+	size_t sum = 0;
+	for(int i = 0; i < num_lookups; i++)
+		sum += getstr((size_t)(i % 1000))[0];
+	const double elapsed = now_ns()-start;
+	if(sum == 1) printf("?");
+	report("getstr", elapsed, num_lookups, alloc);
+}
+
+static void bench_find(const char *name, int count, int (*find)(const char*),
+                       const char *prefix, const char *suffix)
+{
+	char buffer[64];
+	size_t alloc = allocated_bytes();
+	double start = now_ns();
+	for(int i = 0; i < count; i++)
+	{
+		sprintf(buffer, "%s%i%s", prefix, i, suffix);
+		find(buffer);
+	}
+	char label[64];
+	snprintf(label, sizeof(label), "%s (insert)", name);
+	report(label, now_ns()-start, count, alloc);
+
+	alloc = allocated_bytes();
+	start = now_ns();
+	for(int i = 0; i < num_lookups; i++)
+	{
+		sprintf(buffer, "%s%i%s", prefix, i % count, suffix);
+		find(buffer);
+	}
+	snprintf(label, sizeof(label), "%s (lookup)", name);
+	report(label, now_ns()-start, num_lookups, alloc);
+}
+
+static int findDomainID_wrapper(const char *domain)
+{
+	return findDomainID(domain);
+}
+
+static int findClientID_wrapper(const char *client)
+{
+	return findClientID(client, true);
+}
+
+static int findForwardID_wrapper(const char *forward)
+{
+	return findForwardID(forward, true);
+}
+
+static void bench_overtime(void)
+{
+	const size_t alloc = allocated_bytes();
+	const double start = now_ns();
+	for(int i = 0; i < num_lookups; i++)
+		addClientOverTime(i % num_clients, (unsigned int)(i % OVERTIME_SLOTS), 1);
+	report("addClientOverTime", now_ns()-start, num_lookups, alloc);
+}
+
+static void bench_regex(void)
+{
+	// Compile a synthetic pattern set
+	char regexfile[] = "/tmp/FTL-bench-regex-XXXXXX";
+	int fd = mkstemp(regexfile);
+	if(fd < 0)
+		return;
+	FILE *fp = fdopen(fd, "w");
+	for(int i = 0; i < 180; i++)
+		fprintf(fp, "(^|\\.)pattern%i[0-9]*\\.com$\n", i);
+	fclose(fp);
+	files.regexlist = regexfile;
+	files.whitelist = (char*)"/nonexistent";
+	read_regex_from_file();
+
+	char buffer[64];
+	const size_t alloc = allocated_bytes();
+	const double start = now_ns();
+	const int matches = num_lookups/10;
+	for(int i = 0; i < matches; i++)
+	{
+		sprintf(buffer, "host%i.not-blocked.example.com", i);
+		match_regex(buffer);
+	}
+	report("match_regex (no match)", now_ns()-start, matches, alloc);
+	unlink(regexfile);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1) num_domains = atoi(argv[1]);
+	if(argc > 2) num_clients = atoi(argv[2]);
+	if(argc > 3) num_lookups = atoi(argv[3]);
+
+	// Minimal environment: no daemon, no database, log to /dev/null
+	daemonmode = true; // suppress the stdout copy of log lines
+	FTLfiles.log = strdup("/dev/null");
+	open_FTL_log(false);
+	database = false;
+	config.maxlogage = MAXLOGAGE*3600;
+	config.GCbatchsize = 0;
+	config.privacylevel = PRIVACY_SHOW_ALL;
+
+	if(!init_shmem())
+	{
+		printf("Cannot initialize shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("pihole-FTL microbenchmarks: %i domains, %i clients, %i lookups\n\n",
+	       num_domains, num_clients, num_lookups);
+
+	bench_addstr();
+	bench_getstr();
+	bench_find("findDomainID", num_domains, findDomainID_wrapper, "domain", ".bench.net");
+	bench_find("findClientID", num_clients, findClientID_wrapper, "10.", ".0.1");
+	bench_find("findForwardID", 8, findForwardID_wrapper, "192.168.200.", "");
+	bench_overtime();
+	bench_regex();
+
+	destroy_shmem();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,305 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Binary query log
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "shmem.h"
+#include <sys/mman.h>
+
+// The binary query log is an alternative to the sqlite queries table for
+// very high volume resolvers: fixed-size records are appended to a
+// memory-mapped file, so persisting a query is a couple of memory writes
+// with batched msync() instead of sqlite statement execution. One segment
+// file is written per day (<BINARYLOG>.<YYYYMMDD>); segments older than
+// MAXDBDAYS are pruned on rotation.
+
+#define BINLOG_FILE_MAGIC 0x314c4e49424c5446ULL // "FTLBINL1"
+#define BINLOG_RECORD_MAGIC 0x51524543u
+#define BINLOG_CHUNK_RECORDS 4096
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t count;
+} binlogHeader;
+
+typedef struct {
+	uint32_t magic;
+	int32_t type;
+	int32_t status;
+	int64_t timestamp;
+	char domain[68];
+	char client[48];
+	char forward[48]; // empty when the query was not forwarded
+} binlogRecord;
+
+static int binlog_fd = -1;
+static binlogHeader *binlog_map = NULL;
+static size_t binlog_capacity = 0; // records
+static unsigned int binlog_day = 0; // YYYYMMDD of the open segment
+// In-memory sequence used to mark queries as persisted. Only uniqueness
+// within this process matters, the IDs are not stored in the log
+static long long binlog_seq = 0;
+
+bool __attribute__((pure)) binlog_active(void)
+{
+	return FTLfiles.binlog != NULL && strlen(FTLfiles.binlog) > 0;
+}
+
+// Records start right after the header
+static binlogRecord *binlog_records(void)
+{
+	return (binlogRecord*)(void*)((char*)binlog_map + sizeof(binlogHeader));
+}
+
+static unsigned int __attribute__((const)) day_of(time_t timestamp)
+{
+	struct tm day;
+	gmtime_r(&timestamp, &day);
+	return (day.tm_year+1900)*10000u + (day.tm_mon+1)*100u + day.tm_mday;
+}
+
+static void binlog_unmap(void)
+{
+	if(binlog_map != NULL)
+	{
+		msync(binlog_map, sizeof(binlogHeader) + binlog_capacity*sizeof(binlogRecord), MS_SYNC);
+		munmap(binlog_map, sizeof(binlogHeader) + binlog_capacity*sizeof(binlogRecord));
+		binlog_map = NULL;
+	}
+	if(binlog_fd >= 0)
+	{
+		close(binlog_fd);
+		binlog_fd = -1;
+	}
+}
+
+// Build the file name of the segment for the given day
+static char *binlog_filename(unsigned int day)
+{
+	char *path = NULL;
+	if(asprintf(&path, "%s.%u", FTLfiles.binlog, day) < 0)
+		return NULL;
+	return path;
+}
+
+// Open (or create) the segment of the given day and delete the segment
+// that just fell out of the retention window
+static bool binlog_open(unsigned int day)
+{
+	binlog_unmap();
+
+	char *path = binlog_filename(day);
+	if(path == NULL)
+		return false;
+
+	binlog_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if(binlog_fd < 0)
+	{
+		logg("binlog_open(): Cannot open %s: %s (%i)", path, strerror(errno), errno);
+		free(path);
+		return false;
+	}
+	free(path);
+
+	// Determine current capacity from the file size, growing a fresh
+	// (or undersized) file to one chunk
+	struct stat st;
+	fstat(binlog_fd, &st);
+	size_t size = st.st_size;
+	const size_t minsize = sizeof(binlogHeader) + BINLOG_CHUNK_RECORDS*sizeof(binlogRecord);
+	const bool fresh = size < sizeof(binlogHeader);
+	if(size < minsize)
+	{
+		if(ftruncate(binlog_fd, minsize) != 0)
+		{
+			logg("binlog_open(): ftruncate failed: %s (%i)", strerror(errno), errno);
+			close(binlog_fd);
+			binlog_fd = -1;
+			return false;
+		}
+		size = minsize;
+	}
+
+	binlog_capacity = (size - sizeof(binlogHeader))/sizeof(binlogRecord);
+	binlog_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, binlog_fd, 0);
+	if(binlog_map == MAP_FAILED)
+	{
+		logg("binlog_open(): mmap failed: %s (%i)", strerror(errno), errno);
+		binlog_map = NULL;
+		close(binlog_fd);
+		binlog_fd = -1;
+		return false;
+	}
+
+	if(fresh)
+	{
+		binlog_map->magic = BINLOG_FILE_MAGIC;
+		binlog_map->version = 1;
+		binlog_map->count = 0;
+	}
+	else if(binlog_map->magic != BINLOG_FILE_MAGIC)
+	{
+		logg("binlog_open(): Invalid magic in segment %u, starting over", day);
+		binlog_map->magic = BINLOG_FILE_MAGIC;
+		binlog_map->version = 1;
+		binlog_map->count = 0;
+	}
+
+	binlog_day = day;
+
+	// Prune the segment that left the retention window. Day arithmetic
+	// through time_t keeps month/year boundaries correct
+	if(config.maxDBdays > 0)
+	{
+		char *old = binlog_filename(day_of(time(NULL) - (time_t)config.maxDBdays*86400));
+		if(old != NULL)
+		{
+			unlink(old);
+			free(old);
+		}
+	}
+
+	return true;
+}
+
+// Append one record. Called from the database thread with the snapshot
+// already taken, i.e. without any shared-memory lock
+void binlog_append(time_t timestamp, int type, int status,
+                   const char *domain, const char *client, const char *forward)
+{
+	const unsigned int day = day_of(timestamp);
+	if(binlog_map == NULL || day != binlog_day)
+		if(!binlog_open(day))
+			return;
+
+	// Grow the mapping when the segment is full
+	if(binlog_map->count >= binlog_capacity)
+	{
+		const size_t oldsize = sizeof(binlogHeader) + binlog_capacity*sizeof(binlogRecord);
+		const size_t newsize = oldsize + BINLOG_CHUNK_RECORDS*sizeof(binlogRecord);
+		if(ftruncate(binlog_fd, newsize) != 0)
+		{
+			logg("binlog_append(): ftruncate failed: %s (%i)", strerror(errno), errno);
+			return;
+		}
+		void *newmap = mremap(binlog_map, oldsize, newsize, MREMAP_MAYMOVE);
+		if(newmap == MAP_FAILED)
+		{
+			logg("binlog_append(): mremap failed: %s (%i)", strerror(errno), errno);
+			return;
+		}
+		binlog_map = newmap;
+		binlog_capacity += BINLOG_CHUNK_RECORDS;
+	}
+
+	binlogRecord *record = &binlog_records()[binlog_map->count];
+	memset(record, 0, sizeof(*record));
+	record->magic = BINLOG_RECORD_MAGIC;
+	record->type = type;
+	record->status = status;
+	record->timestamp = timestamp;
+	strncpy(record->domain, domain, sizeof(record->domain)-1);
+	strncpy(record->client, client, sizeof(record->client)-1);
+	if(forward != NULL)
+		strncpy(record->forward, forward, sizeof(record->forward)-1);
+
+	// Publish the record only after it has been fully written
+	binlog_map->count++;
+}
+
+// Schedule the dirty pages for write-out. Called once per flush so the
+// individual appends stay allocation- and syscall-free
+void binlog_sync(void)
+{
+	if(binlog_map != NULL)
+		msync(binlog_map, sizeof(binlogHeader) + binlog_capacity*sizeof(binlogRecord), MS_ASYNC);
+}
+
+// Deliver a unique (per process) ID marking a query as persisted
+long long binlog_next_id(void)
+{
+	return ++binlog_seq;
+}
+
+// Import one segment, feeding all records within the time window into the
+// in-memory structures in batches under short lock windows
+static void binlog_import_segment(unsigned int day, time_t mintime, time_t now)
+{
+	char *path = binlog_filename(day);
+	if(path == NULL)
+		return;
+
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if(fd < 0)
+		return;
+
+	struct stat st;
+	fstat(fd, &st);
+	if((size_t)st.st_size < sizeof(binlogHeader))
+	{
+		close(fd);
+		return;
+	}
+
+	binlogHeader *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED || map->magic != BINLOG_FILE_MAGIC)
+	{
+		if(map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return;
+	}
+
+	const binlogRecord *records = (const binlogRecord*)(const void*)((const char*)map + sizeof(binlogHeader));
+	size_t count = map->count;
+	const size_t capacity = (st.st_size - sizeof(binlogHeader))/sizeof(binlogRecord);
+	if(count > capacity)
+		count = capacity;
+
+	int batched = 0;
+	lock_shm();
+	for(size_t i = 0; i < count; i++)
+	{
+		if(++batched > 1000)
+		{
+			batched = 0;
+			unlock_shm();
+			lock_shm();
+		}
+
+		const binlogRecord *record = &records[i];
+		if(record->magic != BINLOG_RECORD_MAGIC || record->timestamp < mintime)
+			continue;
+
+		import_queryrecord(binlog_next_id(), record->timestamp, record->type,
+		                   record->status, record->domain, record->client,
+		                   record->forward[0] != '\0' ? record->forward : NULL, now);
+	}
+	unlock_shm();
+
+	munmap(map, st.st_size);
+}
+
+// Read the most recent history from the binary log segments
+void binlog_import(void)
+{
+	const time_t now = time(NULL);
+	const time_t mintime = now - config.maxlogage;
+
+	// The 24h window can span at most two day segments
+	const unsigned int firstday = day_of(mintime);
+	const unsigned int today = day_of(now);
+	if(firstday != today)
+		binlog_import_segment(firstday, mintime, now);
+	binlog_import_segment(today, mintime, now);
+
+	logg("Imported %i queries from the binary query log", counters->queries);
+}
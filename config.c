@@ -58,6 +58,258 @@ void getLogFilePath(void)
 		logg("Using log file %s", FTLfiles.log);
 }
 
+// Settings that are safe to change while FTL is running. This subroutine is
+// called from read_FTLconf() at startup and again on SIGHUP, so these values
+// can be tuned without a restart -- the periodic threads pick the new values
+// up on their next loop iteration
+void read_runtime_settings(FILE *fp)
+{
+	// See if we got a file handle, if not we have to open
+	// the config file ourselves
+	bool opened = false;
+	if(fp == NULL)
+	{
+		if((fp = fopen(FTLfiles.conf, "r")) == NULL)
+			// Return silently if there is no config file available
+			return;
+		opened = true;
+	}
+
+	char *buffer;
+	int value;
+	float fvalue;
+
+	// DBINTERVAL
+	// How often do we store queries in FTL's database [minutes]?
+	// this value can be a floating point number, e.g. "DBINTERVAL=0.5"
+	// defaults to: once per minute
+	config.DBinterval = 60;
+	buffer = parse_FTLconf(fp, "DBINTERVAL");
+
+	fvalue = 0;
+	if(buffer != NULL && sscanf(buffer, "%f", &fvalue))
+		// check if the read value is
+		// - larger than 0.1min (6sec), and
+		// - smaller than 1440.0min (once a day)
+		if(fvalue >= 0.1f && fvalue <= 1440.0f)
+			config.DBinterval = (int)(fvalue * 60);
+
+	if(config.DBinterval == 60)
+		logg("   DBINTERVAL: saving to DB file every minute");
+	else
+		logg("   DBINTERVAL: saving to DB file every %i seconds", config.DBinterval);
+
+	// FASTEST_UPSTREAM
+	// Feed the measured per-upstream latency and failure averages back
+	// into dnsmasq's server selection, preferring the fastest healthy
+	// upstream and probing the others at a low rate
+	// defaults to: No
+	config.fastestupstream = false;
+	buffer = parse_FTLconf(fp, "FASTEST_UPSTREAM");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.fastestupstream = true;
+
+	if(config.fastestupstream)
+		logg("   FASTEST_UPSTREAM: Latency-aware upstream selection is active");
+	else
+		logg("   FASTEST_UPSTREAM: Inactive");
+
+	// SHMEM_HUGEPAGES
+	// Ask the kernel to back the large shared memory segments with huge
+	// pages (transparent hugepage madvise). Reduces TLB pressure in the
+	// scan loops on instances where the segments grow to hundreds of MB;
+	// the kernel falls back to normal pages when none are available
+	// defaults to: No
+	config.shmhugepages = false;
+	buffer = parse_FTLconf(fp, "SHMEM_HUGEPAGES");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.shmhugepages = true;
+
+	if(config.shmhugepages)
+		logg("   SHMEM_HUGEPAGES: Advising huge pages for large segments");
+	else
+		logg("   SHMEM_HUGEPAGES: Inactive");
+
+	// MAIN_THREAD_CORE
+	// Pin the dnsmasq main thread (the DNS hot path) to the given CPU
+	// core so background work cannot be scheduled onto it (-1 = off)
+	// defaults to: -1
+	config.maincore = -1;
+	buffer = parse_FTLconf(fp, "MAIN_THREAD_CORE");
+
+	value = -1;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 0)
+			config.maincore = value;
+
+	if(config.maincore >= 0)
+		logg("   MAIN_THREAD_CORE: Pinning the DNS thread to core %i", config.maincore);
+	else
+		logg("   MAIN_THREAD_CORE: Not pinning the DNS thread");
+
+	// BACKGROUND_NICE
+	// Run FTL's background threads (database, GC, resolver, importer,
+	// log writer) with batch scheduling and reduced priority so they
+	// yield to the DNS hot path
+	// defaults to: No
+	config.nicebackground = false;
+	buffer = parse_FTLconf(fp, "BACKGROUND_NICE");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.nicebackground = true;
+
+	if(config.nicebackground)
+		logg("   BACKGROUND_NICE: Background threads use batch scheduling");
+	else
+		logg("   BACKGROUND_NICE: Inactive");
+
+	// CACHE_AUTOGROW
+	// Automatically enlarge dnsmasq's DNS cache when live entries had to
+	// be evicted (an undersized cache silently costs upstream round
+	// trips). The cache grows by 50% per step, up to ten times the
+	// configured cache-size
+	// defaults to: No
+	config.cacheautogrow = false;
+	buffer = parse_FTLconf(fp, "CACHE_AUTOGROW");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.cacheautogrow = true;
+
+	if(config.cacheautogrow)
+		logg("   CACHE_AUTOGROW: dnsmasq cache grows on evictions");
+	else
+		logg("   CACHE_AUTOGROW: Inactive");
+
+	// GCBATCHSIZE
+	// Maximum number of queries the garbage collector processes per lock
+	// slice. Between slices the lock is released so that query processing
+	// and API requests are never blocked for the duration of a full GC
+	// run. Setting this to 0 restores the previous all-at-once behavior.
+	// defaults to: 10000
+	config.GCbatchsize = 10000;
+	buffer = parse_FTLconf(fp, "GCBATCHSIZE");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 0)
+			config.GCbatchsize = value;
+
+	if(config.GCbatchsize == 0)
+		logg("   GCBATCHSIZE: --- (GC runs in one piece)");
+	else
+		logg("   GCBATCHSIZE: GC processes up to %i queries per slice", config.GCbatchsize);
+
+	// DBPENDINGMAX
+	// Flush the pending queries to the database as soon as this many have
+	// accumulated, even if the DBINTERVAL time budget has not expired yet.
+	// This bounds the crash-lossable backlog during daytime bursts while
+	// quiet periods see no early flushes (0 = time-based flushing only)
+	// defaults to: 10000
+	config.DBpendingmax = 10000;
+	buffer = parse_FTLconf(fp, "DBPENDINGMAX");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 0)
+			config.DBpendingmax = value;
+
+	if(config.DBpendingmax > 0)
+		logg("   DBPENDINGMAX: Flushing after at most %i pending queries", config.DBpendingmax);
+	else
+		logg("   DBPENDINGMAX: Flushing on the time budget only");
+
+	// RESOLVE_TTL
+	// Validity of resolved host names [seconds]: the re-resolution passes
+	// only look up entries whose cached name expired instead of hammering
+	// the PTR zone with identical lookups every hour
+	// defaults to: 3600 s
+	config.resolveTTL = 3600;
+	buffer = parse_FTLconf(fp, "RESOLVE_TTL");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 60)
+			config.resolveTTL = value;
+
+	logg("   RESOLVE_TTL: Host names are cached for %i seconds", config.resolveTTL);
+
+	// RATE_THRESHOLD
+	// Queries per second above which a client is reported by the
+	// >flooding API command
+	// defaults to: 100 qps
+	config.floodthreshold = 100;
+	buffer = parse_FTLconf(fp, "RATE_THRESHOLD");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value > 0)
+			config.floodthreshold = value;
+
+	logg("   RATE_THRESHOLD: Reporting clients above %i queries per second", config.floodthreshold);
+
+	// RATE_LIMIT
+	// Enforced per-client limit [queries per second]: queries of clients
+	// exceeding it are answered REFUSED locally and never forwarded
+	// (0 = no enforcement). Accounted over ten-second windows
+	// defaults to: 0
+	config.ratelimit = 0;
+	buffer = parse_FTLconf(fp, "RATE_LIMIT");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 0)
+			config.ratelimit = value;
+
+	if(config.ratelimit > 0)
+		logg("   RATE_LIMIT: Refusing client queries above %i qps", config.ratelimit);
+	else
+		logg("   RATE_LIMIT: Not enforcing a rate limit");
+
+	// SAMPLING
+	// Record only every N-th query in full (queries[] entry with domain
+	// and client attribution) while still counting every query in the
+	// cheap aggregate counters; the API scales sampled statistics back
+	// up. Bounds the per-query bookkeeping at extreme rates
+	// defaults to: 1 (record everything)
+	config.sampling = 1;
+	buffer = parse_FTLconf(fp, "SAMPLING");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 1)
+			config.sampling = value;
+
+	if(config.sampling > 1)
+		logg("   SAMPLING: Recording every %i-th query in full", config.sampling);
+	else
+		logg("   SAMPLING: Recording every query");
+
+	// SUBSCRIBE_TICK
+	// Batching interval [milliseconds] for pushed API updates: clients
+	// that registered with >subscribe receive incremental updates at most
+	// this often (and only when the underlying data actually changed)
+	// defaults to: 1000 ms
+	config.subscribetick = 1000;
+	buffer = parse_FTLconf(fp, "SUBSCRIBE_TICK");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 100)
+			config.subscribetick = value;
+
+	logg("   SUBSCRIBE_TICK: Pushing updates every %i ms", config.subscribetick);
+
+
+	// Close the file (and release memory) only if we opened it
+	if(opened)
+	{
+		fclose(fp);
+		release_config_memory();
+	}
+}
+
 void read_FTLconf(void)
 {
 	FILE *fp;
@@ -140,25 +392,8 @@ void read_FTLconf(void)
 	else
 		logg("   RESOLVE_IPV4: Don\'t resolve IPv4 addresses");
 
-	// DBINTERVAL
-	// How often do we store queries in FTL's database [minutes]?
-	// this value can be a floating point number, e.g. "DBINTERVAL=0.5"
-	// defaults to: once per minute
-	config.DBinterval = 60;
-	buffer = parse_FTLconf(fp, "DBINTERVAL");
-
-	float fvalue = 0;
-	if(buffer != NULL && sscanf(buffer, "%f", &fvalue))
-		// check if the read value is
-		// - larger than 0.1min (6sec), and
-		// - smaller than 1440.0min (once a day)
-		if(fvalue >= 0.1f && fvalue <= 1440.0f)
-			config.DBinterval = (int)(fvalue * 60);
-
-	if(config.DBinterval == 60)
-		logg("   DBINTERVAL: saving to DB file every minute");
-	else
-		logg("   DBINTERVAL: saving to DB file every %i seconds", config.DBinterval);
+	// Runtime-tunable settings (re-read on SIGHUP)
+	read_runtime_settings(fp);
 
 	// DBFILE
 	// defaults to: "/etc/pihole/pihole-FTL.db"
@@ -200,12 +435,78 @@ void read_FTLconf(void)
 	config.maxlogage = MAXLOGAGE*3600;
 	buffer = parse_FTLconf(fp, "MAXLOGAGE");
 
-	fvalue = 0;
+	float fvalue = 0;
 	if(buffer != NULL && sscanf(buffer, "%f", &fvalue))
 		if(fvalue >= 0.0f && fvalue <= 1.0f*MAXLOGAGE)
 			config.maxlogage = (int)(fvalue * 3600);
 	logg("   MAXLOGAGE: Importing up to %.1f hours of log data", (float)config.maxlogage/3600.0f);
 
+	// ASYNC_STATS
+	// Defer the reply-side statistics hooks to a lock-free event queue
+	// drained by a dedicated consumer thread instead of taking the
+	// shared-memory lock inside dnsmasq's packet-processing path
+	// defaults to: No
+	config.asyncstats = false;
+	buffer = parse_FTLconf(fp, "ASYNC_STATS");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.asyncstats = true;
+
+	if(config.asyncstats)
+		logg("   ASYNC_STATS: Reply statistics are recorded asynchronously");
+	else
+		logg("   ASYNC_STATS: Inactive");
+
+	// WARMRESTART
+	// Keep the shared memory segments on clean shutdown and resume them
+	// on the next start instead of re-importing the history from the
+	// database, making restarts effectively instant
+	// defaults to: No
+	config.warmrestart = false;
+	buffer = parse_FTLconf(fp, "WARMRESTART");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.warmrestart = true;
+
+	if(config.warmrestart)
+		logg("   WARMRESTART: Resuming shared memory across restarts");
+	else
+		logg("   WARMRESTART: Inactive");
+
+	// DBWAL
+	// Open the long-term database in write-ahead-log mode with relaxed
+	// (but WAL-safe) syncing. This stops readers from blocking the
+	// writer, avoids the per-flush rollback journal churn and is much
+	// friendlier to flash-backed devices
+	// defaults to: Yes
+	config.DBwal = true;
+	buffer = parse_FTLconf(fp, "DBWAL");
+
+	if(buffer != NULL && strcasecmp(buffer, "no") == 0)
+		config.DBwal = false;
+
+	if(config.DBwal)
+		logg("   DBWAL: Using write-ahead logging");
+	else
+		logg("   DBWAL: Using rollback journal");
+
+	// DBMMAPSIZE
+	// Access the database through a memory mapping of up to this many MiB
+	// instead of read() syscalls (0 = disabled)
+	// defaults to: 0
+	config.DBmmapsize = 0;
+	buffer = parse_FTLconf(fp, "DBMMAPSIZE");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 0)
+			config.DBmmapsize = value;
+
+	if(config.DBmmapsize > 0)
+		logg("   DBMMAPSIZE: Mapping up to %i MiB of the database", config.DBmmapsize);
+	else
+		logg("   DBMMAPSIZE: Not using memory-mapped I/O");
+
 	// PRIVACYLEVEL
 	// Specify if we want to anonymize the DNS queries somehow, available options are:
 	// PRIVACY_SHOW_ALL (0) = don't hide anything
@@ -309,6 +610,17 @@ void read_FTLconf(void)
 	// MACVENDORDB
 	getpath(fp, "MACVENDORDB", "/etc/pihole/macvendor.db", &FTLfiles.macvendordb);
 
+	// BINARYLOG
+	// Base path of the binary query log. When set, queries are persisted
+	// into memory-mapped daily segment files (<base>.<YYYYMMDD>) instead
+	// of the sqlite queries table
+	// defaults to: unset (sqlite persistence)
+	buffer = parse_FTLconf(fp, "BINARYLOG");
+	if(buffer != NULL && sscanf(buffer, "%127ms", &FTLfiles.binlog) == 1)
+		logg("   BINARYLOG: Using daily segments %s.<day>", FTLfiles.binlog);
+	else
+		FTLfiles.binlog = NULL;
+
 	// PARSE_ARP_CACHE
 	// defaults to: true
 	config.parse_arp_cache = true;
@@ -9,6 +9,10 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+// Thread scheduling and affinity control
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 struct timeval t0[NUMTIMERS];
 
@@ -110,10 +114,16 @@ void sleepms(int milliseconds)
 	select(0, NULL, NULL, NULL, &tv);
 }
 
+// The pid of the main FTL process. fork()ed TCP workers compare against
+// this to recognize that they only own throwaway copies of process-local
+// structures (see catchupQueryIndexes())
+pid_t mainpid = 0;
+
 void savepid(void)
 {
 	FILE *f;
 	pid_t pid = getpid();
+	mainpid = pid;
 	if((f = fopen(FTLfiles.pid, "w+")) == NULL)
 	{
 		logg("WARNING: Unable to write PID to file.");
@@ -157,3 +167,87 @@ char *getUserName(void)
 
 	return name;
 }
+
+// Give the calling (background) thread batch scheduling and a reduced
+// priority when configured: the kernel then prefers the DNS hot path
+// whenever both are runnable
+void thread_set_background(void)
+{
+	if(!config.nicebackground)
+		return;
+
+	const pid_t tid = (pid_t)syscall(SYS_gettid);
+	struct sched_param param = { 0 };
+	if(sched_setscheduler(tid, SCHED_BATCH, &param) != 0)
+		logg("WARN: Cannot set batch scheduling: %s", strerror(errno));
+	if(setpriority(PRIO_PROCESS, tid, 10) != 0)
+		logg("WARN: Cannot lower thread priority: %s", strerror(errno));
+}
+
+// Pin the calling thread (the dnsmasq main thread) to the configured core.
+// Must be called after the service threads have been created so they do not
+// inherit the restricted affinity
+void main_thread_affinity(void)
+{
+	if(config.maincore < 0)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(config.maincore, &set);
+	if(sched_setaffinity((pid_t)syscall(SYS_gettid), sizeof(set), &set) != 0)
+		logg("WARN: Cannot pin DNS thread to core %i: %s", config.maincore, strerror(errno));
+	else
+		logg("Pinned DNS thread to core %i", config.maincore);
+}
+
+// Consolidated scheduler: all periodic background jobs run on this single
+// thread instead of one mostly-idle thread (stack plus timer wakeups) each.
+// The job table is a minimal timer wheel; the jobs keep their own interval
+// logic (GC interval, adaptive database flushing) internally
+typedef struct {
+	void (*run)(void);
+	unsigned int check_interval;	// [ms]
+	unsigned long long next;	// [ms]
+} periodicJob;
+
+static periodicJob jobs[] = {
+	{ GC_tick, 1000, 0 },
+	{ DB_tick, 1000, 0 },
+};
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000ULL + ts.tv_nsec/1000000ULL;
+}
+
+void *scheduler_thread(void *val)
+{
+	// Set thread name
+	prctl(PR_SET_NAME, "scheduler", 0, 0, 0);
+	thread_set_background();
+
+	while(!killed)
+	{
+		const unsigned long long now = now_ms();
+		unsigned long long earliest = now + 1000;
+		for(unsigned int i = 0; i < sizeof(jobs)/sizeof(*jobs); i++)
+		{
+			if(now >= jobs[i].next)
+			{
+				jobs[i].run();
+				jobs[i].next = now_ms() + jobs[i].check_interval;
+			}
+			if(jobs[i].next < earliest)
+				earliest = jobs[i].next;
+		}
+
+		const unsigned long long after = now_ms();
+		if(earliest > after)
+			sleepms((int)(earliest - after));
+	}
+
+	return NULL;
+}
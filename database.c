@@ -19,8 +19,10 @@ long int lastdbindex = 0;
 
 static pthread_mutex_t dblock;
 
-bool db_set_counter(unsigned int ID, int value);
+bool db_set_counter(unsigned int ID, long long value);
 int db_get_FTL_property(unsigned int ID);
+static bool create_regex_cache_table(void);
+static void store_regex_verdicts(void);
 
 static void check_database(int rc)
 {
@@ -38,6 +40,30 @@ static void check_database(int rc)
 	}
 }
 
+// Apply the user-configured database tuning to a freshly opened connection:
+// write-ahead logging with WAL-safe relaxed syncing and, if requested,
+// memory-mapped I/O
+static void apply_db_pragmas(sqlite3 *dbhandle)
+{
+	if(config.DBwal)
+	{
+		sqlite3_exec(dbhandle, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+		// NORMAL is fully safe in WAL mode and avoids one fsync per
+		// transaction, sparing write cycles on flash-backed devices
+		sqlite3_exec(dbhandle, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
+	}
+
+	if(config.DBmmapsize > 0)
+	{
+		char *pragma = NULL;
+		if(asprintf(&pragma, "PRAGMA mmap_size=%lli;", (long long)config.DBmmapsize << 20) > 0)
+		{
+			sqlite3_exec(dbhandle, pragma, NULL, NULL, NULL);
+			free(pragma);
+		}
+	}
+}
+
 void dbclose(void)
 {
 	int rc = sqlite3_close(db);
@@ -71,17 +97,15 @@ bool dbopen(void)
 		return false;
 	}
 
+	apply_db_pragmas(db);
+
 	return true;
 }
 
-bool dbquery(const char *format, ...)
+static bool db_vquery(sqlite3 *dbhandle, const char *format, va_list args)
 {
 	char *zErrMsg = NULL;
-	va_list args;
-
-	va_start(args, format);
 	char *query = sqlite3_vmprintf(format, args);
-	va_end(args);
 
 	if(query == NULL)
 	{
@@ -91,7 +115,7 @@ bool dbquery(const char *format, ...)
 
 	if(config.debug & DEBUG_DATABASE) logg("dbquery: %s", query);
 
-	int rc = sqlite3_exec(db, query, NULL, NULL, &zErrMsg);
+	int rc = sqlite3_exec(dbhandle, query, NULL, NULL, &zErrMsg);
 
 	if( rc != SQLITE_OK ){
 		logg("dbquery(%s) - SQL error (%i): %s", query, rc, zErrMsg);
@@ -106,6 +130,178 @@ bool dbquery(const char *format, ...)
 
 }
 
+bool dbquery(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	bool ret = db_vquery(db, format, args);
+	va_end(args);
+	return ret;
+}
+
+// Persistent write connection used by save_to_DB(): opening the database and
+// preparing the insert statement happen once, later flushes only bind/step/
+// reset, so the minutely flush no longer pays connection setup and SQL
+// parsing. Access is serialized through the same dblock as the shared handle
+static sqlite3 *savedb = NULL;
+static sqlite3_stmt *savestmt = NULL;
+static sqlite3_stmt *domain_ins = NULL, *domain_sel = NULL;
+static sqlite3_stmt *client_ins = NULL, *client_sel = NULL;
+static sqlite3_stmt *rollup_upsert = NULL;
+
+static bool dbquery_save(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	bool ret = db_vquery(savedb, format, args);
+	va_end(args);
+	return ret;
+}
+
+static bool open_save_connection(void)
+{
+	if(savedb != NULL)
+		return true;
+
+	int rc = sqlite3_open_v2(FTLfiles.db, &savedb, SQLITE_OPEN_READWRITE, NULL);
+	if( rc ){
+		logg("open_save_connection() - SQL error (%i): %s", rc, sqlite3_errmsg(savedb));
+		sqlite3_close(savedb);
+		savedb = NULL;
+		check_database(rc);
+		return false;
+	}
+
+	// Give way to concurrent users of the database instead of failing
+	sqlite3_busy_timeout(savedb, 1000);
+
+	apply_db_pragmas(savedb);
+
+	rc = sqlite3_prepare_v2(savedb, "INSERT INTO queries VALUES (NULL,?,?,?,?,?,?)", -1, &savestmt, NULL);
+	if( rc ){
+		logg("open_save_connection() - error preparing insert (%i): %s", rc, sqlite3_errmsg(savedb));
+		sqlite3_close(savedb);
+		savedb = NULL;
+		check_database(rc);
+		return false;
+	}
+
+	// Dimension table lookups used to resolve domain/client strings into
+	// their integer IDs while saving
+	sqlite3_prepare_v2(savedb, "INSERT OR IGNORE INTO domain_by_id (domain) VALUES (?)", -1, &domain_ins, NULL);
+	sqlite3_prepare_v2(savedb, "SELECT id FROM domain_by_id WHERE domain = ?", -1, &domain_sel, NULL);
+	sqlite3_prepare_v2(savedb, "INSERT OR IGNORE INTO client_by_id (ip) VALUES (?)", -1, &client_ins, NULL);
+	sqlite3_prepare_v2(savedb, "SELECT id FROM client_by_id WHERE ip = ?", -1, &client_sel, NULL);
+
+	// Incremental maintenance of the per-hour rollup counts
+	sqlite3_prepare_v2(savedb, "INSERT INTO hourly_counts VALUES (?,?,?,?,1) "
+	                           "ON CONFLICT(hour,domain,client,status) DO UPDATE SET count = count+1",
+	                   -1, &rollup_upsert, NULL);
+
+	return true;
+}
+
+// Resolve a dimension string into its integer ID, inserting it on first use
+static sqlite3_int64 dimension_id(sqlite3_stmt *ins, sqlite3_stmt *sel, const char *value)
+{
+	sqlite3_bind_text(ins, 1, value, -1, SQLITE_STATIC);
+	sqlite3_step(ins);
+	sqlite3_clear_bindings(ins);
+	sqlite3_reset(ins);
+
+	sqlite3_int64 id = -1;
+	sqlite3_bind_text(sel, 1, value, -1, SQLITE_STATIC);
+	if(sqlite3_step(sel) == SQLITE_ROW)
+		id = sqlite3_column_int64(sel, 0);
+	sqlite3_clear_bindings(sel);
+	sqlite3_reset(sel);
+
+	return id;
+}
+
+// Pending regex verdicts waiting to be written to the database. The buffer
+// is filled from the query path and drained by the database thread; when it
+// overflows we simply drop verdicts, they will be re-evaluated after the
+// next restart
+#define REGEX_PENDING_MAX 4096
+typedef struct {
+	size_t domainpos;
+	unsigned char verdict;
+} pendingRegexVerdict;
+static pendingRegexVerdict regex_pending[REGEX_PENDING_MAX];
+static int regex_pending_count = 0;
+static pthread_mutex_t regex_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Normalize an existing denormalized queries table (database version 5):
+// the full domain and client strings per row are replaced by integer
+// references into newly created dimension tables
+static bool normalize_queries_table(void)
+{
+	bool ret;
+	ret = dbquery("CREATE TABLE domain_by_id ( id INTEGER PRIMARY KEY AUTOINCREMENT, domain TEXT UNIQUE NOT NULL );");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("CREATE TABLE client_by_id ( id INTEGER PRIMARY KEY AUTOINCREMENT, ip TEXT UNIQUE NOT NULL );");
+	if(!ret){ dbclose(); return false; }
+
+	ret = dbquery("BEGIN TRANSACTION");
+	if(!ret){ dbclose(); return false; }
+	dbquery("INSERT INTO domain_by_id (domain) SELECT DISTINCT domain FROM queries;");
+	dbquery("INSERT INTO client_by_id (ip) SELECT DISTINCT client FROM queries;");
+	dbquery("CREATE TABLE queries_normalized ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward TEXT );");
+	ret = dbquery("INSERT INTO queries_normalized SELECT q.id, q.timestamp, q.type, q.status, d.id, c.id, q.forward "
+	              "FROM queries q JOIN domain_by_id d ON q.domain = d.domain JOIN client_by_id c ON q.client = c.ip;");
+	if(!ret){ dbquery("ROLLBACK"); dbclose(); return false; }
+	dbquery("DROP TABLE queries;");
+	dbquery("ALTER TABLE queries_normalized RENAME TO queries;");
+	dbquery("CREATE INDEX idx_queries_timestamps ON queries (timestamp);");
+	ret = db_set_FTL_property(DB_VERSION, 5);
+	if(!ret){ dbquery("ROLLBACK"); dbclose(); return false; }
+	ret = dbquery("END TRANSACTION");
+	if(!ret){ dbclose(); return false; }
+
+	return true;
+}
+
+// Per-hour rollup counts (database version 6): every stored query increments
+// its (hour, domain, client, status) bucket, so long-horizon views aggregate
+// a few thousand rollup rows instead of millions of raw rows. The rollups
+// deliberately survive the raw-row retention cleanup, extending the horizon
+// of the aggregated statistics beyond MAXDBDAYS
+static bool create_rollup_table(void)
+{
+	bool ret;
+	ret = dbquery("CREATE TABLE hourly_counts ( hour INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, status INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY(hour,domain,client,status) );");
+	if(!ret){ dbclose(); return false; }
+
+	// Initialize the rollups from the already stored queries
+	ret = dbquery("INSERT INTO hourly_counts SELECT (timestamp/3600)*3600, domain, client, status, COUNT(*) FROM queries GROUP BY (timestamp/3600)*3600, domain, client, status;");
+	if(!ret){ dbclose(); return false; }
+
+	// Update database version to 6
+	ret = db_set_FTL_property(DB_VERSION, 6);
+	if(!ret){ dbclose(); return false; }
+
+	return true;
+}
+
+static bool create_regex_cache_table(void)
+{
+	bool ret;
+	// Cached per-domain regex verdicts (REGEX_BLOCKED/REGEX_NOTBLOCKED)
+	ret = dbquery("CREATE TABLE regex_cache ( domain TEXT PRIMARY KEY NOT NULL, verdict INTEGER NOT NULL );");
+	if(!ret){ dbclose(); return false; }
+
+	// The set of regex patterns the cached verdicts were computed against
+	ret = dbquery("CREATE TABLE regex_patterns ( pattern TEXT PRIMARY KEY NOT NULL );");
+	if(!ret){ dbclose(); return false; }
+
+	// Update database version to 4
+	ret = db_set_FTL_property(DB_VERSION, 4);
+	if(!ret){ dbclose(); return false; }
+
+	return true;
+}
+
 static bool create_counter_table(void)
 {
 	bool ret;
@@ -142,12 +338,19 @@ static bool db_create(void)
 		check_database(rc);
 		return false;
 	}
-	// Create Queries table in the database
-	ret = dbquery("CREATE TABLE queries ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain TEXT NOT NULL, client TEXT NOT NULL, forward TEXT );");
+	// Create Queries table in the database. Domain and client are integer
+	// references into the dimension tables below so repeated strings are
+	// stored only once
+	ret = dbquery("CREATE TABLE queries ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward TEXT );");
 	if(!ret){ dbclose(); return false; }
 	// Add an index on the timestamps (not a unique index!)
 	ret = dbquery("CREATE INDEX idx_queries_timestamps ON queries (timestamp);");
 	if(!ret){ dbclose(); return false; }
+	// Create dimension tables mirroring the in-memory domains[]/clients[]
+	ret = dbquery("CREATE TABLE domain_by_id ( id INTEGER PRIMARY KEY AUTOINCREMENT, domain TEXT UNIQUE NOT NULL );");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("CREATE TABLE client_by_id ( id INTEGER PRIMARY KEY AUTOINCREMENT, ip TEXT UNIQUE NOT NULL );");
+	if(!ret){ dbclose(); return false; }
 	// Create FTL table in the database (holds properties like database version, etc.)
 	ret = dbquery("CREATE TABLE ftl ( id INTEGER PRIMARY KEY NOT NULL, value BLOB NOT NULL );");
 	if(!ret){ dbclose(); return false; }
@@ -170,6 +373,20 @@ static bool db_create(void)
 	if(!create_network_table())
 		return false;
 
+	// Create regex verdict cache tables
+	// Will update DB version to 4
+	if(!create_regex_cache_table())
+		return false;
+
+	// The queries table above is already normalized
+	if(!db_set_FTL_property(DB_VERSION, 5))
+		{ dbclose(); return false; }
+
+	// Create rollup table
+	// Will update DB version to 6
+	if(!create_rollup_table())
+		return false;
+
 	return true;
 }
 
@@ -249,6 +466,48 @@ void db_init(void)
 		// Get updated version
 		dbversion = db_get_FTL_property(DB_VERSION);
 	}
+	// Update to version 4 if lower
+	if(dbversion < 4)
+	{
+		// Update to version 4: Create regex verdict cache tables
+		logg("Updating long-term database to version 4");
+		if (!create_regex_cache_table())
+		{
+			logg("Regex cache tables not initialized, database not available");
+			database = false;
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_FTL_property(DB_VERSION);
+	}
+	// Update to version 5 if lower
+	if(dbversion < 5)
+	{
+		// Update to version 5: Normalize the queries table
+		logg("Updating long-term database to version 5 (normalizing queries table)");
+		if (!normalize_queries_table())
+		{
+			logg("Queries table not normalized, database not available");
+			database = false;
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_FTL_property(DB_VERSION);
+	}
+	// Update to version 6 if lower
+	if(dbversion < 6)
+	{
+		// Update to version 6: Create hourly rollup table
+		logg("Updating long-term database to version 6 (hourly rollups)");
+		if (!create_rollup_table())
+		{
+			logg("Rollup table not initialized, database not available");
+			database = false;
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_FTL_property(DB_VERSION);
+	}
 
 	// Close database to prevent having it opened all time
 	// we already closed the database when we returned earlier
@@ -288,16 +547,18 @@ bool db_set_FTL_property(unsigned int ID, int value)
 	return dbquery("INSERT OR REPLACE INTO ftl (id, value) VALUES ( %u, %i );", ID, value);
 }
 
-bool db_set_counter(unsigned int ID, int value)
+bool db_set_counter(unsigned int ID, long long value)
 {
-	return dbquery("INSERT OR REPLACE INTO counters (id, value) VALUES ( %u, %i );", ID, value);
+	return dbquery("INSERT OR REPLACE INTO counters (id, value) VALUES ( %u, %lli );", ID, value);
 }
 
-static bool db_update_counters(int total, int blocked)
+// The lifetime counters in the database are 64 bit: a busy instance can
+// overflow a 32-bit total query counter within a few years of uptime
+static bool db_update_counters(long long total, long long blocked)
 {
-	if(!dbquery("UPDATE counters SET value = value + %i WHERE id = %i;", total, DB_TOTALQUERIES))
+	if(!dbquery_save("UPDATE counters SET value = value + %lli WHERE id = %i;", total, DB_TOTALQUERIES))
 		return false;
-	if(!dbquery("UPDATE counters SET value = value + %i WHERE id = %i;", blocked, DB_BLOCKEDQUERIES))
+	if(!dbquery_save("UPDATE counters SET value = value + %lli WHERE id = %i;", blocked, DB_BLOCKEDQUERIES))
 		return false;
 	return true;
 }
@@ -338,7 +599,7 @@ int db_query_int(const char* querystr)
 	return result;
 }
 
-static int number_of_queries_in_DB(void)
+static long long number_of_queries_in_DB(void)
 {
 	sqlite3_stmt* stmt;
 
@@ -359,7 +620,7 @@ static int number_of_queries_in_DB(void)
 		return DB_FAILED;
 	}
 
-	int result = sqlite3_column_int(stmt, 0);
+	long long result = sqlite3_column_int64(stmt, 0);
 
 	sqlite3_finalize(stmt);
 
@@ -370,9 +631,9 @@ static sqlite3_int64 last_ID_in_DB(void)
 {
 	sqlite3_stmt* stmt;
 
-	int rc = sqlite3_prepare_v2(db, "SELECT MAX(ID) FROM queries", -1, &stmt, NULL);
+	int rc = sqlite3_prepare_v2(savedb, "SELECT MAX(ID) FROM queries", -1, &stmt, NULL);
 	if( rc ){
-		logg("last_ID_in_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		logg("last_ID_in_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(savedb));
 		dbclose();
 		check_database(rc);
 		return DB_FAILED;
@@ -380,7 +641,7 @@ static sqlite3_int64 last_ID_in_DB(void)
 
 	rc = sqlite3_step(stmt);
 	if( rc != SQLITE_ROW ){
-		logg("last_ID_in_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		logg("last_ID_in_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(savedb));
 		dbclose();
 		check_database(rc);
 		return DB_FAILED;
@@ -393,9 +654,9 @@ static sqlite3_int64 last_ID_in_DB(void)
 	return result;
 }
 
-int get_number_of_queries_in_DB(void)
+long long get_number_of_queries_in_DB(void)
 {
-	int result = DB_NODATA;
+	long long result = DB_NODATA;
 
 	if(!dbopen())
 	{
@@ -411,6 +672,20 @@ int get_number_of_queries_in_DB(void)
 	return result;
 }
 
+// One row of the snapshot taken by save_to_DB() under the shared-memory
+// lock. All strings are private copies so that the sqlite work afterwards
+// can run without any lock: disk latency no longer blocks DNS stats
+typedef struct {
+	time_t timestamp;
+	unsigned char type;
+	unsigned char status;
+	char *domain;
+	char *client;
+	char *forward; // NULL when the query was not forwarded
+	sqlite3_int64 dbid;
+	bool failed;   // insert failed (or was never attempted), revert the mark
+} dbSnapshotRow;
+
 void save_to_DB(void)
 {
 	// Don't save anything to the database if in PRIVACY_NOSTATS mode
@@ -420,44 +695,45 @@ void save_to_DB(void)
 	// Start database timer
 	if(config.debug & DEBUG_DATABASE) timer_start(DATABASE_WRITE_TIMER);
 
-	// Open database
-	if(!dbopen())
-	{
-		logg("save_to_DB() - failed to open DB");
-		return;
-	}
-
-	unsigned int saved = 0, saved_error = 0;
-	long int i;
-	sqlite3_stmt* stmt;
-
-	// Get last ID stored in the database
-	sqlite3_int64 lastID = last_ID_in_DB();
+	// When the binary query log is active, no sqlite connection is needed
+	const bool binlog = binlog_active();
 
-	bool ret = dbquery("BEGIN TRANSACTION");
-	if(!ret)
+	sqlite3_int64 lastID = 0;
+	if(!binlog)
 	{
-		logg("save_to_DB() - unable to begin transaction (%i): %s", ret, sqlite3_errmsg(db));
-		dbclose();
-		return;
-	}
+		// Serialize with the other database users, then lazily open the
+		// persistent write connection with its prepared insert statement
+		pthread_mutex_lock(&dblock);
+		if(!open_save_connection())
+		{
+			logg("save_to_DB() - failed to open DB");
+			pthread_mutex_unlock(&dblock);
+			return;
+		}
 
-	int rc = sqlite3_prepare_v2(db, "INSERT INTO queries VALUES (NULL,?,?,?,?,?,?)", -1, &stmt, NULL);
-	if( rc )
-	{
-		logg("save_to_DB() - error in preparing SQL statement (%i): %s", ret, sqlite3_errmsg(db));
-		dbclose();
-		check_database(rc);
-		return;
+		// Get last ID stored in the database
+		lastID = last_ID_in_DB();
 	}
+	const sqlite3_int64 firstID = lastID + 1;
+
+	// ======== Phase 1: snapshot the pending slice under the lock ========
+	lock_shm();
+
+	long int i;
+	int pending = 0;
+	dbSnapshotRow *rows = NULL;
+	const long int tail = counters->queries_start + counters->queries;
+	const long int first = MAX(counters->queries_start, lastdbindex);
+	if(tail > first)
+		rows = calloc(tail - first, sizeof(dbSnapshotRow));
 
 	int total = 0, blocked = 0;
 	time_t currenttimestamp = time(NULL);
 	time_t newlasttimestamp = 0;
-	for(i = MAX(0, lastdbindex); i < counters->queries; i++)
+	for(i = first; i < tail; i++)
 	{
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
-		if(queries[i].db != 0)
+		if(queries_cold[i].db != 0)
 		{
 			// Skip, already saved in database
 			continue;
@@ -470,68 +746,33 @@ void save_to_DB(void)
 			break;
 		}
 
-		// Memory checks
-		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
-
-		if(queries[i].privacylevel >= PRIVACY_MAXIMUM)
+		if(queries_cold[i].privacylevel >= PRIVACY_MAXIMUM)
 		{
 			// Skip, we never store nor count queries recorded
 			// while have been in maximum privacy mode in the database
 			continue;
 		}
 
-		// TIMESTAMP
-		sqlite3_bind_int(stmt, 1, queries[i].timestamp);
-
-		// TYPE
-		sqlite3_bind_int(stmt, 2, queries[i].type);
-
-		// STATUS
-		sqlite3_bind_int(stmt, 3, queries[i].status);
-
-		// DOMAIN
-		const char *domain = getDomainString(i);
-		sqlite3_bind_text(stmt, 4, domain, -1, SQLITE_TRANSIENT);
-
-		// CLIENT
-		const char *client = getClientIPString(i);
-		sqlite3_bind_text(stmt, 5, client, -1, SQLITE_TRANSIENT);
-
-		// FORWARD
+		// Copy the row. The database ID is assigned right away so that
+		// this query is not snapshotted again; the marks are reverted
+		// should the write fail below
+		dbSnapshotRow *row = &rows[pending++];
+		row->timestamp = queries[i].timestamp;
+		row->type = queries[i].type;
+		row->status = queries[i].status;
+		row->domain = strdup(getDomainString(i));
+		row->client = strdup(getClientIPString(i));
 		if(queries[i].status == QUERY_FORWARDED && queries[i].forwardID > -1)
 		{
 			validate_access("forwarded", queries[i].forwardID, true, __LINE__, __FUNCTION__, __FILE__);
-			sqlite3_bind_text(stmt, 6, getstr(forwarded[queries[i].forwardID].ippos), -1, SQLITE_TRANSIENT);
+			row->forward = strdup(getstr(forwarded[queries[i].forwardID].ippos));
 		}
 		else
 		{
-			sqlite3_bind_null(stmt, 6);
-		}
-
-		// Step and check if successful
-		rc = sqlite3_step(stmt);
-		sqlite3_clear_bindings(stmt);
-		sqlite3_reset(stmt);
-
-		if( rc != SQLITE_DONE ){
-			logg("save_to_DB() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
-			saved_error++;
-			if(saved_error < 3)
-			{
-				continue;
-			}
-			else
-			{
-				logg("save_to_DB() - exiting due to too many errors");
-				break;
-			}
-			// Check this error message
-			check_database(rc);
+			row->forward = NULL;
 		}
-
-		saved++;
-		// Mark this query as saved in the database by setting the corresponding ID
-		queries[i].db = ++lastID;
+		row->dbid = binlog ? binlog_next_id() : ++lastID;
+		queries_cold[i].db = row->dbid;
 
 		// Total counter information (delta computation)
 		total++;
@@ -548,28 +789,162 @@ void save_to_DB(void)
 			newlasttimestamp = queries[i].timestamp;
 	}
 
-	// Finish prepared statement
-	ret = dbquery("END TRANSACTION");
-	int ret2 = sqlite3_finalize(stmt);
-	if(!ret || ret2 != SQLITE_OK){ dbclose(); return; }
+	// Remember how far we got for the next flush
+	lastdbindex = i;
+
+	unlock_shm();
 
-	// Store index for next loop interation round and update last time stamp
-	// in the database only if all queries have been saved successfully
-	if(saved > 0 && saved_error == 0)
+	// ======== Phase 2: persistence without the shared-memory lock ========
+	unsigned int saved = 0, saved_error = 0;
+	if(binlog)
 	{
-		lastdbindex = i;
-		db_set_FTL_property(DB_LASTTIMESTAMP, newlasttimestamp);
+		// Append the snapshot to the memory-mapped binary query log:
+		// allocation-free writes, one batched msync() at the end
+		for(int n = 0; n < pending; n++)
+			binlog_append(rows[n].timestamp, rows[n].type, rows[n].status,
+			              rows[n].domain, rows[n].client, rows[n].forward);
+		binlog_sync();
+		saved = pending;
+
+		// Release the snapshot
+		for(int n = 0; n < pending; n++)
+		{
+			free(rows[n].domain);
+			free(rows[n].client);
+			if(rows[n].forward != NULL)
+				free(rows[n].forward);
+		}
+		if(rows != NULL)
+			free(rows);
+
+		if(config.debug & DEBUG_DATABASE)
+			logg("Notice: Queries stored in binary log: %u (took %.1f ms)",
+			     saved, timer_elapsed_msec(DATABASE_WRITE_TIMER));
+		return;
 	}
 
-	// Update total counters in DB
-	if(saved > 0 && !db_update_counters(total, blocked))
+	bool ret = dbquery_save("BEGIN TRANSACTION");
+	if(ret)
 	{
-		dbclose();
-		return;
+		for(int n = 0; n < pending; n++)
+		{
+			sqlite3_bind_int(savestmt, 1, rows[n].timestamp);
+			sqlite3_bind_int(savestmt, 2, rows[n].type);
+			sqlite3_bind_int(savestmt, 3, rows[n].status);
+			const sqlite3_int64 domainID = dimension_id(domain_ins, domain_sel, rows[n].domain);
+			const sqlite3_int64 clientID = dimension_id(client_ins, client_sel, rows[n].client);
+			sqlite3_bind_int64(savestmt, 4, domainID);
+			sqlite3_bind_int64(savestmt, 5, clientID);
+			if(rows[n].forward != NULL)
+				sqlite3_bind_text(savestmt, 6, rows[n].forward, -1, SQLITE_STATIC);
+			else
+				sqlite3_bind_null(savestmt, 6);
+
+			// Step and check if successful
+			int rc = sqlite3_step(savestmt);
+			sqlite3_clear_bindings(savestmt);
+			sqlite3_reset(savestmt);
+
+			if( rc != SQLITE_DONE ){
+				logg("save_to_DB() - SQL error (%i): %s", rc, sqlite3_errmsg(savedb));
+				rows[n].failed = true;
+				saved_error++;
+				check_database(rc);
+				if(saved_error >= 3)
+				{
+					logg("save_to_DB() - exiting due to too many errors");
+					// Everything not attempted anymore has not
+					// been saved either
+					for(int r = n+1; r < pending; r++)
+						rows[r].failed = true;
+					break;
+				}
+				continue;
+			}
+
+			saved++;
+
+			// Keep the per-hour rollups in sync
+			if(rollup_upsert != NULL)
+			{
+				sqlite3_bind_int64(rollup_upsert, 1, (rows[n].timestamp/3600)*3600);
+				sqlite3_bind_int64(rollup_upsert, 2, domainID);
+				sqlite3_bind_int64(rollup_upsert, 3, clientID);
+				sqlite3_bind_int(rollup_upsert, 4, rows[n].status);
+				sqlite3_step(rollup_upsert);
+				sqlite3_clear_bindings(rollup_upsert);
+				sqlite3_reset(rollup_upsert);
+			}
+		}
+
+		// Commit the transaction. The prepared statement stays alive
+		// for the next flush, it was already reset after the last row
+		ret = dbquery_save("END TRANSACTION");
 	}
 
-	// Close database
-	dbclose();
+	if(!ret || saved_error > 0)
+	{
+		// The transaction did not commit: nothing of this batch is in
+		// the database, no matter how many steps succeeded
+		if(!ret)
+			for(int n2 = 0; n2 < pending; n2++)
+				rows[n2].failed = true;
+
+		// Revert the in-memory marks of exactly the rows that were not
+		// persisted so they are snapshotted again next time. Matching
+		// by ID is robust against positions having shifted in the
+		// meantime; the snapshot is ID-ordered, so each candidate mark
+		// is located with a binary search
+		lock_shm();
+		long int firstunsaved = counters->queries_start + counters->queries;
+		for(long int k = counters->queries_start; k < counters->queries_start + counters->queries; k++)
+		{
+			const sqlite3_int64 dbid = queries_cold[k].db;
+			if(dbid < firstID)
+				continue;
+
+			int lo = 0, hi = pending;
+			while(lo < hi)
+			{
+				const int mid = lo + (hi - lo)/2;
+				if(rows[mid].dbid < dbid)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if(lo < pending && rows[lo].dbid == dbid && rows[lo].failed)
+			{
+				queries_cold[k].db = 0;
+				if(k < firstunsaved)
+					firstunsaved = k;
+			}
+		}
+		if(firstunsaved < lastdbindex)
+			lastdbindex = firstunsaved;
+		unlock_shm();
+	}
+
+	// Update bookkeeping in the database only if rows were saved
+	if(saved > 0)
+	{
+		dbquery_save("INSERT OR REPLACE INTO ftl (id, value) VALUES ( %u, %li );",
+		             DB_LASTTIMESTAMP, newlasttimestamp);
+		db_update_counters(total, blocked);
+	}
+
+	// Done with the database for this flush
+	pthread_mutex_unlock(&dblock);
+
+	// Release the snapshot
+	for(int n = 0; n < pending; n++)
+	{
+		free(rows[n].domain);
+		free(rows[n].client);
+		if(rows[n].forward != NULL)
+			free(rows[n].forward);
+	}
+	if(rows != NULL)
+		free(rows);
 
 	if(config.debug & DEBUG_DATABASE)
 	{
@@ -579,6 +954,9 @@ void save_to_DB(void)
 	}
 }
 
+// Number of expired rows removed per DELETE statement while pruning
+#define DB_DELETE_CHUNKSIZE 10000
+
 static void delete_old_queries_in_DB(void)
 {
 	// Open database
@@ -590,17 +968,40 @@ static void delete_old_queries_in_DB(void)
 
 	int timestamp = time(NULL) - config.maxDBdays * 86400;
 
-	if(!dbquery("DELETE FROM queries WHERE timestamp <= %i", timestamp))
+	// Delete in bounded chunks with pauses in between: the expired rows
+	// are located through the timestamp index, and releasing the database
+	// between chunks keeps concurrent API queries responsive even when
+	// millions of rows expire at once
+	int affected = 0;
+	while(true)
 	{
+		if(!dbquery("DELETE FROM queries WHERE id IN "
+		            "(SELECT id FROM queries WHERE timestamp <= %i LIMIT %i)",
+		            timestamp, DB_DELETE_CHUNKSIZE))
+		{
+			dbclose();
+			logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
+			database = true;
+			return;
+		}
+
+		// Get how many rows have been affected (deleted) in this chunk
+		const int chunk = sqlite3_changes(db);
+		affected += chunk;
+		if(chunk < DB_DELETE_CHUNKSIZE)
+			break;
+
+		// Give concurrent database users a chance between chunks
 		dbclose();
-		logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
-		database = true;
-		return;
+		sleepms(100);
+		if(!dbopen())
+		{
+			logg("Failed to re-open DB in delete_old_queries_in_DB()");
+			database = true;
+			return;
+		}
 	}
 
-	// Get how many rows have been affected (deleted)
-	int affected = sqlite3_changes(db);
-
 	// Print final message only if there is a difference
 	if((config.debug & DEBUG_DATABASE) || affected)
 		logg("Notice: Database size is %.2f MB, deleted %i rows", get_db_filesize(), affected);
@@ -613,31 +1014,43 @@ static void delete_old_queries_in_DB(void)
 }
 
 int lastDBsave = 0;
-void *DB_thread(void *val)
+
+// One database maintenance check, invoked periodically by the scheduler
+// thread: adaptive flush, regex verdict storage, retention pruning and the
+// ARP scan
+void DB_tick(void)
 {
-	// Set thread name
-	prctl(PR_SET_NAME,"database",0,0,0);
+	if(!database)
+		return;
 
-	// Save timestamp as we do not want to store immediately
-	// to the database
-	lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
+	// Do not store immediately after startup
+	if(lastDBsave == 0)
+		lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
 
-	while(!killed && database)
 	{
-		if(time(NULL) - lastDBsave >= config.DBinterval)
+		// Unsaved backlog (racy unlocked read, only used as heuristic)
+		const long int dbpending = counters->queries_start + counters->queries
+		                           - MAX(counters->queries_start, lastdbindex);
+
+		// Flush adaptively: when the time budget expired or -- under
+		// bursts -- as soon as the pending-row budget is reached. This
+		// bounds the crash-lossable backlog at peak while quiet
+		// periods cause no early wakeup writes
+		if(time(NULL) - lastDBsave >= config.DBinterval ||
+		   (config.DBpendingmax > 0 && dbpending >= config.DBpendingmax))
 		{
 			// Update lastDBsave timer
 			lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
 
-			// Lock FTL's data structures, since it is
-			// likely that they will be changed here
-			lock_shm();
+			// Save data to database unless there is nothing to do.
+			// The shared-memory lock is only taken internally while
+			// the pending slice is snapshotted, all sqlite work
+			// runs without it
+			if(dbpending > 0)
+				save_to_DB();
 
-			// Save data to database
-			save_to_DB();
-
-			// Release data lock
-			unlock_shm();
+			// Store freshly computed regex verdicts
+			store_regex_verdicts();
 
 			// Check if GC should be done on the database
 			if(DBdeleteoldqueries)
@@ -651,214 +1064,569 @@ void *DB_thread(void *val)
 			if (config.parse_arp_cache)
 				parse_arp_cache();
 		}
-		sleepms(100);
 	}
+}
 
-	return NULL;
+// Remember a freshly computed regex verdict for later storage in the
+// database. Called from the query path, so we only record the string
+// position and defer all database work to the database thread
+void queue_regex_verdict(size_t domainpos, unsigned char verdict)
+{
+	if(!database)
+		return;
+
+	pthread_mutex_lock(&regex_pending_lock);
+	if(regex_pending_count < REGEX_PENDING_MAX)
+	{
+		regex_pending[regex_pending_count].domainpos = domainpos;
+		regex_pending[regex_pending_count].verdict = verdict;
+		regex_pending_count++;
+	}
+	pthread_mutex_unlock(&regex_pending_lock);
 }
 
-// Get most recent 24 hours data from long-term database
-void read_data_from_DB(void)
+// Write the pending regex verdicts to the database. Called from the
+// database thread
+static void store_regex_verdicts(void)
 {
-	// Don't try to load anything to the database if in PRIVACY_NOSTATS mode
-	if(config.privacylevel >= PRIVACY_NOSTATS)
+	// Copy the pending verdicts under the shared lock as the string
+	// buffer may get remapped while we access it
+	lock_shm_read();
+	pthread_mutex_lock(&regex_pending_lock);
+	int pending = regex_pending_count;
+	if(pending == 0)
+	{
+		pthread_mutex_unlock(&regex_pending_lock);
+		unlock_shm();
 		return;
+	}
+	char **domains_pending = calloc(pending, sizeof(char*));
+	unsigned char *verdicts = calloc(pending, sizeof(unsigned char));
+	for(int i = 0; i < pending; i++)
+	{
+		domains_pending[i] = strdup(getstr(regex_pending[i].domainpos));
+		verdicts[i] = regex_pending[i].verdict;
+	}
+	regex_pending_count = 0;
+	pthread_mutex_unlock(&regex_pending_lock);
+	unlock_shm();
 
-	// Open database file
 	if(!dbopen())
 	{
-		logg("read_data_from_DB() - Failed to open DB");
-		return;
+		logg("store_regex_verdicts() - Failed to open DB");
+	}
+	else
+	{
+		dbquery("BEGIN TRANSACTION");
+		for(int i = 0; i < pending; i++)
+			dbquery("INSERT OR REPLACE INTO regex_cache (domain, verdict) VALUES ('%q', %i);",
+			        domains_pending[i], verdicts[i]);
+		dbquery("END TRANSACTION");
+		dbclose();
 	}
 
-	// Prepare request
-	char *rstr = NULL;
-	// Get time stamp 24 hours in the past
-	time_t now = time(NULL);
-	time_t mintime = now - config.maxlogage;
-	int rc = asprintf(&rstr, "SELECT * FROM queries WHERE timestamp >= %li", mintime);
-	if(rc < 1)
+	for(int i = 0; i < pending; i++)
+		free(domains_pending[i]);
+	free(domains_pending);
+	free(verdicts);
+}
+
+// Load the persisted regex verdicts and apply them to the in-memory domains
+// data. The cache is invalidated selectively by comparing the current
+// pattern set against the one the verdicts were computed with: added
+// patterns invalidate only the not-blocked verdicts (a new pattern can only
+// block more), removed patterns invalidate only the blocked verdicts (the
+// matching pattern may be gone). Called while the regex list is (re)read;
+// the caller guarantees exclusive access to the domains data
+void load_regex_cache(char **patterns, int count)
+{
+	if(!database)
+		return;
+
+	if(!dbopen())
 	{
-		logg("read_data_from_DB() - Allocation error (%i): %s", rc, sqlite3_errmsg(db));
+		logg("load_regex_cache() - Failed to open DB");
 		return;
 	}
-	// Log DB query string in debug mode
-	if(config.debug & DEBUG_DATABASE) logg("%s", rstr);
 
-	// Prepare SQLite3 statement
+	// Read the pattern set the cached verdicts belong to
 	sqlite3_stmt* stmt;
-	rc = sqlite3_prepare_v2(db, rstr, -1, &stmt, NULL);
+	int rc = sqlite3_prepare_v2(db, "SELECT pattern FROM regex_patterns", -1, &stmt, NULL);
 	if( rc ){
-		logg("read_data_from_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		logg("load_regex_cache() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
 		dbclose();
 		check_database(rc);
 		return;
 	}
 
-	// Loop through returned database rows
-	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	int oldcount = 0, oldcapacity = 64;
+	char **oldpatterns = calloc(oldcapacity, sizeof(char*));
+	while(sqlite3_step(stmt) == SQLITE_ROW)
 	{
-		sqlite3_int64 dbid = sqlite3_column_int64(stmt, 0);
-		time_t queryTimeStamp = sqlite3_column_int(stmt, 1);
-		// 1483228800 = 01/01/2017 @ 12:00am (UTC)
-		if(queryTimeStamp < 1483228800)
-		{
-			logg("DB warn: TIMESTAMP should be larger than 01/01/2017 but is %li", queryTimeStamp);
-			continue;
-		}
-		if(queryTimeStamp > now)
+		if(oldcount >= oldcapacity)
 		{
-			if(config.debug & DEBUG_DATABASE) logg("DB warn: Skipping query logged in the future (%li)", queryTimeStamp);
-			continue;
+			oldcapacity *= 2;
+			oldpatterns = realloc(oldpatterns, oldcapacity*sizeof(char*));
 		}
+		oldpatterns[oldcount++] = strdup((const char*)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
 
-		int type = sqlite3_column_int(stmt, 2);
-		if(type < TYPE_A || type >= TYPE_MAX)
-		{
-			logg("DB warn: TYPE should not be %i", type);
-			continue;
-		}
-		// Don't import AAAA queries from database if the user set
-		// AAAA_QUERY_ANALYSIS=no in pihole-FTL.conf
-		if(type == TYPE_AAAA && !config.analyze_AAAA)
-		{
-			continue;
-		}
+	// Determine if patterns have been added and/or removed
+	bool added = false, removed = false;
+	for(int i = 0; i < count; i++)
+	{
+		bool found = false;
+		for(int j = 0; j < oldcount; j++)
+			if(strcmp(patterns[i], oldpatterns[j]) == 0)
+			{
+				found = true;
+				break;
+			}
+		if(!found)
+			added = true;
+	}
+	for(int j = 0; j < oldcount; j++)
+	{
+		bool found = false;
+		for(int i = 0; i < count; i++)
+			if(strcmp(patterns[i], oldpatterns[j]) == 0)
+			{
+				found = true;
+				break;
+			}
+		if(!found)
+			removed = true;
+	}
 
-		int status = sqlite3_column_int(stmt, 3);
-		if(status < QUERY_UNKNOWN || status > QUERY_EXTERNAL_BLOCKED_NXRA)
+	for(int j = 0; j < oldcount; j++)
+		free(oldpatterns[j]);
+	free(oldpatterns);
+
+	// Selectively invalidate the cached verdicts
+	if(added)
+		dbquery("DELETE FROM regex_cache WHERE verdict = %i;", REGEX_NOTBLOCKED);
+	if(removed)
+		dbquery("DELETE FROM regex_cache WHERE verdict = %i;", REGEX_BLOCKED);
+
+	// Store the current pattern set
+	if(added || removed)
+	{
+		dbquery("BEGIN TRANSACTION");
+		dbquery("DELETE FROM regex_patterns;");
+		for(int i = 0; i < count; i++)
+			dbquery("INSERT INTO regex_patterns (pattern) VALUES ('%q');", patterns[i]);
+		dbquery("END TRANSACTION");
+	}
+
+	// Apply the surviving verdicts to all domains we currently know
+	rc = sqlite3_prepare_v2(db, "SELECT domain, verdict FROM regex_cache", -1, &stmt, NULL);
+	if( rc ){
+		logg("load_regex_cache() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		dbclose();
+		check_database(rc);
+		return;
+	}
+
+	int applied = 0;
+	while(sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		int verdict = sqlite3_column_int(stmt, 1);
+		int domainID = findHashID(DOMAINS, domain);
+		if(domainID >= 0 &&
+		   (verdict == REGEX_BLOCKED || verdict == REGEX_NOTBLOCKED))
 		{
-			logg("DB warn: STATUS should be within [%i,%i] but is %i", QUERY_UNKNOWN, QUERY_EXTERNAL_BLOCKED_NXRA, status);
-			continue;
+			domains[domainID].regexmatch = verdict;
+			applied++;
 		}
+	}
+	sqlite3_finalize(stmt);
+	dbclose();
+
+	logg("Applied %i cached regex verdicts (%s pattern set)", applied,
+	     (added || removed) ? "changed" : "unchanged");
+}
+
+// Serve the long-horizon history from the hourly rollups: one line per hour
+// with total and blocked counts. Aggregating the rollup buckets touches a
+// few thousand rows where the raw queries table holds millions
+void getDBhistory(int *sock)
+{
+	if(!dbopen())
+	{
+		logg("getDBhistory() - Failed to open DB");
+		return;
+	}
+
+	sqlite3_stmt *stmt;
+	int rc = sqlite3_prepare_v2(db,
+		"SELECT hour, SUM(count), "
+		"SUM(CASE WHEN status IN (1,4,5,6,7,8) THEN count ELSE 0 END) "
+		"FROM hourly_counts GROUP BY hour ORDER BY hour", -1, &stmt, NULL);
+	if( rc ){
+		logg("getDBhistory() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		dbclose();
+		check_database(rc);
+		return;
+	}
+
+	while(sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		ssend(*sock, "%lli %lli %lli\n",
+		      sqlite3_column_int64(stmt, 0),
+		      sqlite3_column_int64(stmt, 1),
+		      sqlite3_column_int64(stmt, 2));
+	}
+	sqlite3_finalize(stmt);
+	dbclose();
+}
+
+// Number of rows imported per lock window by read_data_from_DB()
+#define DB_IMPORT_BATCHSIZE 1000
+
+// Whether the query ring temporarily violates the ascending-timestamp
+// invariant. The background import appends day-old records while live
+// queries keep arriving, so the ring is unordered until the import's final
+// sort below -- the time-window binary search in getAllQueries() and the
+// prefix-advance in GC_tick() check this flag and stand back meanwhile
+bool queries_unsorted = false;
+
+struct querySortPair {
+	queriesDataStruct hot;
+	queriesColdDataStruct cold;
+};
+
+// qsort comparison: ascending by timestamp, ties broken by database ID so
+// that re-imported history keeps its original order
+static int cmp_query_timestamp(const void *a, const void *b)
+{
+	const struct querySortPair *pa = a;
+	const struct querySortPair *pb = b;
+	if(pa->hot.timestamp != pb->hot.timestamp)
+		return pa->hot.timestamp < pb->hot.timestamp ? -1 : 1;
+	return pa->cold.db < pb->cold.db ? -1 : (pa->cold.db > pb->cold.db ? 1 : 0);
+}
 
-		const char * domain = (const char *)sqlite3_column_text(stmt, 4);
-		if(domain == NULL)
+// Restore the ascending-timestamp invariant after the background import
+// interleaved historic records with queries recorded live in the meantime.
+// Sorts the ring window in one go and rebuilds everything that referenced
+// query positions; in the common case of an already-ordered ring (no live
+// queries arrived during the import) this is a single verification pass
+static void sort_imported_queries(void)
+{
+	lock_shm();
+
+	const int n = counters->queries;
+	const int start = counters->queries_start;
+
+	// Fast path: verify order only
+	bool sorted = true;
+	for(int i = start + 1; i < start + n; i++)
+		if(queries[i-1].timestamp > queries[i].timestamp)
 		{
-			logg("DB warn: DOMAIN should never be NULL, %li", queryTimeStamp);
-			continue;
+			sorted = false;
+			break;
 		}
 
-		const char * client = (const char *)sqlite3_column_text(stmt, 5);
-		if(client == NULL)
+	if(!sorted)
+	{
+		struct querySortPair *pairs = calloc(n, sizeof(struct querySortPair));
+		if(pairs == NULL)
 		{
-			logg("DB warn: CLIENT should never be NULL, %li", queryTimeStamp);
-			continue;
+			// Leave the flag set: the slow-but-correct paths stay active
+			logg("WARN: Cannot sort %i imported queries (out of memory)", n);
+			unlock_shm();
+			return;
 		}
 
-		// Check if user wants to skip queries coming from localhost
-		if(config.ignore_localhost &&
-		   (strcmp(client, "127.0.0.1") == 0 || strcmp(client, "::1") == 0))
+		for(int i = 0; i < n; i++)
 		{
-			continue;
+			pairs[i].hot = queries[start + i];
+			pairs[i].cold = queries_cold[start + i];
 		}
 
-		const char *forwarddest = (const char *)sqlite3_column_text(stmt, 6);
-		int forwardID = 0;
-		// Determine forwardID only when status == 2 (forwarded) as the
-		// field need not to be filled for other query status types
-		if(status == QUERY_FORWARDED)
+		qsort(pairs, n, sizeof(struct querySortPair), cmp_query_timestamp);
+
+		for(int i = 0; i < n; i++)
 		{
-			if(forwarddest == NULL)
-			{
-				logg("DB warn: FORWARD should not be NULL with status QUERY_FORWARDED, %li", queryTimeStamp);
-				continue;
-			}
-			forwardID = findForwardID(forwarddest, true);
+			queries[start + i] = pairs[i].hot;
+			queries_cold[start + i] = pairs[i].cold;
 		}
+		free(pairs);
 
-		// Obtain IDs only after filtering which queries we want to keep
-		int timeidx = getOverTimeID(queryTimeStamp);
-		int domainID = findDomainID(domain);
-		int clientID = findClientID(client, true);
-
-		// Ensure we have enough space in the queries struct
-		memory_check(QUERIES);
-
-		// Set index for this query
-		int queryIndex = counters->queries;
-
-		// Store this query in memory
-		validate_access("queries", queryIndex, false, __LINE__, __FUNCTION__, __FILE__);
-		validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
-		queries[queryIndex].magic = MAGICBYTE;
-		queries[queryIndex].timestamp = queryTimeStamp;
-		queries[queryIndex].type = type;
-		queries[queryIndex].status = status;
-		queries[queryIndex].domainID = domainID;
-		queries[queryIndex].clientID = clientID;
-		queries[queryIndex].forwardID = forwardID;
-		queries[queryIndex].timeidx = timeidx;
-		queries[queryIndex].db = dbid;
-		queries[queryIndex].id = 0;
-		queries[queryIndex].complete = true; // Mark as all information is available
-		queries[queryIndex].response = 0;
-		queries[queryIndex].dnssec = DNSSEC_UNKNOWN;
-		queries[queryIndex].reply = REPLY_UNKNOWN;
-
-		// Set lastQuery timer and add one query for network table
-		clients[clientID].lastQuery = queryTimeStamp;
-		clients[clientID].numQueriesARP++;
-
-		// Handle type counters
-		if(type >= TYPE_A && type < TYPE_MAX)
+		// Query positions changed: invalidate and rebuild everything
+		// that referenced them. The in-flight hash self-heals through
+		// its id verification, but a cleared table cannot even collide
+		reset_inflight_hash();
+		resetQueryIndexes();
+		catchupQueryIndexes();
+
+		// Any database save that ran during the import resumed from a
+		// now-stale position: rescan from the ring head, the stored
+		// per-query database IDs skip everything already saved
+		lastdbindex = 0;
+
+		logg("Restored timestamp order of %i queries after the background import", n);
+	}
+
+	queries_unsorted = false;
+	unlock_shm();
+}
+
+// Background thread streaming the most recent history into the in-memory
+// structures: DNS and the API come up immediately with empty statistics and
+// the history merges in under short lock windows
+void *DB_import_thread(void *val)
+{
+	// Set thread name
+	prctl(PR_SET_NAME,"DB importer",0,0,0);
+	thread_set_background();
+
+	queries_unsorted = true;
+	if(binlog_active())
+		binlog_import();
+	else
+		read_data_from_DB();
+	sort_imported_queries();
+	log_counter_info();
+
+	return NULL;
+}
+
+// Insert one historic query record into the in-memory structures. Shared by
+// the sqlite import and the binary query log import; the caller holds the
+// shared-memory lock
+void import_queryrecord(long long dbid, time_t queryTimeStamp, int type, int status,
+                        const char *domain, const char *client, const char *forwarddest, time_t now)
+{
+	// 1483228800 = 01/01/2017 @ 12:00am (UTC)
+	if(queryTimeStamp < 1483228800)
+	{
+		logg("DB warn: TIMESTAMP should be larger than 01/01/2017 but is %li", queryTimeStamp);
+		return;
+	}
+	if(queryTimeStamp > now)
+	{
+		if(config.debug & DEBUG_DATABASE) logg("DB warn: Skipping query logged in the future (%li)", queryTimeStamp);
+		return;
+	}
+
+	if(type < TYPE_A || type >= TYPE_MAX)
+	{
+		logg("DB warn: TYPE should not be %i", type);
+		return;
+	}
+	// Don't import AAAA queries from database if the user set
+	// AAAA_QUERY_ANALYSIS=no in pihole-FTL.conf
+	if(type == TYPE_AAAA && !config.analyze_AAAA)
+	{
+		return;
+	}
+
+	if(status < QUERY_UNKNOWN || status > QUERY_REFUSED_RATELIMIT)
+	{
+		logg("DB warn: STATUS should be within [%i,%i] but is %i", QUERY_UNKNOWN, QUERY_EXTERNAL_BLOCKED_NXRA, status);
+		return;
+	}
+
+	if(domain == NULL)
+	{
+		logg("DB warn: DOMAIN should never be NULL, %li", queryTimeStamp);
+		return;
+	}
+
+	if(client == NULL)
+	{
+		logg("DB warn: CLIENT should never be NULL, %li", queryTimeStamp);
+		return;
+	}
+
+	// Check if user wants to skip queries coming from localhost
+	if(config.ignore_localhost &&
+	   (strcmp(client, "127.0.0.1") == 0 || strcmp(client, "::1") == 0))
+	{
+		return;
+	}
+
+	int forwardID = 0;
+	// Determine forwardID only when status == 2 (forwarded) as the
+	// field need not to be filled for other query status types
+	if(status == QUERY_FORWARDED)
+	{
+		if(forwarddest == NULL)
 		{
-			counters->querytype[type-1]++;
-			overTime[timeidx].querytypedata[type-1]++;
+			logg("DB warn: FORWARD should not be NULL with status QUERY_FORWARDED, %li", queryTimeStamp);
+			return;
 		}
+		forwardID = findForwardID(forwarddest, true);
+	}
 
-		// Update overTime data
-		overTime[timeidx].total++;
-		// Update overTime data structure with the new client
-		clients[clientID].overTime[timeidx]++;
+	// Obtain IDs only after filtering which queries we want to keep
+	int timeidx = getOverTimeID(queryTimeStamp);
+	int domainID = findDomainID(domain);
+	int clientID = findClientID(client, true);
+
+	// Ensure we have enough space in the queries struct
+	memory_check(QUERIES);
+
+	// Set index for this query
+	int queryIndex = counters->queries_start + counters->queries;
+
+	// Store this query in memory
+	validate_access("queries", queryIndex, false, __LINE__, __FUNCTION__, __FILE__);
+	validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
+	queries[queryIndex].magic = MAGICBYTE;
+	queries[queryIndex].timestamp = queryTimeStamp;
+	queries[queryIndex].type = type;
+	queries[queryIndex].status = status;
+	queries[queryIndex].domainID = domainID;
+	queries[queryIndex].clientID = clientID;
+	queries[queryIndex].forwardID = forwardID;
+	queries_cold[queryIndex].db = dbid;
+	queries[queryIndex].id = 0;
+	queries[queryIndex].complete = true; // Mark as all information is available
+	queries_cold[queryIndex].response = 0;
+	queries_cold[queryIndex].dnssec = DNSSEC_UNKNOWN;
+	queries[queryIndex].reply = REPLY_UNKNOWN;
+
+	// Set lastQuery timer and add one query for network table
+	clients[clientID].lastQuery = queryTimeStamp;
+	clients[clientID].numQueriesARP++;
+
+	// Handle type counters
+	if(type >= TYPE_A && type < TYPE_MAX)
+	{
+		counters->querytype[type-1]++;
+		overTime[timeidx].querytypedata[type-1]++;
+	}
 
-		// Increase DNS queries counter
-		counters->queries++;
+	// Update overTime data
+	overTime[timeidx].total++;
+	// Update overTime data structure with the new client
+	addClientOverTime(clientID, timeidx, 1);
 
-		// Increment status counters
-		switch(status)
-		{
-			case QUERY_UNKNOWN: // Unknown
-				counters->unknown++;
-				break;
+	// Increase DNS queries counter
+	counters->queries++;
 
-			case QUERY_GRAVITY: // Blocked by gravity.list
-			case QUERY_WILDCARD: // Blocked by regex filter
-			case QUERY_BLACKLIST: // Blocked by black.list
-			case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by external provider
-			case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by external provider
-			case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by external provider
-				counters->blocked++;
-				domains[domainID].blockedcount++;
-				clients[clientID].blockedcount++;
-				// Update overTime data structure
-				overTime[timeidx].blocked++;
-				break;
+	// Record the query in the inverted per-client/per-domain indexes
+	catchupQueryIndexes();
 
-			case QUERY_FORWARDED: // Forwarded
-				counters->forwardedqueries++;
-				// Update overTime data structure
-				overTime[timeidx].forwarded++;
-				break;
+	// Increment status counters
+	switch(status)
+	{
+		case QUERY_UNKNOWN: // Unknown
+			counters->unknown++;
+			break;
 
-			case QUERY_CACHE: // Cached or local config
-				counters->cached++;
-				// Update overTime data structure
-				overTime[timeidx].cached++;
-				break;
+		case QUERY_GRAVITY: // Blocked by gravity.list
+		case QUERY_WILDCARD: // Blocked by regex filter
+		case QUERY_BLACKLIST: // Blocked by black.list
+		case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by external provider
+		case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by external provider
+		case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by external provider
+			counters->blocked++;
+			domains[domainID].blockedcount++;
+			updateTopDomains(true, domainID);
+			clients[clientID].blockedcount++;
+			// Update overTime data structure
+			overTime[timeidx].blocked++;
+			break;
 
-			default:
-				logg("Error: Found unknown status %i in long term database!", status);
-				logg("       Timestamp: %li", queryTimeStamp);
-				logg("       Continuing anyway...");
-				break;
+		case QUERY_FORWARDED: // Forwarded
+			counters->forwardedqueries++;
+			// Update overTime data structure
+			overTime[timeidx].forwarded++;
+			break;
+
+		case QUERY_REFUSED_RATELIMIT: // Refused due to rate limiting
+			counters->ratelimited++;
+			break;
+
+		case QUERY_CACHE: // Cached or local config
+			counters->cached++;
+			// Update overTime data structure
+			overTime[timeidx].cached++;
+			break;
+
+		default:
+			logg("Error: Found unknown status %i in long term database!", status);
+			logg("       Timestamp: %li", queryTimeStamp);
+			logg("       Continuing anyway...");
+			break;
+	}
+}
+
+// Get most recent 24 hours data from long-term database
+void read_data_from_DB(void)
+{
+	// Don't try to load anything to the database if in PRIVACY_NOSTATS mode
+	if(config.privacylevel >= PRIVACY_NOSTATS)
+		return;
+
+	// Open database file
+	if(!dbopen())
+	{
+		logg("read_data_from_DB() - Failed to open DB");
+		return;
+	}
+
+	// Prepare request
+	char *rstr = NULL;
+	// Get time stamp 24 hours in the past
+	time_t now = time(NULL);
+	time_t mintime = now - config.maxlogage;
+	int rc = asprintf(&rstr, "SELECT q.id, q.timestamp, q.type, q.status, d.domain, c.ip, q.forward "
+	                         "FROM queries q JOIN domain_by_id d ON q.domain = d.id "
+	                         "JOIN client_by_id c ON q.client = c.id WHERE q.timestamp >= %li", mintime);
+	if(rc < 1)
+	{
+		logg("read_data_from_DB() - Allocation error (%i): %s", rc, sqlite3_errmsg(db));
+		return;
+	}
+	// Log DB query string in debug mode
+	if(config.debug & DEBUG_DATABASE) logg("%s", rstr);
+
+	// Prepare SQLite3 statement
+	sqlite3_stmt* stmt;
+	rc = sqlite3_prepare_v2(db, rstr, -1, &stmt, NULL);
+	if( rc ){
+		logg("read_data_from_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		dbclose();
+		check_database(rc);
+		return;
+	}
+
+	// Loop through returned database rows. The shared-memory lock is
+	// released and re-acquired between batches so that the resolver and
+	// the API stay responsive while up to 24h of history stream in
+	int batched = 0;
+	lock_shm();
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(++batched > DB_IMPORT_BATCHSIZE)
+		{
+			batched = 0;
+			unlock_shm();
+			lock_shm();
 		}
+
+		import_queryrecord(sqlite3_column_int64(stmt, 0),
+		                   sqlite3_column_int(stmt, 1),
+		                   sqlite3_column_int(stmt, 2),
+		                   sqlite3_column_int(stmt, 3),
+		                   (const char *)sqlite3_column_text(stmt, 4),
+		                   (const char *)sqlite3_column_text(stmt, 5),
+		                   (const char *)sqlite3_column_text(stmt, 6),
+		                   now);
 	}
 	logg("Imported %i queries from the long-term database", counters->queries);
+	unlock_shm();
 
-	// Update lastdbindex so that the next call to save_to_DB()
-	// skips the queries that we just imported from the database
-	lastdbindex = counters->queries;
+	// Note: lastdbindex is deliberately not advanced here. Live queries
+	// may have interleaved with the imported history, so save_to_DB()
+	// scans from the ring head and relies on the per-query database IDs
+	// to skip everything that is already stored
 
 	if( rc != SQLITE_DONE ){
 		logg("read_data_from_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
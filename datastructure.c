@@ -10,6 +10,9 @@
 
 #include "FTL.h"
 
+static void shiftUnknownIndex(int offset);
+static void shiftRecentBlocked(int offset);
+
 // converts upper to lower case, and leaves other characters unchanged
 void strtolower(char *str)
 {
@@ -17,20 +20,37 @@ void strtolower(char *str)
 	while(str[i]){ str[i] = tolower(str[i]); i++; }
 }
 
+// Lowercase ASCII in place and compute the FNV-1a index hash of the lowered
+// string in the same traversal. Domain strings are the most-touched byte
+// buffers in the process, and this fused pass replaces the separate
+// strtolower() walk plus the hashing walk inside the index lookup. The
+// branch-free lowercasing is friendly to compiler vectorization; the hash
+// is bit-identical to the one used when the index entries were inserted
+uint32_t strtolower_hash(char *str)
+{
+	uint32_t hash = 2166136261u;
+	for(; *str != '\0'; str++)
+	{
+		unsigned char c = (unsigned char)*str;
+		// Branch-free ASCII lowercasing
+		c += (unsigned char)(((unsigned char)(c - 'A')) < 26u ? 32u : 0u);
+		*str = (char)c;
+		hash ^= c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 int findForwardID(const char * forward, bool count)
 {
-	int i, forwardID = -1;
-	if(counters->forwarded > 0)
-		validate_access("forwarded", counters->forwarded-1, true, __LINE__, __FUNCTION__, __FILE__);
-	// Go through already knows forward servers and see if we used one of those
-	for(i=0; i < counters->forwarded; i++)
+	// Look up forward destination in the hash index instead of walking the
+	// entire forwarded[] array. The index directly delivers the forward ID
+	int forwardID = findHashID(FORWARDED, forward);
+	if(forwardID >= 0)
 	{
-		if(strcmp(getstr(forwarded[i].ippos), forward) == 0)
-		{
-			forwardID = i;
-			if(count) forwarded[forwardID].count++;
-			return forwardID;
-		}
+		validate_access("forwarded", forwardID, true, __LINE__, __FUNCTION__, __FILE__);
+		if(count) forwarded[forwardID].count++;
+		return forwardID;
 	}
 	// This forward server is not known
 	// Store ID
@@ -51,35 +71,41 @@ int findForwardID(const char * forward, bool count)
 	// Save forward destination IP address
 	forwarded[forwardID].ippos = addstr(forward);
 	forwarded[forwardID].failed = 0;
+	// No latency measurement or failure recorded so far
+	forwarded[forwardID].latency_ewma = 0.0f;
+	forwarded[forwardID].failure_ewma = 0.0f;
+	memset(forwarded[forwardID].latency_histogram, 0, sizeof(forwarded[forwardID].latency_histogram));
 	// Initialize forward hostname
 	// Due to the nature of us being the resolver,
 	// the actual resolving of the host name has
 	// to be done separately to be non-blocking
 	forwarded[forwardID].new = true;
 	forwarded[forwardID].namepos = 0; // 0 -> string with length zero
+	forwarded[forwardID].nameexpires = 0;
+	// Make the new forward destination findable through the hash index
+	addHashID(FORWARDED, forwardID);
 	// Increase counter by one
 	counters->forwarded++;
 
+	// Wake the resolver thread to name this destination right away
+	notify_resolver();
+
 	return forwardID;
 }
 
-int findDomainID(const char *domain)
+// Variant of findDomainID() for callers that already computed the index
+// hash (the query hot path fuses it into the lowercasing pass)
+int findDomainIDHashed(const char *domain, uint32_t hash)
 {
-	int i;
-	if(counters->domains > 0)
-		validate_access("domains", counters->domains-1, true, __LINE__, __FUNCTION__, __FILE__);
-	for(i=0; i < counters->domains; i++)
+	// Look up domain in the hash index instead of walking the entire
+	// domains[] array. The index directly delivers the domain ID
+	int existingID = findHashID_prehashed(DOMAINS, domain, hash);
+	if(existingID >= 0)
 	{
-		// Quick test: Does the domain start with the same character?
-		if(getstr(domains[i].domainpos)[0] != domain[0])
-			continue;
-
-		// If so, compare the full domain using strcmp
-		if(strcmp(getstr(domains[i].domainpos), domain) == 0)
-		{
-			domains[i].count++;
-			return i;
-		}
+		validate_access("domains", existingID, true, __LINE__, __FUNCTION__, __FILE__);
+		domains[existingID].count++;
+		updateTopDomains(false, existingID);
+		return existingID;
 	}
 
 	// If we did not return until here, then this domain is not known
@@ -100,30 +126,32 @@ int findDomainID(const char *domain)
 	domains[domainID].domainpos = addstr(domain);
 	// RegEx needs to be evaluated for this new domain
 	domains[domainID].regexmatch = REGEX_UNKNOWN;
+	// Make the new domain findable through the hash index
+	addHashID(DOMAINS, domainID);
 	// Increase counter by one
 	counters->domains++;
+	// A brand-new domain has to enter the top domains candidate set, too
+	updateTopDomains(false, domainID);
 
 	return domainID;
 }
 
+int findDomainID(const char *domain)
+{
+	return findDomainIDHashed(domain, hash_shm_key(domain));
+}
+
 int findClientID(const char *client, bool count)
 {
-	// Compare content of client against known client IP addresses
-	if(counters->clients > 0)
-		validate_access("clients", counters->clients-1, true, __LINE__, __FUNCTION__, __FILE__);
-	for(int i=0; i < counters->clients; i++)
+	// Look up client IP in the hash index instead of walking the entire
+	// clients[] array. The index directly delivers the client ID
+	int existingID = findHashID(CLIENTS, client);
+	if(existingID >= 0)
 	{
-		// Quick test: Does the clients IP start with the same character?
-		if(getstr(clients[i].ippos)[0] != client[0])
-			continue;
-
-		// If so, compare the full IP using strcmp
-		if(strcmp(getstr(clients[i].ippos), client) == 0)
-		{
-			// Add one if count == true (do not add one, e.g., during ARP table processing)
-			if(count) clients[i].count++;
-			return i;
-		}
+		validate_access("clients", existingID, true, __LINE__, __FUNCTION__, __FILE__);
+		// Add one if count == true (do not add one, e.g., during ARP table processing)
+		if(count) clients[existingID].count++;
+		return existingID;
 	}
 
 	// Return -1 (= not found) if count is false ...
@@ -153,20 +181,392 @@ int findClientID(const char *client, bool count)
 	// to be done separately to be non-blocking
 	clients[clientID].new = true;
 	clients[clientID].namepos = 0;
+	clients[clientID].nameexpires = 0;
+	// Initialize rate accounting
+	clients[clientID].rate_window = 0;
+	clients[clientID].rate_count = 0;
 	// No query seen so far
 	clients[clientID].lastQuery = 0;
 	clients[clientID].numQueriesARP = 0;
 
 	// Initialize client-specific overTime data
-	for(int i = 0; i < OVERTIME_SLOTS; i++)
-		clients[clientID].overTime[i] = 0;
+	initClientOverTime(clientID);
+
+	// Make the new client findable through the hash index
+	addHashID(CLIENTS, clientID);
 
 	// Increase counter by one
 	counters->clients++;
 
+	// Wake the resolver thread to name this client right away
+	notify_resolver();
+
 	return clientID;
 }
 
+// Inverted query indexes: for every client and every domain we keep the
+// list of query positions belonging to it, appended on the query path and
+// pruned by GC. Filtered query-log requests can then stream exactly the
+// matching records instead of scanning the entire query history. The lists
+// are process-local heap memory, but not every writer runs in this process:
+// fork()ed TCP workers record queries in shared memory while appending only
+// to their private, throwaway copy of these lists. The main process hence
+// indexes everything it has not seen yet in one go (catchupQueryIndexes(),
+// called on the exclusive-lock paths), and the API readers fall back to
+// scanning while such a gap is open (queryIndexesComplete()). Entries
+// reference positions in the queries[] ring and are therefore adjusted
+// when memory_check() compacts the ring
+typedef struct {
+	int *positions;
+	int count;
+	int capacity;
+} queryIndexList;
+
+static queryIndexList *clientIndex = NULL;
+static int clientIndexCapacity = 0;
+static queryIndexList *domainIndex = NULL;
+static int domainIndexCapacity = 0;
+
+// Append one query position to the given list, growing it geometrically
+static void appendToIndexList(queryIndexList *list, int queryID)
+{
+	if(list->count >= list->capacity)
+	{
+		list->capacity = list->capacity > 0 ? 2*list->capacity : 16;
+		list->positions = realloc(list->positions, list->capacity*sizeof(int));
+	}
+	list->positions[list->count++] = queryID;
+}
+
+// Make sure the outer array covers at least "required" entities
+static void growIndexArray(queryIndexList **array, int *capacity, int required)
+{
+	if(required <= *capacity)
+		return;
+
+	int newcapacity = *capacity > 0 ? *capacity : 64;
+	while(newcapacity < required)
+		newcapacity *= 2;
+
+	*array = realloc(*array, newcapacity*sizeof(queryIndexList));
+	memset(&(*array)[*capacity], 0, (newcapacity - *capacity)*sizeof(queryIndexList));
+	*capacity = newcapacity;
+}
+
+// Next query position this process has indexed. Everything at or beyond
+// this position is only in shared memory so far
+static int indexed_up_to = 0;
+
+static void appendUnknownQuery(int queryID);
+
+// Record a new query in both inverted indexes
+static void appendQueryIndex(int clientID, int domainID, int queryID)
+{
+	growIndexArray(&clientIndex, &clientIndexCapacity, clientID + 1);
+	appendToIndexList(&clientIndex[clientID], queryID);
+
+	growIndexArray(&domainIndex, &domainIndexCapacity, domainID + 1);
+	appendToIndexList(&domainIndex[domainID], queryID);
+}
+
+// Bring the process-local indexes up to date with the shared query ring.
+// Positions are assigned under the exclusive lock and this walks them in
+// ascending order, so the per-entity lists stay position-sorted as the
+// pruning relies on. Must be called with the exclusive lock held
+void catchupQueryIndexes(void)
+{
+	// fork()ed TCP workers only ever write to their private copy, which
+	// dies with them -- maintaining it would be wasted work
+	if(getpid() != mainpid)
+		return;
+
+	if(indexed_up_to < counters->queries_start)
+		indexed_up_to = counters->queries_start;
+
+	const int end = counters->queries_start + counters->queries;
+	for(int queryID = indexed_up_to; queryID < end; queryID++)
+	{
+		appendQueryIndex(queries[queryID].clientID, queries[queryID].domainID, queryID);
+
+		// Still-open queries additionally enter the unknown index
+		if(queries[queryID].status == QUERY_UNKNOWN && !queries[queryID].complete)
+			appendUnknownQuery(queryID);
+
+		// Queries already marked blocked (recorded and answered inside
+		// a fork()ed TCP worker, which could only append to its own
+		// copy of the ring) also enter the recent-blocked ring here
+		const unsigned char status = queries[queryID].status;
+		if(status == QUERY_GRAVITY || status == QUERY_WILDCARD ||
+		   status == QUERY_BLACKLIST || status == QUERY_EXTERNAL_BLOCKED_IP ||
+		   status == QUERY_EXTERNAL_BLOCKED_NULL || status == QUERY_EXTERNAL_BLOCKED_NXRA)
+			appendBlockedQuery(queryID);
+	}
+	indexed_up_to = end;
+}
+
+// Whether the indexes currently cover the whole ring. While fork()ed TCP
+// workers have recorded queries the main process has not absorbed yet, the
+// API readers have to take the scan path instead
+bool __attribute__((pure)) queryIndexesComplete(void)
+{
+	return indexed_up_to >= counters->queries_start + counters->queries;
+}
+
+// Drop all entries referring to queries expired by GC. The lists are
+// append-ordered by query position, so pruning removes a prefix
+static void pruneIndexList(queryIndexList *list)
+{
+	int keep = 0;
+	while(keep < list->count && list->positions[keep] < counters->queries_start)
+		keep++;
+
+	if(keep > 0)
+	{
+		memmove(&list->positions[0], &list->positions[keep],
+		        (list->count - keep)*sizeof(int));
+		list->count -= keep;
+	}
+}
+
+// Called by the GC routine after it advanced the ring head
+void pruneQueryIndexes(void)
+{
+	for(int i = 0; i < clientIndexCapacity; i++)
+		pruneIndexList(&clientIndex[i]);
+	for(int i = 0; i < domainIndexCapacity; i++)
+		pruneIndexList(&domainIndex[i]);
+}
+
+// Called by memory_check() after it compacted the queries[] ring: all
+// stored positions move down by the given offset
+void shiftQueryIndexes(int offset)
+{
+	shiftUnknownIndex(offset);
+	shiftRecentBlocked(offset);
+	indexed_up_to -= offset;
+
+	for(int i = 0; i < clientIndexCapacity; i++)
+		for(int j = 0; j < clientIndex[i].count; j++)
+			clientIndex[i].positions[j] -= offset;
+	for(int i = 0; i < domainIndexCapacity; i++)
+		for(int j = 0; j < domainIndex[i].count; j++)
+			domainIndex[i].positions[j] -= offset;
+}
+
+// Deliver the list of query positions for one client resp. domain. Returns
+// the number of entries, or -1 if no list exists for this entity
+int getQueryIndexList(bool byclient, int id, const int **positions)
+{
+	queryIndexList *array = byclient ? clientIndex : domainIndex;
+	const int capacity = byclient ? clientIndexCapacity : domainIndexCapacity;
+	if(id < 0 || id >= capacity)
+		return -1;
+
+	*positions = array[id].positions;
+	return array[id].count;
+}
+
+// Live index of incomplete queries: appended in FTL_new_query() and
+// self-cleaning -- filterUnknownIndex() drops all entries that have been
+// completed in the meantime, so getUnknownQueries() only ever touches the
+// typically-tiny set of still-open queries instead of scanning everything
+static int *unknownIndex = NULL;
+static int unknownCount = 0;
+static int unknownCapacity = 0;
+
+static void appendUnknownQuery(int queryID)
+{
+	if(unknownCount >= unknownCapacity)
+	{
+		unknownCapacity = unknownCapacity > 0 ? 2*unknownCapacity : 64;
+		unknownIndex = realloc(unknownIndex, unknownCapacity*sizeof(int));
+	}
+	unknownIndex[unknownCount++] = queryID;
+}
+
+// Drop entries whose query has been answered (or expired) since, keeping
+// the original order. Returns the remaining count and exposes the list
+int filterUnknownIndex(const int **positions)
+{
+	int keep = 0;
+	for(int i = 0; i < unknownCount; i++)
+	{
+		const int queryID = unknownIndex[i];
+		if(queryID < counters->queries_start ||
+		   queryID >= counters->queries_start + counters->queries)
+			continue;
+
+		if(queries[queryID].status != QUERY_UNKNOWN && queries[queryID].complete)
+			continue;
+
+		unknownIndex[keep++] = queryID;
+	}
+	unknownCount = keep;
+
+	*positions = unknownIndex;
+	return unknownCount;
+}
+
+// Follow the ring compaction (see shiftQueryIndexes())
+static void shiftUnknownIndex(int offset)
+{
+	for(int i = 0; i < unknownCount; i++)
+		unknownIndex[i] -= offset;
+}
+
+// Ring of the most recently blocked query positions, appended at the moment
+// a query is marked blocked. getRecentBlocked() reads this ring instead of
+// scanning backwards through the query history
+#define RECENTBLOCKED_SLOTS 64
+static int recentBlocked[RECENTBLOCKED_SLOTS];
+static unsigned int recentBlockedNext = 0;
+static unsigned int recentBlockedCount = 0;
+
+void appendBlockedQuery(int queryID)
+{
+	recentBlocked[recentBlockedNext] = queryID;
+	recentBlockedNext = (recentBlockedNext + 1) % RECENTBLOCKED_SLOTS;
+	if(recentBlockedCount < RECENTBLOCKED_SLOTS)
+		recentBlockedCount++;
+}
+
+// Undo the index entries of the query at the current ring tail, used when
+// the query hook's record is taken back again (FTL_retract_query()). Its
+// entries were necessarily appended last, so popping the list tails
+// suffices; the freed ring slot will be re-indexed for whatever query
+// claims it next
+void retractQueryIndex(int queryID)
+{
+	// Never indexed: the record was created by a fork()ed TCP worker
+	if(indexed_up_to <= queryID)
+		return;
+
+	const int clientID = queries[queryID].clientID;
+	const int domainID = queries[queryID].domainID;
+
+	if(clientID >= 0 && clientID < clientIndexCapacity &&
+	   clientIndex[clientID].count > 0 &&
+	   clientIndex[clientID].positions[clientIndex[clientID].count-1] == queryID)
+		clientIndex[clientID].count--;
+
+	if(domainID >= 0 && domainID < domainIndexCapacity &&
+	   domainIndex[domainID].count > 0 &&
+	   domainIndex[domainID].positions[domainIndex[domainID].count-1] == queryID)
+		domainIndex[domainID].count--;
+
+	if(unknownCount > 0 && unknownIndex[unknownCount-1] == queryID)
+		unknownCount--;
+
+	indexed_up_to = queryID;
+}
+
+// Invalidate everything that stores query positions. Used when positions
+// wholesale changed (the post-import sort); the caller re-populates the
+// inverted and unknown indexes via catchupQueryIndexes() afterwards
+void resetQueryIndexes(void)
+{
+	for(int i = 0; i < clientIndexCapacity; i++)
+		clientIndex[i].count = 0;
+	for(int i = 0; i < domainIndexCapacity; i++)
+		domainIndex[i].count = 0;
+	unknownCount = 0;
+	recentBlockedNext = 0;
+	recentBlockedCount = 0;
+	indexed_up_to = counters->queries_start;
+}
+
+// Deliver the n-th most recent blocked query position (0 = newest), or -1
+// when there are no more entries. Expired positions are skipped by the
+// caller via the usual ring-window check
+int __attribute__((pure)) getRecentBlockedID(unsigned int n)
+{
+	if(n >= recentBlockedCount)
+		return -1;
+	return recentBlocked[(recentBlockedNext + RECENTBLOCKED_SLOTS - 1 - n) % RECENTBLOCKED_SLOTS];
+}
+
+static void shiftRecentBlocked(int offset)
+{
+	for(unsigned int i = 0; i < recentBlockedCount; i++)
+		recentBlocked[(recentBlockedNext + RECENTBLOCKED_SLOTS - 1 - i) % RECENTBLOCKED_SLOTS] -= offset;
+}
+
+// Candidate sets for the top domains / top ads lists. The sets are kept
+// up-to-date incrementally as counters are bumped on the query path, so
+// getTopDomains() can sort TOPDOMAINS_CANDIDATES entries instead of all
+// known domains. They are deliberately larger than the usual top-10 request
+// so that setupVars exclusions still leave enough entries to report. The
+// sets can only grow stale through GC decrementing counters, which is why
+// the GC routine triggers a full rebuild after its final slice
+static int topDomainsSet[TOPDOMAINS_CANDIDATES];
+static int topDomainsCount = 0;
+static int topAdsSet[TOPDOMAINS_CANDIDATES];
+static int topAdsCount = 0;
+
+// Get the counter the given set ranks its domains by
+static int domainMetric(bool blocked, int domainID)
+{
+	return blocked ? domains[domainID].blockedcount
+	               : domains[domainID].count - domains[domainID].blockedcount;
+}
+
+// Keep the candidate set up-to-date: called whenever a domain counter got
+// incremented on the query path
+void updateTopDomains(bool blocked, int domainID)
+{
+	int *set = blocked ? topAdsSet : topDomainsSet;
+	int *members = blocked ? &topAdsCount : &topDomainsCount;
+
+	// Scan the set for this domain and the current minimum member
+	int minpos = 0, mincount = -1;
+	for(int i = 0; i < *members; i++)
+	{
+		if(set[i] == domainID)
+			return;
+
+		const int count = domainMetric(blocked, set[i]);
+		if(mincount < 0 || count < mincount)
+		{
+			mincount = count;
+			minpos = i;
+		}
+	}
+
+	if(*members < TOPDOMAINS_CANDIDATES)
+	{
+		// The set is not full yet, simply append
+		set[(*members)++] = domainID;
+	}
+	else if(domainMetric(blocked, domainID) > mincount)
+	{
+		// Replace the smallest member
+		set[minpos] = domainID;
+	}
+}
+
+// Rebuild both candidate sets from scratch. Called by the GC routine as
+// decremented counters may have changed the ranking in ways the incremental
+// update cannot see
+void rebuildTopDomains(void)
+{
+	topDomainsCount = 0;
+	topAdsCount = 0;
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		updateTopDomains(false, domainID);
+		updateTopDomains(true, domainID);
+	}
+}
+
+// Copy the candidate set for getTopDomains(). Returns the number of entries
+int getTopDomainsCandidates(bool blocked, int *out)
+{
+	const int *set = blocked ? topAdsSet : topDomainsSet;
+	const int members = blocked ? topAdsCount : topDomainsCount;
+	memcpy(out, set, members*sizeof(int));
+	return members;
+}
+
 bool isValidIPv4(const char *addr)
 {
 	struct sockaddr_in sa;
@@ -183,7 +583,7 @@ bool isValidIPv6(const char *addr)
 // only when appropriate for the requested query
 const char *getDomainString(int queryID)
 {
-	if(queries[queryID].privacylevel < PRIVACY_HIDE_DOMAINS)
+	if(queries_cold[queryID].privacylevel < PRIVACY_HIDE_DOMAINS)
 	{
 		validate_access("domains", queries[queryID].domainID, true, __LINE__, __FUNCTION__, __FILE__);
 		return getstr(domains[queries[queryID].domainID].domainpos);
@@ -196,7 +596,7 @@ const char *getDomainString(int queryID)
 // only when appropriate for the requested query
 const char *getClientIPString(int queryID)
 {
-	if(queries[queryID].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
+	if(queries_cold[queryID].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
 	{
 		validate_access("clients", queries[queryID].clientID, true, __LINE__, __FUNCTION__, __FILE__);
 		return getstr(clients[queries[queryID].clientID].ippos);
@@ -209,7 +609,7 @@ const char *getClientIPString(int queryID)
 // only when appropriate for the requested query
 const char *getClientNameString(int queryID)
 {
-	if(queries[queryID].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
+	if(queries_cold[queryID].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
 	{
 		validate_access("clients", queries[queryID].clientID, true, __LINE__, __FUNCTION__, __FILE__);
 		return getstr(clients[queries[queryID].clientID].namepos);
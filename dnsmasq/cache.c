@@ -120,6 +120,33 @@ void cache_init(void)
   rehash(daemon->cachesize);
 }
 
+/* Pi-hole modification: enlarge the cache at runtime. Additional entries are
+   linked into the free list and the hash table is resized accordingly. Must
+   be called from the main thread (the cache is not thread-safe). */
+void cache_grow(int newsize)
+{
+  struct crec *crecp;
+  int i, add = newsize - daemon->cachesize;
+
+  if (add <= 0)
+    return;
+
+  crecp = whine_malloc(add*sizeof(struct crec));
+  if (!crecp)
+    return;
+
+  for (i = 0; i < add; i++, crecp++)
+    {
+      cache_link(crecp);
+      crecp->flags = 0;
+      crecp->uid = UID_NONE;
+    }
+
+  daemon->cachesize = newsize;
+  rehash(newsize);
+  my_syslog(LOG_INFO, _("grew cache to %d entries"), newsize);
+}
+
 /* In most cases, we create the hash table once here by calling this with (hash_table == NULL)
    but if the hosts file(s) are big (some people have 50000 ad-block entries), the table
    will be much too small, so the hosts reading code calls rehash every 1000 addresses, to
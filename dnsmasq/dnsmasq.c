@@ -944,6 +944,9 @@ int main_dnsmasq (int argc, char **argv)
     {
       int t, timeout = -1;
 
+      /* Pi-hole modification: keep the upstream TCP standby pool warm */
+      tcp_pool_maintain(now);
+
       poll_reset();
 
       /* if we are out of resources, find how long we have to wait
@@ -1743,6 +1746,19 @@ static void check_dns_listeners(time_t now)
 	      shutdown(confd, SHUT_RDWR);
 	      while (retry_send(close(confd)));
 	    }
+	  /* Pi-hole modification: answer locally-answerable single TCP
+	     queries inline instead of forking a child. The query is peeked
+	     (MSG_PEEK) so that nothing is consumed unless we can fully
+	     answer it from the cache/blocking lists; everything else takes
+	     the fork path below unchanged. This keeps DoT/DoH front-end
+	     proxies from causing fork storms for cached traffic. */
+	  else if (client_ok && tcp_inline_answer(confd, now, &tcp_addr,
+						  iface ? iface->netmask : (struct in_addr){ 0 },
+						  iface ? iface->dns_auth : 0))
+	    {
+	      shutdown(confd, SHUT_RDWR);
+	      while (retry_send(close(confd)));
+	    }
 #ifndef NO_FORK
 	  else if (!option_bool(OPT_DEBUG) && (p = fork()) != 0)
 	    {
@@ -1755,6 +1771,10 @@ static void check_dns_listeners(time_t now)
 			daemon->tcp_pids[i] = p;
 			break;
 		      }
+
+		  /* The child inherited the standby pool: drop the parent's
+		     copies so no second child can take the same connection */
+		  tcp_pool_drop();
 		}
 	      while (retry_send(close(confd)));
 
@@ -1148,6 +1148,11 @@ extern struct daemon {
 
 /* cache.c */
 void cache_init(void);
+void cache_grow(int newsize); /* Pi-hole modification */
+/* Pi-hole modification: upstream TCP keepalive pool (forward.c) */
+void tcp_pool_maintain(time_t now);
+int tcp_pool_take(union mysockaddr *addr);
+void tcp_pool_drop(void);
 void next_uid(struct crec *crecp);
 void log_query(unsigned int flags, char *name, struct all_addr *addr, char *arg);
 char *record_source(unsigned int index);
@@ -1316,6 +1321,8 @@ int option_read_dynfile(char *file, int flags);
 /* forward.c */
 void reply_query(int fd, int family, time_t now);
 void receive_query(struct listener *listen, time_t now);
+int tcp_inline_answer(int confd, time_t now, union mysockaddr *peer_addr,
+		      struct in_addr netmask, int auth_dns); /* Pi-hole modification */
 unsigned char *tcp_request(int confd, time_t now,
 			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns);
 void server_gone(struct server *server);
@@ -1635,6 +1642,7 @@ void set_dynamic_inotify(int flag, int total_size, struct crec **rhash, int revh
 void poll_reset(void);
 int poll_check(int fd, short event);
 void poll_listen(int fd, short event);
+void poll_close(int fd);
 int do_poll(int timeout);
 
 /* rrfilter.c */
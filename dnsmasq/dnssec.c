@@ -470,6 +470,58 @@ static int explore_rrset(struct dns_header *header, size_t plen, int class, int
   return 1;
 }
 
+/* Pi-hole modification: TTL-bounded cache of signature verification results.
+   The key is a 64-bit hash over signature, digest and algorithm, which binds
+   the RRset (through the digest) and the key (through the signature), so a
+   repeated query within the same zone skips the redundant public-key crypto.
+   Hit/miss counters are exposed through FTL's cache information API. */
+#define VERIFY_CACHE_SLOTS 256
+#define VERIFY_CACHE_TTL   300
+struct verify_cache_entry {
+  unsigned long long hash;
+  time_t expires;
+  int result;
+};
+static struct verify_cache_entry verify_cache[VERIFY_CACHE_SLOTS];
+unsigned int dnssec_verify_hits = 0, dnssec_verify_misses = 0;
+
+static unsigned long long verify_cache_hash(unsigned char *sig, size_t sig_len,
+					    unsigned char *digest, size_t digest_len, int algo)
+{
+  /* FNV-1a, 64 bit */
+  unsigned long long hash = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < sig_len; i++)
+    hash = (hash ^ sig[i]) * 1099511628211ULL;
+  for (i = 0; i < digest_len; i++)
+    hash = (hash ^ digest[i]) * 1099511628211ULL;
+  hash = (hash ^ (unsigned char)algo) * 1099511628211ULL;
+  return hash;
+}
+
+static int cached_verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+			 unsigned char *digest, size_t digest_len, int algo, time_t now)
+{
+  unsigned long long hash = verify_cache_hash(sig, sig_len, digest, digest_len, algo);
+  struct verify_cache_entry *entry = &verify_cache[hash % VERIFY_CACHE_SLOTS];
+  int result;
+
+  if (entry->hash == hash && entry->expires > now)
+    {
+      dnssec_verify_hits++;
+      return entry->result;
+    }
+
+  dnssec_verify_misses++;
+  result = verify(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+
+  entry->hash = hash;
+  entry->expires = now + VERIFY_CACHE_TTL;
+  entry->result = result;
+
+  return result;
+}
+
 /* Validate a single RRset (class, type, name) in the supplied DNS reply
    Return code:
    STAT_SECURE   if it validates.
@@ -621,7 +673,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       if (key)
 	{
 	  if (algo_in == algo && keytag_in == key_tag &&
-	      verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo))
+	      cached_verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo, now))
 	    return STAT_SECURE;
 	}
       else
@@ -631,7 +683,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	    if (crecp->addr.key.algo == algo &&
 		crecp->addr.key.keytag == key_tag &&
 		crecp->uid == (unsigned int)class &&
-		verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo))
+		cached_verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo, now))
 	      return (labels < name_labels) ? STAT_SECURE_WILDCARD : STAT_SECURE;
 	}
     }
@@ -413,6 +413,9 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 		  daemon->forwardcount = 0;
 		  daemon->forwardtime = now;
 		}
+	      /* Pi-hole modification: optionally overrule the choice with the
+		 upstream FTL measured to be fastest and healthy */
+	      start = FTL_select_server(start, now);
 	    }
 	  else
 	    {
@@ -1552,11 +1555,12 @@ void receive_query(struct listener *listen, time_t now)
 #endif
       char *types = querystr(auth_dns ? "auth" : "query", type);
 
+      int ftl_allowed = 1;
       if (listen->family == AF_INET)
       {
 	log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
 		  (struct all_addr *)&source_addr.in.sin_addr, types);
-	FTL_new_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
+	ftl_allowed = FTL_new_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
 	              (struct all_addr *)&source_addr.in.sin_addr, types, daemon->log_display_id, UDP);
       }
 #ifdef HAVE_IPV6
@@ -1564,11 +1568,22 @@ void receive_query(struct listener *listen, time_t now)
       {
 	log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff,
 		  (struct all_addr *)&source_addr.in6.sin6_addr, types);
-	FTL_new_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff,
+	ftl_allowed = FTL_new_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff,
 	              (struct all_addr *)&source_addr.in6.sin6_addr, types, daemon->log_display_id, UDP);
       }
 #endif
 
+      /* Pi-hole modification: the client exceeded its rate limit, answer
+	 REFUSED locally and never forward */
+      if (!ftl_allowed)
+	{
+	  header->hb3 |= HB3_QR;
+	  SET_RCODE(header, REFUSED);
+	  send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
+		    (char *)header, n, &source_addr, &dst_addr, if_index);
+	  return;
+	}
+
 #ifdef HAVE_AUTH
       /* find queries for zones we're authoritative for, and answer them directly */
       if (!auth_dns && !option_bool(OPT_LOCALISE))
@@ -1801,6 +1816,220 @@ static int tcp_key_recurse(time_t now, int status, struct dns_header *header, si
 #endif
 
 
+/* Pi-hole modification: keepalive pool of established upstream TCP
+   connections. The main process keeps one pre-connected (non-blocking)
+   standby connection per upstream; a forked TCP child inherits the pool
+   and takes the matching connection instead of paying the handshake, the
+   parent closes its copies after the fork and re-establishes standbys in
+   the background. Idle standbys are recycled after a minute. */
+#define TCP_POOL_MAX 8
+#define TCP_POOL_IDLE 60
+struct tcp_pool_entry {
+  union mysockaddr addr;
+  int fd;
+  int state; /* 0 empty, 1 connecting, 2 ready */
+  time_t since;
+};
+static struct tcp_pool_entry tcp_pool[TCP_POOL_MAX];
+
+/* Called once per main loop iteration: complete pending connects, expire
+   idle standbys and start new non-blocking connects for upstreams without
+   a standby connection */
+void tcp_pool_maintain(time_t now)
+{
+  struct server *serv;
+  int i;
+
+  for (i = 0; i < TCP_POOL_MAX; i++)
+    {
+      if (tcp_pool[i].state == 1)
+	{
+	  int err = 0;
+	  socklen_t errlen = sizeof(err);
+	  if (getsockopt(tcp_pool[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 ||
+	      (err != 0 && err != EINPROGRESS))
+	    {
+	      close(tcp_pool[i].fd);
+	      tcp_pool[i].state = 0;
+	    }
+	  else if (err == 0)
+	    {
+	      tcp_pool[i].state = 2;
+	      tcp_pool[i].since = now;
+	    }
+	}
+      else if (tcp_pool[i].state == 2 && difftime(now, tcp_pool[i].since) > TCP_POOL_IDLE)
+	{
+	  /* Recycle idle standbys, the server may have dropped them */
+	  close(tcp_pool[i].fd);
+	  tcp_pool[i].state = 0;
+	}
+    }
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    {
+      int free_slot = -1, have = 0;
+
+      if (serv->flags & (SERV_LITERAL_ADDRESS | SERV_NO_ADDR | SERV_USE_RESOLV))
+	continue;
+
+      for (i = 0; i < TCP_POOL_MAX; i++)
+	{
+	  if (tcp_pool[i].state == 0)
+	    free_slot = i;
+	  else if (sockaddr_isequal(&tcp_pool[i].addr, &serv->addr))
+	    have = 1;
+	}
+
+      if (!have && free_slot != -1)
+	{
+	  int fd = socket(serv->addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	  if (fd == -1)
+	    continue;
+	  if (!local_bind(fd, &serv->source_addr, serv->interface, 0, 1) ||
+	      (connect(fd, &serv->addr.sa, sa_len(&serv->addr)) == -1 && errno != EINPROGRESS))
+	    {
+	      close(fd);
+	      continue;
+	    }
+	  tcp_pool[free_slot].addr = serv->addr;
+	  tcp_pool[free_slot].fd = fd;
+	  tcp_pool[free_slot].state = 1;
+	  tcp_pool[free_slot].since = now;
+	}
+    }
+}
+
+/* Take a ready pooled connection to the given upstream (used in the forked
+   TCP child, which inherited the pool). Returns -1 when none is available */
+int tcp_pool_take(union mysockaddr *addr)
+{
+  int i;
+  for (i = 0; i < TCP_POOL_MAX; i++)
+    if (tcp_pool[i].state == 2 && sockaddr_isequal(&tcp_pool[i].addr, addr))
+      {
+	int fd = tcp_pool[i].fd;
+	int flags;
+	tcp_pool[i].state = 0;
+	/* The connection was established non-blocking, the child wants
+	   blocking semantics */
+	if ((flags = fcntl(fd, F_GETFL, 0)) != -1)
+	  fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	return fd;
+      }
+  return -1;
+}
+
+/* Close the parent's copies after a fork handed the pool to a child */
+void tcp_pool_drop(void)
+{
+  int i;
+  for (i = 0; i < TCP_POOL_MAX; i++)
+    if (tcp_pool[i].state != 0)
+      {
+	close(tcp_pool[i].fd);
+	tcp_pool[i].state = 0;
+      }
+}
+
+/* Pi-hole modification: try to answer the first TCP query on a freshly
+   accepted connection inline (cache/blocking lists only). The bytes are
+   only consumed when the query can be fully answered locally; otherwise
+   nothing is read and the caller falls back to forking a child. Returns
+   nonzero when the connection has been fully served. */
+int tcp_inline_answer(int confd, time_t now, union mysockaddr *peer_addr,
+		      struct in_addr netmask, int auth_dns)
+{
+  unsigned char peekbuff[2048];
+  ssize_t avail;
+  size_t qlen, m;
+  unsigned short qtype;
+  struct dns_header *header;
+  struct in_addr dst_addr_4;
+  union mysockaddr tcp_addr;
+  socklen_t tcp_len = sizeof(union mysockaddr);
+  int ad_reqd, do_bit = 0, have_pseudoheader = 0;
+  unsigned char *pheader;
+  unsigned char c1, c2;
+
+  /* Authoritative zones take the regular path */
+  if (auth_dns)
+    return 0;
+
+  /* Peek without consuming (the socket is still non-blocking here) */
+  avail = recv(confd, peekbuff, sizeof(peekbuff), MSG_PEEK | MSG_DONTWAIT);
+  if (avail < 2)
+    return 0;
+
+  qlen = (peekbuff[0] << 8) | peekbuff[1];
+  /* Only exactly one complete query that also fits into dnsmasq's packet
+     buffer (it can be smaller than the peek buffer with a small
+     edns-packet-max); anything larger takes the fork path */
+  if (qlen < (size_t)(sizeof(struct dns_header)) ||
+      qlen > sizeof(peekbuff) - 2 ||
+      qlen > (size_t)daemon->packet_buff_sz ||
+      (size_t)avail != qlen + 2)
+    return 0;
+
+  /* Work on dnsmasq's packet buffer like the UDP path does */
+  memcpy(daemon->packet, peekbuff + 2, qlen);
+  header = (struct dns_header *)daemon->packet;
+
+  if (!extract_request(header, qlen, daemon->namebuff, &qtype))
+    return 0;
+
+  if (find_pseudoheader(header, qlen, NULL, &pheader, NULL, NULL))
+    {
+      unsigned short flags;
+      have_pseudoheader = 1;
+      pheader += 4; /* udp_size and ext-rcode/version */
+      GETSHORT(flags, pheader);
+      if (flags & 0x8000)
+	do_bit = 1;
+    }
+
+  ad_reqd = do_bit;
+  if (header->hb4 & HB4_AD)
+    ad_reqd = 1;
+
+  dst_addr_4.s_addr = 0;
+  if (getsockname(confd, (struct sockaddr *)&tcp_addr, &tcp_len) != -1 &&
+      tcp_addr.sa.sa_family == AF_INET)
+    dst_addr_4 = tcp_addr.in.sin_addr;
+
+  /* Record the query for FTL, mirroring the forked TCP path */
+  daemon->log_display_id = ++daemon->log_id;
+  if (peer_addr->sa.sa_family == AF_INET)
+    FTL_new_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
+		  (struct all_addr *)&peer_addr->in.sin_addr,
+		  querystr("query", qtype), daemon->log_display_id, TCP);
+#ifdef HAVE_IPV6
+  else
+    FTL_new_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff,
+		  (struct all_addr *)&peer_addr->in6.sin6_addr,
+		  querystr("query", qtype), daemon->log_display_id, TCP);
+#endif
+
+  m = answer_request(header, ((char *)header) + daemon->packet_buff_sz, qlen,
+		     dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader);
+  if (m == 0)
+    {
+      /* Cannot answer locally: the fork path will (re)read and record the
+	 query, so take our record back to avoid double counting */
+      FTL_retract_query(daemon->log_display_id);
+      return 0;
+    }
+
+  /* Consume the peeked bytes and send the local answer */
+  while (retry_send(recv(confd, peekbuff, qlen + 2, 0)));
+  c1 = m >> 8;
+  c2 = m & 0xff;
+  if (read_write(confd, &c1, 1, 0) && read_write(confd, &c2, 1, 0))
+    read_write(confd, (unsigned char *)header, m, 0);
+
+  return 1;
+}
+
 /* The daemon forks before calling this: it should deal with one connection,
    blocking as necessary, and then return. Note, need to be a bit careful
    about resources for debug mode, when the fork is suppressed: that's
@@ -2063,6 +2292,14 @@ unsigned char *tcp_request(int confd, time_t now,
 		    retry:
 		      if (last_server->tcpfd == -1)
 			{
+			  /* Pi-hole modification: reuse an inherited
+			     pre-connected standby connection if available */
+			  if ((last_server->tcpfd = tcp_pool_take(&last_server->addr)) != -1)
+			    {
+			      last_server->flags &= ~SERV_GOT_TCP;
+			      goto connected;
+			    }
+
 			  if ((last_server->tcpfd = socket(last_server->addr.sa.sa_family, SOCK_STREAM, 0)) == -1)
 			    continue;
 
@@ -2083,6 +2320,7 @@ unsigned char *tcp_request(int confd, time_t now,
 			  last_server->flags &= ~SERV_GOT_TCP;
 			}
 
+		    connected:
 		      *length = htons(size);
 
 		      /* get query name again for logging - may have been overwritten */
@@ -2277,7 +2515,12 @@ struct randfd *allocate_rfd(int family)
 void free_rfd(struct randfd *rfd)
 {
   if (rfd && --(rfd->refcount) == 0)
-    close(rfd->fd);
+    {
+      /* Deregister from the epoll-backed poller before the fd number
+	 can be reused for an unrelated descriptor */
+      poll_close(rfd->fd);
+      close(rfd->fd);
+    }
 }
 
 static void free_frec(struct frec *f)
@@ -39,9 +39,31 @@
     event is OR of POLLIN, POLLOUT, POLLERR, etc
 */
 
+/* Pi-hole modification: the wrapper below keeps the original poll.c API
+   (poll_reset/poll_listen/do_poll/poll_check) and the sorted pollfd array,
+   but the kernel-side wait uses a persistent epoll instance. The per-
+   iteration cost of the wait becomes proportional to the number of ready
+   descriptors instead of the total number of listening sockets.
+
+   An fd number can be closed and reused between two iterations (the random
+   upstream sockets do this constantly), in which case the number refers to
+   a different descriptor than the one that was registered: code closing a
+   polled fd calls poll_close() first, which deregisters the descriptor
+   while it is still valid, and do_poll() additionally re-issues a cheap
+   EPOLL_CTL_MOD for every desired fd so a reopen that bypassed
+   poll_close() still gets (re-)ADDed via the ENOENT fallback. */
+
+#include <sys/epoll.h>
+
 static struct pollfd *pollfds = NULL;
 static nfds_t nfds, arrsize = 0;
 
+/* What is currently registered with the epoll instance */
+static struct pollfd *registered = NULL;
+static nfds_t nreg = 0, regsize = 0;
+static int epollfd = -1;
+static pid_t epoll_owner = 0;
+
 /* Binary search. Returns either the pollfd with fd, or
    if the fd doesn't match, or return equals nfds, the entry
    to the left of which a new record should be inserted. */
@@ -73,9 +95,160 @@ void poll_reset(void)
   nfds = 0;
 }
 
+static uint32_t to_epoll(short event)
+{
+  uint32_t ev = 0;
+  if (event & POLLIN)
+    ev |= EPOLLIN;
+  if (event & POLLOUT)
+    ev |= EPOLLOUT;
+  if (event & POLLERR)
+    ev |= EPOLLERR;
+  return ev;
+}
+
+static short from_epoll(uint32_t ev)
+{
+  short event = 0;
+  if (ev & EPOLLIN)
+    event |= POLLIN;
+  if (ev & EPOLLOUT)
+    event |= POLLOUT;
+  if (ev & EPOLLERR)
+    event |= POLLERR;
+  if (ev & EPOLLHUP)
+    event |= POLLHUP;
+  return event;
+}
+
+static void epoll_apply(int op, int fd, short event)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll(event);
+  ev.data.fd = fd;
+  if (epoll_ctl(epollfd, op, fd, &ev) == -1)
+    {
+      /* A closed fd was removed automatically, an unknown one may have
+	 been re-opened with the same number: retry with the other op */
+      if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+      else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+}
+
 int do_poll(int timeout)
 {
-  return poll(pollfds, nfds, timeout);
+  nfds_t i = 0, j = 0;
+  struct epoll_event ready[64];
+  int hits, n;
+
+  /* (Re-)create the epoll instance, also after a fork: the instance is
+     shared with the parent otherwise and manipulating it from a TCP child
+     would corrupt the parent's interest set */
+  if (epollfd == -1 || epoll_owner != getpid())
+    {
+      if (epollfd != -1)
+	close(epollfd);
+      if ((epollfd = epoll_create1(0)) == -1)
+	return poll(pollfds, nfds, timeout); /* fallback */
+      epoll_owner = getpid();
+      nreg = 0;
+    }
+
+  /* Diff the desired set (pollfds) against what is registered: both arrays
+     are sorted by fd, so one merge walk issues the necessary epoll_ctl
+     operations. revents of the desired set are cleared on the way */
+  while (i < nfds || j < nreg)
+    {
+      if (j >= nreg || (i < nfds && pollfds[i].fd < registered[j].fd))
+	{
+	  pollfds[i].revents = 0;
+	  epoll_apply(EPOLL_CTL_ADD, pollfds[i].fd, pollfds[i].events);
+	  i++;
+	}
+      else if (i >= nfds || registered[j].fd < pollfds[i].fd)
+	{
+	  epoll_ctl(epollfd, EPOLL_CTL_DEL, registered[j].fd, NULL);
+	  j++;
+	}
+      else
+	{
+	  /* Same fd number in both sets: MOD unconditionally. If the fd
+	     was closed and reopened since the last iteration the kernel
+	     dropped the old registration and MOD fails with ENOENT, which
+	     epoll_apply() turns into the required ADD. */
+	  pollfds[i].revents = 0;
+	  epoll_apply(EPOLL_CTL_MOD, pollfds[i].fd, pollfds[i].events);
+	  i++;
+	  j++;
+	}
+    }
+
+  /* Remember the now-registered set */
+  if (regsize < arrsize)
+    {
+      struct pollfd *new = whine_malloc(arrsize * sizeof(struct pollfd));
+      if (!new)
+	return poll(pollfds, nfds, timeout); /* fallback */
+      if (registered)
+	free(registered);
+      registered = new;
+      regsize = arrsize;
+    }
+  memcpy(registered, pollfds, nfds * sizeof(struct pollfd));
+  nreg = nfds;
+
+  hits = epoll_wait(epollfd, ready, 64, timeout);
+
+  /* Transfer readiness into the pollfd array so that poll_check() works
+     exactly as before */
+  for (n = 0; n < hits; n++)
+    {
+      i = fd_search(ready[n].data.fd);
+      if (i < nfds && pollfds[i].fd == ready[n].data.fd)
+	pollfds[i].revents = from_epoll(ready[n].events);
+    }
+
+  return hits;
+}
+
+/* Must be called before close() on any fd that may have been polled:
+   deregisters the descriptor while it is still valid. Waiting for the
+   kernel's automatic cleanup is not enough, because a forked TCP child
+   holding an inherited copy of the fd keeps the registration alive in
+   the parent's interest set, where it would misattribute events once
+   the fd number is reused. */
+void poll_close(int fd)
+{
+  nfds_t left, right, mid;
+
+  if (epollfd != -1 && epoll_owner == getpid())
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+
+  /* Remove the fd from the remembered registered set (sorted by fd) so
+     the next merge walk doesn't issue a second, stray DEL. */
+  if ((right = nreg) == 0)
+    return;
+
+  left = 0;
+
+  while (right != left + 1)
+    {
+      mid = (left + right)/2;
+
+      if (registered[mid].fd > fd)
+	right = mid;
+      else
+	left = mid;
+    }
+
+  if (registered[left].fd == fd)
+    {
+      memmove(&registered[left], &registered[left+1], (nreg - left - 1) * sizeof(struct pollfd));
+      nreg--;
+    }
 }
 
 int poll_check(int fd, short event)
@@ -1752,7 +1752,19 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 				                     record_source(crecp->uid),
 				                     daemon->log_display_id);
 
-				if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
+				/* Pi-hole modification: blocked answers are
+				   assembled from precomputed templates with one
+				   memcpy; the generic record assembly below only
+				   runs for non-blocking answers */
+				size_t blockedlen = FTL_append_blocked_answer((unsigned char *)ansp,
+									      (unsigned char *)limit,
+									      nameoffset, type, &crecp->addr.addr);
+				if (blockedlen > 0)
+				  {
+				    ansp += blockedlen;
+				    anscount++;
+				  }
+				else if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
 							crec_ttl(crecp, now), NULL, type, C_IN,
 							type == T_A ? "4" : "6", &crecp->addr))
 				  anscount++;
@@ -24,15 +24,45 @@ static void block_single_domain_regex(char *domain);
 static void detect_blocked_IP(unsigned short flags, const char* answer, int queryID);
 static void query_externally_blocked(int i, unsigned char status);
 static int findQueryID(int id);
+static void insert_inflight_hash(int id, int queryID);
+
+// Cheap per-hook latency accounting: a cleanup-attributed timer records the
+// duration of the enclosing hook into the log-scale shared histograms no
+// matter through which return path the hook exits
+typedef struct {
+	int hook;
+	struct timespec start;
+} hookTimerStruct;
+
+static void hook_timer_done(hookTimerStruct *timer)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long ns = (end.tv_sec - timer->start.tv_sec)*1000000000L +
+	          (end.tv_nsec - timer->start.tv_nsec);
+	unsigned int bucket = 0;
+	while(ns > 1 && bucket < HOOK_BUCKETS-1)
+	{
+		ns >>= 1;
+		bucket++;
+	}
+	__sync_fetch_and_add(&counters->hook_histogram[timer->hook][bucket], 1);
+}
+
+#define HOOK_TIMER(hookid) \
+	hookTimerStruct hook_timer __attribute__((cleanup(hook_timer_done))) = { hookid, { 0, 0 } }; \
+	clock_gettime(CLOCK_MONOTONIC, &hook_timer.start)
 
 unsigned char* pihole_privacylevel = &config.privacylevel;
 char flagnames[28][12] = {"F_IMMORTAL ", "F_NAMEP ", "F_REVERSE ", "F_FORWARD ", "F_DHCP ", "F_NEG ", "F_HOSTS ", "F_IPV4 ", "F_IPV6 ", "F_BIGNAME ", "F_NXDOMAIN ", "F_CNAME ", "F_DNSKEY ", "F_CONFIG ", "F_DS ", "F_DNSSECOK ", "F_UPSTREAM ", "F_RRNAME ", "F_SERVER ", "F_QUERY ", "F_NOERR ", "F_AUTH ", "F_DNSSEC ", "F_KEYTAG ", "F_SECSTAT ", "F_NO_RR ", "F_IPSET ", "F_NOEXTRA "};
 
-void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line)
+int _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line)
 {
+	HOOK_TIMER(HOOK_NEW_QUERY);
+
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
-		return;
+		return 1;
 
 	// Create new query in data structure
 	lock_shm();
@@ -65,7 +95,7 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 		// Return early to avoid accessing querytypedata out of bounds
 		if(config.debug & DEBUG_QUERIES) logg("Notice: Skipping unknown query type: %s (%i)", types, id);
 		unlock_shm();
-		return;
+		return 1;
 	}
 
 	// Skip AAAA queries if user doesn't want to have them analyzed
@@ -73,16 +103,28 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	{
 		if(config.debug & DEBUG_QUERIES) logg("Not analyzing AAAA query");
 		unlock_shm();
-		return;
+		return 1;
 	}
 
+	// Sampling mode: keep the full per-query record for only every N-th
+	// query. Only the recording is thinned out -- the blocking decision
+	// and the per-client rate accounting below still run for every query
+	static unsigned long sample_counter = 0;
+	const bool sampled_out = config.sampling > 1 &&
+	                         (++sample_counter % (unsigned long)config.sampling) != 0;
+
 	// Ensure we have enough space in the queries struct
-	memory_check(QUERIES);
-	int queryID = counters->queries;
+	int queryID = -1;
+	if(!sampled_out)
+	{
+		memory_check(QUERIES);
+		queryID = counters->queries_start + counters->queries;
+	}
 
-	// Convert domain to lower case
+	// Convert domain to lower case and compute the index hash in the same
+	// pass over the string
 	char *domain = strdup(name);
-	strtolower(domain);
+	const uint32_t domainhash_value = strtolower_hash(domain);
 
 	// If domain is "pi.hole" we skip this query
 	if(strcmp(domain, "pi.hole") == 0)
@@ -90,7 +132,7 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 		// free memory already allocated here
 		free(domain);
 		unlock_shm();
-		return;
+		return 1;
 	}
 
 	// Store plain text domain in buffer for regex validation
@@ -109,7 +151,7 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 		free(domain);
 		free(client);
 		unlock_shm();
-		return;
+		return 1;
 	}
 
 	// Log new query if in debug mode
@@ -137,55 +179,127 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 		free(domainbuffer);
 		free(client);
 		unlock_shm();
-		return;
+		return 1;
 	}
 
 	// Go through already knows domains and see if it is one of them
-	int domainID = findDomainID(domain);
+	int domainID = findDomainIDHashed(domain, domainhash_value);
 
 	// Go through already knows clients and see if it is one of them
 	int clientID = findClientID(client, true);
 
-	// Save everything
-	validate_access("queries", queryID, false, __LINE__, __FUNCTION__, __FILE__);
-	queries[queryID].magic = MAGICBYTE;
-	queries[queryID].timestamp = querytimestamp;
-	queries[queryID].type = querytype;
-	queries[queryID].status = QUERY_UNKNOWN;
-	queries[queryID].domainID = domainID;
-	queries[queryID].clientID = clientID;
-	queries[queryID].timeidx = timeidx;
-	// Initialize database rowID with zero, will be set when the query is stored in the long-term DB
-	queries[queryID].db = 0;
-	queries[queryID].id = id;
-	queries[queryID].complete = false;
-	queries[queryID].response = converttimeval(request);
-	// Initialize reply type
-	queries[queryID].reply = REPLY_UNKNOWN;
-	// Store DNSSEC result for this domain
-	queries[queryID].dnssec = DNSSEC_UNSPECIFIED;
-
-	// Check and apply possible privacy level rules
-	// The currently set privacy level (at the time the query is
-	// generated) is stored in the queries structure
-	get_privacy_level(NULL);
-	queries[queryID].privacylevel = config.privacylevel;
-
-	// Increase DNS queries counter
-	counters->queries++;
-	// Count this query as unknown as long as no reply has
-	// been found and analyzed
-	counters->unknown++;
+	if(sampled_out)
+	{
+		// Thinned-out query: it appears in the cheap aggregates only
+		counters->unsampled++;
+	}
+	else
+	{
+		// Save everything
+		validate_access("queries", queryID, false, __LINE__, __FUNCTION__, __FILE__);
+		queries[queryID].magic = MAGICBYTE;
+		queries[queryID].timestamp = querytimestamp;
+		queries[queryID].type = querytype;
+		queries[queryID].status = QUERY_UNKNOWN;
+		queries[queryID].domainID = domainID;
+		queries[queryID].clientID = clientID;
+		// Initialize database rowID with zero, will be set when the query is stored in the long-term DB
+		queries_cold[queryID].db = 0;
+		queries[queryID].id = id;
+		queries[queryID].complete = false;
+		queries_cold[queryID].response = converttimeval(request);
+		// Initialize reply type
+		queries[queryID].reply = REPLY_UNKNOWN;
+		// Store DNSSEC result for this domain
+		queries_cold[queryID].dnssec = DNSSEC_UNSPECIFIED;
+
+		// Check and apply possible privacy level rules
+		// The currently set privacy level (at the time the query is
+		// generated) is stored in the queries structure
+		get_privacy_level(NULL);
+		queries_cold[queryID].privacylevel = config.privacylevel;
+
+		// Make the in-flight query findable by its dnsmasq id without scanning
+		insert_inflight_hash(id, queryID);
+
+		// Auto-grow the dnsmasq cache: check the eviction counter once every
+		// 4096 queries and enlarge the cache by 50% (bounded) whenever live
+		// entries had to be evicted since the last check. We are on the
+		// dnsmasq main thread here, so touching the cache is safe
+		if(config.cacheautogrow && (counters->queries & 0xfff) == 0)
+		{
+			static int last_live_freed = 0;
+			static int initial_cachesize = 0;
+			if(initial_cachesize == 0)
+				initial_cachesize = daemon->cachesize;
+			const int live_freed = daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED];
+			if(live_freed > last_live_freed &&
+			   daemon->cachesize < 10*initial_cachesize)
+			{
+				int newsize = daemon->cachesize + daemon->cachesize/2;
+				if(newsize > 10*initial_cachesize)
+					newsize = 10*initial_cachesize;
+				logg("Cache evictions detected (%i), growing dnsmasq cache %i -> %i",
+				     live_freed - last_live_freed, daemon->cachesize, newsize);
+				cache_grow(newsize);
+			}
+			last_live_freed = live_freed;
+		}
+
+		// Increase DNS queries counter
+		counters->queries++;
+		// Count this query as unknown as long as no reply has
+		// been found and analyzed
+		counters->unknown++;
+
+		// Record the query in the inverted per-client/per-domain and
+		// unknown indexes. This also absorbs any queries recorded by
+		// fork()ed TCP workers since the last call
+		catchupQueryIndexes();
+
+		// Update overTime data structure with the new client
+		addClientOverTime(clientID, timeidx, 1);
+	}
 
 	// Update overTime data
 	overTime[timeidx].total++;
-	// Update overTime data structure with the new client
-	clients[clientID].overTime[timeidx]++;
 
 	// Set lastQuery timer and add one query for network table
 	clients[clientID].lastQuery = querytimestamp;
 	clients[clientID].numQueriesARP++;
 
+	// Lightweight per-client rate accounting: count queries within the
+	// current ten-second window (a few cache-line writes, hot-path safe)
+	const time_t rate_window = querytimestamp / 10;
+	if(clients[clientID].rate_window != rate_window)
+	{
+		clients[clientID].rate_window = rate_window;
+		clients[clientID].rate_count = 0;
+	}
+	clients[clientID].rate_count++;
+
+	// Enforce the configured per-client limit: over-limit queries are
+	// recorded with their own status and refused by the caller. Only the
+	// UDP path acts on the return value (the TCP paths answer normally),
+	// so the refused status and counter are limited to UDP queries to
+	// keep the recorded data truthful
+	if(config.ratelimit > 0 && type == UDP &&
+	   clients[clientID].rate_count > (unsigned int)config.ratelimit*10u)
+	{
+		if(!sampled_out)
+		{
+			queries[queryID].status = QUERY_REFUSED_RATELIMIT;
+			queries[queryID].complete = true;
+			counters->unknown--;
+		}
+		counters->ratelimited++;
+		free(client);
+		free(domain);
+		free(domainbuffer);
+		unlock_shm();
+		return 0;
+	}
+
 	// Try blocking regex if configured
 	validate_access("domains", domainID, false, __LINE__, __FUNCTION__, __FILE__);
 	if(domains[domainID].regexmatch == REGEX_UNKNOWN && blockingstatus != BLOCKING_DISABLED)
@@ -195,22 +309,39 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 		// - this domain has not already been validated against the regex.
 		// This effectively prevents multiple evaluations of the same domain
 		//
+		// Domains that are already exactly blocked do not need a regex
+		// evaluation at all -- dnsmasq answers them from its own cache.
+		// The Bloom filter answers the common not-blocked case with a
+		// couple of hash probes; only on a (possibly false positive)
+		// filter hit we fall back to a full check against the lists
+		if(bloom_contains(domain) &&
+		   (countlineswith(domain, files.gravity) > 0 ||
+		    countlineswith(domain, files.blacklist) > 0))
+		{
+			// Exactly blocked domain: skip the regex evaluation.
+			// Marking the domain as not regex-blocked is safe as
+			// this field is reset on every list reload anyway
+			domains[domainID].regexmatch = REGEX_NOTBLOCKED;
+		}
+		//
 		// If a regex filter matched, we additionally compare the domain
 		// against all known whitelisted domains to possibly prevent blocking
 		// of a specific domain. The logic herein is:
 		// If matched, then compare against whitelist
 		// If in whitelist, negate matched so this function returns: not-to-be-blocked
-		if(match_regex(domainbuffer) && !in_whitelist(domainbuffer))
+		else if(match_regex(domainbuffer) && !in_whitelist(domainbuffer))
 		{
 			// We have to block this domain
 			block_single_domain_regex(domainbuffer);
 			domains[domainID].regexmatch = REGEX_BLOCKED;
+			queue_regex_verdict(domains[domainID].domainpos, REGEX_BLOCKED);
 		}
 		else
 		{
 			// Explicitly mark as not blocked to skip regex test
 			// next time we see this domain
 			domains[domainID].regexmatch = REGEX_NOTBLOCKED;
+			queue_regex_verdict(domains[domainID].domainpos, REGEX_NOTBLOCKED);
 		}
 	}
 
@@ -221,11 +352,75 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 
 	// Release thread lock
 	unlock_shm();
+
+	return 1;
+}
+
+// Hash map from dnsmasq query id to the position of the in-flight query in
+// queries[]. The table is direct-mapped: inserting overwrites whatever was in
+// the slot which is fine as dnsmasq ids increase monotonically, so an evicted
+// entry belongs to a query that is INFLIGHT_HASH_SLOTS ids older and long
+// answered. Lookups verify the stored position before using it and fall back
+// to the scan loop below on any mismatch, so a stale entry can never attach
+// reply data to the wrong query. Entries are not removed when a reply is
+// recorded because CNAME chains deliver several replies for the same id.
+// The table is process-local: TCP workers fork()ed by dnsmasq inherit it and
+// handle both query and reply of their connection within the same process.
+#define INFLIGHT_HASH_SLOTS 16384
+typedef struct {
+	int id;
+	int queryID; // Stored with +1 offset so that zeroed slots are "empty"
+} inflightHashEntry;
+static inflightHashEntry inflight_hash[INFLIGHT_HASH_SLOTS] = { { 0, 0 } };
+
+// Remember where the query with the given dnsmasq id lives in queries[]
+static void insert_inflight_hash(int id, int queryID)
+{
+	inflightHashEntry *entry = &inflight_hash[id & (INFLIGHT_HASH_SLOTS-1)];
+	entry->id = id;
+	entry->queryID = queryID + 1;
+}
+
+// Correct the stored positions after memory_check() compacted queries[].
+// Entries pointing before the new head of the ring are dropped
+// Forget all in-flight positions, e.g. after query positions wholesale
+// changed. Pending replies fall back to the verifying scan path until the
+// table fills up again
+void reset_inflight_hash(void)
+{
+	memset(inflight_hash, 0, sizeof(inflight_hash));
+}
+
+void shift_inflight_hash(int offset)
+{
+	for(int slot = 0; slot < INFLIGHT_HASH_SLOTS; slot++)
+	{
+		if(inflight_hash[slot].queryID == 0)
+			continue;
+
+		if(inflight_hash[slot].queryID - 1 >= offset)
+			inflight_hash[slot].queryID -= offset;
+		else
+			inflight_hash[slot].queryID = 0;
+	}
 }
 
 static int findQueryID(int id)
 {
-	// Loop over all queries - we loop in reverse order (start from the most recent query and
+	// Try the in-flight hash first: this directly delivers the position of
+	// the matching query without any scanning
+	const inflightHashEntry *entry = &inflight_hash[id & (INFLIGHT_HASH_SLOTS-1)];
+	if(entry->id == id && entry->queryID > 0)
+	{
+		int queryID = entry->queryID - 1;
+		// Verify the entry still points at the right query
+		if(queryID >= counters->queries_start &&
+		   queryID < counters->queries_start + counters->queries &&
+		   queries[queryID].id == id)
+			return queryID;
+	}
+
+	// Fallback: Loop over all queries - we loop in reverse order (start from the most recent query and
 	// continuously walk older queries while trying to find a match. Ideally, we should always
 	// find the correct query with zero iterations, but it may happen that queries are processed
 	// asynchronously, e.g. for slow upstream relies to a huge amount of requests.
@@ -234,8 +429,9 @@ static int findQueryID(int id)
 	// MAX(0, a) is used to return 0 in case a is negative (negative array indices are harmful)
 
 	// Validate access only once for the maximum index (all lower will work)
-	int until = MAX(0, counters->queries-MAXITER);
-	int start = MAX(0, counters->queries-1);
+	// The valid region of the query ring starts at queries_start
+	int until = MAX(counters->queries_start, counters->queries_start + counters->queries-MAXITER);
+	int start = MAX(counters->queries_start, counters->queries_start + counters->queries-1);
 	validate_access("queries", until, false, __LINE__, __FUNCTION__, __FILE__);
 
 	// Check UUIDs of queries
@@ -247,12 +443,145 @@ static int findQueryID(int id)
 	return -1;
 }
 
+// ==================== asynchronous statistics recording ====================
+// When ASYNC_STATS is enabled, the reply-side hooks (FTL_forwarded, FTL_reply,
+// FTL_cache, FTL_dnssec) only append a small fixed-size event record to a
+// lock-free single-producer/single-consumer ring and return immediately.
+// A dedicated consumer thread applies the events to the shared-memory
+// structures, so contention from API readers or GC no longer adds to
+// dnsmasq's packet-processing latency. FTL_new_query() is not deferred: it
+// makes the regex blocking decision, which has to happen before dnsmasq
+// answers the query.
+enum { EVENT_FORWARDED, EVENT_CACHE, EVENT_REPLY, EVENT_DNSSEC };
+
+#define EVENT_QUEUE_SLOTS 4096
+
+typedef struct {
+	unsigned char hook;
+	unsigned int flags;
+	int id;
+	int status;             // FTL_dnssec() status
+	bool have_addr;
+	struct all_addr addr;
+	struct timeval stamp;   // response time stamp taken when queueing
+	char name[256];         // domain name, empty if none was supplied
+	char arg[64];           // source file argument of FTL_cache()
+} statsEvent;
+
+static statsEvent event_queue[EVENT_QUEUE_SLOTS];
+static volatile unsigned int event_head = 0; // written only by the producer
+static volatile unsigned int event_tail = 0; // written only by the consumer
+static pid_t event_producer = 0;             // PID of the queue-owning process
+// Set in the consumer thread so that re-invoked hooks apply directly
+// instead of queueing their event again
+static __thread bool in_event_consumer = false;
+// Response time stamp of the event currently being applied (consumer only)
+static __thread const struct timeval *event_stamp = NULL;
+
+static bool enqueue_event(unsigned char hook, unsigned int flags, const char *name,
+                          const struct all_addr *addr, const char *arg, int id, int status)
+{
+	// Asynchronous recording may be disabled entirely, and only the process
+	// that owns the consumer thread may produce events: TCP workers
+	// fork()ed by dnsmasq would fill a queue nobody ever drains
+	if(in_event_consumer || event_producer == 0 || event_producer != getpid())
+		return false;
+
+	unsigned int head = event_head;
+	// Queue full? Fall back to synchronous processing
+	if(head - event_tail >= EVENT_QUEUE_SLOTS)
+		return false;
+
+	statsEvent *event = &event_queue[head & (EVENT_QUEUE_SLOTS-1)];
+	event->hook = hook;
+	event->flags = flags;
+	event->id = id;
+	event->status = status;
+	event->have_addr = (addr != NULL);
+	if(addr != NULL)
+		event->addr = *addr;
+	// Take the response time stamp now, not when the event gets applied
+	gettimeofday(&event->stamp, 0);
+	event->name[0] = '\0';
+	if(name != NULL)
+	{
+		strncpy(event->name, name, sizeof(event->name)-1);
+		event->name[sizeof(event->name)-1] = '\0';
+	}
+	event->arg[0] = '\0';
+	if(arg != NULL)
+	{
+		strncpy(event->arg, arg, sizeof(event->arg)-1);
+		event->arg[sizeof(event->arg)-1] = '\0';
+	}
+
+	// Publish the event only after it has been fully written
+	__atomic_store_n(&event_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void *eventqueue_thread(void *val)
+{
+	// Set thread name
+	prctl(PR_SET_NAME, "event consumer", 0, 0, 0);
+	thread_set_background();
+
+	in_event_consumer = true;
+	event_producer = getpid();
+
+	while(!killed)
+	{
+		unsigned int head = __atomic_load_n(&event_head, __ATOMIC_ACQUIRE);
+		if(event_tail == head)
+		{
+			sleepms(5);
+			continue;
+		}
+
+		while(event_tail != head)
+		{
+			statsEvent *event = &event_queue[event_tail & (EVENT_QUEUE_SLOTS-1)];
+			struct all_addr *addr = event->have_addr ? &event->addr : NULL;
+			event_stamp = &event->stamp;
+			switch(event->hook)
+			{
+				case EVENT_FORWARDED:
+					_FTL_forwarded(event->flags, event->name, addr, event->id, "async", 0);
+					break;
+				case EVENT_CACHE:
+					_FTL_cache(event->flags, event->name, addr, event->arg, event->id, "async", 0);
+					break;
+				case EVENT_REPLY:
+					_FTL_reply(event->flags, event->name, addr, event->id, "async", 0);
+					break;
+				case EVENT_DNSSEC:
+					_FTL_dnssec(event->status, event->id, "async", 0);
+					break;
+				default:
+					logg("Invalid event hook: %i", event->hook);
+					break;
+			}
+			event_stamp = NULL;
+			// Free the slot only after the event has been applied
+			__atomic_store_n(&event_tail, event_tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
 void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
 {
+	HOOK_TIMER(HOOK_FORWARDED);
+
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
 		return;
 
+	// Defer to the event queue if asynchronous recording is active
+	if(enqueue_event(EVENT_FORWARDED, flags, name, addr, NULL, id, 0))
+		return;
+
 	// Save that this query got forwarded to an upstream server
 	lock_shm();
 
@@ -298,7 +627,7 @@ void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int i
 	int forwardID = findForwardID(forward, true);
 	queries[i].forwardID = forwardID;
 
-	unsigned int timeidx = queries[i].timeidx;
+	unsigned int timeidx = getOverTimeID(queries[i].timestamp);
 
 	if(queries[i].status == QUERY_CACHE)
 	{
@@ -327,7 +656,7 @@ void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int i
 		gettimeofday(&response, 0);
 		// Reset timer, shift slightly into the past to acknowledge the time
 		// FTLDNS needed to look up the CNAME in its cache
-		queries[i].response = converttimeval(response) - queries[i].response;
+		queries_cold[i].response = converttimeval(response) - queries_cold[i].response;
 	}
 	else
 	{
@@ -355,6 +684,34 @@ void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int i
 	unlock_shm();
 }
 
+// Fingerprints of the list files, used to detect which parts of a reload
+// actually changed so unchanged state (compiled regex automata, cached
+// verdicts, the Bloom filter) survives a gravity-only update
+typedef struct {
+	time_t mtime;
+	off_t size;
+} fileFingerprint;
+static fileFingerprint regexlist_fp = { 0, 0 }, whitelist_fp = { 0, 0 };
+static fileFingerprint gravity_fp = { 0, 0 }, blacklist_fp = { 0, 0 };
+
+// Returns true (and updates the fingerprint) when the file changed since
+// the last call
+static bool file_changed(const char *path, fileFingerprint *fingerprint)
+{
+	struct stat st;
+	if(path == NULL || stat(path, &st) != 0)
+	{
+		st.st_mtime = 0;
+		st.st_size = 0;
+	}
+
+	const bool changed = fingerprint->mtime != st.st_mtime ||
+	                     fingerprint->size != st.st_size;
+	fingerprint->mtime = st.st_mtime;
+	fingerprint->size = st.st_size;
+	return changed;
+}
+
 void FTL_dnsmasq_reload(void)
 {
 	// This function is called by the dnsmasq code on receive of SIGHUP
@@ -363,10 +720,23 @@ void FTL_dnsmasq_reload(void)
 
 	logg("Received SIGHUP, reloading cache");
 
+	// Determine which list files actually changed since the last reload
+	const bool regex_changed = file_changed(files.regexlist, &regexlist_fp) |
+	                           file_changed(files.whitelist, &whitelist_fp);
+	const bool lists_changed = file_changed(files.gravity, &gravity_fp) |
+	                           file_changed(files.blacklist, &blacklist_fp);
+
 	// Called when dnsmasq re-reads its config and hosts files
 	// Reset number of blocked domains
 	counters->gravity = 0;
 
+	// Reset the blocked-domain Bloom filter only when the blocking lists
+	// changed: for an unchanged set, FTL_listsfile() re-adds exactly the
+	// same domains and keeping the filter avoids a window in which the
+	// not-blocked fast path is unavailable
+	if(lists_changed)
+		bloom_clear();
+
 	// Inspect 01-pihole.conf to see if Pi-hole blocking is enabled,
 	// i.e. if /etc/pihole/gravity.list is sourced as addn-hosts file
 	check_blocking_status();
@@ -378,13 +748,25 @@ void FTL_dnsmasq_reload(void)
 	// its own behalf (on initial reading, the config file is already opened)
 	get_blocking_mode(NULL);
 
-	// Reread regex.list
-	free_regex();
-	read_regex_from_file();
+	// Reread regex.list, but only if it (or the whitelist) changed: an
+	// unchanged filter set keeps its compiled automata and -- more
+	// importantly -- the per-domain verdicts, so a gravity-only update
+	// no longer re-pays the entire regex matching cost as traffic arrives
+	if(regex_changed)
+	{
+		free_regex();
+		read_regex_from_file();
+	}
+	else
+		logg("Regex filters unchanged, keeping compiled set and cached verdicts");
 
 	// Reread pihole-FTL.conf to see which debugging flags are set
 	read_debuging_settings(NULL);
 
+	// Reread the runtime-tunable settings (intervals, thresholds, ...)
+	// so they can be changed without restarting FTL
+	read_runtime_settings(NULL);
+
 	// Print current set of capabilities if requested via debug flag
 	if(config.debug & DEBUG_CAPS)
 		check_capabilities();
@@ -392,10 +774,16 @@ void FTL_dnsmasq_reload(void)
 
 void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
 {
+	HOOK_TIMER(HOOK_REPLY);
+
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
 		return;
 
+	// Defer to the event queue if asynchronous recording is active
+	if(enqueue_event(EVENT_REPLY, flags, name, addr, NULL, id, 0))
+		return;
+
 	// Interpret hosts files that have been read by dnsmasq
 	lock_shm();
 	// Determine returned result if available
@@ -421,9 +809,13 @@ void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id,
 		print_flags(flags);
 	}
 
-	// Get response time
+	// Get response time. When this call applies a queued event, use the
+	// time stamp taken when the event was queued instead of "now"
 	struct timeval response;
-	gettimeofday(&response, 0);
+	if(event_stamp != NULL)
+		response = *event_stamp;
+	else
+		gettimeofday(&response, 0);
 
 	// Save status in corresponding query identified by dnsmasq's ID
 	int i = findQueryID(id);
@@ -454,7 +846,7 @@ void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id,
 		counters->unknown--;
 
 		// Get time index
-		unsigned int timeidx = queries[i].timeidx;
+		unsigned int timeidx = getOverTimeID(queries[i].timestamp);
 
 		if(strcmp(answer, "(NXDOMAIN)") == 0 ||
 		   strcmp(answer, "0.0.0.0") == 0 ||
@@ -466,6 +858,8 @@ void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id,
 
 			validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
 			domains[queries[i].domainID].blockedcount++;
+			updateTopDomains(true, queries[i].domainID);
+			appendBlockedQuery(i);
 
 			validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
 			clients[queries[i].clientID].blockedcount++;
@@ -629,7 +1023,7 @@ static void query_externally_blocked(int i, unsigned char status)
 		return;
 
 	// Get time index of this query
-	unsigned int timeidx = queries[i].timeidx;
+	unsigned int timeidx = getOverTimeID(queries[i].timestamp);
 
 	// Correct counters if necessary ...
 	if(queries[i].status == QUERY_FORWARDED)
@@ -644,6 +1038,8 @@ static void query_externally_blocked(int i, unsigned char status)
 	overTime[timeidx].blocked++;
 	validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
 	domains[queries[i].domainID].blockedcount++;
+	updateTopDomains(true, queries[i].domainID);
+	appendBlockedQuery(i);
 	validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
 	clients[queries[i].clientID].blockedcount++;
 
@@ -653,10 +1049,16 @@ static void query_externally_blocked(int i, unsigned char status)
 
 void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg, int id, const char* file, const int line)
 {
+	HOOK_TIMER(HOOK_CACHE);
+
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
 		return;
 
+	// Defer to the event queue if asynchronous recording is active
+	if(enqueue_event(EVENT_CACHE, flags, name, addr, arg, id, 0))
+		return;
+
 	// Save that this query got answered from cache
 	lock_shm();
 	char dest[ADDRSTRLEN]; dest[0] = '\0';
@@ -686,9 +1088,13 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 		print_flags(flags);
 	}
 
-	// Get response time
+	// Get response time. When this call applies a queued event, use the
+	// time stamp taken when the event was queued instead of "now"
 	struct timeval response;
-	gettimeofday(&response, 0);
+	if(event_stamp != NULL)
+		response = *event_stamp;
+	else
+		gettimeofday(&response, 0);
 
 	if(((flags & F_HOSTS) && (flags & F_IMMORTAL)) ||
 	   ((flags & F_NAMEP) && (flags & F_DHCP)) ||
@@ -742,7 +1148,7 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 		counters->unknown--;
 
 		// Get time index
-		unsigned int timeidx = queries[i].timeidx;
+		unsigned int timeidx = getOverTimeID(queries[i].timestamp);
 
 		int domainID = queries[i].domainID;
 		validate_access("domains", domainID, true, __LINE__, __FUNCTION__, __FILE__);
@@ -771,6 +1177,8 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 				counters->blocked++;
 				overTime[timeidx].blocked++;
 				domains[domainID].blockedcount++;
+				updateTopDomains(true, domainID);
+				appendBlockedQuery(i);
 				clients[clientID].blockedcount++;
 				break;
 			case QUERY_CACHE: // cached from one of the lists
@@ -801,10 +1209,16 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 
 void _FTL_dnssec(int status, int id, const char* file, const int line)
 {
+	HOOK_TIMER(HOOK_DNSSEC);
+
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
 		return;
 
+	// Defer to the event queue if asynchronous recording is active
+	if(enqueue_event(EVENT_DNSSEC, 0, NULL, NULL, NULL, id, status))
+		return;
+
 	// Process DNSSEC result for a domain
 	lock_shm();
 	// Search for corresponding query identified by ID
@@ -826,11 +1240,11 @@ void _FTL_dnssec(int status, int id, const char* file, const int line)
 
 	// Iterate through possible values
 	if(status == STAT_SECURE)
-		queries[i].dnssec = DNSSEC_SECURE;
+		queries_cold[i].dnssec = DNSSEC_SECURE;
 	else if(status == STAT_INSECURE)
-		queries[i].dnssec = DNSSEC_INSECURE;
+		queries_cold[i].dnssec = DNSSEC_INSECURE;
 	else
-		queries[i].dnssec = DNSSEC_BOGUS;
+		queries_cold[i].dnssec = DNSSEC_BOGUS;
 
 	unlock_shm();
 }
@@ -1005,16 +1419,40 @@ void save_reply_type(unsigned int flags, int queryID, struct timeval response)
 	}
 
 	// Save response time (relative time)
-	queries[queryID].response = converttimeval(response) -
-	                            queries[queryID].response;
+	queries_cold[queryID].response = converttimeval(response) -
+	                            queries_cold[queryID].response;
+
+	// Histogram bucket of this response time (log scale, 0.1 ms units)
+	unsigned long respbucket_value = queries_cold[queryID].response;
+	unsigned int respbucket = 0;
+	while(respbucket_value > 1 && respbucket < RESPONSE_BUCKETS-1)
+	{
+		respbucket_value >>= 1;
+		respbucket++;
+	}
+	counters->response_histogram[respbucket]++;
+
+	// Feed the measured latency into the per-upstream averages used for
+	// latency-aware upstream selection. Successful replies also decay
+	// the failure average
+	if(queries[queryID].status == QUERY_FORWARDED && queries[queryID].forwardID > -1)
+	{
+		validate_access("forwarded", queries[queryID].forwardID, true, __LINE__, __FUNCTION__, __FILE__);
+		forwardedDataStruct *fwd = &forwarded[queries[queryID].forwardID];
+		const float latency = queries_cold[queryID].response / 10.0f; // [ms]
+		if(fwd->latency_ewma > 0.0f)
+			fwd->latency_ewma += 0.1f*(latency - fwd->latency_ewma);
+		else
+			fwd->latency_ewma = latency;
+		fwd->failure_ewma *= 0.9f;
+		fwd->latency_histogram[respbucket]++;
+	}
 }
 
-pthread_t telnet_listenthreadv4;
-pthread_t telnet_listenthreadv6;
 pthread_t socket_listenthread;
-pthread_t DBthread;
-pthread_t GCthread;
+pthread_t schedulerthread;
 pthread_t DNSclientthread;
+pthread_t eventqueuethread;
 
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 {
@@ -1034,47 +1472,48 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	// Bind to sockets
 	bind_sockets();
 
-	// Start TELNET IPv4 thread
-	if(ipv4telnet && pthread_create( &telnet_listenthreadv4, &attr, telnet_listening_thread_IPv4, NULL ) != 0)
+	// Start API thread: a single epoll event loop serves the telnet and
+	// Unix socket listeners as well as all accepted connections
+	if(pthread_create( &socket_listenthread, &attr, api_listening_thread, NULL ) != 0)
 	{
-		logg("Unable to open IPv4 telnet listening thread. Exiting...");
+		logg("Unable to open API listening thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
-	// Start TELNET IPv6 thread
-	if(ipv6telnet &&  pthread_create( &telnet_listenthreadv6, &attr, telnet_listening_thread_IPv6, NULL ) != 0)
+	// Start the scheduler thread running all periodic background jobs
+	// (database maintenance, garbage collection) on one timer wheel
+	if(pthread_create( &schedulerthread, &attr, scheduler_thread, NULL ) != 0)
 	{
-		logg("Unable to open IPv6 telnet listening thread. Exiting...");
+		logg("Unable to open scheduler thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
-	// Start SOCKET thread
-	if(pthread_create( &socket_listenthread, &attr, socket_listening_thread, NULL ) != 0)
+	// Start thread that will stay in the background until host names needs to be resolved
+	if(pthread_create( &DNSclientthread, &attr, DNSclient_thread, NULL ) != 0)
 	{
-		logg("Unable to open Unix socket listening thread. Exiting...");
+		logg("Unable to open DNS client thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
-	// Start database thread if database is used
-	if(database && pthread_create( &DBthread, &attr, DB_thread, NULL ) != 0)
+	// Start the log writer thread draining the asynchronous log ring
+	pthread_t logwriterthread;
+	if(pthread_create( &logwriterthread, &attr, logwriter_thread, NULL ) != 0)
 	{
-		logg("Unable to open database thread. Exiting...");
+		logg("Unable to open log writer thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
-	// Start thread that will stay in the background until garbage collection needs to be done
-	if(pthread_create( &GCthread, &attr, GC_thread, NULL ) != 0)
+	// Start the stats event consumer thread if asynchronous recording is enabled
+	if(config.asyncstats && pthread_create( &eventqueuethread, &attr, eventqueue_thread, NULL ) != 0)
 	{
-		logg("Unable to open GC thread. Exiting...");
+		logg("Unable to open event consumer thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
-	// Start thread that will stay in the background until host names needs to be resolved
-	if(pthread_create( &DNSclientthread, &attr, DNSclient_thread, NULL ) != 0)
-	{
-		logg("Unable to open DNS client thread. Exiting...");
-		exit(EXIT_FAILURE);
-	}
+	// Pin the dnsmasq main thread to its dedicated core (if configured).
+	// Done after all service threads were created so only this thread is
+	// affected by the restricted affinity
+	main_thread_affinity();
 
 	// Chown files if FTL started as user root but a dnsmasq config option
 	// states to run as a different user/group (e.g. "nobody")
@@ -1088,12 +1527,21 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 }
 
 // int cache_inserted, cache_live_freed are defined in dnsmasq/cache.c
+// Hit/miss counters of the DNSSEC verification cache in dnsmasq/dnssec.c
+// (the Makefile always builds the dnsmasq part with HAVE_DNSSEC)
+extern unsigned int dnssec_verify_hits, dnssec_verify_misses;
 void getCacheInformation(int *sock)
 {
 	ssend(*sock,"cache-size: %i\ncache-live-freed: %i\ncache-inserted: %i\n",
 	            daemon->cachesize,
 	            daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED],
 	            daemon->metrics[METRIC_DNS_CACHE_INSERTED]);
+	ssend(*sock,"dnssec-verify-hits: %u\ndnssec-verify-misses: %u\n",
+	            dnssec_verify_hits, dnssec_verify_misses);
+	// Hit/miss view derived from FTL's own counters: cache answers vs.
+	// queries that had to be forwarded upstream
+	ssend(*sock,"cache-hits: %i\ncache-misses: %i\n",
+	            counters->cached, counters->forwardedqueries);
 	// cache-size is obvious
 	// It means the resolver handled <cache-inserted> names lookups that needed to be sent to
 	// upstream severes and that <cache-live-freed> was thrown out of the cache
@@ -1126,12 +1574,192 @@ void _FTL_forwarding_failed(struct server *server, const char* file, const int l
 	if(config.debug & DEBUG_QUERIES) logg("**** forwarding to %s (ID %i, %s:%i) failed", dest, forwardID, file, line);
 
 	forwarded[forwardID].failed++;
+	// Move the failure average towards one
+	forwarded[forwardID].failure_ewma += 0.1f*(1.0f - forwarded[forwardID].failure_ewma);
 
 	free(forward);
 	unlock_shm();
 	return;
 }
 
+// Retract the most recently recorded query (identified by its dnsmasq id):
+// used when the inline TCP fast path recorded a query but cannot answer it
+// locally, so the forking path -- which records it again -- takes over
+void FTL_retract_query(int id)
+{
+	lock_shm();
+	const int i = counters->queries_start + counters->queries - 1;
+	if(counters->queries > 0 && queries[i].id == id &&
+	   queries[i].status == QUERY_UNKNOWN)
+	{
+		counters->unknown--;
+		if(queries[i].type >= TYPE_A && queries[i].type < TYPE_MAX)
+		{
+			counters->querytype[queries[i].type-1]--;
+			overTime[getOverTimeID(queries[i].timestamp)].querytypedata[queries[i].type-1]--;
+		}
+		const unsigned int timeidx = getOverTimeID(queries[i].timestamp);
+		overTime[timeidx].total--;
+		addClientOverTime(queries[i].clientID, timeidx, -1);
+		clients[queries[i].clientID].count--;
+		domains[queries[i].domainID].count--;
+		// Unwind what catchupQueryIndexes() recorded for this query
+		retractQueryIndex(i);
+		memset(&queries[i], 0, sizeof(*queries));
+		memset(&queries_cold[i], 0, sizeof(*queries_cold));
+		counters->queries--;
+	}
+	unlock_shm();
+}
+
+// Deliver the port the embedded dnsmasq listens on. Used by the resolver
+// thread to direct its PTR lookups at our own cache instead of whatever the
+// system resolver configuration points at
+unsigned short __attribute__((pure)) FTL_dnsmasq_port(void)
+{
+	return daemon->port;
+}
+
+// ==================== blocked-response templates ====================
+// Blocked A/AAAA replies differ only in the (compressed) question name and
+// the DNS ID, so everything after the name pointer -- type, class, TTL,
+// RDLENGTH and the blocking address -- is precomputed once per blocking
+// mode and appended to answers with a single memcpy.
+static unsigned char blocked_template_v4[14];
+static unsigned char blocked_template_v6[26];
+static bool blocked_template_v4_valid = false;
+static bool blocked_template_v6_valid = false;
+static struct all_addr blocked_addr4, blocked_addr6;
+
+static void build_blocked_template(unsigned char *template, unsigned short rrtype,
+                                   unsigned long ttl, const unsigned char *rdata,
+                                   unsigned short rdlen)
+{
+	template[0] = rrtype >> 8;
+	template[1] = rrtype & 0xff;
+	template[2] = 0; template[3] = 1; // class IN
+	template[4] = (ttl >> 24) & 0xff;
+	template[5] = (ttl >> 16) & 0xff;
+	template[6] = (ttl >> 8) & 0xff;
+	template[7] = ttl & 0xff;
+	template[8] = rdlen >> 8;
+	template[9] = rdlen & 0xff;
+	memcpy(&template[10], rdata, rdlen);
+}
+
+// Called from prepare_blocking_mode() once the blocking addresses are known
+void FTL_prepare_blocked_templates(struct all_addr *addr4, int has_IPv4,
+                                   struct all_addr *addr6, int has_IPv6)
+{
+	blocked_template_v4_valid = has_IPv4;
+	blocked_template_v6_valid = has_IPv6;
+	if(has_IPv4)
+	{
+		blocked_addr4 = *addr4;
+		build_blocked_template(blocked_template_v4, 1, daemon->local_ttl,
+		                       (unsigned char*)addr4, 4);
+	}
+	if(has_IPv6)
+	{
+		blocked_addr6 = *addr6;
+		build_blocked_template(blocked_template_v6, 28, daemon->local_ttl,
+		                       (unsigned char*)addr6, 16);
+	}
+}
+
+// Append a blocked answer from the precomputed template. Returns the number
+// of bytes written (0 when no template applies and the generic record
+// assembly has to be used)
+size_t FTL_append_blocked_answer(unsigned char *pos, unsigned char *limit,
+                                 int nameoffset, unsigned short rrtype,
+                                 const struct all_addr *addr)
+{
+	const unsigned char *template;
+	size_t templatelen;
+
+	// Only applies to the configured blocking addresses with local TTL
+	if(rrtype == 1 && blocked_template_v4_valid &&
+	   memcmp(addr, &blocked_addr4, 4) == 0)
+	{
+		template = blocked_template_v4;
+		templatelen = sizeof(blocked_template_v4);
+	}
+	else if(rrtype == 28 && blocked_template_v6_valid &&
+	        memcmp(addr, &blocked_addr6, 16) == 0)
+	{
+		template = blocked_template_v6;
+		templatelen = sizeof(blocked_template_v6);
+	}
+	else
+		return 0;
+
+	if(limit != NULL && pos + 2 + templatelen > limit)
+		return 0;
+
+	// Compressed pointer to the question name followed by the template
+	pos[0] = 0xc0 | ((nameoffset >> 8) & 0x3f);
+	pos[1] = nameoffset & 0xff;
+	memcpy(&pos[2], template, templatelen);
+	return 2 + templatelen;
+}
+
+// Called by dnsmasq right after it determined its upstream server candidate.
+// In FASTEST_UPSTREAM mode we overrule the choice with the server that has
+// the best measured latency/failure record, while every 16th query keeps
+// dnsmasq's pick to keep probing the other upstreams at a low rate
+struct server *FTL_select_server(struct server *start, time_t now)
+{
+	if(!config.fastestupstream || start == NULL)
+		return start;
+
+	// Let every 16th query through unchanged to probe the other servers
+	static unsigned int probe_counter = 0;
+	if(++probe_counter % 16 == 0)
+		return start;
+
+	struct server *best = start;
+	float bestscore = -1.0f;
+
+	lock_shm_read();
+	for(struct server *serv = daemon->servers; serv != NULL; serv = serv->next)
+	{
+		// Skip special server entries (domain-specific, local-only, ...)
+		if(serv->flags & (SERV_LITERAL_ADDRESS | SERV_HAS_DOMAIN | SERV_FOR_NODOTS | SERV_NO_ADDR))
+			continue;
+
+		// Get IP address of this server
+		char dest[ADDRSTRLEN];
+		if(serv->addr.sa.sa_family == AF_INET)
+			inet_ntop(AF_INET, &serv->addr.in.sin_addr, dest, ADDRSTRLEN);
+		else
+			inet_ntop(AF_INET6, &serv->addr.in6.sin6_addr, dest, ADDRSTRLEN);
+		strtolower(dest);
+
+		const int forwardID = findHashID(FORWARDED, dest);
+		if(forwardID < 0)
+		{
+			// No measurement for this server so far: leave probing
+			// it to dnsmasq's own periodic all-servers retest and
+			// to the every-16th pass-through above. Preferring an
+			// unmeasured server here could pin us to a dead one
+			// that never delivers a measurement
+			continue;
+		}
+
+		// Penalize servers with a bad failure record
+		const float score = forwarded[forwardID].latency_ewma *
+		                    (1.0f + 10.0f*forwarded[forwardID].failure_ewma);
+		if(bestscore < 0.0f || score < bestscore)
+		{
+			best = serv;
+			bestscore = score;
+		}
+	}
+	unlock_shm();
+
+	return best;
+}
+
 static unsigned long __attribute__((const)) converttimeval(struct timeval time)
 {
 	// Convert time from struct timeval into units
@@ -1258,6 +1886,9 @@ static void block_single_domain_regex(char *domain)
 
 	// Get IPv4/v6 addresses for blocking depending on user configures blocking mode
 	prepare_blocking_mode(&addr4, &addr6, &has_IPv4, &has_IPv6);
+
+	// Precompute the wire-format answer templates for this blocking mode
+	FTL_prepare_blocked_templates(&addr4, has_IPv4, &addr6, has_IPv6);
 	regexlistname = files.regexlist;
 	add_blocked_domain(&addr4, &addr6, has_IPv4, has_IPv6, domain, strlen(domain), NULL, 0, SRC_REGEX);
 
@@ -1287,6 +1918,9 @@ int FTL_listsfile(char* filename, unsigned int index, FILE *f, int cache_size, s
 	// Get IPv4/v6 addresses for blocking depending on user configured blocking mode
 	prepare_blocking_mode(&addr4, &addr6, &has_IPv4, &has_IPv6);
 
+	// Precompute the wire-format answer templates for this blocking mode
+	FTL_prepare_blocked_templates(&addr4, has_IPv4, &addr6, has_IPv6);
+
 	// If we have neither a valid IPv4 nor a valid IPv6 but the user asked for
 	// blocking modes MODE_IP or MODE_IP_NODATA_AAAA then we cannot add any entries here
 	if(!has_IPv4 && !has_IPv6)
@@ -1344,6 +1978,9 @@ int FTL_listsfile(char* filename, unsigned int index, FILE *f, int cache_size, s
 		// Add domain
 		name_count += add_blocked_domain(&addr4, &addr6, has_IPv4, has_IPv6, domain, len, rhash, hashsz, index);
 
+		// Remember the domain in the blocked-domain Bloom filter
+		bloom_add(domain);
+
 		// Count added domain
 		added++;
 	}
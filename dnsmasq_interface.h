@@ -11,8 +11,10 @@ extern int socketfd, telnetfd4, telnetfd6;
 extern unsigned char* pihole_privacylevel;
 enum { TCP, UDP };
 
+// Returns zero when the client exceeded its rate limit and the query has to
+// be answered REFUSED locally, nonzero otherwise
 #define FTL_new_query(flags, name, addr, types, id, type) _FTL_new_query(flags, name, addr, types, id, type, __FILE__, __LINE__)
-void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line);
+int _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line);
 
 #define FTL_forwarded(flags, name, addr, id) _FTL_forwarded(flags, name, addr, id, __FILE__, __LINE__)
 void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int id, const char* file, const int line);
@@ -32,6 +34,16 @@ void _FTL_header_analysis(unsigned char header4, unsigned int rcode, int id, con
 #define FTL_forwarding_failed(server) _FTL_forwarding_failed(server, __FILE__, __LINE__)
 void _FTL_forwarding_failed(struct server *server, const char* file, const int line);
 
+struct server *FTL_select_server(struct server *start, time_t now);
+
+void FTL_retract_query(int id);
+
+void FTL_prepare_blocked_templates(struct all_addr *addr4, int has_IPv4,
+                                   struct all_addr *addr6, int has_IPv6);
+size_t FTL_append_blocked_answer(unsigned char *pos, unsigned char *limit,
+                                 int nameoffset, unsigned short rrtype,
+                                 const struct all_addr *addr);
+
 #define FTL_upstream_error(rcode, id) _FTL_upstream_error(rcode, id, __FILE__, __LINE__)
 void _FTL_upstream_error(unsigned int rcode, int id, const char* file, const int line);
 
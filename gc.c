@@ -14,15 +14,21 @@
 bool doGC = false;
 
 time_t lastGCrun = 0;
-void *GC_thread(void *val)
+
+// One garbage collection check, invoked periodically by the scheduler
+// thread. Runs the sliced collection when the GC interval expired
+void GC_tick(void)
 {
-	// Set thread name
-	prctl(PR_SET_NAME,"housekeeper",0,0,0);
+	// The prefix-advance below relies on the ascending-timestamp order of
+	// the ring, which the background import temporarily violates: defer
+	// collection until its final sort restored the invariant
+	if(queries_unsorted)
+		return;
+
+	// Do not garbage collect immediately after startup
+	if(lastGCrun == 0)
+		lastGCrun = time(NULL) - time(NULL)%GCinterval;
 
-	// Save timestamp as we do not want to store immediately
-	// to the database
-	lastGCrun = time(NULL) - time(NULL)%GCinterval;
-	while(!killed)
 	{
 		if(time(NULL) - GCdelay - lastGCrun >= GCinterval || doGC)
 		{
@@ -30,10 +36,6 @@ void *GC_thread(void *val)
 			// Update lastGCrun timer
 			lastGCrun = time(NULL) - GCdelay - (time(NULL) - GCdelay)%GCinterval;
 
-			// Lock FTL's data structure, since it is likely that it will be changed here
-			// Requests should not be processed/answered when data is about to change
-			lock_shm();
-
 			// Get minimum time stamp to keep
 			time_t mintime = (time(NULL) - GCdelay) - MAXLOGAGE*3600;
 
@@ -48,12 +50,32 @@ void *GC_thread(void *val)
 			int removed = 0;
 			if(config.debug & DEBUG_GC) logg("GC starting, mintime: %lu %s", mintime, ctime(&mintime));
 
-			// Process all queries
-			for(i=0; i < counters->queries; i++)
+			// Process the expired queries in bounded slices. The lock is
+			// released between two slices so that query processing and API
+			// requests are never blocked for the duration of a full GC run
+			bool finished = false;
+			while(!finished && !killed)
+			{
+
+			// Lock FTL's data structure, since it is likely that it will be changed here
+			// Requests should not be processed/answered when data is about to change
+			lock_shm();
+
+			int sliced = 0;
+
+			// Process expired queries, starting at the ring head
+			for(i=counters->queries_start; i < counters->queries_start + counters->queries; i++)
 			{
 				validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 				// Test if this query is too new
 				if(queries[i].timestamp > mintime)
+				{
+					finished = true;
+					break;
+				}
+
+				// Test if this slice has reached its size limit
+				if(config.GCbatchsize > 0 && sliced >= config.GCbatchsize)
 					break;
 
 				// Adjust client counter
@@ -62,10 +84,10 @@ void *GC_thread(void *val)
 				clients[clientID].count--;
 
 				// Adjust total counters and total over time data
-				int timeidx = queries[i].timeidx;
+				int timeidx = getOverTimeID(queries[i].timestamp);
 				overTime[timeidx].total--;
 				// Adjust corresponding overTime counters
-				clients[clientID].overTime[timeidx]--;
+				addClientOverTime(clientID, timeidx, -1);
 
 				// Adjust domain counter (no overTime information)
 				int domainID = queries[i].domainID;
@@ -79,6 +101,10 @@ void *GC_thread(void *val)
 						// Unknown (?)
 						counters->unknown--;
 						break;
+					case QUERY_REFUSED_RATELIMIT:
+						// Refused due to rate limiting
+						counters->ratelimited--;
+						break;
 					case QUERY_FORWARDED:
 						// Forwarded to an upstream DNS server
 						counters->forwardedqueries--;
@@ -141,42 +167,79 @@ void *GC_thread(void *val)
 					overTime[timeidx].querytypedata[queries[i].type-1]--;
 				}
 
-				// Count removed queries
-				removed++;
+				// Count queries removed in this slice
+				sliced++;
 
 			}
 
-			// Move memory forward to keep only what we want
-			// Note: for overlapping memory blocks, memmove() is a safer approach than memcpy()
+			// We are done once the scan reached the end of the valid region
+			// without hitting the slice size limit first
+			if(i >= counters->queries_start + counters->queries)
+				finished = true;
+
+			// Advance the ring head past the expired queries instead of
+			// compacting the array. The indices of all remaining queries
+			// (and hence lastdbindex) stay valid, the expired region is
+			// reclaimed by memory_check() before the array has to grow.
 			// Example: (I = now invalid, X = still valid queries, F = free space)
 			//   Before: IIIIIIXXXXFF
-			//   After:  XXXXFFFFFFFF
-			memmove(&queries[0], &queries[removed], (counters->queries - removed)*sizeof(*queries));
+			//   After:  FFFFFFXXXXFF
+			memset(&queries[counters->queries_start], 0, sliced*sizeof(*queries));
+			memset(&queries_cold[counters->queries_start], 0, sliced*sizeof(*queries_cold));
+			counters->queries_start += sliced;
 
 			// Update queries counter
-			counters->queries -= removed;
-			// Update DB index as total number of queries reduced
-			lastdbindex -= removed;
-
-			// Zero out remaining memory (marked as "F" in the above example)
-			memset(&queries[counters->queries], 0, (counters->queries_MAX - counters->queries)*sizeof(*queries));
-
-			// Determine if overTime memory needs to get moved
-			moveOverTimeMemory(mintime);
+			counters->queries -= sliced;
+			removed += sliced;
 
-			if(config.debug & DEBUG_GC) logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
+			if(finished)
+			{
+				// Determine if overTime memory needs to get moved
+				moveOverTimeMemory(mintime);
+
+				// Rebuild the hash indexes to ensure they are consistent
+				// with the (possibly modified) content of the underlying arrays
+				rebuildHashIndex(DOMAINS);
+				rebuildHashIndex(CLIENTS);
+				rebuildHashIndex(FORWARDED);
+
+				// The decremented counters may have changed the top
+				// domains ranking, rebuild the candidate sets
+				rebuildTopDomains();
+
+				// Absorb queries recorded by fork()ed TCP workers,
+				// then drop expired queries from the inverted indexes
+				catchupQueryIndexes();
+				pruneQueryIndexes();
+
+				// Return spare segment capacity to the system
+				memory_shrink();
+
+				// Decay the unsampled aggregate proportionally to
+				// the share of recorded queries that just expired
+				// (their timestamps are not known individually)
+				if(counters->unsampled > 0 && removed > 0)
+					counters->unsampled -= (int)((long long)counters->unsampled *
+					                             removed / (removed + counters->queries + 1));
+
+				if(config.debug & DEBUG_GC) logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
+			}
 
 			// Release thread lock
 			unlock_shm();
 
+			// Give other threads a chance to take the lock before
+			// processing the next slice
+			if(!finished)
+				sleepms(5);
+
+			}
+
 			// After storing data in the database for the next time,
 			// we should scan for old entries, which will then be deleted
 			// to free up pages in the database and prevent it from growing
 			// ever larger and larger
 			DBdeleteoldqueries = true;
 		}
-		sleepms(100);
 	}
-
-	return NULL;
 }
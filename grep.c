@@ -9,96 +9,150 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+// mmap()-based file scanning
+#include <sys/mman.h>
+// open() and O_RDONLY
+#include <fcntl.h>
 
 char ** wildcarddomains = NULL;
 unsigned char blockingstatus = 2;
 
-int countlines(const char* fname)
+// Map an entire file read-only. Returns NULL for missing or empty files
+static const char *map_file(const char *fname, size_t *size)
 {
-	FILE *fp;
-	int ch = 0, lines = 0, chars = 0;
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0)
+		return NULL;
 
-	if((fp = fopen(fname, "r")) == NULL) {
-		return -1;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
 	}
 
-	while ((ch = fgetc(fp)) != EOF)
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return map;
+}
+
+// Cached line count of the most recently counted files, keyed on the file's
+// identity and its mtime/size, so repeated countlines() calls against an
+// unchanged gravity-scale list are free
+#define COUNTLINES_CACHE_SLOTS 8
+typedef struct {
+	char *fname;
+	time_t mtime;
+	off_t size;
+	int lines;
+} countCacheEntry;
+static countCacheEntry count_cache[COUNTLINES_CACHE_SLOTS] = { { NULL, 0, 0, 0 } };
+
+int countlines(const char* fname)
+{
+	struct stat st;
+	if(stat(fname, &st) != 0)
+		return -1;
+
+	// Serve from the cache if the file is unchanged
+	countCacheEntry *entry = NULL;
+	for(unsigned int i = 0; i < COUNTLINES_CACHE_SLOTS; i++)
 	{
-		chars++;
-		if (ch=='\n')
+		if(count_cache[i].fname != NULL && strcmp(count_cache[i].fname, fname) == 0)
+		{
+			entry = &count_cache[i];
+			if(entry->mtime == st.st_mtime && entry->size == st.st_size)
+				return entry->lines;
+			break;
+		}
+		if(count_cache[i].fname == NULL)
 		{
-			// Add one to the lines counter
-			++lines;
-			// Reset chars counter
-			chars = 0;
+			entry = &count_cache[i];
+			break;
 		}
 	}
 
+	size_t size = 0;
+	const char *map = map_file(fname, &size);
+	if(map == NULL)
+		// stat() above succeeded, so this is an (existing) empty file
+		return 0;
+
+	// Count newlines with memchr(), which libc vectorizes
+	int lines = 0;
+	const char *pos = map;
+	const char *end = map + size;
+	while(pos < end && (pos = memchr(pos, '\n', end - pos)) != NULL)
+	{
+		lines++;
+		pos++;
+	}
+
 	// Add one more line if there were characters at the
 	// last line of the file even without a final "\n"
-	if(chars > 0)
-		++lines;
+	if(size > 0 && map[size-1] != '\n')
+		lines++;
 
-	// Close the file
-	fclose(fp);
+	munmap((void*)map, size);
+
+	// Remember the result
+	if(entry != NULL)
+	{
+		if(entry->fname == NULL)
+			entry->fname = strdup(fname);
+		entry->mtime = st.st_mtime;
+		entry->size = st.st_size;
+		entry->lines = lines;
+	}
 
 	return lines;
 }
 
 int countlineswith(const char* str, const char* fname)
 {
-	FILE *fp;
-	int found = 0;
-	char *buffer = NULL;
-	size_t size = 0;
-
-	if((fp = fopen(fname, "r")) == NULL) {
-		return -1;
+	size_t mapsize = 0;
+	const char *map = map_file(fname, &mapsize);
+	if(map == NULL)
+	{
+		// Distinguish missing from empty files like the old code did
+		struct stat st;
+		return stat(fname, &st) == 0 ? 0 : -1;
 	}
 
-	// Search through file
-	// getline reads a string from the specified file up to either a
-	// newline character or EOF
-	while(getline(&buffer, &size, fp) != -1)
+	int found = 0;
+	const char *pos = map;
+	const char *end = map + mapsize;
+	const size_t len = strlen(str);
+	while(pos < end)
 	{
-		// Strip potential newline character at the end of line we just read
-		if(buffer[strlen(buffer)-1] == '\n')
-			buffer[strlen(buffer)-1] = '\0';
-
+		const char *eol = memchr(pos, '\n', end - pos);
+		const size_t linelen = (eol != NULL ? (size_t)(eol - pos) : (size_t)(end - pos));
+		const char *line = pos;
+		pos += linelen + 1;
+		{
 		// Search for exact match
-		if(strcmp(buffer, str) == 0)
+		if(linelen == len && memcmp(line, str, len) == 0)
 		{
 			found++;
 			continue;
 		}
 
-		// If line starts with *, search for partial match of
-		// needle "buffer+1" in haystack "str"
-		if(buffer[0] == '*')
-		{
-			char * buf = strstr(str, buffer+1);
-			// The  strstr() function finds the first occurrence of
-			// the substring buffer+1 in the string str.
-			// These functions return a pointer to the beginning of
-			// the located substring, or NULL if the substring is not
-			// found. Hence, we compare the length of the substring to
-			// the wildcard entry to rule out the possiblity that
-			// there is anything behind the wildcard. This avoids that given
-			// "*example.com" "example.com.xxxxx" would also match.
-			if(buf != NULL && strlen(buf) == strlen(buffer+1))
-				found++;
+		// If line starts with *, the wildcard entry matches when it is
+		// a suffix of str. We compare the lengths to rule out that
+		// there is anything behind the wildcard: given "*example.com",
+		// "example.com.xxxxx" must not match
+		if(linelen > 1 && line[0] == '*' &&
+		   linelen - 1 <= len &&
+		   memcmp(str + len - (linelen - 1), line + 1, linelen - 1) == 0)
+			found++;
 		}
 	}
 
-	// Free allocated memory
-	if(buffer != NULL)
-	{
-		free(buffer);
-		buffer = NULL;
-	}
-
-	// Close the file
-	fclose(fp);
+	munmap((void*)map, mapsize);
 
 	return found;
 }
@@ -61,6 +61,104 @@ static void get_timestr(char *timestring)
 	sprintf(timestring,"%d-%02d-%02d %02d:%02d:%02d.%03i", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, millisec);
 }
 
+// Ring buffer of fully formatted log lines: logg() only formats into the
+// ring and returns, the writer thread drains the ring with batched file
+// writes so logging never adds file-I/O latency to the calling thread
+// (which includes dnsmasq's packet-processing path)
+#define LOGRING_SLOTS 256
+#define LOGRING_LINELEN 1024
+static char logring[LOGRING_SLOTS][LOGRING_LINELEN];
+static unsigned int log_head = 0, log_tail = 0; // guarded by "lock"
+static unsigned int log_dropped = 0;
+static pthread_cond_t logcond = PTHREAD_COND_INITIALIZER;
+static bool logwriter_running = false;
+
+// Write one batch of lines to the log file (and stdout when not daemonized).
+// Called with the lines already copied out of the ring, i.e. without "lock"
+static void write_log_batch(char (*lines)[LOGRING_LINELEN], unsigned int count)
+{
+	// Open log file (re-opened per batch so log rotation keeps working)
+	open_FTL_log(false);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(!daemonmode)
+		{
+			fputs(lines[i], stdout);
+			fputc('\n', stdout);
+		}
+
+		if(logfile != NULL)
+		{
+			fputs(lines[i], logfile);
+			fputc('\n', logfile);
+		}
+		else if(!daemonmode)
+		{
+			printf("!!! WARNING: Writing to FTL\'s log file failed!\n");
+			syslog(LOG_ERR, "Writing to FTL\'s log file failed!");
+		}
+	}
+
+	// Close log file
+	close_FTL_log();
+}
+
+// Drain the ring. Called with "lock" held, which is dropped for the file I/O
+static void drain_log_ring(void)
+{
+	static char batch[LOGRING_SLOTS][LOGRING_LINELEN];
+	unsigned int count = 0;
+	while(log_tail != log_head && count < LOGRING_SLOTS)
+	{
+		memcpy(batch[count++], logring[log_tail % LOGRING_SLOTS], LOGRING_LINELEN);
+		log_tail++;
+	}
+	if(log_dropped > 0 && count < LOGRING_SLOTS)
+	{
+		// Report the storm as an extra line rather than overwriting the
+		// most recently drained one. When the batch is already full the
+		// counter is simply carried over to the next drain
+		snprintf(batch[count++], LOGRING_LINELEN,
+		         "WARNING: %u log lines were dropped during a log storm", log_dropped);
+		log_dropped = 0;
+	}
+
+	if(count == 0)
+		return;
+
+	pthread_mutex_unlock(&lock);
+	write_log_batch(batch, count);
+	pthread_mutex_lock(&lock);
+}
+
+// Dedicated log writer: sleeps until lines are queued and drains them in
+// batches
+void *logwriter_thread(void *val)
+{
+	prctl(PR_SET_NAME, "log writer", 0, 0, 0);
+	thread_set_background();
+
+	pthread_mutex_lock(&lock);
+	logwriter_running = true;
+	while(!killed)
+	{
+		if(log_tail == log_head)
+		{
+			// Wake up at least once per second to notice shutdown
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += 1;
+			pthread_cond_timedwait(&logcond, &lock, &until);
+		}
+		drain_log_ring();
+	}
+	logwriter_running = false;
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
 void __attribute__ ((format (gnu_printf, 1, 2))) logg(const char *format, ...)
 {
 	char timestring[84] = "";
@@ -74,37 +172,35 @@ void __attribute__ ((format (gnu_printf, 1, 2))) logg(const char *format, ...)
 	// pihole-FTL instance is logging into the same file
 	long pid = (long)getpid();
 
-	// Print to stdout before writing to file
-	if(!daemonmode)
+	// Format the complete line into the ring
+	if(log_head - log_tail >= LOGRING_SLOTS)
 	{
-		printf("[%s %ld] ", timestring, pid);
+		// Ring full (log storm): drop this line, the writer reports
+		// the number of dropped lines once it catches up
+		log_dropped++;
+	}
+	else
+	{
+		char *line = logring[log_head % LOGRING_SLOTS];
+		int offset = snprintf(line, LOGRING_LINELEN, "[%s %ld] ", timestring, pid);
 		va_start(args, format);
-		vprintf(format, args);
+		vsnprintf(line + offset, LOGRING_LINELEN - offset, format, args);
 		va_end(args);
-		printf("\n");
+		log_head++;
 	}
 
-	// Open log file
-	open_FTL_log(false);
-
-	// Write to log file
-	if(logfile != NULL)
+	if(logwriter_running && !killed)
 	{
-		fprintf(logfile, "[%s %ld] ", timestring, pid);
-		va_start(args, format);
-		vfprintf(logfile, format, args);
-		va_end(args);
-		fputc('\n',logfile);
+		// Wake the writer, the file I/O happens off this thread
+		pthread_cond_signal(&logcond);
 	}
-	else if(!daemonmode)
+	else
 	{
-		printf("!!! WARNING: Writing to FTL\'s log file failed!\n");
-		syslog(LOG_ERR, "Writing to FTL\'s log file failed!");
+		// No writer (yet, or anymore): drain synchronously so early
+		// startup and shutdown messages are never lost
+		drain_log_ring();
 	}
 
-	// Close log file
-	close_FTL_log();
-
 	pthread_mutex_unlock(&lock);
 }
 
@@ -56,11 +56,27 @@ int main (int argc, char* argv[])
 	if(config.maxDBdays != 0)
 		db_init();
 
-	// Try to import queries from long-term database if available
-	if(database && config.DBimport)
-		read_data_from_DB();
-
-	log_counter_info();
+	// Try to import queries from long-term database if available. The
+	// import streams in the background so that the resolver and the API
+	// come up immediately instead of waiting for up to 24h of history.
+	// After a warm restart the in-memory state is already complete
+	if(database && config.DBimport && !warm_restarted)
+	{
+		pthread_attr_t importattr;
+		pthread_attr_init(&importattr);
+		pthread_attr_setdetachstate(&importattr, PTHREAD_CREATE_DETACHED);
+		pthread_t importthread;
+		if(pthread_create( &importthread, &importattr, DB_import_thread, NULL ) != 0)
+		{
+			logg("WARNING: Unable to open database import thread, importing in foreground");
+			read_data_from_DB();
+			log_counter_info();
+		}
+	}
+	else
+	{
+		log_counter_info();
+	}
 	check_setupVarsconf();
 
 	// Check for availability of advanced capabilities
@@ -73,8 +89,6 @@ int main (int argc, char* argv[])
 	logg("Shutting down...");
 
 	// Cancel active threads as we don't need them any more
-	if(ipv4telnet) pthread_cancel(telnet_listenthreadv4);
-	if(ipv6telnet) pthread_cancel(telnet_listenthreadv6);
 	pthread_cancel(socket_listenthread);
 
 	// Save new queries to database
@@ -21,6 +21,7 @@ FTLFileNamesStruct FTLfiles = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -39,17 +40,84 @@ ConfigStruct config;
 
 // Variable size array structs
 queriesDataStruct *queries = NULL;
+queriesColdDataStruct *queries_cold = NULL;
 forwardedDataStruct *forwarded = NULL;
 clientsDataStruct *clients = NULL;
 domainsDataStruct *domains = NULL;
 overTimeDataStruct *overTime = NULL;
+overTimeDataStruct *overTimeHourly = NULL;
+overTimeDataStruct *overTimeDaily = NULL;
+
+// Reclaim the expired region at the head of the queries ring by moving the
+// valid window to the front. All index structures referencing positions in
+// queries[] follow the move
+static void compact_queries(void)
+{
+	if(counters->queries_start == 0)
+		return;
+
+	memmove(&queries[0], &queries[counters->queries_start],
+	        counters->queries*sizeof(*queries));
+	memset(&queries[counters->queries], 0,
+	       counters->queries_start*sizeof(*queries));
+	// The cold companion array is indexed identically
+	memmove(&queries_cold[0], &queries_cold[counters->queries_start],
+	        counters->queries*sizeof(*queries_cold));
+	memset(&queries_cold[counters->queries], 0,
+	       counters->queries_start*sizeof(*queries_cold));
+	// The database index points into queries[] and has to follow the
+	// compaction, as do the in-flight query positions
+	lastdbindex -= counters->queries_start;
+	shift_inflight_hash(counters->queries_start);
+	shiftQueryIndexes(counters->queries_start);
+	counters->queries_start = 0;
+}
+
+// Return spare capacity to the system after GC: when a segment uses less
+// than a quarter of its allocation (typically after a traffic spike), it
+// is halved repeatedly down to at most one page worth of entries
+void memory_shrink(void)
+{
+	const int minimum = getpagesize();
+
+	// queries[] (+ cold companion): compact first so the valid window
+	// starts at the front, then halve the capacity while oversized
+	int target = counters->queries_MAX;
+	while(target/2 >= minimum && counters->queries < target/4)
+		target /= 2;
+	if(target < counters->queries_MAX)
+	{
+		compact_queries();
+		logg("Shrinking queries struct from %i to %i entries", counters->queries_MAX, target);
+		shrink_shmem_struct(QUERIES, target);
+	}
+
+	// String buffer: offsets are referenced everywhere, so only the
+	// unused tail capacity can be returned
+	int strtarget = counters->strings_MAX;
+	while(strtarget/2 >= minimum && (int)shm_strings_used() < strtarget/4)
+		strtarget /= 2;
+	if(strtarget < counters->strings_MAX)
+	{
+		logg("Shrinking string buffer from %i to %i bytes", counters->strings_MAX, strtarget);
+		shrink_shmem_struct(STRINGS, strtarget);
+	}
+}
 
 void memory_check(int which)
 {
 	switch(which)
 	{
 		case QUERIES:
-			if(counters->queries >= counters->queries_MAX-1)
+			if(counters->queries_start + counters->queries >= counters->queries_MAX-1)
+			{
+				// Reclaim the expired region at the head of the
+				// array which GC left behind before growing the
+				// shared memory object. This amortizes the cost
+				// of the compaction over thousands of queries
+				compact_queries();
+			}
+			if(counters->queries_start + counters->queries >= counters->queries_MAX-1)
 			{
 				// Have to reallocate shared memory
 				queries = enlarge_shmem_struct(QUERIES);
@@ -104,6 +172,7 @@ void memory_check(int which)
 	}
 }
 
+#ifndef NO_VALIDATE_ACCESS
 void validate_access(const char * name, int pos, bool testmagic, int line, const char * function, const char * file)
 {
 	int limit = 0;
@@ -134,6 +203,8 @@ void validate_access(const char * name, int pos, bool testmagic, int line, const
 		}
 	}
 }
+#endif
+
 
 // The special memory handling routines have to be the last ones in this source file
 // as we restore the original definition of the strdup, free, calloc, and realloc
@@ -215,3 +286,71 @@ void FTLfree(void *ptr, const char * file, const char * function, int line)
 	// We intentionally run free() nevertheless to see the crash in the debugger
 	free(ptr);
 }
+
+// ==================== request-scoped arena allocator ====================
+// The API handlers make many small short-lived allocations per request.
+// Those go through this bump allocator instead of malloc: allocations are
+// appended to per-thread blocks and the whole arena is released in one go
+// by process_request() when the request is done, which also removes whole
+// classes of per-field leak bugs. These functions intentionally live below
+// the #undef lines as they use the raw allocator.
+
+typedef struct arenaBlockStruct {
+	struct arenaBlockStruct *next;
+	size_t used;
+	size_t size;
+} arenaBlock;
+
+#define ARENA_BLOCKSIZE 65536
+static __thread arenaBlock *arena = NULL;
+
+// Bump-allocate from the current arena
+void *arena_alloc(size_t size)
+{
+	// Keep allocations aligned
+	size = (size + 7u) & ~(size_t)7u;
+
+	arenaBlock *block = arena;
+	if(block == NULL || block->used + size > block->size)
+	{
+		const size_t blocksize = size > ARENA_BLOCKSIZE ? size : ARENA_BLOCKSIZE;
+		block = malloc(sizeof(arenaBlock) + blocksize);
+		if(block == NULL)
+		{
+			logg("FATAL: Arena allocation (%zu) failed", size);
+			return NULL;
+		}
+		block->next = arena;
+		block->used = 0;
+		block->size = blocksize;
+		arena = block;
+	}
+
+	void *ptr = (char*)(block + 1) + block->used;
+	block->used += size;
+	return ptr;
+}
+
+// strdup() into the arena
+char *arena_strdup(const char *src)
+{
+	if(src == NULL)
+		return NULL;
+
+	const size_t len = strlen(src);
+	char *dest = arena_alloc(len + 1);
+	if(dest != NULL)
+		memcpy(dest, src, len + 1);
+	return dest;
+}
+
+// Release everything allocated from this thread's arena
+void arena_release(void)
+{
+	while(arena != NULL)
+	{
+		arenaBlock *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
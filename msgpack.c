@@ -110,6 +110,93 @@ bool pack_str32(int sock, const char *string) {
 	return true;
 }
 
+// ==================== per-response string table ====================
+// When a client requests string-table framing (by appending " strtab" to
+// its command), every distinct string is transmitted in full only once and
+// assigned the next implicit ID in order of first appearance; repeated
+// occurrences are sent as a msgpack fixext4 (type 1) carrying the 32-bit
+// ID. A decoder mirrors the numbering by appending every full string it
+// receives to its table. Popular domain names in a 100k-record
+// getAllQueries() response thus travel once instead of thousands of times.
+#define STRTAB_HASH_SLOTS 8192
+static char **strtab = NULL;
+static uint32_t strtab_count = 0, strtab_capacity = 0;
+static int strtab_hash[STRTAB_HASH_SLOTS];
+static bool strtab_enabled = false;
+
+static uint32_t __attribute__((pure)) strtab_hashstr(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	for(; *str != '\0'; str++)
+	{
+		hash ^= (uint32_t)(unsigned char)*str;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Start a string-table framed response
+void pack_strtab_begin(void)
+{
+	for(uint32_t i = 0; i < strtab_count; i++)
+		free(strtab[i]);
+	strtab_count = 0;
+	memset(strtab_hash, 0xFF, sizeof(strtab_hash));
+	strtab_enabled = true;
+}
+
+// End string-table framing (safe to call when it was never begun)
+void pack_strtab_end(void)
+{
+	if(!strtab_enabled)
+		return;
+	for(uint32_t i = 0; i < strtab_count; i++)
+		free(strtab[i]);
+	strtab_count = 0;
+	strtab_enabled = false;
+}
+
+// Like pack_str32(), but de-duplicated through the response's string table
+bool pack_str32_table(int sock, const char *string)
+{
+	if(!strtab_enabled)
+		return pack_str32(sock, string);
+
+	// Look the string up (open addressing over the content hash)
+	uint32_t slot = strtab_hashstr(string) & (STRTAB_HASH_SLOTS-1);
+	while(strtab_hash[slot] >= 0)
+	{
+		if(strcmp(strtab[strtab_hash[slot]], string) == 0)
+		{
+			// Already sent: emit a fixext4 reference (type 1)
+			uint8_t header[2] = { 0xd6, 0x01 };
+			swrite(sock, header, sizeof(header));
+			uint32_t bigEId = htonl((uint32_t)strtab_hash[slot]);
+			swrite(sock, &bigEId, sizeof(bigEId));
+			return true;
+		}
+		slot = (slot + 1u) & (STRTAB_HASH_SLOTS-1);
+	}
+
+	// First occurrence: send in full and remember it (as long as the
+	// table has room; overflowing strings are simply sent in full)
+	if(!pack_str32(sock, string))
+		return false;
+
+	if(strtab_count < STRTAB_HASH_SLOTS/2)
+	{
+		if(strtab_count >= strtab_capacity)
+		{
+			strtab_capacity = strtab_capacity > 0 ? 2*strtab_capacity : 256;
+			strtab = realloc(strtab, strtab_capacity*sizeof(char*));
+		}
+		strtab[strtab_count] = strdup(string);
+		strtab_hash[slot] = strtab_count++;
+	}
+
+	return true;
+}
+
 void pack_map16_start(int sock, uint16_t length) {
 	uint8_t format = 0xde;
 	swrite(sock, &format, sizeof(format));
@@ -11,6 +11,10 @@
 #include "FTL.h"
 #include "shmem.h"
 #include "sqlite3.h"
+// Netlink neighbor monitoring
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
 #define ARPCACHE "/proc/net/arp"
 
 // Private prototypes
@@ -38,66 +42,103 @@ bool create_network_table(void)
 	return true;
 }
 
-// Read kernel's ARP cache using procfs
-void parse_arp_cache(void)
+// Last-seen state of the ARP cache: one entry per (IP, MAC) pair we already
+// verified against (or inserted into) the network table. With this state,
+// unchanged neighbors cost no database statement at all on later ticks --
+// only new pairs, accumulated query counters and changed host names are
+// written, batched in a single lazily opened transaction
+typedef struct {
+	char ip[100];
+	char hwaddr[100];
+	int dbID;
+	size_t namepos_written;
+} arpStateEntry;
+static arpStateEntry *arp_state = NULL;
+static int arp_state_count = 0;
+static int arp_state_capacity = 0;
+
+static arpStateEntry *find_arp_state(const char *ip, const char *hwaddr)
 {
-	FILE* arpfp = NULL;
-	// Try to access the kernel's ARP cache
-	if((arpfp = fopen(ARPCACHE, "r")) == NULL)
+	for(int i = 0; i < arp_state_count; i++)
+		if(strcmp(arp_state[i].ip, ip) == 0 &&
+		   strcmp(arp_state[i].hwaddr, hwaddr) == 0)
+			return &arp_state[i];
+	return NULL;
+}
+
+static arpStateEntry *add_arp_state(const char *ip, const char *hwaddr, int dbID)
+{
+	if(arp_state_count >= arp_state_capacity)
 	{
-		logg("WARN: Opening of %s failed!", ARPCACHE);
-		logg("      Message: %s", strerror(errno));
-		return;
+		arp_state_capacity = arp_state_capacity > 0 ? 2*arp_state_capacity : 64;
+		arp_state = realloc(arp_state, arp_state_capacity*sizeof(arpStateEntry));
 	}
+	arpStateEntry *entry = &arp_state[arp_state_count++];
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->ip, ip, sizeof(entry->ip)-1);
+	strncpy(entry->hwaddr, hwaddr, sizeof(entry->hwaddr)-1);
+	entry->dbID = dbID;
+	return entry;
+}
 
-	// Open database file
-	if(!dbopen())
+// Process one neighbor (from the ARP cache or a netlink event) against the
+// in-memory state and the network table. Opens the database and starts the
+// transaction lazily through *dbopened
+static void process_neighbor(const char *ip, const char *hwaddr, const char *iface,
+                             time_t now, bool *dbopened, int *written, bool *failed)
+{
+	// Look at what FTL knows about this client
+	// false = do not create a new record if the client is
+	//         unknown (only DNS requesting clients do this)
+	lock_shm_read();
+	int clientID = findClientID(ip, false);
+	bool clientKnown = clientID >= 0;
+	size_t namepos = 0;
+	time_t lastQuery = 0;
+	unsigned int numQueriesARP = 0;
+	if(clientKnown)
 	{
-		logg("read_arp_cache() - Failed to open DB");
-		fclose(arpfp);
-		return;
+		validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
+		namepos = clients[clientID].namepos;
+		lastQuery = clients[clientID].lastQuery;
+		numQueriesARP = clients[clientID].numQueriesARP;
 	}
+	unlock_shm();
 
-	// Start ARP timer
-	if(config.debug & DEBUG_ARP) timer_start(ARP_TIMER);
+	arpStateEntry *state = find_arp_state(ip, hwaddr);
 
-	// Prepare buffers
-	char * linebuffer = NULL;
-	size_t linebuffersize = 0;
-	char ip[100], mask[100], hwaddr[100], iface[100];
-	int type, flags, entries = 0;
-	time_t now = time(NULL);
-
-	// Start collecting database commands
-	dbquery("BEGIN TRANSACTION");
+	// Nothing to do for a known pair without accumulated activity
+	// or host name change -- the common case on a stable network
+	if(state != NULL && (!clientKnown ||
+	   (numQueriesARP == 0 && namepos == state->namepos_written)))
+		return;
 
-	// Read ARP cache line by line
-	while(getline(&linebuffer, &linebuffersize, arpfp) != -1)
+	if(!(*dbopened))
 	{
-		int num = sscanf(linebuffer, "%99s 0x%x 0x%x %99s %99s %99s\n",
-		                 ip, &type, &flags, hwaddr, mask, iface);
-
-		// Skip header and empty lines
-		if (num < 4)
-			continue;
-
-		// Skip incomplete entires, i.e., entries without C (complete) flag
-		if(!(flags & 0x02))
-			continue;
+		// Open database file and start collecting commands
+		if(!dbopen())
+		{
+			logg("process_neighbor() - Failed to open DB");
+			*failed = true;
+			return;
+		}
+		dbquery("BEGIN TRANSACTION");
+		(*dbopened) = true;
+	}
 
-		// Get ID of this device in our network database. If it cannot be found, then this is a new device
-		// We match both IP *and* MAC address
+	if(state == NULL)
+	{
+		// Pair not seen before: check the database. We match both
+		// IP *and* MAC address
 		// Same MAC, two IPs: Non-deterministic DHCP server, treat as two entries
 		// Same IP, two MACs: Either non-deterministic DHCP server or (almost) full DHCP address pool
-		// We can run this SELECT inside the currently active transaction as only the
-		// changed to the database are collected for latter commitment. Read-only access
-		// such as this SELECT command will be executed immediately on the database.
 		char* querystr = NULL;
 		int ret = asprintf(&querystr, "SELECT id FROM network WHERE ip = \'%s\' AND hwaddr = \'%s\';", ip, hwaddr);
 		if(querystr == NULL || ret < 0)
 		{
-			logg("Memory allocation failed in parse_arp_cache (%i)", ret);
-			break;
+			logg("Memory allocation failed in process_neighbor (%i)", ret);
+			*failed = true;
+			return;
 		}
 
 		// Perform SQL query
@@ -107,96 +148,316 @@ void parse_arp_cache(void)
 		if(dbID == DB_FAILED)
 		{
 			// SQLite error
-			break;
+			*failed = true;
+			return;
 		}
 
-		// If we reach this point, we can check if this client
-		// is known to pihole-FTL
-		// false = do not create a new record if the client is
-		//         unknown (only DNS requesting clients do this)
-		lock_shm();
-		int clientID = findClientID(ip, false);
-
-		// This client is known (by its IP address) to pihole-FTL if
-		// findClientID() returned a non-negative index
-		bool clientKnown = clientID >= 0;
-
-		// Get hostname of this client if the client is known
 		const char *hostname = "";
+		lock_shm_read();
 		if(clientKnown)
-		{
-			validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
-			hostname = getstr(clients[clientID].namepos);
-		}
+			hostname = getstr(namepos);
 
-		// Device not in database, add new entry
 		if(dbID == DB_NODATA)
 		{
+			// Device not in database, add new entry
 			char* macVendor = getMACVendor(hwaddr);
 			dbquery("INSERT INTO network "\
 			        "(ip,hwaddr,interface,firstSeen,lastQuery,numQueries,name,macVendor) "\
 			        "VALUES (\'%s\',\'%s\',\'%s\',%lu, %ld, %u, \'%s\', \'%s\');",\
 			        ip, hwaddr, iface, now,
-			        clientKnown ? clients[clientID].lastQuery : 0L,
-			        clientKnown ? clients[clientID].numQueriesARP : 0u,
+			        clientKnown ? lastQuery : 0L,
+			        clientKnown ? numQueriesARP : 0u,
 			        hostname,
 			        macVendor);
 			free(macVendor);
+			dbID = db_query_int("SELECT MAX(id) FROM network;");
 		}
-		// Device in database AND client known to Pi-hole
-		else if(clientKnown)
+		unlock_shm();
+
+		state = add_arp_state(ip, hwaddr, dbID);
+		state->namepos_written = namepos;
+		if(clientKnown && numQueriesARP > 0)
 		{
-			// Update lastQuery. Only use new value if larger
-			// clients[clientID].lastQuery may be zero if this
-			// client is only known from a database entry but has
-			// not been seen since then
-			dbquery("UPDATE network "\
-			        "SET lastQuery = MAX(lastQuery, %ld) "\
-			        "WHERE id = %i;",\
-			        clients[clientID].lastQuery, dbID);
+			lock_shm();
+			clients[clientID].numQueriesARP = 0;
+			unlock_shm();
+		}
+		(*written)++;
+		return;
+	}
 
-			// Update numQueries. Add queries seen since last update
-			// and reset counter afterwards
+	// Known pair with accumulated activity or changed host name
+	if(clientKnown)
+	{
+		if(numQueriesARP > 0)
+		{
+			// Update lastQuery (only use new value if larger;
+			// it may be zero if this client is only known from
+			// a database entry) and add the queries seen since
+			// the last update, then reset the counter
 			dbquery("UPDATE network "\
-			        "SET numQueries = numQueries + %u "\
+			        "SET lastQuery = MAX(lastQuery, %ld), "\
+			        "numQueries = numQueries + %u "\
 			        "WHERE id = %i;",\
-			        clients[clientID].numQueriesARP, dbID);
+			        lastQuery, numQueriesARP, state->dbID);
+			lock_shm();
 			clients[clientID].numQueriesARP = 0;
+			unlock_shm();
+		}
 
-			// Store hostname if available
+		if(namepos != state->namepos_written)
+		{
+			lock_shm_read();
+			const char *hostname = getstr(namepos);
 			if(strlen(hostname) > 0)
-			{
-				// Store host name
 				dbquery("UPDATE network "\
 				        "SET name = \'%s\' "\
 				        "WHERE id = %i;",\
-				        hostname, dbID);
+				        hostname, state->dbID);
+			unlock_shm();
+			state->namepos_written = namepos;
+		}
+		(*written)++;
+	}
+}
+
+// ==================== netlink neighbor monitoring ====================
+// Instead of text-parsing /proc/net/arp on every tick, we subscribe to the
+// kernel's neighbor-change notifications (RTMGRP_NEIGH) and request one
+// full RTM_GETNEIGH dump at startup: updates arrive push-based, immediately
+// and proportional to actual churn. The procfs path below remains as
+// fallback when the netlink socket cannot be created.
+static int neigh_sock = -1;
+static bool neigh_failed = false;
+
+static bool neigh_init(void)
+{
+	neigh_sock = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if(neigh_sock < 0)
+		return false;
+
+	struct sockaddr_nl local;
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = RTMGRP_NEIGH;
+	if(bind(neigh_sock, (struct sockaddr*)&local, sizeof(local)) != 0)
+	{
+		close(neigh_sock);
+		neigh_sock = -1;
+		return false;
+	}
+
+	// Request one full neighbor table dump to seed the state
+	struct {
+		struct nlmsghdr hdr;
+		struct ndmsg ndm;
+	} request;
+	memset(&request, 0, sizeof(request));
+	request.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	request.hdr.nlmsg_type = RTM_GETNEIGH;
+	request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.ndm.ndm_family = AF_INET;
+	if(send(neigh_sock, &request, request.hdr.nlmsg_len, 0) < 0)
+	{
+		close(neigh_sock);
+		neigh_sock = -1;
+		return false;
+	}
+
+	logg("Using netlink neighbor monitoring for the network table");
+	return true;
+}
+
+// Drain all pending neighbor messages and feed them through the shared
+// per-neighbor processing. Returns the number of messages handled
+static int neigh_drain(time_t now, bool *dbopened, int *written)
+{
+	char buffer[16384];
+	int handled = 0;
+	ssize_t length;
+
+	while((length = recv(neigh_sock, buffer, sizeof(buffer), 0)) > 0)
+	{
+		for(struct nlmsghdr *nlh = (struct nlmsghdr*)(void*)buffer;
+		    NLMSG_OK(nlh, (size_t)length); nlh = NLMSG_NEXT(nlh, length))
+		{
+			if(nlh->nlmsg_type == NLMSG_DONE)
+				break;
+			if(nlh->nlmsg_type != RTM_NEWNEIGH)
+				continue;
+
+			struct ndmsg *ndm = NLMSG_DATA(nlh);
+			// Only valid IPv4/IPv6 neighbors with a complete entry
+			if(!(ndm->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_PERMANENT)))
+				continue;
+
+			char ip[100] = "", hwaddr[100] = "", iface[100] = "";
+			int attrlength = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+			for(struct rtattr *rta = (struct rtattr*)(void*)((char*)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+			    RTA_OK(rta, attrlength); rta = RTA_NEXT(rta, attrlength))
+			{
+				if(rta->rta_type == NDA_DST)
+					inet_ntop(ndm->ndm_family, RTA_DATA(rta), ip, sizeof(ip));
+				else if(rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == 6)
+				{
+					const unsigned char *mac = RTA_DATA(rta);
+					snprintf(hwaddr, sizeof(hwaddr), "%02x:%02x:%02x:%02x:%02x:%02x",
+					         mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+				}
 			}
+			if(ip[0] == '\0' || hwaddr[0] == '\0')
+				continue;
+			if(if_indextoname(ndm->ndm_ifindex, iface) == NULL)
+				snprintf(iface, sizeof(iface), "if%i", ndm->ndm_ifindex);
+
+			bool failed = false;
+			process_neighbor(ip, hwaddr, iface, now, dbopened, written, &failed);
+			handled++;
+			if(failed)
+				return handled;
 		}
-		// else:
-		// Device in database but not known to Pi-hole: No action required
+	}
 
-		unlock_shm();
+	return handled;
+}
+
+// Read kernel's ARP cache using procfs
+void parse_arp_cache(void)
+{
+	FILE* arpfp = NULL;
+
+	// Prefer the push-based netlink path: updates are proportional to
+	// actual neighbor churn instead of re-parsing all entries per tick
+	if(neigh_sock < 0 && !neigh_failed)
+		neigh_failed = !neigh_init();
+	if(neigh_sock >= 0)
+	{
+		if(config.debug & DEBUG_ARP) timer_start(ARP_TIMER);
+		bool nl_dbopened = false;
+		int nl_written = 0;
+		const int handled = neigh_drain(time(NULL), &nl_dbopened, &nl_written);
+		if(nl_dbopened)
+		{
+			dbquery("COMMIT");
+			dbclose();
+		}
+		if(config.debug & DEBUG_ARP && handled > 0)
+			logg("Neighbor processing (%i events, %i written) took %.1f ms",
+			     handled, nl_written, timer_elapsed_msec(ARP_TIMER));
+		return;
+	}
+
+	// Fallback: text-parse the kernel's ARP cache
+	if((arpfp = fopen(ARPCACHE, "r")) == NULL)
+	{
+		logg("WARN: Opening of %s failed!", ARPCACHE);
+		logg("      Message: %s", strerror(errno));
+		return;
+	}
+
+	// Start ARP timer
+	if(config.debug & DEBUG_ARP) timer_start(ARP_TIMER);
+
+	// Prepare buffers
+	char * linebuffer = NULL;
+	size_t linebuffersize = 0;
+	char ip[100], mask[100], hwaddr[100], iface[100];
+	int type, flags, entries = 0, written = 0;
+	time_t now = time(NULL);
+
+	// The database is only opened (and the transaction only started) when
+	// there actually is something to look up or write
+	bool dbopened = false;
+
+	// Read ARP cache line by line
+	while(getline(&linebuffer, &linebuffersize, arpfp) != -1)
+	{
+		int num = sscanf(linebuffer, "%99s 0x%x 0x%x %99s %99s %99s\n",
+		                 ip, &type, &flags, hwaddr, mask, iface);
+
+		// Skip header and empty lines
+		if (num < 4)
+			continue;
+
+		// Skip incomplete entires, i.e., entries without C (complete) flag
+		if(!(flags & 0x02))
+			continue;
 
 		// Count number of processed ARP cache entries
 		entries++;
+
+		bool failed = false;
+		process_neighbor(ip, hwaddr, iface, now, &dbopened, &written, &failed);
+		if(failed)
+			break;
 	}
 
-	// Actually update the database
-	dbquery("COMMIT");
+	if(dbopened)
+	{
+		// Actually update the database
+		dbquery("COMMIT");
+		// Close database connection
+		dbclose();
+	}
 
 	// Debug logging
-	if(config.debug & DEBUG_ARP) logg("ARP table processing (%i entries) took %.1f ms", entries, timer_elapsed_msec(ARP_TIMER));
+	if(config.debug & DEBUG_ARP)
+		logg("ARP table processing (%i entries, %i written) took %.1f ms",
+		     entries, written, timer_elapsed_msec(ARP_TIMER));
+
+	// Free line buffer
+	if(linebuffer != NULL)
+		free(linebuffer);
 
 	// Close file handle
 	fclose(arpfp);
+}
 
-	// Close database connection
-	dbclose();
+// Process-lifetime cache of OUI -> vendor resolutions: the OUI space is
+// tiny and static, so the macvendor database file is only opened and
+// queried for genuinely new prefixes
+typedef struct {
+	char oui[9]; // "XX:YY:ZZ"
+	char *vendor;
+} ouiCacheEntry;
+static ouiCacheEntry *oui_cache = NULL;
+static int oui_cache_count = 0;
+static int oui_cache_capacity = 0;
+
+static const char *oui_cache_lookup(const char *oui)
+{
+	for(int i = 0; i < oui_cache_count; i++)
+		if(strcmp(oui_cache[i].oui, oui) == 0)
+			return oui_cache[i].vendor;
+	return NULL;
+}
+
+static void oui_cache_insert(const char *oui, const char *vendor)
+{
+	if(oui_cache_count >= oui_cache_capacity)
+	{
+		oui_cache_capacity = oui_cache_capacity > 0 ? 2*oui_cache_capacity : 32;
+		oui_cache = realloc(oui_cache, oui_cache_capacity*sizeof(ouiCacheEntry));
+	}
+	strncpy(oui_cache[oui_cache_count].oui, oui, sizeof(oui_cache[0].oui)-1);
+	oui_cache[oui_cache_count].oui[sizeof(oui_cache[0].oui)-1] = '\0';
+	oui_cache[oui_cache_count].vendor = strdup(vendor);
+	oui_cache_count++;
 }
 
 static char* getMACVendor(const char* hwaddr)
 {
+	// Serve repeated lookups of the same OUI from the cache
+	if(strlen(hwaddr) == 17)
+	{
+		char oui[9];
+		memcpy(oui, hwaddr, 8);
+		oui[8] = '\0';
+		const char *cached = oui_cache_lookup(oui);
+		if(cached != NULL)
+			return strdup(cached);
+	}
+
 	struct stat st;
 	if(stat(FTLfiles.macvendordb, &st) != 0)
 	{
@@ -262,6 +523,15 @@ static char* getMACVendor(const char* hwaddr)
 	sqlite3_finalize(stmt);
 	sqlite3_close(macdb);
 
+	// Remember the resolution (also negative ones) for this OUI
+	if(vendor != NULL)
+	{
+		char oui[9];
+		memcpy(oui, hwaddr, 8);
+		oui[8] = '\0';
+		oui_cache_insert(oui, vendor);
+	}
+
 	return vendor;
 }
 
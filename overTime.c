@@ -10,6 +10,8 @@
 
 #include "FTL.h"
 
+static void cascadeOverTimeSlot(const overTimeDataStruct *slot);
+
 /**
  * Initialize the overTime slot
  *
@@ -35,7 +37,7 @@ static void initSlot(unsigned int index, time_t timestamp)
 
 	// Zero overTime counter for all known clients
 	for(int clientID = 0; clientID < counters->clients; clientID++)
-		clients[clientID].overTime[index] = 0;
+		resetClientOverTimeSlot(clientID, index);
 }
 
 void initOverTime(void)
@@ -117,32 +119,25 @@ void moveOverTimeMemory(time_t mintime)
 	// function is called before GC is necessary.
 	if(moveOverTime > 0 && moveOverTime < OVERTIME_SLOTS)
 	{
+		// Cascade the expiring fine slots into the coarse tiers before
+		// they are discarded: each ten-minute slot is accumulated into
+		// its hourly bucket, and hourly buckets rotating out of their
+		// one-week ring cascade into the daily ring the same way
+		for(unsigned int expiring = 0; expiring < moveOverTime; expiring++)
+			cascadeOverTimeSlot(&overTime[expiring]);
+
 		// Move overTime memory
 		if(config.debug & DEBUG_OVERTIME)
 			logg("moveOverTimeMemory(): Moving overTime %u - %u to 0 - %u", moveOverTime, moveOverTime+remainingSlots, remainingSlots);
 		memmove(&overTime[0], &overTime[moveOverTime], remainingSlots*sizeof(*overTime));
 
-		// Correct time indices of queries. This is necessary because we just moved the slot this index points to
-		for(int queryID = 0; queryID < counters->queries; queryID++)
-		{
-			// Check if the index would become negative if we adjusted it
-			if(((int)queries[queryID].timeidx - (int)moveOverTime) < 0)
-			{
-				// This should never happen, but we print a warning if it still happens
-				// We don't do anything in this case
-				logg("WARN: moveOverTimeMemory(): overTime time index correction failed (%i: %u / %u)", queryID, queries[queryID].timeidx, moveOverTime);
-			}
-			else
-			{
-				queries[queryID].timeidx -= moveOverTime;
-			}
-		}
+		// Note: queries do not store their overTime slot anymore, it is
+		// derived from the query timestamp via getOverTimeID() whenever
+		// needed, so no O(queries) index correction pass is required here
 
 		// Move client-specific overTime memory
 		for(int clientID = 0; clientID < counters->clients; clientID++)
-		{
-			memmove(&clients[clientID].overTime[0], &clients[clientID].overTime[moveOverTime], remainingSlots*sizeof(int));
-		}
+			moveClientOverTime(clientID, moveOverTime, remainingSlots);
 
 		// Iterate over new overTime region and initialize it
 		for(unsigned int timeidx = remainingSlots; timeidx < OVERTIME_SLOTS ; timeidx++)
@@ -153,3 +148,182 @@ void moveOverTimeMemory(time_t mintime)
 		}
 	}
 }
+
+// ==================== per-client overTime accessors ====================
+// Most clients are active in only a handful of slots, so their counts are
+// held in a small inline list of (slot, count) pairs. Clients exceeding the
+// inline capacity spill into a dense row of the client-overTime segment.
+
+// Deliver the count of one client in one slot
+int __attribute__((pure)) getClientOverTime(int clientID, unsigned int timeidx)
+{
+	const clientsDataStruct *client = &clients[clientID];
+	if(client->dense)
+		return getDenseOverTimeRow(client->denserow)[timeidx];
+
+	for(unsigned char i = 0; i < client->sparse_used; i++)
+		if(client->sparse_idx[i] == timeidx)
+			return client->sparse_count[i];
+	return 0;
+}
+
+// Remove one inline pair (order is not meaningful, swap in the last one)
+static void removeSparsePair(clientsDataStruct *client, unsigned char i)
+{
+	client->sparse_used--;
+	client->sparse_idx[i] = client->sparse_idx[client->sparse_used];
+	client->sparse_count[i] = client->sparse_count[client->sparse_used];
+}
+
+// Change the count of one client in one slot by the given delta
+void addClientOverTime(int clientID, unsigned int timeidx, int delta)
+{
+	clientsDataStruct *client = &clients[clientID];
+	if(client->dense)
+	{
+		getDenseOverTimeRow(client->denserow)[timeidx] += delta;
+		return;
+	}
+
+	for(unsigned char i = 0; i < client->sparse_used; i++)
+	{
+		if(client->sparse_idx[i] == timeidx)
+		{
+			client->sparse_count[i] += delta;
+			// Drop emptied pairs to make room for new activity
+			if(client->sparse_count[i] == 0)
+				removeSparsePair(client, i);
+			return;
+		}
+	}
+
+	// Slot not present yet. Decrements of an unknown slot cannot happen
+	// as GC only removes what was counted before
+	if(delta <= 0)
+		return;
+
+	if(client->sparse_used < CLIENT_SPARSE_SLOTS)
+	{
+		client->sparse_idx[client->sparse_used] = timeidx;
+		client->sparse_count[client->sparse_used] = delta;
+		client->sparse_used++;
+		return;
+	}
+
+	// Chatty client: spill the inline pairs into a dense row
+	client->denserow = allocDenseOverTimeRow();
+	int *row = getDenseOverTimeRow(client->denserow);
+	for(unsigned char i = 0; i < client->sparse_used; i++)
+		row[client->sparse_idx[i]] = client->sparse_count[i];
+	client->dense = true;
+	row[timeidx] += delta;
+}
+
+// Zero the given slot (slot re-initialization after rotation)
+void resetClientOverTimeSlot(int clientID, unsigned int timeidx)
+{
+	clientsDataStruct *client = &clients[clientID];
+	if(client->dense)
+	{
+		getDenseOverTimeRow(client->denserow)[timeidx] = 0;
+		return;
+	}
+
+	for(unsigned char i = 0; i < client->sparse_used; i++)
+		if(client->sparse_idx[i] == timeidx)
+		{
+			removeSparsePair(client, i);
+			return;
+		}
+}
+
+// Shift the client's activity after the overTime memory got rotated
+void moveClientOverTime(int clientID, unsigned int moveOverTime, unsigned int remainingSlots)
+{
+	clientsDataStruct *client = &clients[clientID];
+	if(client->dense)
+	{
+		int *row = getDenseOverTimeRow(client->denserow);
+		memmove(&row[0], &row[moveOverTime], remainingSlots*sizeof(int));
+		memset(&row[remainingSlots], 0, moveOverTime*sizeof(int));
+		return;
+	}
+
+	for(unsigned char i = 0; i < client->sparse_used; )
+	{
+		if(client->sparse_idx[i] < moveOverTime)
+		{
+			// Slot rotated out of the window
+			removeSparsePair(client, i);
+			continue;
+		}
+		client->sparse_idx[i] -= moveOverTime;
+		i++;
+	}
+}
+
+// Initialize the per-client activity of a brand-new client
+void initClientOverTime(int clientID)
+{
+	clientsDataStruct *client = &clients[clientID];
+	client->sparse_used = 0;
+	client->dense = false;
+	client->denserow = -1;
+}
+
+// ==================== tiered overTime history ====================
+// Expiring 10-minute slots are folded into an hourly ring covering one
+// week, and hours rotating out of that ring are folded into a daily ring
+// covering OVERTIME_DAILY_SLOTS days. Both rings are addressed by absolute
+// time (slot = timestamp/width % slots) with the slot's base timestamp
+// stored for staleness detection, so no per-slot shifting is ever needed.
+
+// Accumulate src into the tier slot belonging to base. A slot holding data
+// of an older period is reset (after cascading, for the hourly tier)
+static void accumulateTierSlot(overTimeDataStruct *slot, const overTimeDataStruct *src, time_t base)
+{
+	if(slot->timestamp != base)
+	{
+		// Reset a stale slot for its new period
+		memset(slot, 0, sizeof(*slot));
+		slot->magic = MAGICBYTE;
+		slot->timestamp = base;
+	}
+
+	slot->total += src->total;
+	slot->blocked += src->blocked;
+	slot->cached += src->cached;
+	slot->forwarded += src->forwarded;
+	for(unsigned int queryType = 0; queryType < TYPE_MAX-1; queryType++)
+		slot->querytypedata[queryType] += src->querytypedata[queryType];
+}
+
+// Fold one expiring fine slot into the coarse tiers
+static void cascadeOverTimeSlot(const overTimeDataStruct *slot)
+{
+	if(slot->total == 0 && slot->blocked == 0)
+		return;
+
+	// Hourly tier
+	const time_t hour = slot->timestamp - slot->timestamp % 3600;
+	overTimeDataStruct *hslot = &overTimeHourly[(hour/3600) % OVERTIME_HOURLY_SLOTS];
+	if(hslot->timestamp != hour && hslot->total > 0)
+	{
+		// This hourly slot is about to be reused for a new hour one
+		// week later: cascade its old content into the daily tier
+		const time_t day = hslot->timestamp - hslot->timestamp % 86400;
+		accumulateTierSlot(&overTimeDaily[(day/86400) % OVERTIME_DAILY_SLOTS], hslot, day);
+	}
+	accumulateTierSlot(hslot, slot, hour);
+}
+
+// Send one coarse tier ("hourly" or "daily") for the >overTime API command
+void getOverTimeTier(int *sock, bool daily)
+{
+	const overTimeDataStruct *tier = daily ? overTimeDaily : overTimeHourly;
+	const unsigned int slots = daily ? OVERTIME_DAILY_SLOTS : OVERTIME_HOURLY_SLOTS;
+	for(unsigned int i = 0; i < slots; i++)
+		if(tier[i].total > 0 || tier[i].blocked > 0)
+			ssend(*sock, "%li %i %i\n", tier[i].timestamp,
+			      tier[i].total, tier[i].blocked);
+}
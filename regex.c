@@ -17,34 +17,70 @@ static bool *regexconfigured = NULL;
 static char **regexbuffer = NULL;
 static whitelistStruct whitelist = { NULL, 0 };
 
-static void log_regex_error(const char *where, int errcode, int index)
+// All individual patterns combined into one alternation ("(p1)|(p2)|...")
+// which the regex engine evaluates in a single pass over the domain string
+// instead of one regexec() per pattern. POSIX EREs have no backreferences,
+// so wrapping each pattern in a group cannot change its meaning. We keep the
+// per-pattern path as fallback for when combining fails (e.g. a pattern set
+// exceeding the implementation's size limits) and for regex debug mode,
+// which needs to know the matching line
+static regex_t combined_regex;
+static bool combined_available = false;
+
+static void log_regex_error_at(const char *where, int errcode, const regex_t *re, int index)
 {
 	// Regex failed for some reason (probably user syntax error)
 	// Get error string and log it
-	size_t length = regerror(errcode, &regex[index], NULL, 0);
+	size_t length = regerror(errcode, re, NULL, 0);
 	char *buffer = calloc(length,sizeof(char));
-	(void) regerror (errcode, &regex[index], buffer, length);
+	(void) regerror (errcode, re, buffer, length);
 	logg("ERROR %s regex on line %i: %s (%i)", where, index+1, buffer, errcode);
 	free(buffer);
 }
 
-static bool init_regex(const char *regexin, int index)
+static void log_regex_error(const char *where, int errcode, int index)
+{
+	log_regex_error_at(where, errcode, &regex[index], index);
+}
+
+static bool init_regex(regex_t *re, const char *regexin, int index)
 {
 	// compile regular expressions into data structures that
 	// can be used with regexec to match against a string
-	int errcode = regcomp(&regex[index], regexin, REG_EXTENDED);
+	int errcode = regcomp(re, regexin, REG_EXTENDED);
 	if(errcode != 0)
 	{
-		log_regex_error("compiling", errcode, index);
+		log_regex_error_at("compiling", errcode, re, index);
 		return false;
 	}
 
-	// Store compiled regex string in buffer if in regex debug mode
-	if(config.debug & DEBUG_REGEX)
+	return true;
+}
+
+// One slice of the pattern list to be compiled by a worker thread
+typedef struct {
+	int from;
+	int to;
+	char **lines;
+	regex_t *re;
+	bool *configured;
+} compileSliceStruct;
+
+// Up to this many threads compile the pattern list in parallel
+#define REGEX_COMPILE_THREADS 4
+
+static void *compile_regex_slice(void *val)
+{
+	compileSliceStruct *slice = (compileSliceStruct*)val;
+	for(int i = slice->from; i < slice->to; i++)
 	{
-		regexbuffer[index] = strdup(regexin);
+		// Lines that were skipped while reading are NULL
+		if(slice->lines[i] == NULL)
+			continue;
+
+		slice->configured[i] = init_regex(&slice->re[i], slice->lines[i], i);
 	}
-	return true;
+	return NULL;
 }
 
 bool __attribute__((pure)) in_whitelist(char *domain)
@@ -84,6 +120,34 @@ bool match_regex(char *input)
 
 	// Start matching timer
 	timer_start(REGEX_TIMER);
+
+	// Fast path: evaluate the combined automaton in a single pass. Regex
+	// debug mode uses the per-pattern loop as it reports the matching line
+	if(combined_available && !(config.debug & DEBUG_REGEX))
+	{
+		int errcode = regexec(&combined_regex, input, 0, NULL, 0);
+		if(errcode == 0)
+			matched = true;
+		else if(errcode != REG_NOMATCH)
+		{
+			// Error: log it and fall back to the per-pattern loop below
+			size_t length = regerror(errcode, &combined_regex, NULL, 0);
+			char *buffer = calloc(length,sizeof(char));
+			(void) regerror (errcode, &combined_regex, buffer, length);
+			logg("ERROR matching combined regex: %s (%i)", buffer, errcode);
+			free(buffer);
+		}
+
+		if(errcode == 0 || errcode == REG_NOMATCH)
+		{
+			double elapsed_combined = timer_elapsed_msec(REGEX_TIMER);
+			// Only log evaluation times if they are longer than normal
+			if(elapsed_combined > 10.0)
+				logg("WARN: Regex evaluation took %.3f msec", elapsed_combined);
+			return matched;
+		}
+	}
+
 	for(index = 0; index < num_regex; index++)
 	{
 		// Only check regex which have been successfully compiled
@@ -148,6 +212,13 @@ void free_regex(void)
 	free(regexconfigured);
 	regexconfigured = NULL;
 
+	// Free combined automaton
+	if(combined_available)
+	{
+		regfree(&combined_regex);
+		combined_available = false;
+	}
+
 	// Reset counter for number of regex
 	num_regex = 0;
 
@@ -240,13 +311,11 @@ void read_regex_from_file(void)
 		return;
 	}
 
-	// Allocate memory for regex
-	regex = calloc(num_regex, sizeof(regex_t));
-	regexconfigured = calloc(num_regex, sizeof(bool));
-
-	// Buffer strings if in regex debug mode
-	if(config.debug & DEBUG_REGEX)
-		regexbuffer = calloc(num_regex, sizeof(char*));
+	// Allocate memory for the new set of compiled patterns. We compile
+	// into local arrays and only swap them into the globals when done
+	regex_t *newregex = calloc(num_regex, sizeof(regex_t));
+	bool *newconfigured = calloc(num_regex, sizeof(bool));
+	char **lines = calloc(num_regex, sizeof(char*));
 
 	// Search through file
 	// getline reads a string from the specified file up to either a
@@ -269,7 +338,6 @@ void read_regex_from_file(void)
 		// effect and would immediately lead to "blocking the entire Internet"
 		if(strlen(buffer) < 1)
 		{
-			regexconfigured[i] = false;
 			logg("Skipping empty regex filter on line %i", i+1);
 			skipped++;
 			continue;
@@ -278,14 +346,13 @@ void read_regex_from_file(void)
 		// Skip this entry if it is commented out
 		if(buffer[0] == '#')
 		{
-			regexconfigured[i] = false;
 			logg("Skipping commented out regex filter on line %i", i+1);
 			skipped++;
 			continue;
 		}
 
-		// Compile this regex
-		regexconfigured[i] = init_regex(buffer, i);
+		// Remember this pattern for compilation
+		lines[i] = strdup(buffer);
 	}
 
 	// Free allocated memory
@@ -298,6 +365,96 @@ void read_regex_from_file(void)
 	// Close the file
 	fclose(fp);
 
+	// Compile the patterns in parallel across a small thread pool so list
+	// reloads are no longer single-core-bound
+	int threads = num_regex < REGEX_COMPILE_THREADS ? num_regex : REGEX_COMPILE_THREADS;
+	if(threads > 0)
+	{
+		pthread_t tid[REGEX_COMPILE_THREADS];
+		compileSliceStruct slice[REGEX_COMPILE_THREADS];
+		const int stride = (num_regex + threads - 1) / threads;
+		for(int t = 0; t < threads; t++)
+		{
+			slice[t].from = t*stride;
+			slice[t].to = (t+1)*stride < num_regex ? (t+1)*stride : num_regex;
+			slice[t].lines = lines;
+			slice[t].re = newregex;
+			slice[t].configured = newconfigured;
+			if(pthread_create(&tid[t], NULL, compile_regex_slice, &slice[t]) != 0)
+			{
+				// Thread creation failed, compile this slice inline
+				compile_regex_slice(&slice[t]);
+				tid[t] = 0;
+			}
+		}
+		for(int t = 0; t < threads; t++)
+			if(tid[t] != 0)
+				pthread_join(tid[t], NULL);
+	}
+
+	// Swap the freshly compiled arrays in. Callers either hold the lock
+	// (API-triggered recompilation) or run before query processing starts
+	regex = newregex;
+	regexconfigured = newconfigured;
+
+	// Buffer pattern strings if in regex debug mode
+	if(config.debug & DEBUG_REGEX)
+	{
+		regexbuffer = calloc(num_regex, sizeof(char*));
+		for(int i = 0; i < num_regex; i++)
+			if(regexconfigured[i])
+				regexbuffer[i] = strdup(lines[i]);
+	}
+
+	// Collect the successfully compiled patterns to build the combined
+	// single-pass automaton
+	char **patterns = calloc(num_regex, sizeof(char*));
+	int valid = 0;
+	for(int i = 0; i < num_regex; i++)
+		if(regexconfigured[i])
+			patterns[valid++] = lines[i];
+
+	// Combine all patterns into one alternation and compile it into a
+	// single automaton that matches the entire set in one pass
+	if(valid > 0)
+	{
+		// Combined length: every pattern is wrapped in "(...)" and the
+		// groups are joined by "|": strlen + 3 extra characters each
+		size_t length = 1;
+		for(int i = 0; i < valid; i++)
+			length += strlen(patterns[i]) + 3;
+
+		char *combined = calloc(length, sizeof(char));
+		char *pos = combined;
+		for(int i = 0; i < valid; i++)
+			pos += sprintf(pos, "%s(%s)", i > 0 ? "|" : "", patterns[i]);
+
+		int errcode = regcomp(&combined_regex, combined, REG_EXTENDED | REG_NOSUB);
+		if(errcode == 0)
+		{
+			combined_available = true;
+		}
+		else
+		{
+			// Keep using the per-pattern loop in match_regex()
+			logg("INFO: Cannot compile combined regex (%i), using per-pattern matching", errcode);
+			combined_available = false;
+		}
+		free(combined);
+	}
+
+	// Load persisted regex verdicts from the long-term database and apply
+	// them to the domains we currently know. Only verdicts affected by
+	// actual changes to the pattern set get invalidated
+	load_regex_cache(patterns, valid);
+
+	// Free pattern strings (patterns[] only borrows the pointers)
+	for(int i = 0; i < num_regex; i++)
+		if(lines[i] != NULL)
+			free(lines[i]);
+	free(lines);
+	free(patterns);
+
 	// Read whitelisted domains from file
 	read_whitelist_from_file();
 
@@ -0,0 +1,277 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query-log replay load generator (built via "make replay")
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+// Standalone tool: replays captured query logs against a running FTL
+// instance at a configurable speed multiplier and client distribution,
+// reporting achieved QPS and response latency percentiles.
+//
+//   pihole-FTL-replay <pihole-FTL.db | export.log> <server> <port> [speed] [clients]
+//
+//   speed:   time compression factor (0 = replay as fast as possible,
+//            1 = original timing, 10 = ten times faster, ...). Default: 0
+//   clients: queries are spread over this many loopback source addresses
+//            (127.0.0.1 ... 127.0.0.N) mirroring the original per-client
+//            distribution. Default: 1
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sqlite3.h"
+
+typedef struct {
+	long timestamp;
+	char domain[256];
+	int client;
+} replayRecord;
+
+static replayRecord *records = NULL;
+static long nrecords = 0, recordcapacity = 0;
+
+// Remember the original client strings to map them onto loopback sources
+static char (*clientnames)[64] = NULL;
+static int nclientnames = 0, clientcapacity = 0;
+
+static int client_index(const char *client)
+{
+	for(int i = 0; i < nclientnames; i++)
+		if(strcmp(clientnames[i], client) == 0)
+			return i;
+
+	if(nclientnames >= clientcapacity)
+	{
+		clientcapacity = clientcapacity > 0 ? 2*clientcapacity : 64;
+		clientnames = realloc(clientnames, (size_t)clientcapacity*sizeof(*clientnames));
+	}
+	snprintf(clientnames[nclientnames], sizeof(*clientnames), "%s", client);
+	return nclientnames++;
+}
+
+static void add_record(long timestamp, const char *domain, const char *client)
+{
+	if(nrecords >= recordcapacity)
+	{
+		recordcapacity = recordcapacity > 0 ? 2*recordcapacity : 4096;
+		records = realloc(records, (size_t)recordcapacity*sizeof(*records));
+	}
+	records[nrecords].timestamp = timestamp;
+	snprintf(records[nrecords].domain, sizeof(records[0].domain), "%s", domain);
+	records[nrecords].client = client_index(client);
+	nrecords++;
+}
+
+// Load the replay set from a long-term database (normalized schema)
+static bool load_from_db(const char *path)
+{
+	sqlite3 *db;
+	if(sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		fprintf(stderr, "Cannot open database %s: %s\n", path, sqlite3_errmsg(db));
+		return false;
+	}
+
+	sqlite3_stmt *stmt;
+	const char *sql = "SELECT q.timestamp, d.domain, c.ip FROM queries q "
+	                  "JOIN domain_by_id d ON q.domain = d.id "
+	                  "JOIN client_by_id c ON q.client = c.id ORDER BY q.timestamp";
+	if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		fprintf(stderr, "Cannot prepare query: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return false;
+	}
+
+	while(sqlite3_step(stmt) == SQLITE_ROW)
+		add_record(sqlite3_column_int64(stmt, 0),
+		           (const char*)sqlite3_column_text(stmt, 1),
+		           (const char*)sqlite3_column_text(stmt, 2));
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return true;
+}
+
+// Load the replay set from a text log in the format produced by >export
+// ("timestamp type domain client ...")
+static bool load_from_log(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	long timestamp;
+	char type[16], domain[256], client[64];
+	while(getline(&line, &size, fp) != -1)
+		if(sscanf(line, "%li %15s %255s %63s", &timestamp, type, domain, client) == 4)
+			add_record(timestamp, domain, client);
+
+	free(line);
+	fclose(fp);
+	return true;
+}
+
+// Encode a DNS A query for the given domain
+static size_t build_query(const char *domain, unsigned short id, unsigned char *packet)
+{
+	packet[0] = id >> 8;
+	packet[1] = id & 0xff;
+	packet[2] = 0x01; // RD
+	packet[3] = 0;
+	packet[4] = 0; packet[5] = 1; // QDCOUNT
+	memset(&packet[6], 0, 6);
+
+	size_t pos = 12;
+	const char *label = domain;
+	while(*label != '\0')
+	{
+		const char *dot = strchr(label, '.');
+		const size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+		if(len == 0 || len > 63 || pos + len + 2 > 500)
+			return 0;
+		packet[pos++] = (unsigned char)len;
+		memcpy(&packet[pos], label, len);
+		pos += len;
+		label += len + (dot != NULL ? 1 : 0);
+	}
+	packet[pos++] = 0;
+	packet[pos++] = 0; packet[pos++] = 1; // A
+	packet[pos++] = 0; packet[pos++] = 1; // IN
+	return pos;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double da = *(const double*)a, db = *(const double*)b;
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <pihole-FTL.db | export.log> <server> <port> [speed] [clients]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char *source = argv[1];
+	const char *server = argv[2];
+	const int port = atoi(argv[3]);
+	const double speed = argc > 4 ? atof(argv[4]) : 0.0;
+	const int spreadclients = argc > 5 ? atoi(argv[5]) : 1;
+
+	// Try the database format first, fall back to the text log
+	if(!load_from_db(source) || nrecords == 0)
+		load_from_log(source);
+
+	if(nrecords == 0)
+	{
+		fprintf(stderr, "No replayable records found in %s\n", source);
+		return EXIT_FAILURE;
+	}
+
+	printf("Replaying %ld queries from %ld distinct clients against %s:%i "
+	       "(speed %s, %i loopback sources)\n",
+	       nrecords, (long)nclientnames, server, port,
+	       speed > 0.0 ? "scaled" : "max", spreadclients);
+
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(port);
+	inet_pton(AF_INET, server, &dest.sin_addr);
+
+	// One socket per loopback source address
+	int *socks = calloc(spreadclients > 0 ? spreadclients : 1, sizeof(int));
+	for(int i = 0; i < spreadclients; i++)
+	{
+		socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		struct timeval timeout = { 2, 0 };
+		setsockopt(socks[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		struct sockaddr_in src;
+		memset(&src, 0, sizeof(src));
+		src.sin_family = AF_INET;
+		char ip[32];
+		snprintf(ip, sizeof(ip), "127.0.0.%i", 1 + (i % 250));
+		inet_pton(AF_INET, ip, &src.sin_addr);
+		bind(socks[i], (struct sockaddr*)&src, sizeof(src));
+	}
+
+	double *latencies = calloc(nrecords, sizeof(double));
+	long answered = 0, timeouts = 0;
+	const double start = now_us();
+	const long firststamp = records[0].timestamp;
+
+	for(long i = 0; i < nrecords; i++)
+	{
+		// Pace the replay according to the original timing
+		if(speed > 0.0)
+		{
+			const double due = (records[i].timestamp - firststamp)*1e6/speed;
+			double ahead = due - (now_us() - start);
+			if(ahead > 0)
+				usleep((useconds_t)ahead);
+		}
+
+		unsigned char packet[512], reply[512];
+		const unsigned short id = (unsigned short)(i & 0xffff);
+		const size_t len = build_query(records[i].domain, id, packet);
+		if(len == 0)
+			continue;
+
+		const int sock = socks[records[i].client % spreadclients];
+		const double sent = now_us();
+		sendto(sock, packet, len, 0, (struct sockaddr*)&dest, sizeof(dest));
+		const ssize_t got = recv(sock, reply, sizeof(reply), 0);
+		if(got >= 2 && reply[0] == packet[0] && reply[1] == packet[1])
+			latencies[answered++] = now_us() - sent;
+		else
+			timeouts++;
+	}
+
+	const double elapsed = (now_us() - start)/1e6;
+
+	printf("\nReplayed %ld queries in %.2f s -> %.0f qps (%ld answered, %ld lost)\n",
+	       nrecords, elapsed, nrecords/elapsed, answered, timeouts);
+
+	if(answered > 0)
+	{
+		qsort(latencies, answered, sizeof(double), cmp_double);
+		printf("Latency: p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us\n",
+		       latencies[answered/2],
+		       latencies[(long)(answered*0.9)],
+		       latencies[(long)(answered*0.99)],
+		       latencies[answered-1]);
+	}
+
+	free(latencies);
+	free(records);
+	free(clientnames);
+	free(socks);
+	return EXIT_SUCCESS;
+}
@@ -16,165 +16,350 @@ bool __attribute__((pure)) command(const char *client_message, const char* cmd)
 	return strstr(client_message, cmd) != NULL;
 }
 
-void process_request(const char *client_message, int *sock)
-{
-	char EOT[2];
-	EOT[0] = 0x04;
-	EOT[1] = 0x00;
-	bool processed = false;
+// All API endpoints, resolved through a keyword-hash dispatch table so that
+// routing a request is a single lookup instead of re-scanning the message
+// for every candidate endpoint
+enum { CMD_STATS, CMD_OVERTIME, CMD_TOPDOMAINS, CMD_TOPCLIENTS, CMD_FORWARDDEST,
+       CMD_FORWARDNAMES, CMD_QUERYTYPES, CMD_GETALLQUERIES, CMD_RECENTBLOCKED,
+       CMD_CLIENTID, CMD_QUERYTYPESOVERTIME, CMD_VERSION, CMD_DBSTATS,
+       CMD_CLIENTSOVERTIME, CMD_CLIENTNAMES, CMD_UNKNOWN, CMD_DOMAIN,
+       CMD_CACHEINFO, CMD_RERESOLVE, CMD_RECOMPILE_REGEX, CMD_UPDATE_MAC_VENDOR,
+       CMD_EXPORT, CMD_SUBSCRIBE, CMD_DBHISTORY, CMD_FLOODING, CMD_HOOKTIMES, CMD_LATENCY, CMD_METRICS, CMD_LOCKSTATS, CMD_MEMORY };
 
-	if(command(client_message, ">stats"))
-	{
-		processed = true;
-		lock_shm();
-		getStats(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">overTime"))
-	{
-		processed = true;
-		lock_shm();
-		getOverTime(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
-	{
-		processed = true;
-		lock_shm();
-		getTopDomains(client_message, sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">top-clients"))
-	{
-		processed = true;
-		lock_shm();
-		getTopClients(client_message, sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">forward-dest"))
-	{
-		processed = true;
-		lock_shm();
-		getForwardDestinations(client_message, sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">forward-names"))
-	{
-		processed = true;
-		lock_shm();
-		getForwardDestinations(">forward-dest unsorted", sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">querytypes"))
-	{
-		processed = true;
-		lock_shm();
-		getQueryTypes(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">getallqueries"))
-	{
-		processed = true;
-		lock_shm();
-		getAllQueries(client_message, sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">recentBlocked"))
-	{
-		processed = true;
-		lock_shm();
-		getRecentBlocked(client_message, sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">clientID"))
-	{
-		processed = true;
-		lock_shm();
-		getClientID(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">QueryTypesoverTime"))
-	{
-		processed = true;
-		lock_shm();
-		getQueryTypesOverTime(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">version"))
-	{
-		processed = true;
-		// No lock required
-		getVersion(sock);
-	}
-	else if(command(client_message, ">dbstats"))
-	{
-		processed = true;
-		// No lock required. Access to the database
-		// is guaranteed to be atomic
-		getDBstats(sock);
-	}
-	else if(command(client_message, ">ClientsoverTime"))
-	{
-		processed = true;
-		lock_shm();
-		getClientsOverTime(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">client-names"))
-	{
-		processed = true;
-		lock_shm();
-		getClientNames(sock);
-		unlock_shm();
-	}
-	else if(command(client_message, ">unknown"))
+static const struct {
+	const char *cmd;
+	int id;
+} commands[] = {
+	{ ">stats",                  CMD_STATS },
+	{ ">overTime",               CMD_OVERTIME },
+	{ ">top-domains",            CMD_TOPDOMAINS },
+	{ ">top-ads",                CMD_TOPDOMAINS },
+	{ ">top-clients",            CMD_TOPCLIENTS },
+	{ ">forward-dest",           CMD_FORWARDDEST },
+	{ ">forward-names",          CMD_FORWARDNAMES },
+	{ ">querytypes",             CMD_QUERYTYPES },
+	{ ">getallqueries",          CMD_GETALLQUERIES },
+	{ ">getallqueries-time",     CMD_GETALLQUERIES },
+	{ ">getallqueries-qtype",    CMD_GETALLQUERIES },
+	{ ">getallqueries-forward",  CMD_GETALLQUERIES },
+	{ ">getallqueries-domain",   CMD_GETALLQUERIES },
+	{ ">getallqueries-client",   CMD_GETALLQUERIES },
+	{ ">recentBlocked",          CMD_RECENTBLOCKED },
+	{ ">clientID",               CMD_CLIENTID },
+	{ ">QueryTypesoverTime",     CMD_QUERYTYPESOVERTIME },
+	{ ">version",                CMD_VERSION },
+	{ ">dbstats",                CMD_DBSTATS },
+	{ ">ClientsoverTime",        CMD_CLIENTSOVERTIME },
+	{ ">client-names",           CMD_CLIENTNAMES },
+	{ ">unknown",                CMD_UNKNOWN },
+	{ ">domain",                 CMD_DOMAIN },
+	{ ">cacheinfo",              CMD_CACHEINFO },
+	{ ">reresolve",              CMD_RERESOLVE },
+	{ ">recompile-regex",        CMD_RECOMPILE_REGEX },
+	{ ">update-mac-vendor",      CMD_UPDATE_MAC_VENDOR },
+	{ ">export",                 CMD_EXPORT },
+	{ ">subscribe",              CMD_SUBSCRIBE },
+	{ ">dbhistory",              CMD_DBHISTORY },
+	{ ">flooding",               CMD_FLOODING },
+	{ ">hooktimes",              CMD_HOOKTIMES },
+	{ ">latency",                CMD_LATENCY },
+	{ ">metrics",                CMD_METRICS },
+	{ ">lockstats",              CMD_LOCKSTATS },
+	{ ">memory",                 CMD_MEMORY },
+};
+
+// Dispatch table: power-of-two sized, open addressing. Holds indices into
+// commands[], -1 marks an empty slot
+#define DISPATCH_SLOTS 64
+static int dispatch[DISPATCH_SLOTS];
+static bool dispatch_built = false;
+
+// Hash a command keyword (FNV-1a)
+static uint32_t __attribute__((pure)) hash_command(const char *cmd)
+{
+	uint32_t hash = 2166136261u;
+	for(; *cmd != '\0'; cmd++)
 	{
-		processed = true;
-		lock_shm();
-		getUnknownQueries(sock);
-		unlock_shm();
+		hash ^= (uint32_t)(unsigned char)*cmd;
+		hash *= 16777619u;
 	}
-	else if(command(client_message, ">domain"))
+	return hash;
+}
+
+// Build the dispatch table. Called once on the first request
+static void build_dispatch_table(void)
+{
+	for(unsigned int i = 0; i < DISPATCH_SLOTS; i++)
+		dispatch[i] = -1;
+
+	for(unsigned int i = 0; i < sizeof(commands)/sizeof(*commands); i++)
 	{
-		processed = true;
-		lock_shm();
-		getDomainDetails(client_message, sock);
-		unlock_shm();
+		uint32_t slot = hash_command(commands[i].cmd) & (DISPATCH_SLOTS-1);
+		// Linear probing
+		while(dispatch[slot] >= 0)
+			slot = (slot + 1u) & (DISPATCH_SLOTS-1);
+		dispatch[slot] = i;
 	}
-	else if(command(client_message, ">cacheinfo"))
+
+	dispatch_built = true;
+}
+
+// Resolve a client message into a command ID (or -1 if unknown). The keyword
+// is everything from the ">" up to the first space, parenthesis or line end
+static int __attribute__((pure)) find_command(const char *client_message)
+{
+	const char *start = strchr(client_message, '>');
+	if(start == NULL)
+		return -1;
+
+	// Extract the command keyword
+	char keyword[64];
+	unsigned int length = 0;
+	for(const char *pos = start; length < sizeof(keyword)-1; pos++)
 	{
-		processed = true;
-		lock_shm();
-		getCacheInformation(sock);
-		unlock_shm();
+		if(*pos == '\0' || *pos == ' ' || *pos == '(' ||
+		   *pos == '\n' || *pos == '\r')
+			break;
+		keyword[length++] = *pos;
 	}
-	else if(command(client_message, ">reresolve"))
+	keyword[length] = '\0';
+
+	// Look up the keyword in the dispatch table
+	for(uint32_t slot = hash_command(keyword) & (DISPATCH_SLOTS-1); ;
+	    slot = (slot + 1u) & (DISPATCH_SLOTS-1))
 	{
-		processed = true;
-		logg("Received API request to re-resolve host names");
-		// Important: Don't obtain a lock for this request
-		//            Locking will be done internally when needed
-		// onlynew=false -> reresolve all host names
-		resolveClients(false);
-		resolveForwardDestinations(false);
-		logg("Done re-resolving host names");
+		const int candidate = dispatch[slot];
+		if(candidate < 0)
+			return -1;
+
+		if(strcmp(commands[candidate].cmd, keyword) == 0)
+			return commands[candidate].id;
 	}
-	else if(command(client_message, ">recompile-regex"))
+}
+
+// Read-only commands whose serialized response only depends on the command
+// string and the current data epoch. These are eligible for the server-side
+// response cache
+static bool __attribute__((const)) cacheable_command(int id)
+{
+	switch(id)
 	{
-		processed = true;
-		logg("Received API request to recompile regex");
-		lock_shm();
-		free_regex();
-		read_regex_from_file();
-		unlock_shm();
+		case CMD_STATS:
+		case CMD_OVERTIME:
+		case CMD_TOPDOMAINS:
+		case CMD_TOPCLIENTS:
+		case CMD_FORWARDDEST:
+		case CMD_FORWARDNAMES:
+		case CMD_QUERYTYPES:
+		case CMD_QUERYTYPESOVERTIME:
+		case CMD_CLIENTSOVERTIME:
+		case CMD_METRICS:
+			return true;
+		default:
+			return false;
 	}
-	else if(command(client_message, ">update-mac-vendor"))
+}
+
+void process_request(const char *client_message, int *sock)
+{
+	char EOT[2];
+	EOT[0] = 0x04;
+	EOT[1] = 0x00;
+	bool processed = true;
+
+	if(!dispatch_built)
+		build_dispatch_table();
+
+	const int cmd_id = find_command(client_message);
+	const bool cacheable = cacheable_command(cmd_id);
+
+	// Serve identical requests within the same data epoch from the cache
+	const bool cached = cacheable && serve_cached_response(client_message, *sock);
+
+	if(cacheable && !cached)
+		start_response_capture(*sock);
+
+	switch(cached ? -1 : cmd_id)
 	{
-		processed = true;
-		logg("Received API request to update vendors in network table");
-		updateMACVendorRecords();
+		case CMD_STATS:
+			lock_shm_read();
+			getStats(sock);
+			unlock_shm();
+			break;
+		case CMD_OVERTIME:
+			lock_shm_read();
+			getOverTime(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_TOPDOMAINS:
+			lock_shm_read();
+			getTopDomains(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_TOPCLIENTS:
+			lock_shm_read();
+			getTopClients(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_FORWARDDEST:
+			lock_shm_read();
+			getForwardDestinations(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_FORWARDNAMES:
+			lock_shm_read();
+			getForwardDestinations(">forward-dest unsorted", sock);
+			unlock_shm();
+			break;
+		case CMD_QUERYTYPES:
+			lock_shm_read();
+			getQueryTypes(sock);
+			unlock_shm();
+			break;
+		case CMD_GETALLQUERIES:
+			lock_shm_read();
+			getAllQueries(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_RECENTBLOCKED:
+			lock_shm_read();
+			getRecentBlocked(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_CLIENTID:
+			lock_shm_read();
+			getClientID(sock);
+			unlock_shm();
+			break;
+		case CMD_QUERYTYPESOVERTIME:
+			lock_shm_read();
+			getQueryTypesOverTime(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_VERSION:
+			// No lock required
+			getVersion(sock);
+			break;
+		case CMD_DBSTATS:
+			// No lock required. Access to the database
+			// is guaranteed to be atomic
+			getDBstats(sock);
+			break;
+		case CMD_DBHISTORY:
+			// No lock required, this is served entirely from the
+			// rollup tables in the database
+			getDBhistory(sock);
+			break;
+		case CMD_CLIENTSOVERTIME:
+			lock_shm_read();
+			getClientsOverTime(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_METRICS:
+			lock_shm_read();
+			getMetrics(sock);
+			unlock_shm();
+			break;
+		case CMD_MEMORY:
+			lock_shm_read();
+			getMemory(sock);
+			unlock_shm();
+			break;
+		case CMD_LOCKSTATS:
+			lock_shm_read();
+			getLockStats(sock);
+			unlock_shm();
+			break;
+		case CMD_LATENCY:
+			lock_shm_read();
+			getLatency(sock);
+			unlock_shm();
+			break;
+		case CMD_HOOKTIMES:
+			lock_shm_read();
+			getHookTimes(sock);
+			unlock_shm();
+			break;
+		case CMD_FLOODING:
+			lock_shm_read();
+			getFlooding(sock);
+			unlock_shm();
+			break;
+		case CMD_CLIENTNAMES:
+			lock_shm_read();
+			getClientNames(sock);
+			unlock_shm();
+			break;
+		case CMD_UNKNOWN:
+			lock_shm_read();
+			getUnknownQueries(sock);
+			unlock_shm();
+			break;
+		case CMD_DOMAIN:
+			lock_shm_read();
+			getDomainDetails(client_message, sock);
+			unlock_shm();
+			break;
+		case CMD_CACHEINFO:
+			lock_shm_read();
+			getCacheInformation(sock);
+			unlock_shm();
+			break;
+		case CMD_RERESOLVE:
+			logg("Received API request to re-resolve host names");
+			// Important: Don't obtain a lock for this request
+			//            Locking will be done internally when needed
+			// onlynew=false -> reresolve all host names
+			resolveClients(false);
+			resolveForwardDestinations(false);
+			logg("Done re-resolving host names");
+			break;
+		case CMD_RECOMPILE_REGEX:
+			logg("Received API request to recompile regex");
+			// Exclusive lock: recompiling the regex filters resets the
+			// per-domain regexmatch fields in shared memory
+			lock_shm();
+			free_regex();
+			read_regex_from_file();
+			unlock_shm();
+			break;
+		case CMD_SUBSCRIBE:
+		{
+			// Register interest in pushed updates, e.g.
+			// ">subscribe stats overTime". Without explicit topics
+			// the client is subscribed to everything
+			unsigned int topics = 0;
+			if(command(client_message, " stats"))
+				topics |= SUBSCRIBE_STATS;
+			if(command(client_message, " overTime"))
+				topics |= SUBSCRIBE_OVERTIME;
+			if(topics == 0)
+				topics = SUBSCRIBE_STATS | SUBSCRIBE_OVERTIME;
+
+			if(add_subscriber(*sock, topics))
+				ssend(*sock, "subscribed\n");
+			else
+				ssend(*sock, "error: too many subscribers\n");
+			break;
+		}
+		case CMD_EXPORT:
+			// No outer lock: the export takes and releases the
+			// shared lock once per chunk internally
+			getQueryExport(client_message, sock);
+			break;
+		case CMD_UPDATE_MAC_VENDOR:
+			logg("Received API request to update vendors in network table");
+			updateMACVendorRecords();
+			break;
+		default:
+			processed = cached;
+			break;
 	}
 
+	// Remember the captured response for identical requests
+	if(cacheable && !cached)
+		store_cached_response(client_message, *sock);
+
 	// Test only at the end if we want to quit or kill
 	// so things can be processed before
 	if(command(client_message, ">quit") || command(client_message, EOT))
@@ -195,4 +380,11 @@ void process_request(const char *client_message, int *sock)
 		// Send EOM
 		seom(*sock);
 	}
+
+	// Drop the per-response string table (no-op unless the client
+	// requested string-table framing for this response)
+	pack_strtab_end();
+
+	// Release all short-lived per-request allocations in one go
+	arena_release();
 }
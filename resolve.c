@@ -11,12 +11,183 @@
 #include "FTL.h"
 #include "shmem.h"
 
+// Build the reverse-lookup QNAME for an IP address in DNS wire format
+// (length-prefixed labels). Returns the encoded length or 0 on failure
+static size_t build_ptr_qname(const char *addr, bool IPv6, unsigned char *qname, size_t size)
+{
+	char name[128];
+	if(IPv6)
+	{
+		struct in6_addr ip;
+		if(inet_pton(AF_INET6, addr, &ip) != 1)
+			return 0;
+		// Nibble format, least significant first
+		char *pos = name;
+		for(int i = 15; i >= 0; i--)
+			pos += sprintf(pos, "%x.%x.", ip.s6_addr[i] & 0xf, ip.s6_addr[i] >> 4);
+		strcpy(pos, "ip6.arpa");
+	}
+	else
+	{
+		unsigned int a, b, c, d;
+		if(sscanf(addr, "%u.%u.%u.%u", &a, &b, &c, &d) != 4)
+			return 0;
+		snprintf(name, sizeof(name), "%u.%u.%u.%u.in-addr.arpa", d, c, b, a);
+	}
+
+	// Encode as length-prefixed labels
+	size_t out = 0;
+	const char *label = name;
+	while(*label != '\0')
+	{
+		const char *dot = strchr(label, '.');
+		const size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+		if(len == 0 || len > 63 || out + len + 2 > size)
+			return 0;
+		qname[out++] = (unsigned char)len;
+		memcpy(&qname[out], label, len);
+		out += len;
+		label += len + (dot != NULL ? 1 : 0);
+	}
+	qname[out++] = 0;
+	return out;
+}
+
+// Decode a (possibly compressed) DNS name from a reply into a dotted string
+static bool decode_dns_name(const unsigned char *packet, size_t plen, size_t pos, char *out, size_t outsize)
+{
+	size_t used = 0;
+	int hops = 0;
+	while(pos < plen)
+	{
+		const unsigned char len = packet[pos];
+		if(len == 0)
+		{
+			if(used == 0)
+				return false;
+			out[used-1] = '\0'; // Strip trailing dot
+			return true;
+		}
+		if((len & 0xc0) == 0xc0)
+		{
+			// Compression pointer
+			if(pos + 1 >= plen || ++hops > 16)
+				return false;
+			pos = ((len & 0x3f) << 8) | packet[pos+1];
+			continue;
+		}
+		if(pos + 1 + len > plen || used + len + 1 >= outsize)
+			return false;
+		memcpy(&out[used], &packet[pos+1], len);
+		used += len;
+		out[used++] = '.';
+		pos += 1 + len;
+	}
+	return false;
+}
+
+// Resolve a PTR record by querying the embedded dnsmasq directly: answers
+// dnsmasq already holds in its cache come back without touching the system
+// resolver path, and cache misses are forwarded upstream by dnsmasq itself
+static char *resolve_via_dnsmasq(const char *addr, bool IPv6)
+{
+	unsigned char packet[512];
+	unsigned char qname[256];
+	const size_t qnamelen = build_ptr_qname(addr, IPv6, qname, sizeof(qname));
+	if(qnamelen == 0)
+		return NULL;
+
+	// Build the query: header, QNAME, QTYPE=PTR(12), QCLASS=IN(1)
+	const unsigned short id = (unsigned short)(random() & 0xffff);
+	memset(packet, 0, 12);
+	packet[0] = id >> 8;
+	packet[1] = id & 0xff;
+	packet[2] = 0x01; // RD
+	packet[5] = 0x01; // QDCOUNT = 1
+	memcpy(&packet[12], qname, qnamelen);
+	size_t plen = 12 + qnamelen;
+	packet[plen++] = 0; packet[plen++] = 12; // PTR
+	packet[plen++] = 0; packet[plen++] = 1;  // IN
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock < 0)
+		return NULL;
+
+	struct timeval timeout = { 2, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	dest.sin_port = htons(FTL_dnsmasq_port());
+
+	if(sendto(sock, packet, plen, 0, (struct sockaddr*)&dest, sizeof(dest)) < 0)
+	{
+		close(sock);
+		return NULL;
+	}
+
+	unsigned char reply[1024];
+	const ssize_t rlen = recv(sock, reply, sizeof(reply), 0);
+	close(sock);
+	if(rlen < 12 || reply[0] != packet[0] || reply[1] != packet[1])
+		return NULL;
+
+	const unsigned int ancount = (reply[6] << 8) | reply[7];
+	if(ancount == 0)
+		return NULL;
+
+	// Skip the question section
+	size_t pos = 12;
+	while(pos < (size_t)rlen && reply[pos] != 0)
+	{
+		if((reply[pos] & 0xc0) == 0xc0) { pos++; break; }
+		pos += reply[pos] + 1;
+	}
+	pos += 5; // Zero byte + QTYPE + QCLASS
+
+	// Walk the answers until we find a PTR record
+	for(unsigned int n = 0; n < ancount && pos + 12 <= (size_t)rlen; n++)
+	{
+		// Skip the owner name
+		while(pos < (size_t)rlen && reply[pos] != 0 && (reply[pos] & 0xc0) != 0xc0)
+			pos += reply[pos] + 1;
+		pos += (pos < (size_t)rlen && (reply[pos] & 0xc0) == 0xc0) ? 2 : 1;
+		if(pos + 10 > (size_t)rlen)
+			break;
+
+		const unsigned int type = (reply[pos] << 8) | reply[pos+1];
+		const unsigned int rdlen = (reply[pos+8] << 8) | reply[pos+9];
+		pos += 10;
+		if(pos + rdlen > (size_t)rlen)
+			break;
+
+		if(type == 12)
+		{
+			char hostname[256];
+			if(decode_dns_name(reply, rlen, pos, hostname, sizeof(hostname)))
+			{
+				char *result = strdup(hostname);
+				if(result != NULL)
+					strtolower(result);
+				return result;
+			}
+			return NULL;
+		}
+		pos += rdlen;
+	}
+
+	return NULL;
+}
+
 static char *resolveHostname(const char *addr)
 {
 	// Get host name
-	struct hostent *he = NULL;
-	char *hostname = NULL;;
+	char host[NI_MAXHOST] = "";
+	char *hostname = NULL;
 	bool IPv6 = false;
+	int ret = EAI_FAIL;
 
 	// Check if this is a hidden client
 	// if so, return "hidden" as hostname
@@ -33,20 +204,36 @@ static char *resolveHostname(const char *addr)
 		IPv6 = true;
 	}
 
+	// Ask the embedded dnsmasq first: its cache often already holds the
+	// PTR record and the lookup avoids the loopback round-trip through
+	// the libc resolver machinery
+	if((IPv6 && config.resolveIPv6) || (!IPv6 && config.resolveIPv4))
+	{
+		hostname = resolve_via_dnsmasq(addr, IPv6);
+		if(hostname != NULL)
+			return hostname;
+	}
+
+	// Fallback: getnameinfo() is thread-safe, the lookups may run
+	// concurrently in the resolver worker pool
 	if(IPv6 && config.resolveIPv6) // Resolve IPv6 address only if requested
 	{
-		struct in6_addr ipaddr;
-		inet_pton(AF_INET6, addr, &ipaddr);
-		he = gethostbyaddr(&ipaddr, sizeof ipaddr, AF_INET6);
+		struct sockaddr_in6 sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin6_family = AF_INET6;
+		inet_pton(AF_INET6, addr, &sa.sin6_addr);
+		ret = getnameinfo((struct sockaddr*)&sa, sizeof(sa), host, sizeof(host), NULL, 0, NI_NAMEREQD);
 	}
 	else if(!IPv6 && config.resolveIPv4) // Resolve IPv4 address only if requested
 	{
-		struct in_addr ipaddr;
-		inet_pton(AF_INET, addr, &ipaddr);
-		he = gethostbyaddr(&ipaddr, sizeof ipaddr, AF_INET);
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		inet_pton(AF_INET, addr, &sa.sin_addr);
+		ret = getnameinfo((struct sockaddr*)&sa, sizeof(sa), host, sizeof(host), NULL, 0, NI_NAMEREQD);
 	}
 
-	if(he == NULL)
+	if(ret != 0)
 	{
 		// No hostname found
 		hostname = strdup("");
@@ -55,7 +242,7 @@ static char *resolveHostname(const char *addr)
 	else
 	{
 		// Return hostname copied to new memory location
-		hostname = strdup(he->h_name);
+		hostname = strdup(host);
 		if(hostname == NULL) return NULL;
 		// Convert hostname to lower case
 		strtolower(hostname);
@@ -68,7 +255,7 @@ static size_t resolveAndAddHostname(size_t ippos, size_t oldnamepos)
 {
 	// Get IP and host name strings. They are cloned in case shared memory is
 	// resized before the next lock
-	lock_shm();
+	lock_shm_read();
 	char* ipaddr = strdup(getstr(ippos));
 	char* oldname = strdup(getstr(oldnamepos));
 	unlock_shm();
@@ -105,110 +292,190 @@ static size_t resolveAndAddHostname(size_t ippos, size_t oldnamepos)
 	return oldnamepos;
 }
 
-// Resolve client host names
-void resolveClients(bool onlynew)
+// Resolve one client or forward destination entry
+static void resolveEntry(bool client, int id, bool onlynew)
 {
-	// Lock counter access here, we use a copy in the following loop
-	lock_shm();
-	int clientscount = counters->clients;
-	unlock_shm();
-	for(int clientID = 0; clientID < clientscount; clientID++)
+	bool newflag;
+	size_t ippos, oldnamepos;
+	time_t nameexpires;
+
+	// Memory access needs to get locked
+	lock_shm_read();
+	if(client)
 	{
-		// Memory validation
-		validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
+		newflag = clients[id].new;
+		ippos = clients[id].ippos;
+		oldnamepos = clients[id].namepos;
+		nameexpires = clients[id].nameexpires;
+	}
+	else
+	{
+		newflag = forwarded[id].new;
+		ippos = forwarded[id].ippos;
+		oldnamepos = forwarded[id].namepos;
+		nameexpires = forwarded[id].nameexpires;
+	}
+	unlock_shm();
 
-		// Memory access needs to get locked
-		lock_shm();
-		bool newflag = clients[clientID].new;
-		size_t ippos = clients[clientID].ippos;
-		size_t oldnamepos = clients[clientID].namepos;
-		unlock_shm();
+	// If onlynew flag is set, we will only resolve new entries
+	// If not, we will try to re-resolve all known entries
+	if(onlynew && !newflag)
+		return;
 
-		// If onlynew flag is set, we will only resolve new clients
-		// If not, we will try to re-resolve all known clients
-		if(onlynew && !newflag)
-			continue;
+	// Skip entries whose cached name has not expired yet: repeated
+	// passes only pay lookups for stale entries
+	if(!newflag && time(NULL) < nameexpires)
+		return;
 
-		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
+	// Obtain/update hostname of this entry
+	size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
 
-		lock_shm();
+	lock_shm();
+	if(client)
+	{
 		// Store obtained host name (may be unchanged)
-		clients[clientID].namepos = newnamepos;
+		clients[id].namepos = newnamepos;
+		// Mark entry as not new and the name as fresh
+		clients[id].new = false;
+		clients[id].nameexpires = time(NULL) + config.resolveTTL;
+	}
+	else
+	{
+		forwarded[id].namepos = newnamepos;
+		forwarded[id].new = false;
+		forwarded[id].nameexpires = time(NULL) + config.resolveTTL;
+	}
+	unlock_shm();
+}
 
-		// Mark entry as not new
-		clients[clientID].new = false;
-		unlock_shm();
+// One slice of the entries resolved by a worker thread. The lookups are
+// blocking (getnameinfo), so a bounded pool of concurrent workers turns
+// the former one-at-a-time pass over thousands of clients into seconds
+#define RESOLVE_THREADS 8
+
+typedef struct {
+	int from;
+	int to;
+	bool client;
+	bool onlynew;
+} resolveSliceStruct;
+
+static void *resolve_slice(void *val)
+{
+	resolveSliceStruct *slice = (resolveSliceStruct*)val;
+	for(int id = slice->from; id < slice->to; id++)
+	{
+		// Memory validation
+		validate_access(slice->client ? "clients" : "forwarded", id, true, __LINE__, __FUNCTION__, __FILE__);
+		resolveEntry(slice->client, id, slice->onlynew);
 	}
+	return NULL;
 }
 
-// Resolve upstream destination host names
-void resolveForwardDestinations(bool onlynew)
+// Resolve all client resp. forward destination host names with a bounded
+// pool of concurrent worker threads
+static void resolveAll(bool client, bool onlynew)
 {
 	// Lock counter access here, we use a copy in the following loop
-	lock_shm();
-	int forwardedcount = counters->forwarded;
+	lock_shm_read();
+	const int count = client ? counters->clients : counters->forwarded;
 	unlock_shm();
-	for(int forwardID = 0; forwardID < forwardedcount; forwardID++)
+
+	if(count == 0)
+		return;
+
+	const int threads = count < RESOLVE_THREADS ? count : RESOLVE_THREADS;
+	pthread_t tid[RESOLVE_THREADS];
+	resolveSliceStruct slice[RESOLVE_THREADS];
+	const int stride = (count + threads - 1) / threads;
+	for(int t = 0; t < threads; t++)
 	{
-		// Memory validation
-		validate_access("forwarded", forwardID, true, __LINE__, __FUNCTION__, __FILE__);
+		slice[t].from = t*stride;
+		slice[t].to = (t+1)*stride < count ? (t+1)*stride : count;
+		slice[t].client = client;
+		slice[t].onlynew = onlynew;
+		if(pthread_create(&tid[t], NULL, resolve_slice, &slice[t]) != 0)
+		{
+			// Thread creation failed, resolve this slice inline
+			resolve_slice(&slice[t]);
+			tid[t] = 0;
+		}
+	}
+	for(int t = 0; t < threads; t++)
+		if(tid[t] != 0)
+			pthread_join(tid[t], NULL);
+}
 
-		// Memory access needs to get locked
-		lock_shm();
-		bool newflag = forwarded[forwardID].new;
-		size_t ippos = forwarded[forwardID].ippos;
-		size_t oldnamepos = forwarded[forwardID].namepos;
-		unlock_shm();
+// Resolve client host names
+void resolveClients(bool onlynew)
+{
+	resolveAll(true, onlynew);
+}
 
-		// If onlynew flag is set, we will only resolve new upstream destinations
-		// If not, we will try to re-resolve all known upstream destinations
-		if(onlynew && !newflag)
-			continue;
+// Resolve upstream destination host names
+void resolveForwardDestinations(bool onlynew)
+{
+	resolveAll(false, onlynew);
+}
 
-		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
+// Event-driven wakeup of the resolver thread: findClientID() and
+// findForwardID() signal this condition when they created a new entry, so
+// fresh clients get their host name within moments instead of waiting for
+// the next fixed polling interval -- and the thread no longer does wasted
+// full scans when nothing is new
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static bool resolver_pending = false;
 
-		lock_shm();
-		// Store obtained host name (may be unchanged)
-		forwarded[forwardID].namepos = newnamepos;
-		// Mark entry as not new
-		forwarded[forwardID].new = false;
-		unlock_shm();
-	}
+void notify_resolver(void)
+{
+	pthread_mutex_lock(&resolver_mutex);
+	resolver_pending = true;
+	pthread_cond_signal(&resolver_cond);
+	pthread_mutex_unlock(&resolver_mutex);
 }
 
 void *DNSclient_thread(void *val)
 {
 	// Set thread name
 	prctl(PR_SET_NAME, "DNS client", 0, 0, 0);
+	thread_set_background();
 
+	time_t lastfullpass = time(NULL);
 	while(!killed)
 	{
-		// Run every minute to resolve only new clients and upstream servers
-		if(time(NULL) % RESOLVE_INTERVAL == 0)
+		// Sleep until new entries are signalled (with a one-second
+		// upper bound so shutdown and the hourly pass are noticed)
+		pthread_mutex_lock(&resolver_mutex);
+		if(!resolver_pending)
+		{
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += 1;
+			pthread_cond_timedwait(&resolver_cond, &resolver_mutex, &until);
+		}
+		const bool pending = resolver_pending;
+		resolver_pending = false;
+		pthread_mutex_unlock(&resolver_mutex);
+
+		if(pending)
 		{
 			// Try to resolve new client host names (onlynew=true)
 			resolveClients(true);
 			// Try to resolve new upstream destination host names (onlynew=true)
 			resolveForwardDestinations(true);
-			// Prevent immediate re-run of this routine
-			sleepms(500);
 		}
 
-		// Run every hour to update possibly changed client host names
-		if(time(NULL) % RERESOLVE_INTERVAL == 0)
+		// Run every hour to update possibly changed host names. The
+		// TTL-gated skip keeps fresh entries out of this pass
+		if(time(NULL) - lastfullpass >= RERESOLVE_INTERVAL)
 		{
+			lastfullpass = time(NULL);
 			// Try to resolve all client host names (onlynew=false)
 			resolveClients(false);
 			// Try to resolve all upstream destination host names (onlynew=false)
 			resolveForwardDestinations(false);
-			// Prevent immediate re-run of this routine
-			sleepms(500);
 		}
-
-		// Idle for 0.5 sec before checking again the time criteria
-		sleepms(500);
 	}
 
 	return NULL;
@@ -13,11 +13,17 @@ void timer_start(int i);
 double timer_elapsed_msec(int i);
 void sleepms(int milliseconds);
 void savepid(void);
+extern pid_t mainpid;
+extern bool queries_unsorted;
 char * getUserName(void);
 void removepid(void);
+void *scheduler_thread(void *val);
+void thread_set_background(void);
+void main_thread_affinity(void);
 
 void open_FTL_log(bool test);
 void logg(const char* format, ...) __attribute__ ((format (gnu_printf, 1, 2)));
+void *logwriter_thread(void *val);
 void logg_struct_resize(const char* str, int to, int step);
 void log_counter_info(void);
 void format_memory_size(char *prefix, unsigned long int bytes, double *formated);
@@ -25,24 +31,41 @@ void log_FTL_version(bool crashreport);
 
 // datastructure.c
 void strtolower(char *str);
+uint32_t strtolower_hash(char *str);
 int findForwardID(const char * forward, bool count);
 int findDomainID(const char *domain);
+int findDomainIDHashed(const char *domain, uint32_t hash);
 int findClientID(const char *client, bool addNew);
 bool isValidIPv4(const char *addr);
 bool isValidIPv6(const char *addr);
 const char *getDomainString(int queryID);
 const char *getClientIPString(int queryID);
 const char *getClientNameString(int queryID);
+void catchupQueryIndexes(void);
+void resetQueryIndexes(void);
+void retractQueryIndex(int queryID);
+bool queryIndexesComplete(void);
+int filterUnknownIndex(const int **positions);
+void appendBlockedQuery(int queryID);
+int getRecentBlockedID(unsigned int n) __attribute__((pure));
+void pruneQueryIndexes(void);
+void shiftQueryIndexes(int offset);
+int getQueryIndexList(bool byclient, int id, const int **positions);
+void updateTopDomains(bool blocked, int domainID);
+void rebuildTopDomains(void);
+int getTopDomainsCandidates(bool blocked, int *out);
 
 void close_telnet_socket(void);
 void close_unix_socket(void);
 void seom(int sock);
 void ssend(int sock, const char *format, ...) __attribute__ ((format (gnu_printf, 2, 3)));
 void swrite(int sock, const void* value, size_t size);
-void *telnet_listening_thread_IPv4(void *args);
-void *telnet_listening_thread_IPv6(void *args);
+void *api_listening_thread(void *args);
+bool add_subscriber(int sock, unsigned int topics);
+bool serve_cached_response(const char *cmd, int sock);
+void start_response_capture(int sock);
+void store_cached_response(const char *cmd, int sock);
 
-void *socket_listening_thread(void *args);
 bool ipv6_available(void);
 void bind_sockets(void);
 
@@ -74,16 +97,31 @@ void read_FTLconf(void);
 void get_privacy_level(FILE *fp);
 void get_blocking_mode(FILE *fp);
 void read_debuging_settings(FILE *fp);
+void read_runtime_settings(FILE *fp);
 
 // gc.c
-void *GC_thread(void *val);
+void GC_tick(void);
 
 // database.c
 void db_init(void);
-void *DB_thread(void *val);
-int get_number_of_queries_in_DB(void);
+void DB_tick(void);
+long long get_number_of_queries_in_DB(void);
+void queue_regex_verdict(size_t domainpos, unsigned char verdict);
+void load_regex_cache(char **patterns, int count);
 void save_to_DB(void);
 void read_data_from_DB(void);
+void *DB_import_thread(void *val);
+void getDBhistory(int *sock);
+void import_queryrecord(long long dbid, time_t queryTimeStamp, int type, int status,
+                        const char *domain, const char *client, const char *forwarddest, time_t now);
+
+// binlog.c
+bool binlog_active(void) __attribute__((pure));
+void binlog_append(time_t timestamp, int type, int status,
+                   const char *domain, const char *client, const char *forward);
+void binlog_sync(void);
+long long binlog_next_id(void);
+void binlog_import(void);
 bool db_set_FTL_property(unsigned int ID, int value);
 bool dbquery(const char *format, ...);
 bool dbopen(void);
@@ -93,19 +131,36 @@ void SQLite3LogCallback(void *pArg, int iErrCode, const char *zMsg);
 
 // memory.c
 void memory_check(int which);
+void memory_shrink(void);
 char *FTLstrdup(const char *src, const char *file, const char *function, int line) __attribute__((malloc));
 void *FTLcalloc(size_t nmemb, size_t size, const char *file, const char *function, int line) __attribute__((malloc)) __attribute__((alloc_size(1,2)));
 void *FTLrealloc(void *ptr_in, size_t size, const char *file, const char *function, int line) __attribute__((alloc_size(2)));
 void FTLfree(void *ptr, const char* file, const char *function, int line);
+void *arena_alloc(size_t size);
+char *arena_strdup(const char *src);
+void arena_release(void);
+#ifdef NO_VALIDATE_ACCESS
+// Production build (make production): the bounds and magic byte checks
+// compile to nothing, trading debuggability for the per-query overhead
+#define validate_access(name, pos, testmagic, line, function, file) do { } while(0)
+#else
 void validate_access(const char * name, int pos, bool testmagic, int line, const char * function, const char * file);
+#endif
 
 int main_dnsmasq(int argc, const char ** argv);
 
+// dnsmasq_interface.c
+void shift_inflight_hash(int offset);
+void reset_inflight_hash(void);
+void *eventqueue_thread(void *val);
+unsigned short FTL_dnsmasq_port(void) __attribute__((pure));
+
 // signals.c
 void handle_signals(void);
 
 // resolve.c
 void *DNSclient_thread(void *val);
+void notify_resolver(void);
 void resolveClients(bool onlynew);
 void resolveForwardDestinations(bool onlynew);
 
@@ -121,6 +176,22 @@ void destroy_shmem(void);
 size_t addstr(const char *str);
 const char *getstr(size_t pos);
 void *enlarge_shmem_struct(char type);
+void *shrink_shmem_struct(char type, int newcount);
+unsigned int shm_strings_used(void) __attribute__((pure));
+int *getDenseOverTimeRow(int row) __attribute__((pure));
+int allocDenseOverTimeRow(void);
+int findHashID(int type, const char *key);
+int findHashID_prehashed(int type, const char *key, uint32_t hash);
+uint32_t hash_shm_key(const char *key) __attribute__((pure));
+void addHashID(int type, int id);
+void rebuildHashIndex(int type);
+unsigned int get_data_epoch(void);
+const void *getLockStatsEntry(unsigned int slot, const char **caller,
+                              unsigned long *acquisitions, unsigned long *contended,
+                              unsigned long long *held_ns, unsigned long long *max_ns);
+void bloom_clear(void);
+void bloom_add(const char *domain);
+bool bloom_contains(const char *domain);
 
 /**
  * Create a new overTime client shared memory block.
@@ -136,6 +207,11 @@ void addOverTimeClientSlot(void);
 
 // overTime.c
 void initOverTime(void);
+int getClientOverTime(int clientID, unsigned int timeidx) __attribute__((pure));
+void addClientOverTime(int clientID, unsigned int timeidx, int delta);
+void resetClientOverTimeSlot(int clientID, unsigned int timeidx);
+void moveClientOverTime(int clientID, unsigned int moveOverTime, unsigned int remainingSlots);
+void initClientOverTime(int clientID);
 unsigned int getOverTimeID(time_t timestamp);
 
 /**
@@ -145,6 +221,7 @@ unsigned int getOverTimeID(time_t timestamp);
  * @param mintime The start of the oldest interval
  */
 void moveOverTimeMemory(time_t mintime);
+void getOverTimeTier(int *sock, bool daily);
 
 // capabilities.c
 bool check_capabilities(void);
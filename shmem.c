@@ -12,7 +12,10 @@
 #include "shmem.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 6
+#define SHARED_MEMORY_VERSION 26
+
+/// Marker left in ShmSettings by a clean shutdown in warm-restart mode
+#define WARM_MAGIC 0x57415231u
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHARED_LOCK_NAME "/FTL-lock"
@@ -21,9 +24,22 @@
 #define SHARED_DOMAINS_NAME "/FTL-domains"
 #define SHARED_CLIENTS_NAME "/FTL-clients"
 #define SHARED_QUERIES_NAME "/FTL-queries"
+#define SHARED_QUERIES_COLD_NAME "/FTL-queries-cold"
 #define SHARED_FORWARDED_NAME "/FTL-forwarded"
 #define SHARED_OVERTIME_NAME "/FTL-overTime"
 #define SHARED_SETTINGS_NAME "/FTL-settings"
+#define SHARED_DOMAINHASH_NAME "/FTL-domainhash"
+#define SHARED_CLIENTHASH_NAME "/FTL-clienthash"
+#define SHARED_FORWARDHASH_NAME "/FTL-forwardhash"
+#define SHARED_STRINGHASH_NAME "/FTL-stringhash"
+#define SHARED_BLOOM_NAME "/FTL-bloom"
+#define SHARED_CLIENTS_OVERTIME_NAME "/FTL-clients-overTime"
+#define SHARED_LOCKSTATS_NAME "/FTL-lockstats"
+#define SHARED_OVERTIME_TIERS_NAME "/FTL-overTime-tiers"
+
+/// Size of the blocked-domain Bloom filter in bits. 2^25 bits (4 MiB) keep
+/// the false positive rate around 0.3% for a one-million-entry gravity list
+#define BLOOM_BITS (1 << 25)
 
 /// The pointer in shared memory to the shared string buffer
 static SharedMemory shm_lock = { 0 };
@@ -32,22 +48,165 @@ static SharedMemory shm_counters = { 0 };
 static SharedMemory shm_domains = { 0 };
 static SharedMemory shm_clients = { 0 };
 static SharedMemory shm_queries = { 0 };
+static SharedMemory shm_queries_cold = { 0 };
 static SharedMemory shm_forwarded = { 0 };
 static SharedMemory shm_overTime = { 0 };
 static SharedMemory shm_settings = { 0 };
+static SharedMemory shm_domainhash = { 0 };
+static SharedMemory shm_clienthash = { 0 };
+static SharedMemory shm_forwardhash = { 0 };
+
+/// Local pointers into the hash index segments. The tables map the hash of a
+/// key string (domain name resp. IP address) to the corresponding ID in the
+/// domains[], clients[] and forwarded[] arrays so that the find*ID() routines
+/// do not have to scan the entire arrays on every query.
+static int *domainhash = NULL;
+static int *clienthash = NULL;
+static int *forwardhash = NULL;
+
+/// The string intern table maps string content to the offset of the already
+/// stored copy in shm_strings so addstr() never stores a string twice. Its
+/// "IDs" are the string positions themselves (always > 0 as position zero is
+/// reserved for the empty string).
+static SharedMemory shm_stringhash = { 0 };
+static int *stringhash = NULL;
+
+/// Bloom filter over the blocked-domain set (gravity + blacklist), rebuilt
+/// whenever dnsmasq re-reads the lists. Shared so that fork()ed TCP workers
+/// see the same filter without any copying
+static SharedMemory shm_bloom = { 0 };
+static unsigned char *bloomfilter = NULL;
+
+/// Dense spill rows for the per-client overTime data (see overTime.c). One
+/// row holds OVERTIME_SLOTS ints and is handed out by allocDenseOverTimeRow()
+static SharedMemory shm_clients_overtime = { 0 };
+static int *clients_overtime = NULL;
 
 typedef struct {
+	// Robust process-shared mutex: the only lock takers that can die
+	// independently of the daemon are fork()ed TCP workers inside the FTL
+	// hooks, and those always take the exclusive path. A worker dying
+	// while holding the mutex is recovered via EOWNERDEAD below instead
+	// of deadlocking the resolver
 	pthread_mutex_t lock;
+	// Count of active shared holders. Readers are confined to threads of
+	// the main FTL process (API, export and resolver paths), which cannot
+	// die independently of the daemon, so this count cannot leak
+	volatile int readers;
 	bool waitingForLock;
 } ShmLock;
+
+/// Always-on lock contention statistics, one slot per caller site of
+/// lock_shm()/lock_shm_read(). Queryable through the >lockstats API command
+#define LOCKSTATS_SLOTS 48
+typedef struct {
+	char caller[48];
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long long held_ns;
+	unsigned long long max_ns;
+} lockStatsEntry;
+static SharedMemory shm_lockstats = { 0 };
+static lockStatsEntry *lockstats = NULL;
+
+/// Coarse overTime tiers (hourly ring followed by daily ring), maintained
+/// by the cascade in overTime.c
+static SharedMemory shm_overtime_tiers = { 0 };
+
+// Where and when the current lock of this thread was taken
+static __thread lockStatsEntry *lock_site = NULL;
+static __thread struct timespec lock_taken = { 0, 0 };
+
+// Find (or create) the statistics slot of a caller site and account the
+// acquisition. Runs while holding the lock (shared or exclusive), so the
+// counters are updated with atomic adds
+static void lockstats_acquired(const char *function, bool contended)
+{
+	lockStatsEntry *entry = NULL;
+	for(unsigned int i = 0; i < LOCKSTATS_SLOTS; i++)
+	{
+		if(lockstats[i].caller[0] == '\0')
+		{
+			// Claim this free slot for the new site
+			strncpy(lockstats[i].caller, function, sizeof(lockstats[i].caller)-1);
+			entry = &lockstats[i];
+			break;
+		}
+		if(strcmp(lockstats[i].caller, function) == 0)
+		{
+			entry = &lockstats[i];
+			break;
+		}
+	}
+	if(entry == NULL)
+		return;
+
+	__sync_fetch_and_add(&entry->acquisitions, 1);
+	if(contended)
+		__sync_fetch_and_add(&entry->contended, 1);
+
+	lock_site = entry;
+	clock_gettime(CLOCK_MONOTONIC, &lock_taken);
+}
+
+// Account the hold time when the lock is released
+static void lockstats_released(void)
+{
+	if(lock_site == NULL)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const unsigned long long ns = (now.tv_sec - lock_taken.tv_sec)*1000000000ULL +
+	                              (now.tv_nsec - lock_taken.tv_nsec);
+	__sync_fetch_and_add(&lock_site->held_ns, ns);
+	if(ns > lock_site->max_ns)
+		lock_site->max_ns = ns;
+	lock_site = NULL;
+}
+
+// Deliver one slot for the >lockstats API command, NULL past the end
+const void *getLockStatsEntry(unsigned int slot, const char **caller,
+                              unsigned long *acquisitions, unsigned long *contended,
+                              unsigned long long *held_ns, unsigned long long *max_ns)
+{
+	if(slot >= LOCKSTATS_SLOTS || lockstats[slot].caller[0] == '\0')
+		return NULL;
+
+	*caller = lockstats[slot].caller;
+	*acquisitions = lockstats[slot].acquisitions;
+	*contended = lockstats[slot].contended;
+	*held_ns = lockstats[slot].held_ns;
+	*max_ns = lockstats[slot].max_ns;
+	return &lockstats[slot];
+}
 static ShmLock *shmLock = NULL;
 static ShmSettings *shmSettings = NULL;
 
 static int pagesize;
 static unsigned int local_shm_counter = 0;
 
+// Whether this thread currently holds the exclusive lock. Used to bump the
+// data epoch for the API response cache when the writer releases the lock
+static __thread bool exclusive_lock_held = false;
+// Whether this thread currently holds the lock in shared (read-only) mode
+static __thread bool shared_lock_held = false;
+
 static size_t get_optimal_object_size(size_t objsize, size_t minsize);
 
+// Ask the kernel to back a large mapping with (transparent) huge pages.
+// This is advisory: if no huge pages are available the mapping simply stays
+// on normal 4 KB pages, so there is no failure path to handle
+static void advise_hugepages(void *ptr, size_t size)
+{
+	// Only segments of at least one huge page benefit
+	if(!config.shmhugepages || size < (2u << 20))
+		return;
+
+	if(madvise(ptr, size, MADV_HUGEPAGE) != 0 && config.debug & DEBUG_SHMEM)
+		logg("DEBUG: madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+}
+
 size_t addstr(const char *str)
 {
 	if(str == NULL)
@@ -64,16 +223,33 @@ size_t addstr(const char *str)
 		return 0;
 	}
 
+	// Return the position of an already stored copy if we interned this
+	// string before. This keeps the string buffer free of duplicates
+	int interned = findHashID(STRINGS, str);
+	if(interned >= 0)
+	{
+		if(config.debug & DEBUG_SHMEM)
+			logg("Reusing \"%s\" (len %zu) at position %i", str, len, interned);
+		return (size_t)interned;
+	}
+
 	// Debugging output
 	if(config.debug & DEBUG_SHMEM)
 		logg("Adding \"%s\" (len %zu) to buffer. next_str_pos is %u", str, len, shmSettings->next_str_pos);
 
-	// Reserve additional memory if necessary
+	// Reserve additional memory if necessary. The buffer capacity is
+	// doubled (geometric growth) so that the number of resize-and-remap
+	// cycles stays logarithmic in the buffer size even under query bursts.
+	// next_str_pos tracks how much of the capacity is actually used
 	size_t required_size = shmSettings->next_str_pos + len + 1;
-	// Need to cast to long long because size_t calculations cannot be negative
-	if((long long)required_size-(long long)shm_strings.size > 0 &&
-	   !realloc_shm(&shm_strings, shm_strings.size + pagesize, true))
-		return 0;
+	if(required_size > shm_strings.size)
+	{
+		size_t newsize = shm_strings.size;
+		while(newsize < required_size)
+			newsize *= 2;
+		if(!realloc_shm(&shm_strings, newsize, true))
+			return 0;
+	}
 
 	// Store new string buffer size in corresponding counters entry
 	// for re-using when we need to re-map shared memory objects
@@ -86,6 +262,10 @@ size_t addstr(const char *str)
 	// Increment string length counter
 	shmSettings->next_str_pos += len+1;
 
+	// Remember the new string in the intern table
+	addHashID(STRINGS, (int)(shmSettings->next_str_pos - (len + 1)));
+	counters->strings_interned++;
+
 	// Return start of stored string
 	return (shmSettings->next_str_pos - (len + 1));
 }
@@ -102,10 +282,256 @@ const char *getstr(size_t pos)
 	}
 }
 
-/// Create a mutex for shared memory
-static pthread_mutex_t create_mutex(void) {
+// Hash a string using the FNV-1a algorithm. The result is used as starting
+// position for the linear probing in the open-addressing hash tables below
+static uint32_t __attribute__((pure)) hashstr(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	for(; *str != '\0'; str++)
+	{
+		hash ^= (uint32_t)(unsigned char)*str;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Return the key string under which a given entry is stored in the hash
+// index of the given type (domain name resp. IP address)
+static const char *gethashkey(int type, int id)
+{
+	switch(type)
+	{
+		case DOMAINS:   return getstr(domains[id].domainpos);
+		case CLIENTS:   return getstr(clients[id].ippos);
+		case FORWARDED: return getstr(forwarded[id].ippos);
+		case STRINGS:   return getstr((size_t)id);
+		default:        return "";
+	}
+}
+
+// Resolve a hash index type (DOMAINS, CLIENTS or FORWARDED) into its local
+// table pointer, shared memory object, capacity counter and number of entries
+static int **select_hash_table(int type, SharedMemory **shm, int **capacity, int *entries)
+{
+	switch(type)
+	{
+		case DOMAINS:
+			*shm = &shm_domainhash;
+			*capacity = &counters->domainhash_MAX;
+			*entries = counters->domains;
+			return &domainhash;
+		case CLIENTS:
+			*shm = &shm_clienthash;
+			*capacity = &counters->clienthash_MAX;
+			*entries = counters->clients;
+			return &clienthash;
+		case FORWARDED:
+			*shm = &shm_forwardhash;
+			*capacity = &counters->forwardhash_MAX;
+			*entries = counters->forwarded;
+			return &forwardhash;
+		case STRINGS:
+			*shm = &shm_stringhash;
+			*capacity = &counters->stringhash_MAX;
+			*entries = counters->strings_interned;
+			return &stringhash;
+		default:
+			logg("Invalid argument in select_hash_table(): %i", type);
+			return NULL;
+	}
+}
+
+// Look up a key in one of the hash indexes using an already computed hash
+// (see strtolower_hash(), which lowercases and hashes in a single pass).
+// Returns the ID of the matching entry or -1 if the key is not (yet) known
+int findHashID_prehashed(int type, const char *key, uint32_t hash)
+{
+	SharedMemory *shm = NULL;
+	int *capacity = NULL, entries = 0;
+	int **table = select_hash_table(type, &shm, &capacity, &entries);
+	if(table == NULL)
+		return -1;
+
+	const uint32_t mask = (uint32_t)*capacity - 1u;
+	// Open addressing: Start at the hash position and probe linearly until
+	// we either find the key or hit an empty slot (= key not known)
+	for(uint32_t slot = hash & mask; ; slot = (slot + 1u) & mask)
+	{
+		const int id = (*table)[slot];
+		if(id < 0)
+			return -1;
+
+		if(strcmp(gethashkey(type, id), key) == 0)
+			return id;
+	}
+}
+
+// Look up a key in one of the hash indexes
+int findHashID(int type, const char *key)
+{
+	return findHashID_prehashed(type, key, hashstr(key));
+}
+
+// Deliver the number of bytes used in the shared string buffer
+unsigned int __attribute__((pure)) shm_strings_used(void)
+{
+	return shmSettings->next_str_pos;
+}
+
+// Shrink one of the dynamic array segments to the given number of entries.
+// The counterpart of enlarge_shmem_struct(), invoked after GC when the
+// utilization fell below the shrink threshold
+void *shrink_shmem_struct(char type, int newcount)
+{
+	switch(type)
+	{
+		case QUERIES:
+			realloc_shm(&shm_queries, (size_t)newcount*sizeof(queriesDataStruct), true);
+			queries = (queriesDataStruct*)shm_queries.ptr;
+			realloc_shm(&shm_queries_cold, (size_t)newcount*sizeof(queriesColdDataStruct), true);
+			queries_cold = (queriesColdDataStruct*)shm_queries_cold.ptr;
+			counters->queries_MAX = newcount;
+			return queries;
+		case STRINGS:
+			realloc_shm(&shm_strings, (size_t)newcount, true);
+			counters->strings_MAX = newcount;
+			return shm_strings.ptr;
+		default:
+			logg("Invalid argument in shrink_shmem_struct(): %i", type);
+			return NULL;
+	}
+}
+
+// Expose the index hash of a key for callers that want to cache it
+uint32_t __attribute__((pure)) hash_shm_key(const char *key)
+{
+	return hashstr(key);
+}
+
+// Insert one ID into a hash index without any load checking. Used both by
+// addHashID() and when rebuilding a table after resizing
+static void insert_hash(int type, int *table, uint32_t mask, int id)
+{
+	uint32_t slot = hashstr(gethashkey(type, id)) & mask;
+	// Skip over already occupied slots (linear probing)
+	while(table[slot] >= 0)
+		slot = (slot + 1u) & mask;
+	table[slot] = id;
+}
+
+// Rebuild one of the hash indexes from scratch using the current content of
+// the corresponding array. Called by the GC routine and after table resizing
+void rebuildHashIndex(int type)
+{
+	SharedMemory *shm = NULL;
+	int *capacity = NULL, entries = 0;
+	int **table = select_hash_table(type, &shm, &capacity, &entries);
+	if(table == NULL)
+		return;
+
+	// Mark all slots as empty (-1), 0xFF in each byte yields -1 as int
+	memset(*table, 0xFF, *capacity*sizeof(int));
+
+	if(type == STRINGS)
+	{
+		// The IDs of the string intern table are the positions in the
+		// string buffer itself: walk the buffer string by string
+		for(size_t pos = 1; pos < shmSettings->next_str_pos; pos += strlen(getstr(pos)) + 1)
+			insert_hash(type, *table, (uint32_t)*capacity - 1u, (int)pos);
+		return;
+	}
+
+	for(int id = 0; id < entries; id++)
+		insert_hash(type, *table, (uint32_t)*capacity - 1u, id);
+}
+
+// Add a new entry (which is known to not be in the table) to a hash index.
+// The table is grown and rebuilt before insertion when more than half of its
+// slots would be in use as linear probing degrades on densely filled tables
+void addHashID(int type, int id)
+{
+	SharedMemory *shm = NULL;
+	int *capacity = NULL, entries = 0;
+	int **table = select_hash_table(type, &shm, &capacity, &entries);
+	if(table == NULL)
+		return;
+
+	if(2*(entries + 1) > *capacity)
+	{
+		// Double the number of slots (stays a power of two)
+		*capacity *= 2;
+		realloc_shm(shm, *capacity*sizeof(int), true);
+		*table = (int*)shm->ptr;
+		rebuildHashIndex(type);
+	}
+
+	insert_hash(type, *table, (uint32_t)*capacity - 1u, id);
+}
+
+// Set all bits in the blocked-domain Bloom filter to zero. Called before the
+// blocking lists are (re)read
+void bloom_clear(void)
+{
+	memset(bloomfilter, 0, BLOOM_BITS/8);
+}
+
+// Derive the four probe positions for a domain. The second hash is obtained
+// by rehashing the primary hash, which is enough de-correlation in practice
+static void bloom_positions(const char *domain, uint32_t positions[4])
+{
+	const uint32_t hash1 = hashstr(domain);
+	const uint32_t hash2 = hash1 * 2654435761u + 1u;
+	for(unsigned int i = 0; i < 4; i++)
+		positions[i] = (hash1 + i*hash2) & (BLOOM_BITS - 1);
+}
+
+// Add a blocked domain to the Bloom filter
+void bloom_add(const char *domain)
+{
+	uint32_t positions[4];
+	bloom_positions(domain, positions);
+	for(unsigned int i = 0; i < 4; i++)
+		bloomfilter[positions[i] / 8] |= (unsigned char)(1u << (positions[i] % 8));
+}
+
+// Test a domain against the Bloom filter. A negative answer is exact (the
+// domain is certainly not on the blocking lists), a positive answer may be
+// a false positive and has to be confirmed against the lists themselves
+bool __attribute__((pure)) bloom_contains(const char *domain)
+{
+	uint32_t positions[4];
+	bloom_positions(domain, positions);
+	for(unsigned int i = 0; i < 4; i++)
+		if(!(bloomfilter[positions[i] / 8] & (1u << (positions[i] % 8))))
+			return false;
+	return true;
+}
+
+// Deliver a pointer to the given dense client-overTime row
+int * __attribute__((pure)) getDenseOverTimeRow(int row)
+{
+	return &clients_overtime[row*OVERTIME_SLOTS];
+}
+
+// Hand out a fresh (zeroed) dense client-overTime row, growing the segment
+// geometrically when necessary
+int allocDenseOverTimeRow(void)
+{
+	if(counters->denserows >= counters->denserows_MAX)
+	{
+		counters->denserows_MAX *= 2;
+		realloc_shm(&shm_clients_overtime, counters->denserows_MAX*OVERTIME_SLOTS*sizeof(int), true);
+		clients_overtime = (int*)shm_clients_overtime.ptr;
+	}
+
+	const int row = counters->denserows++;
+	memset(getDenseOverTimeRow(row), 0, OVERTIME_SLOTS*sizeof(int));
+	return row;
+}
+
+/// Create the mutex at the core of the shared-memory lock
+static void create_shm_lock(pthread_mutex_t *lock) {
 	pthread_mutexattr_t lock_attr = {};
-	pthread_mutex_t lock = {};
 
 	// Initialize the lock attributes
 	pthread_mutexattr_init(&lock_attr);
@@ -113,16 +539,41 @@ static pthread_mutex_t create_mutex(void) {
 	// Allow the lock to be used by other processes
 	pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
 
-	// Make the lock robust against process death
+	// Make the lock robust against process death: a fork()ed TCP worker
+	// killed inside an FTL hook (SIGALRM after CHILD_LIFETIME, OOM, ...)
+	// must not take the lock to its grave
 	pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
 
 	// Initialize the lock
-	pthread_mutex_init(&lock, &lock_attr);
+	pthread_mutex_init(lock, &lock_attr);
 
 	// Destroy the lock attributes since we're done with it
 	pthread_mutexattr_destroy(&lock_attr);
+}
+
+// Salvage the mutex when its owner died while holding it. Writers complete
+// their shared-memory updates before unlocking, so the data is consistent
+// and we can simply continue with the lock held
+static int handle_owner_died(int result)
+{
+	if(result == EOWNERDEAD)
+	{
+		logg("Shared memory lock was abandoned by a dying process - recovering");
+		result = pthread_mutex_consistent(&shmLock->lock);
+	}
+	return result;
+}
 
-	return lock;
+// Readers register while holding the mutex and deregister with an atomic
+// decrement; an exclusive locker keeps the mutex and waits for this count
+// to drain. New readers queue behind the waiting writer at the mutex, so
+// writers are preferred: long-running API readers cannot starve the
+// dnsmasq-side writers as this would directly translate into DNS
+// resolution latency
+static void wait_for_readers(void)
+{
+	while(shmLock->readers > 0)
+		sched_yield();
 }
 
 static void remap_shm(void)
@@ -130,6 +581,8 @@ static void remap_shm(void)
 	// Remap shared object pointers which might have changed
 	realloc_shm(&shm_queries, counters->queries_MAX*sizeof(queriesDataStruct), false);
 	queries = (queriesDataStruct*)shm_queries.ptr;
+	realloc_shm(&shm_queries_cold, counters->queries_MAX*sizeof(queriesColdDataStruct), false);
+	queries_cold = (queriesColdDataStruct*)shm_queries_cold.ptr;
 	realloc_shm(&shm_domains, counters->domains_MAX*sizeof(domainsDataStruct), false);
 	domains = (domainsDataStruct*)shm_domains.ptr;
 	realloc_shm(&shm_clients, counters->clients_MAX*sizeof(clientsDataStruct), false);
@@ -138,6 +591,16 @@ static void remap_shm(void)
 	forwarded = (forwardedDataStruct*)shm_forwarded.ptr;
 	realloc_shm(&shm_strings, counters->strings_MAX, false);
 	// strings are not exposed by a global pointer
+	realloc_shm(&shm_domainhash, counters->domainhash_MAX*sizeof(int), false);
+	domainhash = (int*)shm_domainhash.ptr;
+	realloc_shm(&shm_clienthash, counters->clienthash_MAX*sizeof(int), false);
+	clienthash = (int*)shm_clienthash.ptr;
+	realloc_shm(&shm_forwardhash, counters->forwardhash_MAX*sizeof(int), false);
+	forwardhash = (int*)shm_forwardhash.ptr;
+	realloc_shm(&shm_stringhash, counters->stringhash_MAX*sizeof(int), false);
+	stringhash = (int*)shm_stringhash.ptr;
+	realloc_shm(&shm_clients_overtime, counters->denserows_MAX*OVERTIME_SLOTS*sizeof(int), false);
+	clients_overtime = (int*)shm_clients_overtime.ptr;
 
 	// Update local counter to reflect that we absorbed this change
 	local_shm_counter = shmSettings->global_shm_counter;
@@ -148,12 +611,23 @@ void _lock_shm(const char* function, const int line, const char * file) {
 	shmLock->waitingForLock = true;
 
 	if(config.debug & DEBUG_LOCKS)
-		logg("Waiting for lock in %s() (%s:%i)", function, file, line);
+		logg("Waiting for exclusive lock in %s() (%s:%i)", function, file, line);
+
+	// Detect contention cheaply: only when the uncontended fast path
+	// fails we fall back to the blocking acquisition
+	bool contended = false;
+	int result = handle_owner_died(pthread_mutex_trylock(&shmLock->lock));
+	if(result == EBUSY)
+	{
+		contended = true;
+		result = handle_owner_died(pthread_mutex_lock(&shmLock->lock));
+	}
 
-	int result = pthread_mutex_lock(&shmLock->lock);
+	// Let the active shared holders finish before touching any data
+	wait_for_readers();
 
 	if(config.debug & DEBUG_LOCKS)
-		logg("Obtained lock for %s() (%s:%i)", function, file, line);
+		logg("Obtained exclusive lock for %s() (%s:%i)", function, file, line);
 
 	// Check if this process needs to remap the shared memory objects
 	if(shmSettings != NULL &&
@@ -169,18 +643,100 @@ void _lock_shm(const char* function, const int line, const char * file) {
 	// deferring to FTL that they can jump in the lock queue.
 	shmLock->waitingForLock = false;
 
-	if(result == EOWNERDEAD) {
-		// Try to make the lock consistent if the other process died while
-		// holding the lock
-		result = pthread_mutex_consistent(&shmLock->lock);
-	}
+	exclusive_lock_held = true;
+	// Signal external read-only consumers that a write is in progress
+	if(shmSettings != NULL)
+		__sync_fetch_and_add(&shmSettings->seqlock, 1);
+	lockstats_acquired(function, contended);
 
 	if(result != 0)
 		logg("Failed to obtain SHM lock: %s", strerror(result));
 }
 
+// Deliver the current data epoch. API responses cached under an older epoch
+// are stale and have to be recomputed
+unsigned int __attribute__((pure)) get_data_epoch(void)
+{
+	return shmSettings->data_epoch;
+}
+
+void _lock_shm_read(const char* function, const int line, const char * file) {
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for shared lock in %s() (%s:%i)", function, file, line);
+
+	bool contended = false;
+	int result = handle_owner_died(pthread_mutex_trylock(&shmLock->lock));
+	if(result == EBUSY)
+	{
+		contended = true;
+		result = handle_owner_died(pthread_mutex_lock(&shmLock->lock));
+	}
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained shared lock for %s() (%s:%i)", function, file, line);
+
+	// Check if this process needs to remap the shared memory objects.
+	// Remapping modifies this process' local pointers and must hence not
+	// happen concurrently with other threads of the same process reading
+	// them: drain the other readers while still holding the mutex, which
+	// makes us effectively exclusive for the duration of the remapping
+	if(shmSettings != NULL &&
+	   local_shm_counter != shmSettings->global_shm_counter)
+	{
+		wait_for_readers();
+		if(config.debug & DEBUG_SHMEM)
+			logg("Remapping shared memory for current process %u %u",
+		             local_shm_counter, shmSettings->global_shm_counter);
+		remap_shm();
+	}
+
+	// Register as shared holder and release the mutex: the data may be
+	// read concurrently by any number of registered readers, exclusive
+	// lockers wait for the count to drain before touching anything.
+	// The increment has to be atomic even though we hold the mutex, as
+	// deregistration in _unlock_shm() happens without it: a plain
+	// read-modify-write racing that decrement could lose it and leave
+	// the counter permanently inflated
+	__sync_fetch_and_add(&shmLock->readers, 1);
+	shared_lock_held = true;
+	pthread_mutex_unlock(&shmLock->lock);
+
+	lockstats_acquired(function, contended);
+
+	if(result != 0)
+		logg("Failed to obtain shared SHM lock: %s", strerror(result));
+}
+
 void _unlock_shm(const char* function, const int line, const char * file) {
-	int result = pthread_mutex_unlock(&shmLock->lock);
+	lockstats_released();
+
+	// A writer releasing the exclusive lock may have changed the data the
+	// API serves: bump the response cache epoch, but at most once per
+	// second so pollers can still share cached responses under load
+	if(exclusive_lock_held)
+	{
+		exclusive_lock_held = false;
+		// Write cycle complete: sequence becomes even again
+		if(shmSettings != NULL)
+			__sync_fetch_and_add(&shmSettings->seqlock, 1);
+		const time_t now = time(NULL);
+		if(shmSettings != NULL && now != shmSettings->epoch_stamp)
+		{
+			shmSettings->epoch_stamp = now;
+			shmSettings->data_epoch++;
+		}
+	}
+
+	int result = 0;
+	if(shared_lock_held)
+	{
+		// Shared holders only deregister, the mutex was already
+		// released when the shared lock was taken
+		shared_lock_held = false;
+		__sync_fetch_and_sub(&shmLock->readers, 1);
+	}
+	else
+		result = pthread_mutex_unlock(&shmLock->lock);
 
 	if(config.debug & DEBUG_LOCKS)
 		logg("Removed lock in %s() (%s:%i)", function, file, line);
@@ -189,16 +745,157 @@ void _unlock_shm(const char* function, const int line, const char * file) {
 		logg("Failed to unlock SHM lock: %s", strerror(result));
 }
 
+bool warm_restarted = false;
+
+// Attach to an already existing shared memory object of (at least) the given
+// size. On any failure the returned ptr is NULL and the caller falls back to
+// creating the objects from scratch
+static SharedMemory attach_shm(const char *name, size_t size)
+{
+	SharedMemory sharedMemory = { .name = name, .size = size, .ptr = NULL };
+
+	int fd = shm_open(name, O_RDWR, S_IRUSR | S_IWUSR);
+	if(fd < 0)
+		return sharedMemory;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < size)
+	{
+		close(fd);
+		return sharedMemory;
+	}
+
+	void *shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED)
+		return sharedMemory;
+
+	advise_hugepages(shm, st.st_size);
+
+	sharedMemory.ptr = shm;
+	sharedMemory.size = st.st_size;
+	return sharedMemory;
+}
+
+// Simple checksum over the counters used to validate a warm restart
+static unsigned int __attribute__((pure)) counters_checksum(void)
+{
+	const unsigned char *bytes = (const unsigned char*)counters;
+	unsigned int sum = 0;
+	for(size_t i = 0; i < sizeof(countersStruct); i++)
+		sum = sum*31u + bytes[i];
+	return sum;
+}
+
+// Try to resume the shared memory state left behind by a clean shutdown in
+// warm-restart mode. Returns false when anything does not check out, in
+// which case the caller initializes everything from scratch as usual
+static bool try_warm_attach(void)
+{
+	shm_settings = attach_shm(SHARED_SETTINGS_NAME, sizeof(ShmSettings));
+	if(shm_settings.ptr == NULL)
+		return false;
+	shmSettings = (ShmSettings*)shm_settings.ptr;
+
+	if(shmSettings->version != SHARED_MEMORY_VERSION ||
+	   shmSettings->warm_magic != WARM_MAGIC)
+		return false;
+
+	shm_counters = attach_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct));
+	if(shm_counters.ptr == NULL)
+		return false;
+	counters = (countersStruct*)shm_counters.ptr;
+
+	if(shmSettings->warm_checksum != counters_checksum())
+		return false;
+
+	// Attach the remaining segments with the capacities recorded in the
+	// counters. A size mismatch in any of them aborts the warm attach
+	shm_lock = attach_shm(SHARED_LOCK_NAME, sizeof(ShmLock));
+	shm_strings = attach_shm(SHARED_STRINGS_NAME, counters->strings_MAX);
+	shm_domains = attach_shm(SHARED_DOMAINS_NAME, counters->domains_MAX*sizeof(domainsDataStruct));
+	shm_clients = attach_shm(SHARED_CLIENTS_NAME, counters->clients_MAX*sizeof(clientsDataStruct));
+	shm_forwarded = attach_shm(SHARED_FORWARDED_NAME, counters->forwarded_MAX*sizeof(forwardedDataStruct));
+	shm_queries = attach_shm(SHARED_QUERIES_NAME, counters->queries_MAX*sizeof(queriesDataStruct));
+	shm_queries_cold = attach_shm(SHARED_QUERIES_COLD_NAME, counters->queries_MAX*sizeof(queriesColdDataStruct));
+	shm_overTime = attach_shm(SHARED_OVERTIME_NAME, get_optimal_object_size(sizeof(overTimeDataStruct), OVERTIME_SLOTS)*sizeof(overTimeDataStruct));
+	shm_domainhash = attach_shm(SHARED_DOMAINHASH_NAME, counters->domainhash_MAX*sizeof(int));
+	shm_clienthash = attach_shm(SHARED_CLIENTHASH_NAME, counters->clienthash_MAX*sizeof(int));
+	shm_forwardhash = attach_shm(SHARED_FORWARDHASH_NAME, counters->forwardhash_MAX*sizeof(int));
+	shm_stringhash = attach_shm(SHARED_STRINGHASH_NAME, counters->stringhash_MAX*sizeof(int));
+	shm_bloom = attach_shm(SHARED_BLOOM_NAME, BLOOM_BITS/8);
+	shm_clients_overtime = attach_shm(SHARED_CLIENTS_OVERTIME_NAME, counters->denserows_MAX*OVERTIME_SLOTS*sizeof(int));
+	shm_lockstats = attach_shm(SHARED_LOCKSTATS_NAME, LOCKSTATS_SLOTS*sizeof(lockStatsEntry));
+	shm_overtime_tiers = attach_shm(SHARED_OVERTIME_TIERS_NAME,
+	                                (OVERTIME_HOURLY_SLOTS+OVERTIME_DAILY_SLOTS)*sizeof(overTimeDataStruct));
+
+	if(shm_lock.ptr == NULL || shm_strings.ptr == NULL || shm_domains.ptr == NULL ||
+	   shm_clients.ptr == NULL || shm_forwarded.ptr == NULL || shm_queries.ptr == NULL ||
+	   shm_queries_cold.ptr == NULL || shm_overTime.ptr == NULL || shm_domainhash.ptr == NULL ||
+	   shm_clienthash.ptr == NULL || shm_forwardhash.ptr == NULL || shm_stringhash.ptr == NULL ||
+	   shm_bloom.ptr == NULL || shm_clients_overtime.ptr == NULL ||
+	   shm_lockstats.ptr == NULL || shm_overtime_tiers.ptr == NULL)
+		return false;
+
+	// Expose the attached segments through the global pointers
+	shmLock = (ShmLock*)shm_lock.ptr;
+	domains = (domainsDataStruct*)shm_domains.ptr;
+	clients = (clientsDataStruct*)shm_clients.ptr;
+	forwarded = (forwardedDataStruct*)shm_forwarded.ptr;
+	queries = (queriesDataStruct*)shm_queries.ptr;
+	queries_cold = (queriesColdDataStruct*)shm_queries_cold.ptr;
+	overTime = (overTimeDataStruct*)shm_overTime.ptr;
+	domainhash = (int*)shm_domainhash.ptr;
+	clienthash = (int*)shm_clienthash.ptr;
+	forwardhash = (int*)shm_forwardhash.ptr;
+	stringhash = (int*)shm_stringhash.ptr;
+	bloomfilter = (unsigned char*)shm_bloom.ptr;
+	clients_overtime = (int*)shm_clients_overtime.ptr;
+	lockstats = (lockStatsEntry*)shm_lockstats.ptr;
+	overTimeHourly = (overTimeDataStruct*)shm_overtime_tiers.ptr;
+	overTimeDaily = overTimeHourly + OVERTIME_HOURLY_SLOTS;
+
+	// The lock cannot be resumed from a dead process, initialize it anew
+	create_shm_lock(&shmLock->lock);
+	shmLock->readers = 0;
+	shmLock->waitingForLock = false;
+
+	// Everyone attaching later starts from these mappings
+	local_shm_counter = shmSettings->global_shm_counter;
+
+	// Invalidate the marker: only the next clean shutdown may arm another
+	// warm restart, a crash must fall back to the cold path
+	shmSettings->warm_magic = 0;
+
+	// Rebuild the process-local acceleration structures from the resumed
+	// shared data
+	catchupQueryIndexes();
+	rebuildTopDomains();
+
+	logg("Warm restart: resumed shared memory state (%i queries, %i domains, %i clients)",
+	     counters->queries, counters->domains, counters->clients);
+
+	return true;
+}
+
 bool init_shmem(void)
 {
 	// Get kernel's page size
 	pagesize = getpagesize();
 
+	// Try to resume the previous state if warm restarts are enabled
+	if(config.warmrestart && try_warm_attach())
+	{
+		warm_restarted = true;
+		return true;
+	}
+
 	/****************************** shared memory lock ******************************/
 	// Try to create shared memory object
 	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock));
 	shmLock = (ShmLock*) shm_lock.ptr;
-	shmLock->lock = create_mutex();
+	create_shm_lock(&shmLock->lock);
+	shmLock->readers = 0;
 	shmLock->waitingForLock = false;
 
 	/****************************** shared counters struct ******************************/
@@ -248,6 +945,55 @@ bool init_shmem(void)
 	queries = (queriesDataStruct*)shm_queries.ptr;
 	counters->queries_MAX = pagesize;
 
+	// Cold companion array, indexed identically to queries[]
+	shm_queries_cold = create_shm(SHARED_QUERIES_COLD_NAME, pagesize*sizeof(queriesColdDataStruct));
+	queries_cold = (queriesColdDataStruct*)shm_queries_cold.ptr;
+
+	/****************************** shared hash indexes ******************************/
+	// Start with twice as many (empty) slots as we can hold entries so the
+	// tables operate below 50% load. All slot counts are powers of two,
+	// which the probing in findHashID() relies on
+	shm_domainhash = create_shm(SHARED_DOMAINHASH_NAME, 2*pagesize*sizeof(int));
+	domainhash = (int*)shm_domainhash.ptr;
+	counters->domainhash_MAX = 2*pagesize;
+	memset(domainhash, 0xFF, counters->domainhash_MAX*sizeof(int));
+
+	shm_clienthash = create_shm(SHARED_CLIENTHASH_NAME, 1024*sizeof(int));
+	clienthash = (int*)shm_clienthash.ptr;
+	counters->clienthash_MAX = 1024;
+	memset(clienthash, 0xFF, counters->clienthash_MAX*sizeof(int));
+
+	shm_forwardhash = create_shm(SHARED_FORWARDHASH_NAME, 64*sizeof(int));
+	forwardhash = (int*)shm_forwardhash.ptr;
+	counters->forwardhash_MAX = 64;
+	memset(forwardhash, 0xFF, counters->forwardhash_MAX*sizeof(int));
+
+	shm_stringhash = create_shm(SHARED_STRINGHASH_NAME, 2*pagesize*sizeof(int));
+	stringhash = (int*)shm_stringhash.ptr;
+	counters->stringhash_MAX = 2*pagesize;
+	memset(stringhash, 0xFF, counters->stringhash_MAX*sizeof(int));
+
+	/****************************** dense client-overTime rows ******************************/
+	shm_clients_overtime = create_shm(SHARED_CLIENTS_OVERTIME_NAME, 4*OVERTIME_SLOTS*sizeof(int));
+	clients_overtime = (int*)shm_clients_overtime.ptr;
+	counters->denserows_MAX = 4;
+	counters->denserows = 0;
+
+	/****************************** coarse overTime tiers ******************************/
+	shm_overtime_tiers = create_shm(SHARED_OVERTIME_TIERS_NAME,
+	                                (OVERTIME_HOURLY_SLOTS+OVERTIME_DAILY_SLOTS)*sizeof(overTimeDataStruct));
+	overTimeHourly = (overTimeDataStruct*)shm_overtime_tiers.ptr;
+	overTimeDaily = overTimeHourly + OVERTIME_HOURLY_SLOTS;
+
+	/****************************** lock statistics block ******************************/
+	shm_lockstats = create_shm(SHARED_LOCKSTATS_NAME, LOCKSTATS_SLOTS*sizeof(lockStatsEntry));
+	lockstats = (lockStatsEntry*)shm_lockstats.ptr;
+
+	/****************************** blocked-domain Bloom filter ******************************/
+	// Fixed size, so secondary processes never need to remap it
+	shm_bloom = create_shm(SHARED_BLOOM_NAME, BLOOM_BITS/8);
+	bloomfilter = (unsigned char*)shm_bloom.ptr;
+
 	/****************************** shared overTime struct ******************************/
 	size = get_optimal_object_size(sizeof(overTimeDataStruct), OVERTIME_SLOTS);
 	// Try to create shared memory object
@@ -258,8 +1004,46 @@ bool init_shmem(void)
 	return true;
 }
 
+// Unmap a shared memory object without unlinking it (warm-restart shutdown)
+static void keep_shm(SharedMemory *sharedMemory)
+{
+	if(munmap(sharedMemory->ptr, sharedMemory->size) != 0)
+		logg("keep_shm(): munmap(%p, %zu) failed: %s", sharedMemory->ptr, sharedMemory->size, strerror(errno));
+}
+
 void destroy_shmem(void)
 {
+	if(config.warmrestart)
+	{
+		// Arm the warm-restart handshake and keep all segments so the
+		// next start can resume instead of re-importing
+		shmSettings->warm_checksum = counters_checksum();
+		shmSettings->warm_magic = WARM_MAGIC;
+
+		pthread_mutex_destroy(&shmLock->lock);
+		shmLock = NULL;
+
+		keep_shm(&shm_lock);
+		keep_shm(&shm_strings);
+		keep_shm(&shm_counters);
+		keep_shm(&shm_domains);
+		keep_shm(&shm_clients);
+		keep_shm(&shm_queries);
+		keep_shm(&shm_queries_cold);
+		keep_shm(&shm_forwarded);
+		keep_shm(&shm_overTime);
+		keep_shm(&shm_settings);
+		keep_shm(&shm_domainhash);
+		keep_shm(&shm_clienthash);
+		keep_shm(&shm_forwardhash);
+		keep_shm(&shm_stringhash);
+		keep_shm(&shm_bloom);
+		keep_shm(&shm_clients_overtime);
+		keep_shm(&shm_lockstats);
+		keep_shm(&shm_overtime_tiers);
+		return;
+	}
+
 	pthread_mutex_destroy(&shmLock->lock);
 	shmLock = NULL;
 
@@ -269,9 +1053,18 @@ void destroy_shmem(void)
 	delete_shm(&shm_domains);
 	delete_shm(&shm_clients);
 	delete_shm(&shm_queries);
+	delete_shm(&shm_queries_cold);
 	delete_shm(&shm_forwarded);
 	delete_shm(&shm_overTime);
 	delete_shm(&shm_settings);
+	delete_shm(&shm_domainhash);
+	delete_shm(&shm_clienthash);
+	delete_shm(&shm_forwardhash);
+	delete_shm(&shm_stringhash);
+	delete_shm(&shm_bloom);
+	delete_shm(&shm_clients_overtime);
+	delete_shm(&shm_lockstats);
+	delete_shm(&shm_overtime_tiers);
 }
 
 SharedMemory create_shm(const char *name, size_t size)
@@ -332,6 +1125,8 @@ SharedMemory create_shm(const char *name, size_t size)
 	// needed after having called mmap()
 	close(fd);
 
+	advise_hugepages(shm, size);
+
 	sharedMemory.ptr = shm;
 	return sharedMemory;
 }
@@ -339,7 +1134,7 @@ SharedMemory create_shm(const char *name, size_t size)
 void *enlarge_shmem_struct(char type)
 {
 	SharedMemory *sharedMemory = NULL;
-	size_t sizeofobj, allocation_step;
+	size_t sizeofobj;
 	int *counter = NULL;
 
 	// Select type of struct that should be enlarged
@@ -347,25 +1142,24 @@ void *enlarge_shmem_struct(char type)
 	{
 		case QUERIES:
 			sharedMemory = &shm_queries;
-			allocation_step = pagesize;
 			sizeofobj = sizeof(queriesDataStruct);
 			counter = &counters->queries_MAX;
+			// Keep the cold companion array at the same capacity
+			realloc_shm(&shm_queries_cold, 2*shm_queries_cold.size, true);
+			queries_cold = (queriesColdDataStruct*)shm_queries_cold.ptr;
 			break;
 		case CLIENTS:
 			sharedMemory = &shm_clients;
-			allocation_step = get_optimal_object_size(sizeof(clientsDataStruct), 1);
 			sizeofobj = sizeof(clientsDataStruct);
 			counter = &counters->clients_MAX;
 			break;
 		case DOMAINS:
 			sharedMemory = &shm_domains;
-			allocation_step = pagesize;
 			sizeofobj = sizeof(domainsDataStruct);
 			counter = &counters->domains_MAX;
 			break;
 		case FORWARDED:
 			sharedMemory = &shm_forwarded;
-			allocation_step = get_optimal_object_size(sizeof(forwardedDataStruct), 1);
 			sizeofobj = sizeof(forwardedDataStruct);
 			counter = &counters->forwarded_MAX;
 			break;
@@ -374,11 +1168,14 @@ void *enlarge_shmem_struct(char type)
 			return 0;
 	}
 
-	// Reallocate enough space for 4096 instances of requested object
-	realloc_shm(sharedMemory, sharedMemory->size + allocation_step*sizeofobj, true);
+	// Double the allocated space (geometric growth). The initial sizes are
+	// page-aligned multiples of the object size, so doubling preserves the
+	// alignment while amortizing the resize-and-remap cost to O(1) per added
+	// object even under query bursts
+	realloc_shm(sharedMemory, 2*sharedMemory->size, true);
 
-	// Add allocated memory to corresponding counter
-	*counter += allocation_step;
+	// Update counter to the new capacity
+	*counter = sharedMemory->size/sizeofobj;
 
 	return sharedMemory->ptr;
 }
@@ -435,6 +1232,8 @@ bool realloc_shm(SharedMemory *sharedMemory, size_t size, bool resize)
 		exit(EXIT_FAILURE);
 	}
 
+	advise_hugepages(new_ptr, size);
+
 	sharedMemory->ptr = new_ptr;
 	sharedMemory->size = size;
 
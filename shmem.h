@@ -42,11 +42,18 @@ bool realloc_shm(SharedMemory *sharedMemory, size_t size, bool resize);
 /// \param sharedMemory the shared memory struct
 void delete_shm(SharedMemory *sharedMemory);
 
-/// Block until a lock can be obtained
+/// Block until the exclusive (writer) lock can be obtained. Use this
+/// whenever shared memory content may be modified while holding the lock.
 #define lock_shm() _lock_shm(__FUNCTION__, __LINE__, __FILE__);
 void _lock_shm(const char* func, const int line, const char* file);
 
-/// Unlock the lock. Only call this if there is an active lock.
+/// Block until a shared (reader) lock can be obtained. Multiple readers
+/// (API workers, resolver and database threads) can hold this lock at the
+/// same time, only the writing dnsmasq-side routines are exclusive.
+#define lock_shm_read() _lock_shm_read(__FUNCTION__, __LINE__, __FILE__);
+void _lock_shm_read(const char* func, const int line, const char* file);
+
+/// Unlock the lock (shared or exclusive). Only call this if there is an active lock.
 #define unlock_shm() _unlock_shm(__FUNCTION__, __LINE__, __FILE__);
 void _unlock_shm(const char* func, const int line, const char* file);
 
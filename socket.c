@@ -11,6 +11,10 @@
 #include "FTL.h"
 #include "api.h"
 #include "shmem.h"
+// Single event loop for all API connections
+#include <sys/epoll.h>
+
+static void remove_subscriber(int sock);
 
 // The backlog argument defines the maximum length
 // to which the queue of pending connections for
@@ -201,12 +205,169 @@ static void removeport(void)
 	fclose(f);
 }
 
+// Per-connection output buffers: ssend() and swrite() append to the buffer
+// of their connection and the data is written out in large chunks at seom()
+// or when the high-water mark is reached. Large API responses like
+// getAllQueries() previously caused one write() syscall per field
+#define OUTBUF_HIGHWATER (64*1024)
+typedef struct {
+	char *data;
+	size_t used;
+	size_t size;
+} outputBufferStruct;
+static outputBufferStruct outbuf[MAXCONNS] = { { NULL, 0, 0 } };
+
+// Response capture state of the server-side response cache (see below)
+static bool capture_active = false;
+static bool capture_valid = false;
+static int capture_sock = -1;
+static size_t capture_start = 0;
+
+// Write out everything buffered for this connection
+static void flush_output(int sock)
+{
+	if(sock < 0 || sock >= MAXCONNS || outbuf[sock].used == 0)
+		return;
+
+	// A flush during response capture means the response cannot be cached
+	if(capture_active && sock == capture_sock)
+		capture_valid = false;
+
+	size_t written = 0;
+	while(written < outbuf[sock].used)
+	{
+		const ssize_t ret = write(sock, outbuf[sock].data + written,
+		                          outbuf[sock].used - written);
+		if(ret < 0)
+		{
+			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
+			break;
+		}
+		written += ret;
+	}
+	outbuf[sock].used = 0;
+}
+
+// Discard buffered output, e.g. when the connection slot gets reused
+static void reset_output(int sock)
+{
+	if(sock >= 0 && sock < MAXCONNS)
+		outbuf[sock].used = 0;
+}
+
+// Append data to the connection's output buffer
+static void append_output(int sock, const void *data, size_t size)
+{
+	if(sock < 0 || sock >= MAXCONNS)
+	{
+		// Should not happen, write directly as fallback
+		if(write(sock, data, size) == -1)
+			logg("WARNING: Socket write returned error code %i", errno);
+		return;
+	}
+
+	// Grow the buffer if necessary (geometrically)
+	if(outbuf[sock].used + size > outbuf[sock].size)
+	{
+		size_t newsize = outbuf[sock].size > 0 ? outbuf[sock].size : 4096;
+		while(newsize < outbuf[sock].used + size)
+			newsize *= 2;
+		outbuf[sock].data = realloc(outbuf[sock].data, newsize);
+		outbuf[sock].size = newsize;
+	}
+
+	memcpy(outbuf[sock].data + outbuf[sock].used, data, size);
+	outbuf[sock].used += size;
+
+	// Flush early when a large response accumulates
+	if(outbuf[sock].used >= OUTBUF_HIGHWATER)
+		flush_output(sock);
+}
+
+// Server-side response cache: identical read-only requests arriving within
+// the same data epoch are answered from the cached serialized buffer instead
+// of recomputing the payload. All API requests are handled by the single
+// event loop thread, so no locking is needed here. The capture mechanism
+// snapshots the output buffer region written by a handler; responses that
+// crossed the high-water mark (and were hence flushed early) are not cached
+#define RESPONSE_CACHE_SLOTS 8
+typedef struct {
+	char *cmd;
+	bool telnet;
+	unsigned int epoch;
+	char *data;
+	size_t used;
+} responseCacheEntry;
+static responseCacheEntry response_cache[RESPONSE_CACHE_SLOTS] = { { NULL, false, 0, NULL, 0 } };
+
+// Hash a command string into a cache slot (FNV-1a)
+static uint32_t __attribute__((pure)) hash_response(const char *cmd)
+{
+	uint32_t hash = 2166136261u;
+	for(; *cmd != '\0'; cmd++)
+	{
+		hash ^= (uint32_t)(unsigned char)*cmd;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Try to answer the request from the cache. Returns true on a cache hit
+bool serve_cached_response(const char *cmd, int sock)
+{
+	responseCacheEntry *entry = &response_cache[hash_response(cmd) % RESPONSE_CACHE_SLOTS];
+	if(entry->cmd == NULL || strcmp(entry->cmd, cmd) != 0 ||
+	   entry->telnet != istelnet[sock] || entry->epoch != get_data_epoch())
+		return false;
+
+	append_output(sock, entry->data, entry->used);
+	return true;
+}
+
+// Start capturing the response written for this connection
+void start_response_capture(int sock)
+{
+	capture_active = true;
+	capture_valid = true;
+	capture_sock = sock;
+	capture_start = (sock >= 0 && sock < MAXCONNS) ? outbuf[sock].used : 0;
+}
+
+// Store the captured response in the cache
+void store_cached_response(const char *cmd, int sock)
+{
+	if(!capture_active)
+		return;
+	capture_active = false;
+
+	// Responses that were flushed early cannot be captured
+	if(!capture_valid || sock != capture_sock || sock < 0 || sock >= MAXCONNS)
+		return;
+
+	responseCacheEntry *entry = &response_cache[hash_response(cmd) % RESPONSE_CACHE_SLOTS];
+	if(entry->cmd != NULL)
+	{
+		free(entry->cmd);
+		free(entry->data);
+	}
+
+	entry->used = outbuf[sock].used - capture_start;
+	entry->cmd = strdup(cmd);
+	entry->data = calloc(entry->used > 0 ? entry->used : 1, sizeof(char));
+	memcpy(entry->data, outbuf[sock].data + capture_start, entry->used);
+	entry->telnet = istelnet[sock];
+	entry->epoch = get_data_epoch();
+}
+
 void seom(int sock)
 {
 	if(istelnet[sock])
 		ssend(sock, "---EOM---\n\n");
 	else
 		pack_eom(sock);
+
+	// The response is complete, write it out
+	flush_output(sock);
 }
 
 void __attribute__ ((format (gnu_printf, 2, 3))) ssend(int sock, const char *format, ...)
@@ -218,15 +379,13 @@ void __attribute__ ((format (gnu_printf, 2, 3))) ssend(int sock, const char *for
 	va_end(args);
 	if(ret > 0)
 	{
-		if(!write(sock, buffer, strlen(buffer)))
-			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
+		append_output(sock, buffer, strlen(buffer));
 		free(buffer);
 	}
 }
 
 void swrite(int sock, const void *value, size_t size) {
-	if(write(sock, value, size) == -1)
-		logg("WARNING: Socket write returned error code %i", errno);
+	append_output(sock, value, size);
 }
 
 static inline int checkClientLimit(int socket) {
@@ -239,6 +398,7 @@ static inline int checkClientLimit(int socket) {
 		logg("Client denied (at max capacity of %i): %i", MAXCONNS, socket);
 
 		close(socket);
+		errno = EMFILE;
 		return -1;
 	}
 }
@@ -294,105 +454,45 @@ void close_unix_socket(void)
 	close(socketfd);
 }
 
-static void *telnet_connection_handler_thread(void *socket_desc)
+// Handle one readable client connection: receive the request and hand it to
+// process_request(). Returns false when the connection was closed (either by
+// the peer or through ">quit"/EOT) and must be dropped from the event loop
+static bool handle_client_data(int sock)
 {
-	//Get the socket descriptor
-	int sock = *(int*)socket_desc;
-	// Set connection type to telnet
-	istelnet[sock] = true;
-
 	// Define buffer for client's message
 	char client_message[SOCKETBUFFERLEN] = "";
 
-	// Set thread name
-	char threadname[16];
-	sprintf(threadname,"telnet-%i",sock);
-	prctl(PR_SET_NAME,threadname,0,0,0);
-	//Receive from client
-	ssize_t n;
-	while((n = recv(sock,client_message,SOCKETBUFFERLEN-1, 0)))
-	{
-		if (n > 0)
-		{
-			char *message = strdup(client_message);
-			if(message == NULL) break;
-
-			// Clear client message receive buffer
-			memset(client_message, 0, sizeof client_message);
-
-			// Process received message
-			process_request(message, &sock);
-			free(message);
-
-			if(sock == 0)
-			{
-				// Client disconnected by sending EOT or ">quit"
-				break;
-			}
-		}
-		else if(n == -1)
-		{
-			break;
-		}
+	ssize_t n = recv(sock, client_message, SOCKETBUFFERLEN-1, 0);
+	if(n <= 0)
+	{
+		// Client closed the connection (or an error occurred)
+		remove_subscriber(sock);
+		close(sock);
+		return false;
 	}
 
-	//Free the socket pointer
-	if(sock != 0)
+	char *message = strdup(client_message);
+	if(message == NULL)
+	{
+		remove_subscriber(sock);
 		close(sock);
-	free(socket_desc);
-
-	return false;
-}
-
-
-static void *socket_connection_handler_thread(void *socket_desc)
-{
-	//Get the socket descriptor
-	int sock = *(int*)socket_desc;
-	// Set connection type to not telnet
-	istelnet[sock] = false;
-
-	// Define buffer for client's message
-	char client_message[SOCKETBUFFERLEN] = "";
-
-	// Set thread name
-	char threadname[16];
-	sprintf(threadname,"socket-%i",sock);
-	prctl(PR_SET_NAME,threadname,0,0,0);
-	//Receive from client
-	ssize_t n;
-	while((n = recv(sock,client_message,SOCKETBUFFERLEN-1, 0)))
-	{
-		if (n > 0)
-		{
-			char *message = strdup(client_message);
-			if(message == NULL) break;
-
-			// Clear client message receive buffer
-			memset(client_message, 0, sizeof client_message);
+		return false;
+	}
 
-			// Process received message
-			process_request(message, &sock);
-			free(message);
+	// Process received message
+	const int fd = sock;
+	process_request(message, &sock);
+	free(message);
 
-			if(sock == 0)
-			{
-				// Socket connection interrupted by sending EOT or ">quit"
-				break;
-			}
-		}
-		else if(n == -1)
-		{
-			break;
-		}
+	// process_request() sets sock to zero when the client disconnected
+	// by sending EOT or ">quit" (the socket is already closed then)
+	if(sock == 0)
+	{
+		remove_subscriber(fd);
+		return false;
 	}
 
-	//Free the socket pointer
-	if(sock != 0)
-		close(sock);
-	free(socket_desc);
-
-	return false;
+	return true;
 }
 
 void bind_sockets(void)
@@ -413,122 +513,180 @@ void bind_sockets(void)
 	bind_to_unix_socket(&socketfd);
 }
 
-void *telnet_listening_thread_IPv4(void *args)
+// Push-based stats subscriptions: clients register interest with the
+// >subscribe command and receive incremental updates whenever the data epoch
+// changed, batched on the SUBSCRIBE_TICK interval. Each push is prefixed
+// with "!<topic>" and terminated like a regular response, so subscribers can
+// reuse their existing response parsers
+#define MAXSUBSCRIBERS 16
+typedef struct {
+	int sock;            // 0 marks a free slot
+	unsigned int topics;
+	unsigned int epoch;  // epoch of the last pushed update
+} subscriberEntry;
+static subscriberEntry subscribers[MAXSUBSCRIBERS] = { { 0, 0, 0 } };
+
+// Register a subscriber. Returns false when all slots are taken
+bool add_subscriber(int sock, unsigned int topics)
 {
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	// Set thread name
-	prctl(PR_SET_NAME,"telnet-IPv4",0,0,0);
-
-	// Listen as long as FTL is not killed
-	while(!killed)
+	for(int i = 0; i < MAXSUBSCRIBERS; i++)
 	{
-		// Look for new clients that want to connect
-		int csck = listener(telnetfd4, 4);
-		if(csck == -1)
+		if(subscribers[i].sock == 0 || subscribers[i].sock == sock)
 		{
-			logg("IPv4 telnet error: %s (%i)", strerror(errno), errno);
-			continue;
-		}
-
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
-
-		pthread_t telnet_connection_thread;
-		// Create a new thread
-		if(pthread_create( &telnet_connection_thread, &attr, telnet_connection_handler_thread, (void*) newsock ) != 0)
-		{
-			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread, error: %s", strerror(errno));
+			subscribers[i].sock = sock;
+			subscribers[i].topics = topics;
+			// Force a full push on the next tick
+			subscribers[i].epoch = get_data_epoch() - 1u;
+			return true;
 		}
 	}
 	return false;
 }
 
-void *telnet_listening_thread_IPv6(void *args)
+// Drop a subscriber, e.g. when its connection closed
+static void remove_subscriber(int sock)
 {
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	// Set thread name
-	prctl(PR_SET_NAME,"telnet-IPv6",0,0,0);
+	for(int i = 0; i < MAXSUBSCRIBERS; i++)
+		if(subscribers[i].sock == sock)
+		{
+			subscribers[i].sock = 0;
+			subscribers[i].topics = 0;
+		}
+}
 
-	// Listen as long as FTL is not killed
-	while(!killed)
+// Push updates to all subscribers whose data changed since their last push
+static void push_subscriptions(void)
+{
+	const unsigned int epoch = get_data_epoch();
+	for(int i = 0; i < MAXSUBSCRIBERS; i++)
 	{
-		// Look for new clients that want to connect
-		int csck = listener(telnetfd6, 6);
-		if(csck == -1)
-		{
-			logg("IPv6 telnet error: %s (%i)", strerror(errno), errno);
+		if(subscribers[i].sock == 0 || subscribers[i].epoch == epoch)
 			continue;
+
+		int sock = subscribers[i].sock;
+		if(subscribers[i].topics & SUBSCRIBE_STATS)
+		{
+			ssend(sock, "!stats\n");
+			lock_shm_read();
+			getStats(&sock);
+			unlock_shm();
+			seom(sock);
 		}
+		if(subscribers[i].topics & SUBSCRIBE_OVERTIME)
+		{
+			ssend(sock, "!overTime\n");
+			lock_shm_read();
+			getOverTime(">overTime", &sock);
+			unlock_shm();
+			seom(sock);
+		}
+		subscribers[i].epoch = epoch;
+	}
+}
 
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
+// Register a file descriptor with the epoll instance
+static void epoll_register(int epollfd, int fd)
+{
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) != 0)
+		logg("WARNING: epoll_ctl(ADD, %i) failed: %s (%i)", fd, strerror(errno), errno);
+}
 
-		pthread_t telnet_connection_thread;
-		// Create a new thread
-		if(pthread_create( &telnet_connection_thread, &attr, telnet_connection_handler_thread, (void*) newsock ) != 0)
+// Accept all pending connections on a (non-blocking) listening socket and
+// add them to the event loop
+static void accept_clients(int epollfd, int sockfd, char type)
+{
+	while(true)
+	{
+		int csck = listener(sockfd, type);
+		if(csck < 0)
 		{
-			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread, error: %s", strerror(errno));
+			// All pending connections accepted (or over client limit)
+			if(errno != EAGAIN && errno != EMFILE && type != 0)
+				logg("IPv%i telnet error: %s (%i)", type, strerror(errno), errno);
+			return;
 		}
+
+		// Unix socket connections speak the binary protocol
+		istelnet[csck] = (type != 0);
+		// The fd may be reused from an earlier connection
+		reset_output(csck);
+		remove_subscriber(csck);
+		epoll_register(epollfd, csck);
 	}
-	return false;
 }
 
-void *socket_listening_thread(void *args)
+// Single event loop serving all API connections. Accepted clients are plain
+// level-triggered epoll members, so one thread handles hundreds of
+// short-lived monitoring connections without any per-connection threads.
+// process_request() in request.c remains the dispatch point
+void *api_listening_thread(void *args)
 {
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
 	// Set thread name
-	prctl(PR_SET_NAME,"socket listener",0,0,0);
+	prctl(PR_SET_NAME,"api listener",0,0,0);
 
+	int epollfd = epoll_create1(0);
+	if(epollfd < 0)
+	{
+		logg("FATAL: Cannot create epoll instance: %s (%i)", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	// The listening sockets are non-blocking so that we can accept in a
+	// drain loop; accepted client sockets stay blocking as responses are
+	// written synchronously
+	if(ipv4telnet)
+	{
+		fcntl(telnetfd4, F_SETFL, fcntl(telnetfd4, F_GETFL) | O_NONBLOCK);
+		epoll_register(epollfd, telnetfd4);
+	}
+	if(ipv6telnet)
+	{
+		fcntl(telnetfd6, F_SETFL, fcntl(telnetfd6, F_GETFL) | O_NONBLOCK);
+		epoll_register(epollfd, telnetfd6);
+	}
+	fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+	epoll_register(epollfd, socketfd);
+
+	struct epoll_event events[32];
+	struct timeval lasttick;
+	gettimeofday(&lasttick, 0);
 	// Listen as long as FTL is not killed
 	while(!killed)
 	{
-		// Look for new clients that want to connect
-		int csck = listener(socketfd, 0);
-		if(csck < 0) continue;
-
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
+		const int ready = epoll_wait(epollfd, events, 32, config.subscribetick);
+		for(int i = 0; i < ready; i++)
+		{
+			const int fd = events[i].data.fd;
+			if(ipv4telnet && fd == telnetfd4)
+				accept_clients(epollfd, telnetfd4, 4);
+			else if(ipv6telnet && fd == telnetfd6)
+				accept_clients(epollfd, telnetfd6, 6);
+			else if(fd == socketfd)
+				accept_clients(epollfd, socketfd, 0);
+			else if(!handle_client_data(fd))
+			{
+				// Closed connections are removed from the epoll
+				// set automatically when their fd is closed, no
+				// epoll_ctl(DEL) needed
+			}
+		}
 
-		pthread_t socket_connection_thread;
-		// Create a new thread
-		if(pthread_create( &socket_connection_thread, &attr, socket_connection_handler_thread, (void*) newsock ) != 0)
+		// Push batched updates to subscribers once per tick
+		struct timeval now;
+		gettimeofday(&now, 0);
+		const long elapsed = (now.tv_sec - lasttick.tv_sec)*1000L +
+		                     (now.tv_usec - lasttick.tv_usec)/1000L;
+		if(elapsed >= config.subscribetick)
 		{
-			// Log the error code description
-			logg("WARNING: Unable to open socket processing thread, error: %s", strerror(errno));
+			push_subscriptions();
+			lasttick = now;
 		}
 	}
+
+	close(epollfd);
 	return false;
 }
 
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Training workload for the PGO pipeline (make pgo): runs the instrumented
+# pihole-FTL against a synthetic replay log and exercises the API endpoints
+# so the profile covers the query, reply, GC-adjacent and API hot paths.
+set -e
+
+DIR="$(mktemp -d)"
+trap 'kill $FTLPID 2>/dev/null; rm -rf "$DIR"' EXIT
+cd "$DIR"
+
+cat > pihole-FTL.conf <<EOT
+DBFILE=pihole-FTL.db
+LOGFILE=pihole-FTL.log
+SOCKETFILE=pihole-FTL.sock
+PIDFILE=pihole-FTL.pid
+PORTFILE=pihole-FTL.port
+FTLPORT=47110
+EOT
+
+# Start the instrumented binary with a local-only resolver setup
+"$OLDPWD/pihole-FTL" no-daemon -- --port=53550 --no-resolv --no-hosts \
+	--address=/#/192.0.2.1 >/dev/null 2>&1 &
+FTLPID=$!
+sleep 2
+
+# Synthetic replay log: 50k queries, 2k domains, 20 clients
+awk 'BEGIN { for(i=0; i<50000; i++)
+	printf "%d A train%d.pgo.test 10.0.%d.1 2 0 4 1\n",
+	       1500000000+i%600, i%2000, i%20 }' > train.log
+"$OLDPWD/pihole-FTL-replay" train.log 127.0.0.1 53550 0 20
+
+# Exercise the API paths (the actual port is published in the port file,
+# a system-wide config file may override FTLPORT). Exported so that the
+# bash -c children below can expand it
+APIPORT=$(cat pihole-FTL.port 2>/dev/null)
+[ -n "$APIPORT" ] || APIPORT=47110
+export APIPORT
+for cmd in ">stats" ">top-domains" ">top-clients" ">overTime" \
+           ">getallqueries (1000)" ">querytypes" ">metrics" ">latency"; do
+	printf '%s\n' "$cmd" | timeout 5 bash -c 'exec 3<>/dev/tcp/127.0.0.1/$APIPORT; cat >&3; head -c 65536 <&3 >/dev/null' || true
+done
+
+# Clean shutdown flushes the profile data
+kill $FTLPID
+wait $FTLPID 2>/dev/null || true
+sleep 1